@@ -0,0 +1,366 @@
+/**
+ * @file cab_bench.c
+ * @brief Contention benchmark of the CABs of the ptask library
+ *
+ * One writer publishes messages as fast as it can while a growing number of
+ * readers get and release the most recent one, each configuration running for
+ * the same time. For each number of readers the benchmark prints the
+ * throughput of the writer and of all the readers together, and the latency of
+ * each operation: reserve plus putmes for the writer, getmes plus unget for the
+ * readers (median and 99th percentile, the worst among readers for the
+ * latter, and maximum). Readers also check that each message they get is
+ * whole, printing the number of torn ones, which shall be zero.
+ *
+ * With a window depth greater than one, the cab keeps a history of that depth
+ * and readers acquire the whole window of the most recent messages using
+ * ptask_cab_getmes_window instead, while the writer also resets the cab every
+ * BENCH_RESET messages. Besides checking that each message is whole, readers
+ * check that the messages of each window are consecutive, printing the number
+ * of windows with gaps, which shall be zero too.
+ *
+ * The implementation measured is the one the library is built with, see
+ * PTASK_CAB_LOCKFREE; `make bench` builds and runs both.
+ *
+ * Usage: cab_bench [duration of each configuration (ms)] [message size (B)]
+ *                  [window depth]
+ *
+ * NOTICE: threads are plain pthreads with the default scheduling, so results
+ * depend on the load of the machine. Latencies include a clock reading.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "api/time_utils.h"
+#include "api/histogram.h"
+#include "api/ptask.h"
+
+//-------------------------------------------------------------
+// CONSTANTS
+//-------------------------------------------------------------
+
+/// Each reader holds at most one buffer, so a CAB with PTASK_CAB_MAX_SIZE
+/// buffers serves at most this number of readers besides its writer
+#define BENCH_MAX_READERS	(PTASK_CAB_MAX_SIZE - 2)
+
+#define BENCH_DURATION		(500)	///< Default duration (ms)
+#define BENCH_SIZE			(64)	///< Default message size (bytes)
+#define BENCH_DEPTH			(1)		///< Default window depth
+#define BENCH_RESET			(4096)	///< Messages between two resets, in
+									///< window mode
+
+/// The numbers of readers that are measured
+static const int bench_readers[] = { 1, 2, 4, 8, 16, BENCH_MAX_READERS };
+
+#ifdef PTASK_CAB_LOCKFREE
+#define BENCH_IMPL	"lock-free"
+#else
+#define BENCH_IMPL	"mutex"
+#endif
+
+//-------------------------------------------------------------
+// DATA TYPES
+//-------------------------------------------------------------
+
+/// Statistics of a thread
+typedef struct __BENCH_THREAD
+{
+	pthread_t	tid;
+	uint64_t	ops;		///< Completed operations
+	uint64_t	torn;		///< Torn messages got by a reader
+	uint64_t	gaps;		///< Windows with non consecutive messages
+	uint64_t	full;		///< Failed reservations of the writer
+	histogram_t	latency;	///< Latency of each operation (ns)
+} bench_thread_t;
+
+//-------------------------------------------------------------
+// GLOBAL VARIABLES
+//-------------------------------------------------------------
+
+static ptask_cab_t		cab;
+static void*			buffers[PTASK_CAB_MAX_SIZE];
+static size_t			size = BENCH_SIZE;
+static int				depth = BENCH_DEPTH;
+static atomic_bool		stop;
+
+static bench_thread_t	writer;
+static bench_thread_t	readers[BENCH_MAX_READERS];
+
+//-------------------------------------------------------------
+// THREADS
+//-------------------------------------------------------------
+
+/// Elapsed time since the given time (in ns)
+static inline uint64_t elapsed(struct timespec start)
+{
+struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return time_diff_ns(now, start);
+}
+
+/// Publishes messages filled with their sequence number
+static void *writer_body(void *arg)
+{
+bench_thread_t*	self = (bench_thread_t *) arg;
+struct timespec	start;
+void*			buffer;
+ptask_cab_id_t	id;
+uint64_t		seq = 0;
+size_t			i;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (ptask_cab_reserve(&cab, &buffer, &id))
+		{
+			++self->full;
+			continue;
+		}
+
+		++seq;
+		for (i = 0; i < size / sizeof(uint64_t); ++i)
+			((uint64_t *) buffer)[i] = seq;
+
+		ptask_cab_putmes(&cab, id);
+
+		histogram_add(&self->latency, elapsed(start));
+		++self->ops;
+
+		// Resets shorten the windows, which shall stay consecutive anyway
+		if (depth > 1 && seq % BENCH_RESET == 0)
+			ptask_cab_reset(&cab);
+	}
+
+	return NULL;
+}
+
+/// Returns true if the given message is whole
+static inline bool whole(const void *buffer)
+{
+const uint64_t *words = (const uint64_t *) buffer;
+
+	return words[0] == words[size / sizeof(uint64_t) - 1];
+}
+
+/// Gets the most recent window and checks that its messages are whole and
+/// consecutive
+static void window_body(bench_thread_t *self)
+{
+struct timespec	start;
+const void*		buffers[PTASK_CAB_MAX_SIZE];
+ptask_cab_id_t	ids[PTASK_CAB_MAX_SIZE];
+int				count;
+int				j;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (ptask_cab_getmes_window(&cab, depth, buffers, ids, NULL, &count))
+			continue;
+
+		for (j = 0; j < count; ++j)
+		{
+			if (!whole(buffers[j]))
+				++self->torn;
+		}
+
+		for (j = 1; j < count; ++j)
+		{
+			if (*(const uint64_t *) buffers[j] !=
+				*(const uint64_t *) buffers[j-1] + 1)
+			{
+				++self->gaps;
+				break;
+			}
+		}
+
+		ptask_cab_unget_window(&cab, ids, count);
+
+		histogram_add(&self->latency, elapsed(start));
+		++self->ops;
+	}
+}
+
+/// Gets the most recent message and checks that it is whole
+static void *reader_body(void *arg)
+{
+bench_thread_t*	self = (bench_thread_t *) arg;
+struct timespec	start;
+const void*		buffer;
+ptask_cab_id_t	id;
+
+	if (depth > 1)
+	{
+		window_body(self);
+		return NULL;
+	}
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (ptask_cab_getmes(&cab, &buffer, &id, NULL))
+			continue;
+
+		if (!whole(buffer))
+			++self->torn;
+
+		ptask_cab_unget(&cab, id);
+
+		histogram_add(&self->latency, elapsed(start));
+		++self->ops;
+	}
+
+	return NULL;
+}
+
+//-------------------------------------------------------------
+// BENCHMARK
+//-------------------------------------------------------------
+
+/**
+ * Runs the given number of readers against one writer for the given time,
+ * printing the results. Returns zero on success, the errno value of the
+ * failing call otherwise.
+ */
+static int bench_run(int nreaders, int duration)
+{
+struct timespec	t = { .tv_sec = duration / 1000,
+					  .tv_nsec = (duration % 1000) * 1000000L };
+uint64_t		reads = 0;
+uint64_t		torn = 0;
+uint64_t		gaps = 0;
+uint64_t		p50 = 0;	// Mean of the medians of the readers
+uint64_t		p99 = 0;	// Worst 99th percentile among readers
+uint64_t		max = 0;
+int				nbuffers;
+int				err;
+int				i;
+
+	// Besides the history, each reader holds up to depth buffers and the
+	// writer one
+	nbuffers = depth + nreaders * depth + 1;
+
+	err = ptask_cab_init_history(&cab, nbuffers, size, buffers, depth);
+	if (err) return err;
+
+	memset(&writer, 0, sizeof(writer));
+	histogram_init(&writer.latency);
+
+	for (i = 0; i < nreaders; ++i)
+	{
+		memset(&readers[i], 0, sizeof(readers[i]));
+		histogram_init(&readers[i].latency);
+	}
+
+	atomic_store(&stop, false);
+
+	err = pthread_create(&writer.tid, NULL, writer_body, &writer);
+	if (err) return err;
+
+	for (i = 0; i < nreaders && !err; ++i)
+		err = pthread_create(&readers[i].tid, NULL, reader_body, &readers[i]);
+
+	nreaders = i - (err ? 1 : 0);
+
+	nanosleep(&t, NULL);
+	atomic_store(&stop, true);
+
+	pthread_join(writer.tid, NULL);
+
+	for (i = 0; i < nreaders; ++i)
+	{
+		pthread_join(readers[i].tid, NULL);
+
+		reads	+= readers[i].ops;
+		torn	+= readers[i].torn;
+		gaps	+= readers[i].gaps;
+		p50		+= histogram_percentile(&readers[i].latency, 50.);
+
+		if (histogram_percentile(&readers[i].latency, 99.) > p99)
+			p99 = histogram_percentile(&readers[i].latency, 99.);
+		if (histogram_max(&readers[i].latency) > max)
+			max = histogram_max(&readers[i].latency);
+	}
+
+	if (err) return err;
+
+	printf("%-9s %5d %7d %11.0f %11.0f %7llu %7llu %9llu %7llu %7llu %9llu "
+		"%5llu %5llu %5llu\n", BENCH_IMPL, depth, nreaders,
+		writer.ops * 1000. / duration, reads * 1000. / duration,
+		(unsigned long long) histogram_percentile(&writer.latency, 50.),
+		(unsigned long long) histogram_percentile(&writer.latency, 99.),
+		(unsigned long long) histogram_max(&writer.latency),
+		(unsigned long long) p50 / nreaders,
+		(unsigned long long) p99,
+		(unsigned long long) max,
+		(unsigned long long) writer.full,
+		(unsigned long long) torn,
+		(unsigned long long) gaps);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+int duration = BENCH_DURATION;
+int err;
+int i;
+
+	if (argc > 1)
+		duration = atoi(argv[1]);
+	if (argc > 2)
+		size = atoi(argv[2]);
+	if (argc > 3)
+		depth = atoi(argv[3]);
+
+	// Messages are checked one 64-bit word at a time
+	size = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+
+	// The history and one window for a reader shall fit in the cab
+	if (duration <= 0 || size == 0 || depth < 1 ||
+		2 * depth + 1 > PTASK_CAB_MAX_SIZE)
+	{
+		fprintf(stderr, "Usage: %s [duration (ms)] [message size (B)] "
+			"[window depth]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < PTASK_CAB_MAX_SIZE; ++i)
+	{
+		buffers[i] = calloc(1, size);
+		if (buffers[i] == NULL)
+			return EXIT_FAILURE;
+	}
+
+	printf("%-9s %5s %7s %11s %11s %7s %7s %9s %7s %7s %9s %5s %5s %5s\n",
+		"impl", "depth", "readers", "puts/s", "gets/s", "put p50", "put p99",
+		"put max", "get p50", "get p99", "get max", "full", "torn", "gaps");
+
+	for (i = 0; i < (int) (sizeof(bench_readers) / sizeof(int)); ++i)
+	{
+		// With windows, fewer readers fit in the cab
+		if (depth + bench_readers[i] * depth + 1 > PTASK_CAB_MAX_SIZE)
+			break;
+
+		err = bench_run(bench_readers[i], duration);
+		if (err)
+		{
+			fprintf(stderr, "Benchmark with %d readers failed: %s\n",
+				bench_readers[i], strerror(err));
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,340 @@
+/**
+ * @file shm_cab_bench.c
+ * @brief Read-only readers of the shared-memory CABs
+ *
+ * One writer publishes messages as fast as it can on a shared CAB created by
+ * this process, while a growing number of readers open the same CAB in
+ * read-only mode, as another process would do, and read it for the same time.
+ * Half of the readers copy each new message using shm_cab_read_next, the other
+ * half read the most recent message in place using shm_cab_getmes and then
+ * shm_cab_validate. Each message is filled with its sequence number, so
+ * readers can check that every message they accept is whole: the number of
+ * torn messages shall be zero, while in-place reads that are overwritten
+ * before being validated are only counted as invalid.
+ *
+ * For each number of readers the benchmark prints the throughput of the writer
+ * and of all the readers together, and the latency of the readers (median, the
+ * worst 99th percentile among readers, and maximum). Before starting, it also
+ * checks that the CAB cannot be created again while its owner is running.
+ *
+ * Usage: shm_cab_bench [duration of each configuration (ms)] [message size (B)]
+ *
+ * NOTICE: threads are plain pthreads with the default scheduling, so results
+ * depend on the load of the machine. Latencies include a clock reading.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "api/time_utils.h"
+#include "api/histogram.h"
+#include "api/shm_cab.h"
+
+//-------------------------------------------------------------
+// CONSTANTS
+//-------------------------------------------------------------
+
+#define BENCH_NAME			"/super_shm_cab_bench"	///< Name of the segment
+#define BENCH_BUFFERS		(8)		///< Number of buffers of the shared CAB
+#define BENCH_MAX_READERS	(8)		///< Maximum number of readers
+#define BENCH_TIMEOUT		(10)	///< Timeout of blocking reads (ms), used
+									///< to check for termination
+
+#define BENCH_DURATION		(500)	///< Default duration (ms)
+#define BENCH_SIZE			(64)	///< Default message size (bytes)
+
+/// The numbers of readers that are measured
+static const int bench_readers[] = { 1, 2, 4, BENCH_MAX_READERS };
+
+//-------------------------------------------------------------
+// DATA TYPES
+//-------------------------------------------------------------
+
+/// Statistics of a thread
+typedef struct __BENCH_THREAD
+{
+	pthread_t	tid;
+	bool		in_place;	///< True if the reader does not copy messages
+	int			err;		///< Error of the opening of the CAB, if any
+	uint64_t	ops;		///< Completed operations
+	uint64_t	invalid;	///< In-place reads overwritten before validation
+	uint64_t	torn;		///< Accepted messages that are not whole
+	histogram_t	latency;	///< Latency of each read (ns)
+} bench_thread_t;
+
+//-------------------------------------------------------------
+// GLOBAL VARIABLES
+//-------------------------------------------------------------
+
+static shm_cab_t		cab;
+static size_t			size = BENCH_SIZE;
+static atomic_bool		stop;
+
+static bench_thread_t	writer;
+static bench_thread_t	readers[BENCH_MAX_READERS];
+
+//-------------------------------------------------------------
+// THREADS
+//-------------------------------------------------------------
+
+/// Elapsed time since the given time (in ns)
+static inline uint64_t elapsed(struct timespec start)
+{
+struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return time_diff_ns(now, start);
+}
+
+/// Returns true if all the words of the given message contain seq
+static inline bool whole(const uint64_t *words, unsigned int seq)
+{
+size_t i;
+
+	for (i = 0; i < size / sizeof(uint64_t); ++i)
+	{
+		if (words[i] != seq)
+			return false;
+	}
+
+	return true;
+}
+
+/// Publishes messages filled with their sequence number, which starts from one
+static void *writer_body(void *arg)
+{
+bench_thread_t*	self = (bench_thread_t *) arg;
+void*			buffer;
+int				id;
+uint64_t		seq = 0;
+size_t			i;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed))
+	{
+		if (shm_cab_reserve(&cab, &buffer, &id))
+			continue;
+
+		++seq;
+		for (i = 0; i < size / sizeof(uint64_t); ++i)
+			((uint64_t *) buffer)[i] = seq;
+
+		shm_cab_putmes(&cab, id);
+		++self->ops;
+	}
+
+	return NULL;
+}
+
+/// Opens the CAB in read-only mode and reads it until the benchmark stops
+static void *reader_body(void *arg)
+{
+bench_thread_t*	self = (bench_thread_t *) arg;
+shm_cab_t		ro;			// The read-only handle of this reader
+struct timespec	start;
+uint64_t*		copy;
+const void*		message;
+unsigned int	seq = 0;
+int				id;
+
+	copy = malloc(size);
+	if (copy == NULL)
+	{
+		self->err = ENOMEM;
+		return NULL;
+	}
+
+	self->err = shm_cab_open(&ro, BENCH_NAME);
+	if (self->err)
+	{
+		free(copy);
+		return NULL;
+	}
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (self->in_place)
+		{
+			if (shm_cab_getmes(&ro, &message, &id, NULL, &seq))
+				continue;
+
+			// Whatever is read is checked only if the read is valid
+			if (!whole((const uint64_t *) message, seq))
+			{
+				if (shm_cab_validate(&ro, id, seq))
+					++self->torn;
+				else
+					++self->invalid;
+
+				continue;
+			}
+
+			if (!shm_cab_validate(&ro, id, seq))
+			{
+				++self->invalid;
+				continue;
+			}
+		}
+		else
+		{
+			if (shm_cab_read_next(&ro, copy, NULL, &seq, BENCH_TIMEOUT))
+				continue;
+
+			if (!whole(copy, seq))
+				++self->torn;
+		}
+
+		histogram_add(&self->latency, elapsed(start));
+		++self->ops;
+	}
+
+	shm_cab_close(&ro);
+	free(copy);
+
+	return NULL;
+}
+
+//-------------------------------------------------------------
+// BENCHMARK
+//-------------------------------------------------------------
+
+/**
+ * Runs the given number of readers against one writer for the given time,
+ * printing the results. Returns zero on success, the errno value of the
+ * failing call otherwise.
+ */
+static int bench_run(int nreaders, int duration)
+{
+struct timespec	t = { .tv_sec = duration / 1000,
+					  .tv_nsec = (duration % 1000) * 1000000L };
+shm_cab_t		other;		// A second attempt to create the same CAB
+uint64_t		reads = 0;
+uint64_t		invalid = 0;
+uint64_t		torn = 0;
+uint64_t		p50 = 0;	// Mean of the medians of the readers
+uint64_t		p99 = 0;	// Worst 99th percentile among readers
+uint64_t		max = 0;
+int				err;
+int				i;
+
+	err = shm_cab_create(&cab, BENCH_NAME, BENCH_BUFFERS, size);
+	if (err) return err;
+
+	// The owner is running, the segment shall not be replaced
+	err = shm_cab_create(&other, BENCH_NAME, BENCH_BUFFERS, size);
+	if (err != EEXIST)
+	{
+		if (!err)
+			shm_cab_close(&other);
+
+		shm_cab_close(&cab);
+		return err ? err : EINVAL;
+	}
+
+	memset(&writer, 0, sizeof(writer));
+
+	for (i = 0; i < nreaders; ++i)
+	{
+		memset(&readers[i], 0, sizeof(readers[i]));
+		readers[i].in_place = i % 2;
+		histogram_init(&readers[i].latency);
+	}
+
+	atomic_store(&stop, false);
+
+	err = pthread_create(&writer.tid, NULL, writer_body, &writer);
+	if (err)
+	{
+		shm_cab_close(&cab);
+		return err;
+	}
+
+	for (i = 0; i < nreaders && !err; ++i)
+		err = pthread_create(&readers[i].tid, NULL, reader_body, &readers[i]);
+
+	nreaders = i - (err ? 1 : 0);
+
+	nanosleep(&t, NULL);
+	atomic_store(&stop, true);
+
+	pthread_join(writer.tid, NULL);
+
+	for (i = 0; i < nreaders; ++i)
+	{
+		pthread_join(readers[i].tid, NULL);
+
+		if (readers[i].err)
+			err = readers[i].err;
+
+		reads	+= readers[i].ops;
+		invalid	+= readers[i].invalid;
+		torn	+= readers[i].torn;
+		p50		+= histogram_percentile(&readers[i].latency, 50.);
+
+		if (histogram_percentile(&readers[i].latency, 99.) > p99)
+			p99 = histogram_percentile(&readers[i].latency, 99.);
+		if (histogram_max(&readers[i].latency) > max)
+			max = histogram_max(&readers[i].latency);
+	}
+
+	shm_cab_close(&cab);
+
+	if (err) return err;
+
+	printf("%7d %11.0f %11.0f %7llu %7llu %9llu %7llu %5llu\n", nreaders,
+		writer.ops * 1000. / duration, reads * 1000. / duration,
+		(unsigned long long) p50 / nreaders,
+		(unsigned long long) p99,
+		(unsigned long long) max,
+		(unsigned long long) invalid,
+		(unsigned long long) torn);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+int duration = BENCH_DURATION;
+int err;
+int i;
+
+	if (argc > 1)
+		duration = atoi(argv[1]);
+	if (argc > 2)
+		size = atoi(argv[2]);
+
+	// Messages are checked one 64-bit word at a time
+	size = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+
+	if (duration <= 0 || size == 0)
+	{
+		fprintf(stderr, "Usage: %s [duration (ms)] [message size (B)]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("%7s %11s %11s %7s %7s %9s %7s %5s\n", "readers", "puts/s",
+		"reads/s", "get p50", "get p99", "get max", "invalid", "torn");
+
+	for (i = 0; i < (int) (sizeof(bench_readers) / sizeof(int)); ++i)
+	{
+		err = bench_run(bench_readers[i], duration);
+		if (err)
+		{
+			fprintf(stderr, "Benchmark with %d readers failed: %s\n",
+				bench_readers[i], strerror(err));
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
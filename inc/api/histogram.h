@@ -0,0 +1,84 @@
+/**
+ * @file histogram.h
+ * @brief Lock-free log-linear histograms
+ *
+ * Histograms collect non-negative integer samples (e.g. durations in
+ * nanoseconds) in buckets whose width grows with the magnitude of the values,
+ * so that the relative error on any reported value is bounded (about 3%)
+ * while the memory used by each histogram is constant.
+ *
+ * Values up to 2^HISTOGRAM_SUB_BITS have a bucket each, then every power of two
+ * is split in 2^(HISTOGRAM_SUB_BITS-1) buckets of equal width. Values greater
+ * than 2^HISTOGRAM_MAX_BITS are counted in the last bucket, but the maximum is
+ * always exact.
+ *
+ * Samples can be added and statistics can be read concurrently by any number
+ * of threads without locks; statistics read while samples are being added
+ * may not include the most recent ones.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/// Number of bits that select the bucket within each power of two
+#define HISTOGRAM_SUB_BITS	(6)
+
+/// Values are tracked with bounded error up to 2^HISTOGRAM_MAX_BITS (about 68
+/// seconds, if they are nanoseconds)
+#define HISTOGRAM_MAX_BITS	(36)
+
+/// The number of buckets of each histogram
+#define HISTOGRAM_BUCKETS	((1 << HISTOGRAM_SUB_BITS) + \
+	(HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * \
+	(1 << (HISTOGRAM_SUB_BITS - 1)))
+
+/**
+ * A log-linear histogram
+ */
+typedef struct __HISTOGRAM
+{
+	atomic_uint		buckets[HISTOGRAM_BUCKETS];
+									///< Number of samples in each bucket
+	atomic_ullong	count;			///< Total number of samples
+	atomic_ullong	sum;			///< Sum of all samples
+	atomic_ullong	max;			///< Maximum sample
+} histogram_t;
+
+/**
+ * @name Histograms
+ */
+//@{
+
+/// Empties the given histogram
+extern void histogram_init(histogram_t *h);
+
+/// Adds a sample to the given histogram
+extern void histogram_add(histogram_t *h, uint64_t value);
+
+/// Returns the number of samples in the histogram
+extern uint64_t histogram_count(const histogram_t *h);
+
+/// Returns the sum of all the samples in the histogram
+extern uint64_t histogram_sum(const histogram_t *h);
+
+/// Returns the maximum sample, zero if the histogram is empty
+extern uint64_t histogram_max(const histogram_t *h);
+
+/// Returns the mean of the samples, zero if the histogram is empty
+extern uint64_t histogram_mean(const histogram_t *h);
+
+/**
+ * Returns the value below which the given percentage of samples falls (e.g.
+ * 99 for the 99th percentile); the value is the upper bound of the bucket that
+ * contains the percentile, hence it can overestimate it by the width of the
+ * bucket, but never more than the maximum sample.
+ * Returns zero if the histogram is empty.
+ */
+extern uint64_t histogram_percentile(const histogram_t *h, double percentile);
+
+//@}
+
+#endif
@@ -131,6 +131,17 @@ ptask_join(task0);
 
 #include <pthread.h>
 #include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "api/histogram.h"
+
+// Older C libraries do not export the SCHED_DEADLINE policy
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE	(6)
+#endif
 
 //-------------------------------------------------------------
 // DEFINES AND DATA TYPES
@@ -158,6 +169,120 @@ typedef enum __PTASK_ENUM {
 /// The maximum number of bytes that can be given as argument to a ptask
 #define PTASK_ARGS_SIZE	(32)
 
+/// The offset of a task whose releases are not aligned to the phase origin
+#define PTASK_NO_OFFSET	(-1)
+
+/**
+ * What ptask_wait_for_period does when a job completes after the next
+ * activation time of its task (an overrun):
+ * - PTASK_OVERRUN_CATCHUP: the activations that already elapsed are released
+ * one after the other without waiting, until the task is back in phase. This is
+ * the default and suits tasks that shall never lose a job.
+ * - PTASK_OVERRUN_SKIP: the elapsed activations are dropped and the task waits
+ * for the next activation aligned to its original phase, so that a transient
+ * overload is cleared within one period.
+ * - PTASK_OVERRUN_HANDLER: the overrun handler of the task is called and
+ * decides which one of the above policies is applied.
+ */
+typedef enum __PTASK_OVERRUN_ENUM {
+	PTASK_OVERRUN_CATCHUP	= 0,
+	PTASK_OVERRUN_SKIP,
+	PTASK_OVERRUN_HANDLER
+} ptask_overrun_t;
+
+struct __PTASK_STRUCT;
+
+/**
+ * Called by ptask_wait_for_period, on behalf of the task that overran, with
+ * the number of its activations that already elapsed. It returns the policy to
+ * apply, either PTASK_OVERRUN_CATCHUP or PTASK_OVERRUN_SKIP.
+ */
+typedef ptask_overrun_t (ptask_overrun_handler_t)
+	(struct __PTASK_STRUCT *ptask, int elapsed);
+
+/**
+ * What happens when a job of a task consumes more CPU time than its budget,
+ * see ptask_set_budget:
+ * - PTASK_BUDGET_FLAG: the job is only flagged as over budget, which the job
+ * itself can check using ptask_over_budget.
+ * - PTASK_BUDGET_DEMOTE: the job is flagged and its thread is moved to the
+ * SCHED_IDLE policy, so that it runs only on CPUs that would otherwise be
+ * idle, until the job ends and the original policy and priority are restored.
+ * - PTASK_BUDGET_HANDLER: the job is flagged and the budget handler of the task
+ * is called.
+ */
+typedef enum __PTASK_BUDGET_ENUM {
+	PTASK_BUDGET_FLAG	= 0,
+	PTASK_BUDGET_DEMOTE,
+	PTASK_BUDGET_HANDLER
+} ptask_budget_action_t;
+
+/**
+ * Called on behalf of a job that exceeded its budget, from within a signal
+ * handler running on the thread of the task: it shall call only
+ * async-signal-safe functions, typically it sets a flag that makes the job
+ * degrade the rest of its work.
+ */
+typedef void (ptask_budget_handler_t) (struct __PTASK_STRUCT *ptask);
+
+/// The real-time signal that notifies budget overruns to the threads of the
+/// tasks, it shall not be used by the rest of the program
+#define PTASK_BUDGET_SIGNAL	(SIGRTMIN + 1)
+
+/// Comment this line to disable the measurement of the timing of each job of
+/// each task, which costs two clock readings per job
+#define PTASK_PROFILE
+
+#ifdef PTASK_PROFILE
+
+/**
+ * Timing statistics of the jobs of a task, all durations are in nanoseconds.
+ * Periodic tasks are measured automatically by ptask_start_period and
+ * ptask_wait_for_period, event-driven ones shall delimit each job using
+ * ptask_job_start and ptask_job_end.
+ */
+typedef struct __PTASK_PROFILE
+{
+	histogram_t	exec;			///< CPU time consumed by each job
+	histogram_t	response;		///< Time from the activation of each job to
+								///< its completion
+	histogram_t	jitter;			///< Time from the activation of each job to
+								///< its actual start
+
+	struct timespec _release;	///< Activation time of the current job
+	struct timespec _cpu_start;	///< CPU time of the thread when the current
+								///< job started
+	bool _in_job;				///< Tells if a job is being measured
+} ptask_profile_t;
+
+#endif
+
+/// Comment this line to activate periodic tasks by sleeping until their next
+/// activation time with clock_nanosleep. Otherwise each periodic task waits on
+/// a periodic timerfd, which tells how many activations elapsed (hence whether
+/// the task overran) and can be waited together with other file descriptors,
+/// see ptask_wait_for_event. Tasks scheduled with SCHED_DEADLINE never use it.
+#define PTASK_TIMERFD
+
+/// Uncomment this line to run the tasks on a virtual clock instead of
+/// CLOCK_MONOTONIC, so that task sets can be simulated faster than real time
+/// with reproducible results, see ptask_sim_consume. Meant for offline testing
+/// only: the threads of the tasks are executed one at a time, with the default
+/// policy of the system.
+// #define PTASK_SIMULATION
+
+#ifdef PTASK_SIMULATION
+// Timers of the kernel cannot follow the virtual clock
+#undef PTASK_TIMERFD
+#endif
+
+/// Uncomment this line to count the page faults taken and the memory
+/// allocations performed within the jobs of each task, which a real-time task
+/// shall never experience once ptask_rt_init has been called. Meant for
+/// debugging only: allocations are counted by replacing malloc, calloc and
+/// realloc of the whole process.
+// #define PTASK_RT_GUARD
+
 /**
  * The structure representing a task
  */
@@ -165,14 +290,59 @@ typedef struct __PTASK_STRUCT
 {
 	int id;				///< Identificator of a ptask
 	long wcet;			///< Worst case execution time (in us): 0 means unknown
-	int period;			///< in milliseconds
-	int deadline;		///< Relative to activation time (in ms)
+	int64_t period;		///< in nanoseconds
+	int64_t deadline;	///< Relative to activation time (in ns)
+	int64_t offset;		///< Release offset w.r.t. the phase origin (in ns),
+						///< PTASK_NO_OFFSET if the task is not phased
 	int priority;		///< Value between [0,99], standard should be in [0,32]
 	int dmiss;			///< Number of occurred deadline misses
+	int skipped;		///< Number of activations dropped after overruns
 	struct timespec at;	///< Next activation time
 	struct timespec dl;	///< Next absolute deadline
 
+	ptask_overrun_t overrun;
+						///< What to do when a job overruns its period
+	ptask_overrun_handler_t *overrun_handler;
+						///< Decides the policy if overrun is
+						///< PTASK_OVERRUN_HANDLER
+
+	long budget;		///< CPU time each job can consume (in us), 0 if not
+						///< enforced
+	ptask_budget_action_t budget_action;
+						///< What to do when a job exceeds the budget
+	ptask_budget_handler_t *budget_handler;
+						///< Called if budget_action is
+						///< PTASK_BUDGET_HANDLER
+	atomic_int overbudget;
+						///< Number of jobs that exceeded the budget
+
+	cpu_set_t affinity;	///< CPUs on which the task can run, if empty the
+						///< task inherits the affinity of its creator
+
 	ptask_state_t _state;///< State of the ptask, see ptask_state_t
+	int _policy;		///< Scheduling policy the task has been created with
+	void* (*_body) (void*);
+						///< Body of the task, run once the thread has
+						///< been set up
+	int _timer;			///< Timerfd that activates the task, -1 if none
+	int _epoll;			///< Epoll set of the file descriptors the task
+						///< waits for besides its timer, -1 if none
+	int _pending;		///< Activations already elapsed and not yet
+						///< released, see PTASK_OVERRUN_CATCHUP
+	timer_t _budget_timer;
+						///< CPU-time timer of the thread that measures the
+						///< budget of each job
+	bool _has_budget_timer;
+						///< Tells if the budget timer has been created
+	volatile sig_atomic_t _over_budget;
+						///< Set when the current job exceeds the budget
+	volatile sig_atomic_t _demoted;
+						///< Set while the thread runs as SCHED_IDLE
+
+#ifdef PTASK_SIMULATION
+	struct __PTASK_SIM_THREAD *_sim;
+						///< The thread of the task in the simulation
+#endif
 
 	pthread_t _tid;		///< Pthread id of the task
 	pthread_attr_t _attr;///< Pthread params of the task
@@ -180,10 +350,74 @@ typedef struct __PTASK_STRUCT
 	char args[PTASK_ARGS_SIZE];
 						///< Extra arguments that may be given to the task,
 						///< up to PTASK_ARGS_SIZE bytes
+
+#ifdef PTASK_PROFILE
+	ptask_profile_t profile;
+						///< Timing statistics of the jobs of the task
+#endif
+
+#ifdef PTASK_RT_GUARD
+	long faults;		///< Page faults taken within the jobs of the task
+	long allocs;		///< Allocations performed within the jobs of the
+						///< task
+#endif
 } ptask_t;
 
+/// Uncomment this line to profile the contention of each ptask_mutex_t:
+/// acquisitions, contended acquisitions, the time spent waiting for the mutex
+/// and holding it, and which tasks held it, see ptask_mutex_report. Meant for
+/// debugging only: each acquisition costs a trylock and two clock readings
+// #define PTASK_MUTEX_PROFILE
+
+#ifdef PTASK_MUTEX_PROFILE
+
+/// The maximum number of mutexes included in the report
+#define PTASK_MUTEX_MAX		(64)
+
+/// The maximum number of distinct holders tracked for each mutex, further ones
+/// are accounted to the last one
+#define PTASK_MUTEX_HOLDERS	(8)
+
+/**
+ * The usage of a mutex by one of its holders.
+ */
+typedef struct __PTASK_MUTEX_HOLDER
+{
+	int			task;			///< Id of the holding ptask, -1 for threads
+								///< that are not ptasks
+	uint64_t	acquisitions;	///< Acquisitions by this holder
+	uint64_t	contended;		///< Acquisitions in which it had to wait
+	int64_t		hold;			///< Total time it held the mutex (in ns)
+} ptask_mutex_holder_t;
+
+/**
+ * A mutex whose contention is profiled. All the statistics are updated while
+ * holding the mutex itself, hence they need no further synchronization.
+ */
+typedef struct __PTASK_MUTEX
+{
+	pthread_mutex_t	_mux;		///< The actual mutex
+	const char*		name;		///< Name used in the report, NULL if unnamed
+	uint64_t		acquisitions;
+								///< Number of acquisitions
+	uint64_t		contended;	///< Acquisitions that found the mutex held
+	histogram_t		wait;		///< Time spent waiting for the mutex (in ns)
+	histogram_t		hold;		///< Time the mutex was held (in ns)
+	int				holder;		///< Id of the current holder, see
+								///< ptask_mutex_holder_t
+	ptask_mutex_holder_t holders[PTASK_MUTEX_HOLDERS];
+								///< Usage of each distinct holder
+	int				nholders;	///< Number of distinct holders
+	struct timespec	_acquired;	///< Time of the current acquisition
+} ptask_mutex_t;
+
+#else
+
 /// Alias of phtread_mutex_t
 typedef pthread_mutex_t ptask_mutex_t;
+
+#endif
+
 /// Alias of phtread_cond_t
 typedef pthread_cond_t ptask_cond_t;
 
@@ -191,8 +425,76 @@ typedef pthread_cond_t ptask_cond_t;
 #define PTASK_CAB_MAX		(50)
 
 /// The maximum number of buffers within a cab structure
+/// NOTICE: the lock-free implementation keeps a bitmap of free buffers in an
+/// unsigned int, so this value cannot exceed its width
 #define PTASK_CAB_MAX_SIZE	(32)
 
+/// Comment this line to use the mutex-based implementation of CABs, in which
+/// each operation takes a priority inheritance mutex. The lock-free
+/// implementation never blocks readers or writers on a kernel mutex.
+/// Both support several writers: the last message is always the one with the
+/// most recent sequence number, whatever the order of their publications.
+/// Defining PTASK_CAB_MUTEX on the command line has the same effect, so that
+/// both implementations can be built from the same tree (see the bench target
+/// of the Makefile).
+#ifndef PTASK_CAB_MUTEX
+#define PTASK_CAB_LOCKFREE
+#endif
+
+#ifdef PTASK_CAB_LOCKFREE
+
+/// Flag set in the reference count of a buffer reserved by a writer
+#define PTASK_CAB_WRITER	(1 << 30)
+
+/**
+ * The structure representing a CAB
+ */
+typedef struct __PTASK_CAB
+{
+	int	id;							///< Identificator of the cab
+	int num_buffers;				///< Number of buffers in the cab
+	int size_buffers;				///< Size of each buffer in the cab in
+									///< bytes (all equal)
+
+	void *buffers[PTASK_CAB_MAX_SIZE];
+									///< Pointers to the actual buffers
+
+	atomic_int busy[PTASK_CAB_MAX_SIZE];
+									///< Number of readers using each buffer,
+									///< or PTASK_CAB_WRITER if reserved by a
+									///< writer
+	atomic_int last_index;			///< Pointer to the current last data buffer
+	atomic_uint free_hint;			///< Bitmap of buffers that were free when
+									///< last released, used to speed up the
+									///< search of a free buffer
+	struct timespec timestamps[PTASK_CAB_MAX_SIZE];
+									///< Time at which each buffer has been
+									///< inserted as the most recent one
+
+	unsigned int sequences[PTASK_CAB_MAX_SIZE];
+									///< Sequence number of the message
+									///< contained in each buffer
+	atomic_uint sequence;			///< Sequence number of the most recent
+									///< message, zero if none has been put
+									///< yet; blocking readers wait on it
+	atomic_uint _next_sequence;		///< Last assigned sequence number
+	atomic_int _waiters;			///< Number of blocked readers
+	int _eventfd;					///< Signaled at each publication, -1 if
+									///< not requested by any reader
+
+	int depth;						///< Number of most recent messages kept
+									///< in the history
+	atomic_int history[PTASK_CAB_MAX_SIZE];
+									///< Buffer holding each of the latest
+									///< messages, indexed by their sequence
+									///< number modulo PTASK_CAB_MAX_SIZE
+	atomic_uint _base_sequence;		///< Sequence number of the most recent
+									///< message at the last reset, messages
+									///< up to it are not in the history
+} ptask_cab_t;
+
+#else
+
 /**
  * The structure representing a CAB
  */
@@ -208,13 +510,37 @@ typedef struct __PTASK_CAB
 
 	int busy[PTASK_CAB_MAX_SIZE];	///< Number of tasks using each buffer
 	int last_index;					///< Pointer to the current last data buffer
-	struct timespec timestamp;		///< Time at which the most recent buffer
-									///< has been inserted
+	struct timespec timestamps[PTASK_CAB_MAX_SIZE];
+									///< Time at which each buffer has been
+									///< inserted as the most recent one
+
+	unsigned int sequences[PTASK_CAB_MAX_SIZE];
+									///< Sequence number of the message
+									///< contained in each buffer
+	atomic_uint sequence;			///< Sequence number of the most recent
+									///< message, zero if none has been put
+									///< yet; blocking readers wait on it
+	atomic_uint _next_sequence;		///< Last assigned sequence number
+	atomic_int _waiters;			///< Number of blocked readers
+	int _eventfd;					///< Signaled at each publication, -1 if
+									///< not requested by any reader
+
+	int depth;						///< Number of most recent messages kept
+									///< in the history
+	atomic_int history[PTASK_CAB_MAX_SIZE];
+									///< Buffer holding each of the latest
+									///< messages, indexed by their sequence
+									///< number modulo PTASK_CAB_MAX_SIZE
+	atomic_uint _base_sequence;		///< Sequence number of the most recent
+									///< message at the last reset, messages
+									///< up to it are not in the history
 
 	ptask_mutex_t _mux;				///< Mutex semaphore used to protect access
 									///< to the cab structure
 } ptask_cab_t;
 
+#endif
+
 /**
  * This alias is useful when defining pointers to functions that can be
  * tasks bodies.
@@ -240,11 +566,22 @@ typedef int ptask_cab_id_t;
  * - SCHED_OTHER
  * - SCHED_RR
  * - SCHED_FIFO
- * - SCHED_DEADLINE (currently not supported, returns EINVAL)
+ * - SCHED_DEADLINE
  *
  * All other values will make this function fail, returning EINVAL. On success
  * this function returns 0.
  *
+ * With SCHED_DEADLINE each task gets a CPU reservation from the kernel: every
+ * period it can run for wcet microseconds (which becomes its runtime) before
+ * its relative deadline, hence the wcet of each task shall be known and no
+ * longer than its deadline, which in turn shall be no longer than its period,
+ * while its priority shall be zero. Reservations are subject to admission
+ * control: if the kernel cannot guarantee all the reservations, ptask_create
+ * fails with EBUSY, without starting the task; EPERM means that the process is
+ * not allowed to use real-time scheduling.
+ * Periodic tasks give back their remaining runtime in ptask_wait_for_period,
+ * being suspended by the kernel until the beginning of their next period.
+ *
  * NOTICE: Scheduler should only be set once per process execution, before all
  * other threads than the main thread have been started.
  */
@@ -272,6 +609,101 @@ extern int ptask_init(ptask_t *ptask);
 extern int ptask_set_params(ptask_t *ptask, long wcet, int period, int deadline,
 	int priority);
 
+/**
+ * Sets period and relative deadline of the given ptask in nanoseconds, for
+ * tasks whose period shall match exactly an external one (e.g. the period of
+ * an audio device) instead of a whole number of milliseconds.
+ * Returns 0 on success, EINVAL if the values are not valid, otherwise the
+ * errors of ptask_create if the task uses SCHED_DEADLINE, whose reservation is
+ * updated too.
+ *
+ * If the task already started its period and it is activated by a timerfd
+ * (see PTASK_TIMERFD), the timer is re-armed so that after the next activation
+ * it expires with the new period.
+ *
+ * NOTICE: this function can be called either before starting the ptask or by
+ * the task itself.
+ */
+extern int ptask_set_period_ns(ptask_t *ptask, int64_t period,
+	int64_t deadline);
+
+/**
+ * Sets the CPUs on which the given ptask can run; a NULL or empty set means
+ * that the task inherits the affinity of the thread that creates it.
+ * Returns 0 on success, a non zero value otherwise.
+ *
+ * NOTICE: this function can be called only before starting the ptask.
+ *
+ * NOTICE: the kernel refuses SCHED_DEADLINE tasks whose affinity does not
+ * include all the CPUs of their root domain, hence with that scheduler
+ * ptask_create fails with EINVAL if an affinity has been set.
+ */
+extern int ptask_set_affinity(ptask_t *ptask, const cpu_set_t *affinity);
+
+/**
+ * Sets what ptask_wait_for_period does when a job of the given ptask completes
+ * after the next activation time, see ptask_overrun_t. The handler is used
+ * only with PTASK_OVERRUN_HANDLER, in which case it shall not be NULL.
+ * Returns 0 on success, EINVAL if the arguments are not valid.
+ *
+ * NOTICE: this function can be called either before starting the ptask or by
+ * the task itself.
+ */
+extern int ptask_set_overrun(ptask_t *ptask, ptask_overrun_t overrun,
+	ptask_overrun_handler_t *handler);
+
+/**
+ * Sets the CPU budget of each job of the given ptask (in us) and what happens
+ * when a job exceeds it, see ptask_budget_action_t; the handler is used only
+ * with PTASK_BUDGET_HANDLER, in which case it shall not be NULL. A zero budget
+ * disables the enforcement.
+ * The budget is measured by a POSIX timer on the CPU-time clock of the thread
+ * of the task, armed when each job starts (see ptask_job_start) and disarmed
+ * when it ends, whose expiration is notified by PTASK_BUDGET_SIGNAL. Hence a
+ * runaway job cannot monopolize a CPU with SCHED_FIFO when demoted.
+ * Returns 0 on success, EINVAL if the arguments are not valid.
+ *
+ * NOTICE: with SCHED_DEADLINE the kernel already throttles the task when it
+ * exhausts its runtime, PTASK_BUDGET_DEMOTE behaves like PTASK_BUDGET_FLAG.
+ *
+ * NOTICE: this function can be called either before starting the ptask or by
+ * the task itself between two jobs.
+ */
+extern int ptask_set_budget(ptask_t *ptask, long budget,
+	ptask_budget_action_t action, ptask_budget_handler_t *handler);
+
+/**
+ * Sets the release offset of the given ptask (in ns): its releases happen at
+ * the offset plus a whole number of periods after the phase origin, which is
+ * common to all the tasks and set by the first call of this function, so that
+ * tasks with the same period keep the same distance between their releases
+ * regardless of when they are started. PTASK_NO_OFFSET restores the default
+ * behavior, in which the first release is the call of ptask_start_period.
+ * Event-driven tasks can delay their jobs by the offset using
+ * ptask_wait_for_offset.
+ * Returns 0 on success, EINVAL if the offset is negative and not
+ * PTASK_NO_OFFSET.
+ *
+ * NOTICE: this function can be called either before starting the ptask or by
+ * the task itself before calling ptask_start_period.
+ */
+extern int ptask_set_offset(ptask_t *ptask, int64_t offset);
+
+/**
+ * Staggers the releases of the given group of n ptasks, which shall share the
+ * same period, spreading them evenly over the given span (in ns) starting
+ * from the phase origin: the i-th task gets an offset of i * span / n. A span
+ * of zero means the whole period; a shorter span leaves the last tasks more
+ * time before their deadline. Spreading releases spreads lock contention and
+ * the peak demand of CPU time across the period instead of concentrating them
+ * at each release.
+ * Returns 0 on success, EINVAL if the periods differ or the span is negative
+ * or longer than the period.
+ *
+ * NOTICE: this function can be called only before starting the ptasks.
+ */
+extern int ptask_stagger(ptask_t *tasks[], int n, int64_t span);
+
 /**
  * Copies the given arguments into the ptask_t structure, so that the task can
  * later retrieve them.
@@ -286,13 +718,15 @@ extern int ptask_set_args(ptask_t *ptask, void *args, size_t args_size);
 /**
  * Creates a new (previously initialized) ptask and starts its execution with
  * the given body function.
- * Returns 0 on success, a non zero value otherwise.
+ * Returns 0 on success, a non zero value otherwise. With SCHED_DEADLINE, the
+ * reservation of the task has already been accepted by the kernel when this
+ * function returns, see ptask_set_scheduler for the returned errors.
  */
 extern int ptask_create(ptask_t *ptask, ptask_body_t *body);
 
 /**
- * Destroys a previously initialied ptask but only if the ptask_create
- * function previously failed.
+ * Destroys a previously initialied ptask but only if it has not been started
+ * yet or if the ptask_create function previously failed.
  * Returns 0 on success, a non zero value otherwise.
  */
 extern int ptask_destroy(ptask_t *ptask);
@@ -305,6 +739,16 @@ extern int ptask_short(ptask_t *ptask,
 	long wcet, int period, int deadline, int priority, ptask_body_t *body,
 	void *args, size_t args_size);
 
+/**
+ * Shorthand for the creation of a task that can run only on the given CPUs,
+ * see ptask_set_affinity.
+ * Returns 0 on success, a non zero value otherwise.
+ */
+extern int ptask_short_affinity(ptask_t *ptask,
+	long wcet, int period, int deadline, int priority,
+	const cpu_set_t *affinity, ptask_body_t *body,
+	void *args, size_t args_size);
+
 /**
  * Cancels a previously started ptask, if it is still running.
  * Returns 0 on success, a non zero value otherwise.
@@ -328,7 +772,10 @@ extern int ptask_join(ptask_t *ptask);
 
 /**
  * Reads the current time and computes the next activation time and the
- * absolute deadline of the task.
+ * absolute deadline of the task. With SCHED_DEADLINE, the task is suspended
+ * until the beginning of its next period first, so that its first job starts
+ * with a full budget. A task with an offset is suspended until its first
+ * release instead, see ptask_set_offset.
  *
  * This function shall be called by the task itself.
  */
@@ -336,13 +783,33 @@ extern void ptask_start_period(ptask_t *ptask);
 
 /**
  * Suspends the calling task until the next activation and, when awaken,
- * updates activation time and deadline.
+ * updates activation time and deadline. If the next activation time already
+ * elapsed, the overrun policy of the task is applied, see ptask_set_overrun.
  *
  * This function shall be called by the task itself.
  *
  */
 extern void ptask_wait_for_period(ptask_t *ptask);
 
+/**
+ * Returns true if the current job of the task has exceeded its budget, see
+ * ptask_set_budget, so that it can degrade the rest of its work.
+ *
+ * This function shall be called by the task itself.
+ */
+extern bool ptask_over_budget(ptask_t *ptask);
+
+/**
+ * Suspends the calling task until the offset of the task (see
+ * ptask_set_offset) elapses after the given release time (e.g. the publication
+ * time of the message that woke up the task), which is then updated, so that
+ * the jobs of a group of event-driven tasks woken up by the same event can be
+ * staggered too. It returns immediately if the task is not phased.
+ *
+ * This function shall be called by the task itself.
+ */
+extern void ptask_wait_for_offset(ptask_t *ptask, struct timespec *release);
+
 /**
  * If the task is still in execution after its deadline, it increments the
  * value of dmiss and returns a non zero value, otherwise returns zero.
@@ -351,6 +818,360 @@ extern void ptask_wait_for_period(ptask_t *ptask);
  */
 extern int ptask_deadline_miss(ptask_t *ptask);
 
+/**
+ * Like ptask_deadline_miss, for event-driven jobs whose absolute deadline is
+ * the relative deadline of the task after the given release time, which shall
+ * be the one given to ptask_job_start.
+ *
+ * This function shall be called by the task itself.
+ */
+extern int ptask_job_deadline_miss(ptask_t *ptask,
+	const struct timespec *release);
+
+/**
+ * Adds the given file descriptor (e.g. one of the poll descriptors of an ALSA
+ * device or the eventfd of a CAB) to the ones the task waits for in
+ * ptask_wait_for_event, which wakes up the task when it is readable.
+ * Returns 0 on success, ENOTSUP if PTASK_TIMERFD is not defined, the errno
+ * value of the failing epoll call otherwise.
+ *
+ * NOTICE: this function can be called either before starting the ptask or by
+ * the task itself.
+ */
+extern int ptask_add_event_fd(ptask_t *ptask, int fd);
+
+/**
+ * Like ptask_wait_for_period, but the calling task is woken up also as soon as
+ * one of the file descriptors added by ptask_add_event_fd is readable, so that
+ * a task can be both time-triggered and event-triggered. In that case a new job
+ * is started, released at the current time, and the file descriptor is
+ * returned; the task shall consume the event before waiting again, since file
+ * descriptors are level-triggered. Otherwise it returns -1, once the next
+ * periodic activation has been released.
+ * Without a timerfd (see PTASK_TIMERFD) it waits only for the period.
+ *
+ * This function shall be called by the task itself.
+ */
+extern int ptask_wait_for_event(ptask_t *ptask);
+
+/**
+ * Marks the beginning of a new job of the task, which has been activated at the
+ * given release time (e.g. the publication time of the message that woke up
+ * the task). Periodic tasks that use ptask_wait_for_period do not need to call
+ * this function.
+ * Jobs are also recorded in the trace of the calling thread, if any (see
+ * trace.h), together with their release time, and their CPU time is measured
+ * against the budget of the task, if any (see ptask_set_budget).
+ *
+ * This function shall be called by the task itself.
+ */
+extern void ptask_job_start(ptask_t *ptask, const struct timespec *release);
+
+/**
+ * Marks the end of the job started by ptask_job_start, updating the timing
+ * statistics of the task.
+ *
+ * This function shall be called by the task itself.
+ */
+extern void ptask_job_end(ptask_t *ptask);
+
+//@}
+
+//-------------------------------------------------------------
+// REAL-TIME MEMORY
+//-------------------------------------------------------------
+
+/**
+ * @name Real-time memory functions
+ */
+//@{
+
+/**
+ * Prepares the process to run real-time tasks without page faults:
+ * - the threads of the ptasks created from now on get a stack of the given
+ * size (in bytes, zero keeps the default size), which each thread prefaults
+ * before running the body of its task;
+ * - the memory allocator stops giving back freed memory to the system, so that
+ * it does not need to be faulted in again when it is reused;
+ * - all the pages of the process, current and future ones, are locked in
+ * memory.
+ * Returns 0 on success, EINVAL if the stack size is too small, the errno value
+ * of mlockall otherwise (e.g. EPERM or ENOMEM if the process is not allowed to
+ * lock that much memory); the first two settings are applied anyway.
+ *
+ * NOTICE: this function shall be called once, before starting any task and
+ * possibly before any big allocation.
+ */
+extern int ptask_rt_init(size_t stack_size);
+
+/**
+ * Touches each page of the given buffer without changing its content, so that
+ * real-time tasks using it later do not take page faults. Buffers shall be
+ * prefaulted after ptask_rt_init, which keeps them in memory.
+ *
+ * NOTICE: this function shall be called before starting the tasks that write
+ * the buffer.
+ */
+extern void ptask_rt_prefault(void *buffer, size_t size);
+
+//@}
+
+//-------------------------------------------------------------
+// SCHEDULABILITY ANALYSIS
+//-------------------------------------------------------------
+
+/**
+ * The orders in which fixed priorities can be assigned automatically:
+ * - PTASK_PRIO_RM: rate monotonic, shorter periods get higher priorities;
+ * - PTASK_PRIO_DM: deadline monotonic, shorter relative deadlines get higher
+ * priorities, which is optimal for tasks whose deadline is not greater than
+ * their period.
+ */
+typedef enum __PTASK_PRIO_ORDER_ENUM {
+	PTASK_PRIO_RM	= 0,
+	PTASK_PRIO_DM
+} ptask_prio_order_t;
+
+/**
+ * @name Schedulability analysis functions
+ */
+//@{
+
+/**
+ * Assigns a priority in [min_prio, max_prio] to each one of the n given
+ * tasks, in the given order; tasks with the same period (or deadline) get the
+ * same priority, using one level for each distinct value.
+ * Returns 0 on success, EINVAL if a task has already been started or if there
+ * are not enough priority levels.
+ *
+ * NOTICE: this function shall be called before starting the tasks.
+ */
+extern int ptask_assign_priorities(ptask_t *tasks[], int n,
+	ptask_prio_order_t order, int min_prio, int max_prio);
+
+/**
+ * Performs the response-time analysis of the n given fixed-priority tasks,
+ * storing in response the worst-case response time of each task (in ns). The
+ * WCETs used are the ones in the wcet array (in ns) or, if it is NULL, the ones
+ * of the tasks. If the iteration for a task exceeds its deadline, the value
+ * stored is the first one found beyond the deadline.
+ *
+ * A task is interfered by all the other tasks with greater or equal priority
+ * that share at least one CPU with it (an empty affinity means any CPU). The
+ * result is exact for tasks bound to the same single CPU, while it is
+ * pessimistic for tasks that can migrate.
+ *
+ * Returns the number of tasks whose response time exceeds their deadline,
+ * hence zero if the task set is schedulable.
+ */
+extern int ptask_response_time_analysis(ptask_t *tasks[], const int64_t wcet[],
+	int n, int64_t response[]);
+
+//@}
+
+//-------------------------------------------------------------
+// APERIODIC SERVERS
+//-------------------------------------------------------------
+
+/// The maximum number of jobs waiting to be served by an aperiodic server
+#define PTASK_SERVER_QUEUE	(32)
+
+/// The maximum number of pending replenishments of an aperiodic server, when
+/// exceeded the last one is postponed and merged with the new one
+#define PTASK_SERVER_REPL	(8)
+
+/**
+ * An aperiodic job, executed by a server with the given argument.
+ */
+typedef void (ptask_job_t) (void *arg);
+
+/**
+ * A job waiting in the queue of a server.
+ */
+typedef struct __PTASK_SERVER_JOB
+{
+	ptask_job_t*	job;			///< The function to execute
+	void*			arg;			///< Its argument
+	struct timespec	submitted;		///< Time at which it has been queued, it
+									///< is the release time of the job
+} ptask_server_job_t;
+
+/**
+ * A sporadic server: a task that executes queued aperiodic jobs, in FIFO
+ * order, consuming a budget of CPU time that is replenished according to the
+ * sporadic server rules. When the server becomes active (it has jobs to serve
+ * and some budget), the budget it consumes from then until it becomes idle or
+ * runs out of budget is given back one period after the activation.
+ *
+ * Hence, from the point of view of the other tasks, the server is never worse
+ * than a periodic task with the same budget (as WCET) and period, and it can
+ * be included as such in ptask_response_time_analysis, while bursts of
+ * aperiodic jobs are served as soon as possible within the budget.
+ *
+ * Each job gets the remaining capacity as its budget (see ptask_set_budget),
+ * with PTASK_BUDGET_DEMOTE: the job that exhausts it completes anyway, but
+ * with SCHED_IDLE, overdrawing the budget only while no other task is ready,
+ * and the excess is paid back from the following replenishments. Hence the
+ * budget should be no shorter than the longest job, otherwise such a job runs
+ * in background; with SCHED_DEADLINE the kernel enforces the budget instead.
+ * The budget of the task executing the server is overwritten.
+ */
+typedef struct __PTASK_SERVER
+{
+	int64_t	budget;					///< Capacity replenished in each period
+									///< (in ns)
+	int64_t	period;					///< Replenishment period (in ns)
+	int64_t	capacity;				///< Budget currently available (in ns),
+									///< negative if overdrawn
+	int		served;					///< Number of jobs served so far
+	int		rejected;				///< Number of jobs not accepted because
+									///< the queue was full or the server had
+									///< been stopped
+	int		discarded;				///< Number of jobs still queued when the
+									///< server has been stopped
+
+	ptask_server_job_t _queue[PTASK_SERVER_QUEUE];
+									///< Jobs waiting to be served
+	int		_head;					///< Index of the oldest queued job
+	int		_count;					///< Number of queued jobs
+
+	struct timespec _repl_time[PTASK_SERVER_REPL];
+									///< Times of the pending replenishments,
+									///< in increasing order
+	int64_t	_repl_amount[PTASK_SERVER_REPL];
+									///< Budget given back by each one (in ns)
+	int		_nrepl;					///< Number of pending replenishments
+
+	bool	_terminate;				///< Set to stop the server
+	ptask_mutex_t _mux;				///< Protects the queue and the counters
+	ptask_cond_t _cond;				///< Signaled when a job is queued
+} ptask_server_t;
+
+/**
+ * @name Aperiodic servers
+ */
+//@{
+
+/**
+ * Initializes the given server with the given budget (in us) and replenishment
+ * period (in ms). The server is executed by a task created with
+ * ptask_server_task as body and a pointer to the server as argument, e.g.
+ *
+ * \code
+ptask_server_t *sp = &server;
+
+ptask_server_init(sp, 2000l, 20);
+ptask_short(&task, 2000l, 20, 20, 1, ptask_server_task, &sp, sizeof(sp));
+ * \endcode
+ *
+ * whose parameters shall be the ones of the server, so that the analysis of the
+ * task set is correct.
+ * Returns 0 on success, EINVAL if the budget is not in (0, period], the error
+ * of the initialization of the mutex or condition variable otherwise.
+ */
+extern int ptask_server_init(ptask_server_t *server, long budget, int period);
+
+/**
+ * The body of the task that executes the jobs of a server, until the server
+ * is stopped. Each job is measured like the ones of a periodic task, released
+ * when it has been queued (see ptask_job_start).
+ */
+extern void *ptask_server_task(void *arg);
+
+/**
+ * Queues the given job, which will be executed by the server with the given
+ * argument as soon as its budget allows it.
+ * Returns 0 on success, EAGAIN if the queue is full or the server has been
+ * stopped.
+ *
+ * This function can be called by any thread.
+ */
+extern int ptask_server_submit(ptask_server_t *server, ptask_job_t *job,
+	void *arg);
+
+/**
+ * Stops the given server: its task returns as soon as the running job (if any)
+ * completes, or at the next replenishment if it is waiting for budget,
+ * discarding the queued jobs; it shall then be joined.
+ *
+ * This function can be called by any thread.
+ */
+extern void ptask_server_stop(ptask_server_t *server);
+
+//@}
+
+//-------------------------------------------------------------
+// VIRTUAL CLOCK
+//-------------------------------------------------------------
+
+/**
+ * @name Clock and simulation functions
+ *
+ * All the timing of the library (activations, deadlines, profiles, CAB
+ * timestamps and timeouts) is based on the clock returned by
+ * ptask_clock_gettime, which is CLOCK_MONOTONIC unless PTASK_SIMULATION is
+ * defined; code that compares its own times with the ones of the tasks shall
+ * use it too.
+ *
+ * With PTASK_SIMULATION the clock is a virtual one, which starts from the
+ * value of CLOCK_MONOTONIC when it is first read and advances only when all
+ * the threads that take part in the simulation are suspended: the threads of
+ * the tasks always take part in it, other threads only between
+ * ptask_sim_enter and ptask_sim_leave. They are executed one at a time,
+ * taking no virtual time, until they declare the CPU time they would have
+ * consumed (see ptask_sim_consume) or they wait for an activation, a timeout,
+ * a ptask_mutex_t, a ptask_cond_t or a CAB message; then the clock jumps to
+ * the next event. Threads are chosen by priority, or by absolute deadline
+ * with SCHED_DEADLINE, and then in FIFO order.
+ *
+ * CPU time is consumed on the first CPU of the affinity of each task, where
+ * the task can be preempted by the tasks with higher priority, while a task
+ * without affinity is assumed to have a CPU of its own. Budgets (see
+ * ptask_set_budget) are checked each time the consumption ends. Hence, with
+ * declared costs each run gives the same deadline misses and response times.
+ *
+ * NOTICE: threads that take part in the simulation shall block only through
+ * this library (or for negligible times): a thread blocked on anything else
+ * stops the virtual clock, while keeping the other threads waiting.
+ */
+//@{
+
+/// Stores the current time of the clock of the library in the given structure
+extern void ptask_clock_gettime(struct timespec *t);
+
+/// Suspends the calling thread until the given time of the clock of the library
+extern void ptask_sleep_until(const struct timespec *t);
+
+/**
+ * Declares that the calling thread consumes the given amount of CPU time (in
+ * ns), suspending it until it has been executed on its CPU, see above. It does
+ * nothing if PTASK_SIMULATION is not defined, so that task bodies can
+ * declare their costs unconditionally.
+ */
+extern void ptask_sim_consume(int64_t ns);
+
+/**
+ * Tells if the CPU time actually consumed by the threads that take part in the
+ * simulation shall be consumed in virtual time too, each time they are
+ * suspended, so that task bodies that do not declare their costs can be
+ * simulated using measured ones (scaled by the given factor). Measured costs
+ * make runs no longer exactly reproducible. It does nothing if
+ * PTASK_SIMULATION is not defined.
+ *
+ * NOTICE: this function shall be called before starting the tasks.
+ */
+extern void ptask_sim_measure(bool measure, double scale);
+
+/**
+ * Makes the calling thread take part in the simulation until it calls
+ * ptask_sim_leave, e.g. while it creates a group of tasks, which would
+ * otherwise start at different virtual times. They do nothing if
+ * PTASK_SIMULATION is not defined.
+ */
+extern void ptask_sim_enter();
+/// See ptask_sim_enter
+extern void ptask_sim_leave();
+
 //@}
 
 //-------------------------------------------------------------
@@ -366,14 +1187,48 @@ extern int ptask_deadline_miss(ptask_t *ptask);
 extern int ptask_get_id(ptask_t *ptask);
 /// Returns the task WCET
 extern long ptask_get_wcet(ptask_t *ptask);
-/// Returns the task period
+/// Returns the task period, in milliseconds rounded down
 extern int ptask_get_period(ptask_t *ptask);
-/// Returns the task deadline
+/// Returns the task deadline, in milliseconds rounded down
 extern int ptask_get_dealine(ptask_t *ptask);
+/// Returns the task period in nanoseconds
+extern int64_t ptask_get_period_ns(ptask_t *ptask);
+/// Returns the task deadline in nanoseconds
+extern int64_t ptask_get_deadline_ns(ptask_t *ptask);
+/// Returns the task release offset in nanoseconds, or PTASK_NO_OFFSET
+extern int64_t ptask_get_offset(ptask_t *ptask);
 /// Returns the task priority
 extern int ptask_get_priority(ptask_t *ptask);
 /// Returns the number of deadline misses experienced by the task
 extern int ptask_get_dmiss(ptask_t *ptask);
+/// Returns the number of activations dropped by the overrun policy of the task
+extern int ptask_get_skipped(ptask_t *ptask);
+/// Returns the number of jobs of the task that exceeded their budget
+extern int ptask_get_overbudget(ptask_t *ptask);
+/// Copies the CPU affinity of the task in the given set
+extern void ptask_get_affinity(ptask_t *ptask, cpu_set_t *affinity);
+
+#ifdef PTASK_RT_GUARD
+/// Returns the number of page faults taken within the jobs of the task
+extern long ptask_get_faults(ptask_t *ptask);
+/// Returns the number of allocations performed within the jobs of the task
+extern long ptask_get_allocs(ptask_t *ptask);
+#endif
+
+#ifdef PTASK_PROFILE
+/// Returns the timing statistics of the task
+extern const ptask_profile_t *ptask_get_profile(ptask_t *ptask);
+#endif
+
+/**
+ * Prints a line with the 50th and 99th percentiles and the maximum of the
+ * execution time, response time and activation jitter of the jobs of the task,
+ * in microseconds, preceded by the given name. The maximum execution time is a
+ * measured estimate of the WCET of the task.
+ * It prints nothing if PTASK_PROFILE is not defined or if no job has been
+ * measured.
+ */
+extern void ptask_print_profile(ptask_t *ptask, const char *name);
 
 //@}
 
@@ -402,6 +1257,25 @@ extern int ptask_cond_signal(ptask_cond_t *cond_p);
 /// Broadcasts a signal to all tasks waiting for the given ptask_cond_t
 extern int ptask_cond_broadcast(ptask_cond_t *cond_p);
 
+/**
+ * Gives a name to the given ptask_mutex_t, which identifies it in the report
+ * of PTASK_MUTEX_PROFILE; the name is not copied, it shall be a string
+ * literal. It does nothing if PTASK_MUTEX_PROFILE is not defined.
+ */
+extern void ptask_mutex_set_name(ptask_mutex_t *mux_p, const char *name);
+
+/**
+ * Prints the contention profile of each ptask_mutex_t initialized so far that
+ * has been acquired at least once: acquisitions, the fraction of contended
+ * ones, p50, p99 and max of waiting and holding times (in us) and the usage of
+ * each task that held it, identified by its id (see ptask_get_id). It does
+ * nothing if PTASK_MUTEX_PROFILE is not defined.
+ *
+ * NOTICE: mutexes are tracked by address, hence they shall outlive the report.
+ * It shall be called when no task is using the mutexes, e.g. at exit.
+ */
+extern void ptask_mutex_report();
+
 //@}
 
 //-------------------------------------------------------------
@@ -422,8 +1296,23 @@ extern int ptask_cond_broadcast(ptask_cond_t *cond_p);
 extern int ptask_cab_init(ptask_cab_t *ptask_cab, int n, int size,
 	void *buffers[]);
 
+/**
+ * Initializes a new cab like ptask_cab_init, but keeps the given number of
+ * most recent messages (depth) in a history that readers can acquire as a
+ * whole using ptask_cab_getmes_window. Buffers in the history are never
+ * reserved by writers, hence the cab shall have at least depth buffers, plus
+ * one for each buffer held at the same time by readers, plus one for each
+ * writer. A cab initialized by ptask_cab_init has a depth of one.
+ *
+ * Returns zero on success, EINVAL if the depth is not in [1, n-1] or if the
+ * maximum number of CABs has already been assigned.
+ */
+extern int ptask_cab_init_history(ptask_cab_t *ptask_cab, int n, int size,
+	void *buffers[], int depth);
+
 /**
  * Resets the cab last value to no value, as it was just been initialized.
+ * The history is emptied as well.
  * Any task using a cab buffer can continue using it without any problem.
  *
  * Returns zero on success, a non zero value otherwise.
@@ -444,7 +1333,9 @@ extern int ptask_cab_reset(ptask_cab_t *ptask_cab);
  * buffer. This id will be used later to commit any changes applied to the
  * buffer using ptask_cab_putmes.
  *
- * It returns zero on success, a non zero value otherwise.
+ * It returns zero on success, a non zero value otherwise. The lock-free
+ * implementation returns EAGAIN if no buffer is free, which cannot happen if
+ * the cab is used correctly.
  *
  * NOTICE: Attempting to reserve a buffer using a non already initialized cab
  * results in undefined behavior.
@@ -492,6 +1383,55 @@ extern int ptask_cab_putmes(ptask_cab_t *ptask_cab, ptask_cab_id_t b_id);
 extern int ptask_cab_getmes(ptask_cab_t *ptask_cab, const void* buffer[],
 	ptask_cab_id_t *b_id, struct timespec *timestamp);
 
+/**
+ * This function works like ptask_cab_getmes, but it acquires only a message
+ * newer than the one with the given sequence number, blocking the calling
+ * thread until such a message is put in the cab or the given timeout (in ms,
+ * a negative value means forever) expires. Blocked threads are woken up as soon
+ * as a new message is put.
+ *
+ * The seq argument is an INOUT argument: it shall contain the sequence number
+ * of the last message seen by the caller (zero if none) and on success it
+ * contains the one of the acquired message. Sequence numbers increase
+ * monotonically with each ptask_cab_putmes call; since only the most recent
+ * message is acquired, the caller can compare consecutive sequence numbers to
+ * detect the messages it skipped.
+ *
+ * Messages put before the last ptask_cab_reset cannot be acquired anymore: if
+ * the cab has been resetted, the sequence number is moved forward to the
+ * reset and the calling thread waits for a message put after it.
+ *
+ * It returns zero on success and ETIMEDOUT if the timeout expired. The
+ * acquired buffer shall be released using ptask_cab_unget.
+ */
+extern int ptask_cab_getmes_next(ptask_cab_t *ptask_cab, const void* buffer[],
+	ptask_cab_id_t *b_id, struct timespec *timestamp, unsigned int *seq,
+	int timeout);
+
+/**
+ * Returns a non-blocking eventfd whose counter is incremented by each
+ * publication in the cab, creating it on the first call, or -1 if it cannot be
+ * created. It allows a reader to wait for new messages together with other
+ * file descriptors, e.g. using ptask_wait_for_event; once woken up, the reader
+ * shall read the 8 bytes of the counter to reset it and then get the most
+ * recent message. Since the counter is reset by the first reader that reads
+ * it, the eventfd suits a single reader.
+ *
+ * NOTICE: this function shall be called before starting the tasks that write
+ * the cab; from then on, each publication costs a write system call.
+ */
+extern int ptask_cab_get_eventfd(ptask_cab_t *ptask_cab);
+
+/**
+ * Releases the resources acquired by the cab after its initialization, i.e.
+ * its eventfd (see ptask_cab_get_eventfd). Buffers are owned by the caller and
+ * are not freed.
+ * Returns zero on success, the errno value of the failing call otherwise.
+ *
+ * NOTICE: no task shall use the cab when this function is called.
+ */
+extern int ptask_cab_destroy(ptask_cab_t *ptask_cab);
+
 /**
  * This function releases a buffer acquired for reading purposes using the
  * ptask_cab_getmes. It MUST be called after a ptask_cab_getmes call
@@ -508,6 +1448,35 @@ extern int ptask_cab_getmes(ptask_cab_t *ptask_cab, const void* buffer[],
  */
 extern int ptask_cab_unget(ptask_cab_t *ptask_cab, ptask_cab_id_t b_id);
 
+/**
+ * This function acquires for reading purposes the k most recent messages of
+ * the history of the cab, without copying them. On success, count contains
+ * the number of acquired messages, which can be less than k if fewer messages
+ * have been put since the cab has been initialized or resetted; the first count
+ * elements of the buffer, b_id and timestamp (which can be NULL) arrays contain
+ * the acquired messages, from the oldest to the most recent one.
+ *
+ * The acquired messages are always consecutive: if a writer overwrites one of
+ * them while the window is being acquired, the acquisition is restarted from
+ * the most recent message.
+ *
+ * It returns zero on success, EINVAL if k is not in [1, depth] and EAGAIN if no
+ * value has been put inside the cab since it has been initialized or resetted.
+ * The acquired buffers shall be released using ptask_cab_unget_window.
+ */
+extern int ptask_cab_getmes_window(ptask_cab_t *ptask_cab, int k,
+	const void* buffer[], ptask_cab_id_t b_id[], struct timespec timestamp[],
+	int *count);
+
+/**
+ * This function releases all the buffers acquired by a successful call to
+ * ptask_cab_getmes_window, given the b_id array and count filled by it.
+ *
+ * It returns zero on success, a non zero value otherwise.
+ */
+extern int ptask_cab_unget_window(ptask_cab_t *ptask_cab,
+	const ptask_cab_id_t b_id[], int count);
+
 //@}
 
 #endif
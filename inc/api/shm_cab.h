@@ -0,0 +1,147 @@
+/**
+ * @file shm_cab.h
+ * @brief Cyclic asynchronous buffers shared between processes
+ *
+ * A shared CAB lives in a POSIX shared memory segment, so that a process (the
+ * owner) can publish messages that other processes read. The segment contains
+ * a control header followed by the buffers; since each process maps the
+ * segment at a different address, buffers are located by their offset from
+ * the beginning of the segment instead of by pointers.
+ *
+ * Writers live in the owner process, which maps the segment in read-write
+ * mode and serializes reservations and publications with a process-shared
+ * robust mutex: if a writer dies while holding it, the next writer recovers
+ * the mutex instead of blocking forever.
+ *
+ * Readers map the whole segment in read-only mode, hence they cannot block
+ * writers nor corrupt the published messages. Since readers cannot take
+ * references on buffers, each read is validated instead: a buffer has a zero
+ * sequence number while it is being written, and a message is valid only if
+ * the sequence number of its buffer did not change while it was read. Writers
+ * always reuse the buffer holding the oldest message, so a reader has the time
+ * of n-1 publications to read a message before it is overwritten.
+ *
+ * NOTICE: the segment is created with permissions 0644, so that an
+ * unprivileged process can read messages published by a privileged one.
+ */
+
+#ifndef SHM_CAB_H
+#define SHM_CAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/// The maximum length of the name of a shared CAB, including the leading slash
+#define SHM_CAB_NAME_SIZE	(64)
+
+/// The maximum number of buffers within a shared CAB
+#define SHM_CAB_MAX_SIZE	(32)
+
+/// The control header of a shared CAB, defined in shm_cab.c
+struct __SHM_CAB_SEGMENT;
+
+/**
+ * The process-local handle of a shared CAB
+ */
+typedef struct __SHM_CAB
+{
+	struct __SHM_CAB_SEGMENT *segment;
+									///< The mapped segment
+	size_t	segment_size;			///< The size of the mapped segment
+	bool	owner;					///< True if the segment has been created by
+									///< this process, which can write messages
+	char	name[SHM_CAB_NAME_SIZE];///< The name of the segment
+} shm_cab_t;
+
+/**
+ * @name Shared CABs
+ */
+//@{
+
+/**
+ * Creates a new shared CAB with the given name (which shall start with a
+ * slash), made of n buffers, each one of the given size in bytes. A stale
+ * segment with the same name, left by a process that terminated without
+ * closing it, is replaced; the process that created a segment is stored in its
+ * header, so that a segment whose owner is still running is never replaced.
+ *
+ * Returns zero on success, EINVAL if the arguments are not valid, EEXIST if a
+ * segment with the same name exists and it is not stale, the errno value of
+ * the failing system call otherwise.
+ */
+extern int shm_cab_create(shm_cab_t *cab, const char *name, int n, int size);
+
+/**
+ * Opens the shared CAB with the given name, created by another process, in
+ * read-only mode.
+ *
+ * Returns zero on success, EINVAL if the segment is not a shared CAB or it has
+ * been created by an incompatible version of this library, the errno value of
+ * the failing system call otherwise.
+ */
+extern int shm_cab_open(shm_cab_t *cab, const char *name);
+
+/**
+ * Unmaps the shared CAB. If the calling process created it, the segment is
+ * removed as well; processes that still have it mapped can keep reading it.
+ */
+extern void shm_cab_close(shm_cab_t *cab);
+
+/**
+ * Returns the size of each buffer of the shared CAB, in bytes.
+ */
+extern int shm_cab_get_size(const shm_cab_t *cab);
+
+/**
+ * Reserves a buffer of the shared CAB for writing purposes, like
+ * ptask_cab_reserve. It can be called only by the process that created the
+ * CAB.
+ *
+ * Returns zero on success, EPERM if the CAB has been opened in read-only mode
+ * and EAGAIN if all the buffers are reserved.
+ */
+extern int shm_cab_reserve(shm_cab_t *cab, void *buffer[], int *b_id);
+
+/**
+ * Publishes the message written in the given buffer, which shall have been
+ * reserved using shm_cab_reserve, and wakes up readers blocked in
+ * shm_cab_read_next.
+ *
+ * Returns zero on success, EINVAL if the buffer was not reserved.
+ */
+extern int shm_cab_putmes(shm_cab_t *cab, int b_id);
+
+/**
+ * Returns a pointer to the most recent message without copying it. On success,
+ * b_id and seq contain the buffer id and the sequence number of the message,
+ * which shall be passed to shm_cab_validate once the message has been read;
+ * timestamp (which can be NULL) contains the time at which it was published.
+ *
+ * Returns zero on success, EAGAIN if no message has been published yet.
+ */
+extern int shm_cab_getmes(const shm_cab_t *cab, const void *buffer[],
+	int *b_id, struct timespec *timestamp, unsigned int *seq);
+
+/**
+ * Returns true if the message acquired using shm_cab_getmes has not been
+ * overwritten so far, hence anything read from it before this call is valid.
+ */
+extern bool shm_cab_validate(const shm_cab_t *cab, int b_id, unsigned int seq);
+
+/**
+ * Copies the most recent message newer than the one with the given sequence
+ * number into the given buffer, which shall be big enough to hold it. The
+ * calling thread is blocked until such a message is published or the given
+ * timeout (in ms, a negative value means forever) expires.
+ *
+ * The seq argument is an INOUT argument, like in ptask_cab_getmes_next.
+ *
+ * Returns zero on success and ETIMEDOUT if the timeout expired.
+ */
+extern int shm_cab_read_next(const shm_cab_t *cab, void *buffer,
+	struct timespec *timestamp, unsigned int *seq, int timeout);
+
+//@}
+
+#endif
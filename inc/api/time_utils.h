@@ -35,8 +35,14 @@
 #include <linux/time.h>
 #endif
 
+#include <stdint.h>
 #include <time.h>
 
+/// Nanoseconds in a millisecond
+#define TIME_NS_PER_MS	(1000000LL)
+/// Nanoseconds in a second
+#define TIME_NS_PER_S	(1000000000LL)
+
 /** Copies the time value in ts into td.
  */
 extern void time_copy(struct timespec *td, struct timespec ts);
@@ -45,6 +51,18 @@ extern void time_copy(struct timespec *td, struct timespec ts);
  */
 extern void time_add_ms(struct timespec *t, int ms);
 
+/** Adds ns nanoseconds, which may be negative, to the value contained in t.
+ */
+extern void time_add_ns(struct timespec *t, int64_t ns);
+
+/** Returns the value contained in t in nanoseconds.
+ */
+extern int64_t time_to_ns(struct timespec t);
+
+/** Returns the time corresponding to the given number of nanoseconds.
+ */
+extern struct timespec time_from_ns(int64_t ns);
+
 /** Compares the two values contained in t1 and t2.
  *
  * @return The result is either
@@ -63,4 +81,9 @@ extern int time_cmp(struct timespec t1, struct timespec t2);
  */
 extern int time_diff(struct timespec *tdest, struct timespec t2, struct timespec t1);
 
+/** Returns the difference between two times (t2 - t1) in nanoseconds, which
+ * is negative if t2 is before t1.
+ */
+extern int64_t time_diff_ns(struct timespec t2, struct timespec t1);
+
 #endif
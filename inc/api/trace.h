@@ -0,0 +1,107 @@
+/**
+ * @file trace.h
+ * @brief Per-thread event traces exported as Chrome trace events
+ *
+ * Each thread that records events owns a ring buffer, in which it is the only
+ * writer, so that recording an event costs a clock reading and a few stores,
+ * without any lock. When a ring is full, its oldest events are overwritten,
+ * hence a trace always contains the most recent events of each thread.
+ *
+ * Traces are written in the Chrome trace-event JSON format, which can be
+ * opened both by chrome://tracing and by the Perfetto UI: each ring becomes a
+ * track named after its thread, showing durations, instant events and
+ * counters on a common time axis (CLOCK_MONOTONIC unless another clock is set
+ * by trace_set_clock, in microseconds).
+ *
+ * Recording is disabled until trace_enable is called; until then each
+ * recording function returns after reading a flag.
+ *
+ * NOTICE: event names are not copied, they shall be string literals.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/// The maximum number of rings, hence of distinct traced threads
+#define TRACE_MAX_RINGS	(32)
+
+/// The number of events kept by each ring, it shall be a power of two
+#define TRACE_RING_SIZE	(4096)
+
+/// The maximum length of the name of a ring, including the terminator
+#define TRACE_NAME_SIZE	(16)
+
+/// A function that reads the time of the events
+typedef void (trace_clock_t) (struct timespec *t);
+
+/**
+ * @name Tracing
+ */
+//@{
+
+/**
+ * Enables recording from now on.
+ *
+ * NOTICE: this function shall be called before starting the traced threads.
+ */
+extern void trace_enable();
+
+/// Returns true if recording is enabled
+extern bool trace_enabled();
+
+/**
+ * Replaces CLOCK_MONOTONIC with the given clock to timestamp the events, e.g.
+ * the virtual clock of a simulation.
+ *
+ * NOTICE: this function shall be called before starting the traced threads.
+ */
+extern void trace_set_clock(trace_clock_t *clock);
+
+/**
+ * Gives a ring with the given name to the calling thread, which records its
+ * events in it from now on. The ring of a terminated thread with the same name
+ * is reused, so that a thread started again continues the same track.
+ * Returns zero on success (or if recording is disabled), EAGAIN if all the
+ * rings are in use and ENOMEM if the ring cannot be allocated.
+ *
+ * NOTICE: this function allocates memory, it shall be called at the beginning
+ * of a thread and not within real-time jobs. Threads without a ring record
+ * nothing.
+ */
+extern int trace_thread_register(const char *name);
+
+/// Records the beginning of a duration with the given name and id
+extern void trace_begin(const char *name, int id);
+
+/// Records the end of the last duration begun with the given name
+extern void trace_end(const char *name, int id);
+
+/// Records an instant event with the given name, id and value
+extern void trace_instant(const char *name, int id, double value);
+
+/// Records an instant event that happened at the given time
+extern void trace_instant_at(const char *name, int id, double value,
+	const struct timespec *t);
+
+/**
+ * Records the given value of a counter: counters with the same name are shown
+ * in the same track, with one series for each id.
+ */
+extern void trace_counter(const char *name, int id, double value);
+
+/**
+ * Writes the events of all the rings into the given file, in the Chrome
+ * trace-event JSON format. It can be called at any time: events recorded
+ * while it runs may be missing, and older events that are overwritten while
+ * their ring is being copied are dropped, so that no exported event mixes the
+ * fields of two records.
+ * Returns zero on success, the errno value of the failing call otherwise.
+ */
+extern int trace_write(const char *filename);
+
+//@}
+
+#endif
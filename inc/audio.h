@@ -50,6 +50,23 @@ typedef enum __AUDIO_TYPE_ENUM
  */
 extern int audio_init();
 
+#ifdef AUDIO_CAPTURE_FILE
+/**
+ * Initializes the audio module without any sound output: no sound driver,
+ * synthesizer, sequencer or playback device is installed, samples are recorded
+ * from the capture file without any countdown and play requests are served
+ * (measuring their timing) without playing anything. Meant for offline
+ * simulations, see TASK_SIM_DURATION.
+ */
+extern int audio_init_headless();
+#endif
+
+/**
+ * Releases the resources of the audio module, i.e. its CABs and the ones that
+ * outlive the process if not released, like shared memory segments.
+ */
+extern void audio_close();
+
 /**
  * Opens the file specified by the filename.
  * The filename shall be the complete absolute path of the file.
@@ -68,8 +85,16 @@ extern bool audio_file_is_open(int i);
 extern int audio_file_close(int filenum);
 
 /**
- * Displays a countdown and then records an audio sample that can be used to
- * trigger the specified audio file.
+ * Displays a countdown of COUNTDOWN_SECONDS, to let the user get the timing of
+ * a recording right. It shall be called by the thread that interacts with the
+ * user before audio_file_record_sample_to_play(), so that the latter does not
+ * keep the aperiodic server busy while waiting.
+ */
+extern void audio_record_countdown();
+
+/**
+ * Records an audio sample that can be used to trigger the specified audio
+ * file, starting immediately.
  * Returns zero on success.
  */
 extern int audio_file_record_sample_to_play(int i);
@@ -99,6 +124,27 @@ extern void audio_file_discard_recorded_sample(int i);
  */
 extern int audio_file_play(int filenum);
 
+/**
+ * Requests the playback of the file specified by the number, without blocking
+ * the calling task. The request is served by the playback task as soon as
+ * possible. The score is the value that triggered the request, used only for
+ * logging purposes.
+ * Returns zero on success, EAGAIN if too many requests are already pending and
+ * EINVAL if the file number is invalid.
+ */
+extern int audio_file_request_play(int filenum, double score);
+
+/**
+ * Replaces the recorded sample of the specified file with the most recent
+ * window published by the microphone task, which shall be running, and arms
+ * it. Unlike audio_file_record_sample_to_play(), it neither waits nor reads
+ * the capture device, so that it can be executed in graphic mode as an
+ * aperiodic job, see main_submit_job().
+ * Returns zero on success, EINVAL if the file number is invalid and EAGAIN if
+ * no window has been published yet.
+ */
+extern int audio_file_record_last_capture(int i);
+
 /**
  * Stops any audio or midi that is currently playing.
  * Only all audio at once can be stopped, there is no way to stop a specific
@@ -122,6 +168,13 @@ extern int audio_file_num_opened();
  */
 extern bool audio_file_has_rec(int i);
 
+/**
+ * Returns true if the recording associated with the given file is currently
+ * analyzed by the analysis workers, i.e. the file can be triggered.
+ * WARNING: no check whether the given audio file index if performed.
+ */
+extern bool audio_file_is_armed(int i);
+
 /**
  * Returns a null terminated string containing the file name.
  * WARNING: no check whether the given audio file index if performed.
@@ -191,6 +244,11 @@ extern void audio_file_frequency_up(int i);
 /// the given index, decreasing it by one value
 extern void audio_file_frequency_down(int i);
 
+/// Arms the trigger of the file corresponding to the given index if it is
+/// disarmed and vice versa; analysis workers pick up the change at the next FFT.
+/// New recordings are always armed.
+extern void audio_file_toggle_armed(int i);
+
 //@}
 
 /**
@@ -231,6 +289,13 @@ extern int audio_get_record_rrate();
  */
 extern int audio_get_record_rframes();
 
+/**
+ * Returns the period of the capture device in nanoseconds, which is the
+ * duration of the frames it publishes at once: a fraction of a sample, see
+ * AUDIO_LATENCY_REDUCER, unless AUDIO_APERIODIC is defined.
+ */
+extern long long audio_get_record_period_ns();
+
 /**
  * Returns the acquisition rate of the recorder, which is also the frequency
  * that is considered as a base when calculating the FFT of a signal.
@@ -261,9 +326,23 @@ extern void* checkdata_task(void *arg);
 /// The body of the microphone task
 extern void *microphone_task(void *arg);
 
-/// The body of the analyzer task
+/// The body of each analysis worker, whose index within the pool of
+/// TASK_ALS_NUM workers is the argument of the task
 extern void *analysis_task(void *arg);
 
 //@}
 
+/**
+ * @name Playback-related Tasks
+ */
+//@{
+
+/// The body of the playback task, which starts each requested sound in its
+/// first period after the requested start time (see AUDIO_PLAY_LATENCY_MS),
+/// skipping into samples by the lateness; the latency of Allegro mixer is not
+/// compensated
+extern void *playback_task(void *arg);
+
+//@}
+
 #endif
@@ -70,6 +70,38 @@
 /// Minimum value is zero.
 #define AUDIO_ANALYSIS_DELAY_MS	(500)
 
+/// The fixed latency between a detected tap and the start of the triggered
+/// sound, in milliseconds. Sounds triggered by taps detected later than this
+/// start playing from the position they would have reached, so the timing does
+/// not depend on where the tap fell within the analyzed window. It should be a
+/// little longer than the duration of a capture window; zero means that the
+/// sound always starts as soon as possible, skipping into it.
+#define AUDIO_PLAY_LATENCY_MS	(100)
+
+/// The fraction of the peak amplitude of a recorded sample that marks its
+/// onset, which is used to locate taps within analyzed windows.
+#define AUDIO_ONSET_RATIO		(0.5)
+
+/// Comment this line to correlate every FFT with the recorded samples.
+/// Otherwise the microphone task gates each FFT it publishes: a window opens
+/// the gate if its RMS exceeds AUDIO_GATE_SNR times the noise floor and its
+/// spectral flux exceeds AUDIO_GATE_FLUX times the mean one (an onset), then
+/// the gate stays open as long as that onset is within the analyzed window.
+/// FFTs published while the gate is closed, e.g. in silence, are not analyzed
+#define AUDIO_GATE
+
+#define AUDIO_GATE_SNR			(2.)	///< RMS over the noise floor of an
+										///< onset
+#define AUDIO_GATE_FLUX			(1.5)	///< Spectral flux over the mean one
+										///< of an onset
+#define AUDIO_GATE_FLUX_WEIGHT	(0.05)	///< Weight of each window in the mean
+										///< spectral flux
+#define AUDIO_GATE_RISE			(0.01)	///< Weight of each window with the
+										///< gate closed in the noise floor,
+										///< which falls at once to quieter ones
+#define AUDIO_GATE_MIN_RMS		(8.)	///< Lowest noise floor, in the units
+										///< of the captured frames
+
 /// The amplitude which corresponds to the maximum height
 #define TIME_MAX_AMPLITUDE		(1000000000/2)
 
@@ -80,6 +112,38 @@
 /// it up using another faster task
 // #define AUDIO_APERIODIC
 
+/// Uncomment this line to send MIDI files to external synthesizers through the
+/// ALSA sequencer, instead of rendering them with the built-in synthesizer
+// #define AUDIO_MIDI_ALSA_SEQ
+
+/// Name of the ALSA sequencer client (and queue) used for MIDI output
+#define AUDIO_MIDI_SEQ_CLIENT_NAME	"super"
+
+/// ALSA sequencer address the MIDI output port is connected to on startup (for
+/// example "14:0", the Midi Through port of snd-seq-dummy); leave it empty to
+/// connect the port from outside, using aconnect
+#define AUDIO_MIDI_SEQ_DEST			""
+
+/// Uncomment this line to publish each capture window and its FFT also on
+/// shared memory CABs (see api/shm_cab.h), so that other processes (e.g. an
+/// unprivileged GUI) can read them without sharing locks with this one
+// #define AUDIO_SHM_PUBLISH
+
+/// Names of the shared memory segments used when AUDIO_SHM_PUBLISH is defined
+//@{
+#define AUDIO_SHM_RECORD_NAME		"/super_record"
+#define AUDIO_SHM_FFT_NAME			"/super_fft"
+//@}
+
+/// Uncomment this line to read captures from the given file instead of the
+/// microphone: it shall contain raw signed 16-bit mono frames at
+/// AUDIO_DESIRED_RATE (e.g. recorded by `arecord -f S16_LE -c 1 -r 44100 -t
+/// raw`), which become available as the clock of the tasks advances (see
+/// ptask_clock_gettime) and are read again from the beginning at its end.
+/// Together with PTASK_SIMULATION, the audio pipeline runs faster than real
+/// time on a reproducible input
+// #define AUDIO_CAPTURE_FILE		"capture.raw"
+
 
 //@}
 
@@ -93,6 +157,10 @@
 
 #define LOG_VERBOSE				(0x01)	///< Verbose logging enabled
 
+/// File in which the trace of the tasks is written when the program is started
+/// with the -t flag, relative to the working directory, see trace.h
+#define TRACE_FILE_NAME			"super_trace.json"
+
 // -----------------------------------------------------------------------------
 //                           RECORDING CONSTANTS
 // -----------------------------------------------------------------------------
@@ -104,6 +172,9 @@
 
 #define AUDIO_MAX_FILES			(8)		///< The maximum number of opened audio files
 
+#define COUNTDOWN_SECONDS		(5)		///< The number of seconds to wait before
+										///< recording an audio sample
+
 /// Adds padding to the specified number if the zero padding is enabled,
 /// otherwise does nothing.
 #define AUDIO_ADD_PADDING(frames)	\
@@ -133,13 +204,18 @@
 /// Number of buffers used to record audio.
 /// It is given as the count of tasks that can read/write recorded audio samples
 /// plus one.
-/// Such tasks are the microphone task and the gui task
-#define AUDIO_REC_NUM_BUFFERS		(3)
+/// Such tasks are the microphone task, the gui task and the server task (which
+/// records samples in graphic mode)
+#define AUDIO_REC_NUM_BUFFERS		(4)
 
 /// Number of buffers used to publish FFTs.
-/// It is given as the number of opened audio files (each potentially associated
-/// with a task), plus the gui task, plus one
-#define AUDIO_FFT_NUM_BUFFERS		(AUDIO_MAX_FILES+2)
+/// Each reader holds at most one buffer, hence it is given as the number of
+/// readers, i.e. the TASK_ALS_NUM analysis workers plus the gui task, plus one
+/// for the FFT task that writes them, plus one.
+/// The same number of buffers is used by the pool of
+/// correlation_non_normalized(), whose users are the analysis workers, the FFT
+/// task and the job that arms a recorded sample
+#define AUDIO_FFT_NUM_BUFFERS		(TASK_ALS_NUM+3)
 
 
 /// Converts a certain number of frames in milliseconds, given current
@@ -147,8 +223,16 @@
 #define FRAMES_TO_MS(frames,rate) \
 	((1000L * STATIC_CAST(long,frames)) / STATIC_CAST(long,rate))
 
+/// Converts a certain number of frames in nanoseconds, given current capture
+/// rate
+#define FRAMES_TO_NS(frames,rate) \
+	((1000000000LL * STATIC_CAST(long long,frames)) / \
+		STATIC_CAST(long long,rate))
+
 /// The desired period of the audio acquisition task.
-/// NOTICE that the actual period is truncated to the millisecond of course.
+/// NOTICE that this value is truncated to the millisecond, it is used for
+/// timeouts and as initial period only: the microphone task sets its own period
+/// to the exact duration of the period accepted by the capture device.
 #define AUDIO_DESIRED_PERIOD \
 	FRAMES_TO_MS(AUDIO_DESIRED_FRAMES/AUDIO_LATENCY_REDUCER, AUDIO_DESIRED_RATE)
 
@@ -485,6 +569,34 @@
 
 
 
+//-------------------------------------------------------------
+// QOS CONSTANTS
+//-------------------------------------------------------------
+
+//@}
+
+/**
+ * @name Quality of service governor, see qos.h
+ */
+//@{
+
+/// Comment this line to keep full quality regardless of the load of the audio
+/// tasks. Otherwise the user interaction task runs the governor, which sheds
+/// cosmetic work first and analysis work last when audio tasks are overloaded
+#define QOS_GOVERNOR
+
+#define QOS_WINDOW			(500)	///< Duration of each observation (ms)
+#define QOS_HIGH_LOAD		(0.8)	///< Relative response time above which a
+									///< task is under pressure
+#define QOS_LOW_LOAD		(0.5)	///< Relative response time below which a
+									///< task has enough headroom
+#define QOS_UP_WINDOWS		(4)		///< Windows with headroom needed before
+									///< stepping back up
+#define QOS_GUI_DIVIDER		(2)		///< Periods of the GUI task per frame
+									///< when the GUI is slowed down
+#define QOS_ANALYSIS_HOP	(2)		///< FFTs per analysis when the analysis
+									///< rate is reduced
+
 //-------------------------------------------------------------
 // TASKS CONSTANTS
 //-------------------------------------------------------------
@@ -496,31 +608,96 @@
  */
 //@{
 
-// The tasks are: gui, user interaction, microphone, checkdata and analysis.
+// The tasks are: gui, user interaction, microphone, checkdata, playback,
+// synthesizer, the aperiodic server and a pool of analysis workers. The
+// synthesizer task is the only one that keeps running in terminal mode too.
 #define TASK_GUI		(0)
 #define TASK_UI			(1)
 #define TASK_CHK		(2)
 #define TASK_MIC		(2)
-#define TASK_ALS_FIRST	(3)
+#define TASK_PLY		(3)
+#define TASK_SYN		(4)
+#define TASK_SRV		(5)
+#define TASK_ALS_FIRST	(6)
+
+/// Number of analysis workers, which share the armed triggers among themselves
+/// at each FFT; it shall not be greater than AUDIO_MAX_FILES.
+/// NOTICE: AUDIO_FFT_NUM_BUFFERS depends on it
+#define TASK_ALS_NUM	(2)
 
 /// Maximum number of tasks which may be running at any time
-#define	TASK_NUM		(TASK_ALS_FIRST + AUDIO_MAX_FILES)
+#define	TASK_NUM		(TASK_ALS_FIRST + TASK_ALS_NUM)
 
-/// A zero wcet means that the value is unknown
+/// Size of the stack of each task (in bytes), which is prefaulted when the task
+/// starts so that it never takes a page fault within a job, see
+/// ptask_rt_init(). Besides the frames of the task, it holds the temporary
+/// buffers that FFTW allocates on the stack.
+#define TASK_STACK_SIZE	(512 * 1024)
+
+/// A zero wcet means that the value is unknown; measured execution times are
+/// printed when leaving graphic mode, see ptask_print_profile()
 #define WCET_UNKNOWN	(0)
 
-#ifdef NDEBUG
+/// Uncomment this line to schedule tasks with SCHED_DEADLINE instead of
+/// SCHED_FIFO when not in debug mode: each task gets a CPU reservation of
+/// TASK_*_BUDGET microseconds every period instead of a fixed priority
+// #define TASK_SCHED_DEADLINE
+
+/// Comment this line to let the kernel place tasks on any CPU. Otherwise the
+/// microphone task (which computes FFTs too) gets a CPU on its own, the first
+/// isolated one (see the isolcpus kernel parameter) if any, analysis tasks are
+/// spread over the other isolated CPUs (or over all the other CPUs if there are
+/// none) and the GUI, together with Allegro threads, is kept off them.
+/// NOTICE: placement is disabled with TASK_SCHED_DEADLINE, since the kernel
+/// does not accept deadline tasks bound to a subset of CPUs.
+#define TASK_CPU_PLACEMENT
+
+/// Comment this line to use the TASK_*_PRIORITY values with SCHED_FIFO. Otherwise
+/// priorities are assigned at startup in two bands, from 1 to TASK_NUM: the
+/// audio chain (capture, analysis, playback and synthesizer) always gets the
+/// higher one, the GUI, user interaction and server tasks the lower one, and
+/// within each band priorities follow deadline-monotonic order, see
+/// ptask_assign_priorities()
+#define TASK_AUTO_PRIORITY
+
+/// Uncomment this line to refuse to start when the response-time analysis of
+/// the tasks finds that some of them may miss their deadline, instead of only
+/// printing a warning. The analysis uses the TASK_*_BUDGET values as WCETs.
+// #define TASK_RTA_STRICT
+
+#if defined NDEBUG && !defined TASK_SCHED_DEADLINE
 /// If not in debug mode, this does nothing
 #define GET_PRIO(prio) (prio)
 #else
-/// In debug mode real-time scheduling is disabled, so priority must be zero
+/// In debug mode real-time scheduling is disabled, so priority must be zero;
+/// SCHED_DEADLINE does not use priorities either
 #define GET_PRIO(prio) (0)
 #endif
 
+#if defined NDEBUG && defined TASK_SCHED_DEADLINE
+/// SCHED_DEADLINE needs the runtime of each task, which is its budget
+#define GET_WCET(wcet, budget) (budget)
+#else
+/// Otherwise, this does nothing
+#define GET_WCET(wcet, budget) (wcet)
+#endif
+
 // Tasks priorities are chosen following RM guidelines, even if the UI task has
 // a lower priority than the microphone tasks because the responsiveness to the
 // microphone inputs has a much greater importance than responsiveness to
-// keyboard/mouse inputs.
+// keyboard/mouse inputs. They are used only if TASK_AUTO_PRIORITY is not
+// defined.
+
+// Budgets (in us) are the WCETs used by the response-time analysis performed at
+// startup and the runtimes of the reservations with TASK_SCHED_DEADLINE. In the
+// latter case, the sum of the ratios between budgets and periods shall stay
+// below the CPU share that the kernel grants to real-time tasks (95% of each
+// CPU by default), otherwise the kernel refuses to start the tasks.
+
+// Costs (in us) are the CPU times declared by the jobs of each task when
+// PTASK_SIMULATION is defined, see ptask_sim_consume(); the one of the
+// microphone task is charged for each published window, the one of the
+// analysis tasks for each analyzed trigger. Jobs of the server are not charged.
 
 // GUI TASK
 
@@ -532,6 +709,11 @@
 									///< Lowest priority, missing a frame is not
 									///< a big deal, system responsiveness is
 									///< much more important
+#define TASK_GUI_BUDGET		(6000)
+#define TASK_GUI_COST		(3000)	///< For each drawn frame
+#define TASK_GUI_OVERRUN	(PTASK_OVERRUN_SKIP)
+									///< Late frames are dropped rather than
+									///< drawn back-to-back
 
 // USER INTERACTION TASK
 
@@ -539,6 +721,8 @@
 #define TASK_UI_PERIOD		(10)	///< A hundred times per second
 #define TASK_UI_DEADLINE	(10)
 #define TASK_UI_PRIORITY	(2)
+#define TASK_UI_BUDGET		(1000)
+#define TASK_UI_COST		(200)
 
 // CHECK DATA TASK (this is used only if AUDIO_APERIODIC is defined)
 
@@ -546,6 +730,8 @@
 #define TASK_CHK_PERIOD		(1)
 #define TASK_CHK_DEADLINE	(TASK_CHK_PERIOD)
 #define TASK_CHK_PRIORITY	(4)
+#define TASK_CHK_BUDGET		(100)
+#define TASK_CHK_COST		(20)
 
 // MICROPHONE TASK
 
@@ -555,13 +741,88 @@
 #define TASK_MIC_PERIOD		(AUDIO_DESIRED_PERIOD)
 #define TASK_MIC_DEADLINE	(TASK_MIC_PERIOD)
 #define TASK_MIC_PRIORITY	(3)
-
-// ANALYSIS TASK (which may me many)
+#define TASK_MIC_BUDGET		(3000)	///< Includes the FFT
+#define TASK_MIC_COST		(1500)	///< Includes the FFT
+#define TASK_MIC_OVERRUN	(PTASK_OVERRUN_SKIP)
+									///< Each job reads all the available
+									///< frames, so catch-up jobs would find
+									///< nothing to do
+
+// PLAYBACK TASK
+
+// NOTICE: play requests are served in the first period of this task after
+// their start time, up to one period late, so keep this period short
+#define TASK_PLY_WCET		(WCET_UNKNOWN)
+#define TASK_PLY_PERIOD		(2)
+#define TASK_PLY_DEADLINE	(TASK_PLY_PERIOD)
+#define TASK_PLY_PRIORITY	(3)
+#define TASK_PLY_BUDGET		(200)
+#define TASK_PLY_COST		(50)
+
+// SYNTHESIZER TASK
+
+// NOTICE: the period must be shorter than the duration of half the synthesizer
+// stream buffer (256 frames, almost 6 ms at 44.1 kHz), otherwise MIDI playback
+// will stutter
+#define TASK_SYN_WCET		(WCET_UNKNOWN)
+#define TASK_SYN_PERIOD		(2)
+#define TASK_SYN_DEADLINE	(TASK_SYN_PERIOD)
+#define TASK_SYN_PRIORITY	(3)
+#define TASK_SYN_BUDGET		(500)
+#define TASK_SYN_COST		(200)
+
+// APERIODIC SERVER TASK
+
+// NOTICE: the server executes the actions requested by the user in graphic
+// mode and the commands that load files and record samples in terminal mode,
+// see main_submit_job(), consuming at most TASK_SRV_BUDGET us every period;
+// from the point of view of the other tasks it is a periodic task with such
+// WCET and period. The budget shall be no shorter than the longest action
+#define TASK_SRV_WCET		(WCET_UNKNOWN)
+#define TASK_SRV_PERIOD		(20)
+#define TASK_SRV_DEADLINE	(TASK_SRV_PERIOD)
+#define TASK_SRV_PRIORITY	(1)
+#define TASK_SRV_BUDGET		(2000)
+
+// ANALYSIS TASKS (TASK_ALS_NUM workers)
+
+// NOTICE: analysis tasks are woken up as soon as a new FFT is published, so the
+// period is only the timeout used to check for termination, while the deadline
+// is relative to the publication of each FFT. Each worker analyzes up to
+// AUDIO_MAX_FILES / TASK_ALS_NUM triggers (rounded up) per FFT
 
 #define TASK_ALS_WCET		(WCET_UNKNOWN)
 #define TASK_ALS_PERIOD		(AUDIO_DESIRED_PERIOD)
-#define TASK_ALS_DEADLINE	(TASK_ALS_PERIOD)
+#define TASK_ALS_DEADLINE	(AUDIO_PLAY_LATENCY_MS - \
+	FRAMES_TO_MS(AUDIO_DESIRED_FRAMES, AUDIO_DESIRED_RATE) - TASK_PLY_PERIOD)
+									///< A tap at the beginning of a window is
+									///< published with the whole window, its
+									///< sound shall then be requested in time
+									///< to be played AUDIO_PLAY_LATENCY_MS
+									///< after the tap, by the playback task
 #define TASK_ALS_PRIORITY	(3)
+#define TASK_ALS_BUDGET		(4000)
+#define TASK_ALS_COST		(600)	///< For each analyzed trigger
+
+/// Uncomment this line to stagger the jobs of the analysis workers over the part
+/// of the deadline that leaves the last worker its whole budget, so that they
+/// do not contend for the CABs and for the CPUs all at the same time, see
+/// ptask_stagger(). Otherwise all the workers start as soon as each FFT is
+/// published.
+/// NOTICE: workers are released by the FFTs, so each offset only delays their
+/// jobs, it pays off only when workers share a CPU and contend for it
+// #define TASK_ALS_STAGGER
+
+/// Comment this line to let analysis jobs run past their budget. Otherwise a
+/// job that consumes more than TASK_ALS_BUDGET us of CPU time is moved to the
+/// background until the next FFT and skips the triggers it did not analyze
+/// yet, so that it cannot monopolize a CPU, see ptask_set_budget()
+#define TASK_ALS_ENFORCE_BUDGET
+
+/// Duration (in seconds of virtual time) of the simulation run when the program
+/// is started with -s, which is available only if both PTASK_SIMULATION and
+/// AUDIO_CAPTURE_FILE are defined
+#define TASK_SIM_DURATION	(10)
 
 //@}
 
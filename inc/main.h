@@ -54,4 +54,19 @@ extern void main_terminate_tasks();
  */
 extern bool main_get_tasks_terminate();
 
+/**
+ * Queues an aperiodic job, executed by the server task as soon as its budget
+ * allows it, with the given argument. Returns zero on success, EAGAIN if the
+ * job cannot be queued.
+ * The server task keeps running in terminal mode too, until the program exits.
+ */
+extern int main_submit_job(ptask_job_t *job, void *arg);
+
+/**
+ * Lets the quality of service governor observe the audio tasks, see
+ * qos_update().
+ * This function shall be called in graphic mode only, by a single task.
+ */
+extern void main_update_qos();
+
 #endif
@@ -0,0 +1,93 @@
+/**
+ * @file midi.h
+ * @brief MIDI files pre-parsing public functions and data types
+ *
+ * This module converts MIDI files loaded by Allegro into flat arrays of channel
+ * events sorted by time, so that the modules that play them back do not need
+ * to parse anything when a MIDI is triggered.
+ *
+ * NOTICE: since the MIDI data type is defined by Allegro, allegro.h shall be
+ * included before this header.
+ *
+ * Functions in this module shall be called from a single-thread environment.
+ *
+ */
+
+#ifndef MIDI_H
+#define MIDI_H
+
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+//                             PUBLIC CONSTANTS
+// -----------------------------------------------------------------------------
+
+/**
+ * @name MIDI status bytes
+ */
+//@{
+
+#define MIDI_NOTE_OFF			(0x80)	///< Note off, data: key and velocity
+#define MIDI_NOTE_ON			(0x90)	///< Note on, data: key and velocity
+#define MIDI_KEY_PRESSURE		(0xA0)	///< Polyphonic key pressure
+#define MIDI_CONTROL_CHANGE		(0xB0)	///< Controller change
+#define MIDI_PROGRAM_CHANGE		(0xC0)	///< Program change, one data byte
+#define MIDI_CHANNEL_PRESSURE	(0xD0)	///< Channel pressure, one data byte
+#define MIDI_PITCH_BEND			(0xE0)	///< Pitch bend, 14 bits value
+
+/// Returns the type of a channel event, given its status byte
+#define MIDI_STATUS_TYPE(status)	((status) & 0xF0)
+/// Returns the channel of a channel event, given its status byte
+#define MIDI_STATUS_CHANNEL(status)	((status) & 0x0F)
+
+#define MIDI_CHANNELS			(16)	///< Number of MIDI channels
+#define MIDI_DRUM_CHANNEL		(9)		///< Percussion channel (zero-based)
+
+//@}
+
+// -----------------------------------------------------------------------------
+//                             PUBLIC DATA TYPES
+// -----------------------------------------------------------------------------
+
+/**
+ * A single channel event of a MIDI sequence.
+ */
+typedef struct __MIDI_EVENT_STRUCT
+{
+	int64_t			time;		///< Time of the event since the beginning of
+								///< the sequence (in ns)
+	unsigned char	status;		///< Status byte (event type and channel)
+	unsigned char	data1;		///< First data byte
+	unsigned char	data2;		///< Second data byte, zero if unused
+} midi_event_t;
+
+/**
+ * A whole MIDI file, flattened in a single array of channel events.
+ */
+typedef struct __MIDI_SEQUENCE_STRUCT
+{
+	midi_event_t*	events;		///< Channel events sorted by time, tracks
+								///< are merged together
+	int				num_events;	///< Number of events in the array
+	int64_t			duration;	///< Time of the last event (in ns)
+} midi_sequence_t;
+
+// -----------------------------------------------------------------------------
+//                             PUBLIC FUNCTIONS
+// -----------------------------------------------------------------------------
+
+/**
+ * Parses all the tracks of the given Allegro MIDI structure into the given
+ * sequence, applying all the tempo changes to obtain absolute times.
+ * Returns zero on success, EINVAL if the MIDI data is malformed or uses SMPTE
+ * timing, ENOMEM if the events array cannot be allocated.
+ */
+extern int midi_sequence_parse(midi_sequence_t *sequence, const MIDI *midi);
+
+/**
+ * Releases the memory allocated by midi_sequence_parse(). It is safe to call
+ * this function on an empty sequence.
+ */
+extern void midi_sequence_free(midi_sequence_t *sequence);
+
+#endif
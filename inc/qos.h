@@ -0,0 +1,69 @@
+/**
+ * @file qos.h
+ * @brief Quality of service governor public functions and data types
+ *
+ * While in graphic mode, the governor watches the audio tasks and, when they
+ * are under pressure, sheds non-critical work one level at a time: cosmetic
+ * work first, detection last. At the end of each window of QOS_WINDOW ms, the
+ * audio tasks are under pressure if any of them missed a deadline or exceeded
+ * its budget within the window, or if the mean response time of its jobs
+ * exceeded QOS_HIGH_LOAD times its relative deadline; in that case the level
+ * is raised by one. The level is lowered by one after QOS_UP_WINDOWS
+ * consecutive windows in which no task missed a deadline and the mean response
+ * time of each one stayed below QOS_LOW_LOAD times its deadline. Each change
+ * is logged and recorded in the trace (see trace.h).
+ *
+ * NOTICE: ptask.h shall be included before this header.
+ *
+ */
+
+#ifndef QOS_H
+#define QOS_H
+
+// -----------------------------------------------------------------------------
+//                             PUBLIC DATA TYPES
+// -----------------------------------------------------------------------------
+
+/**
+ * The levels of the governor, each one sheds the work of the previous ones
+ * too.
+ */
+typedef enum __QOS_LEVEL_ENUM
+{
+	QOS_LEVEL_FULL = 0,		///< Everything is done
+	QOS_LEVEL_GUI_SLOW,		///< The GUI draws one frame every
+							///< QOS_GUI_DIVIDER periods
+	QOS_LEVEL_NO_FFT,		///< The FFT plot is not drawn
+	QOS_LEVEL_NO_WAVEFORM,	///< The amplitude plot is not drawn
+	QOS_LEVEL_ANALYSIS_HOP,	///< Triggers are analyzed once every
+							///< QOS_ANALYSIS_HOP FFTs
+	QOS_LEVEL_NUM			///< Number of levels
+} qos_level_t;
+
+// -----------------------------------------------------------------------------
+//                             PUBLIC FUNCTIONS
+// -----------------------------------------------------------------------------
+
+/* ------- UNSAFE FUNCTIONS - CALL ONLY IN SINGLE THREAD ENVIRONMENT -------- */
+
+/**
+ * Restores the full quality and forgets the tasks observed so far, it shall be
+ * called before starting the tasks of a new graphic session.
+ */
+extern void qos_reset();
+
+/**
+ * Observes the given audio tasks and changes the level if a window elapsed
+ * since the last change, see above. The tasks shall be given in the same order
+ * at each call.
+ * It shall be called periodically always by the same task, with a period much
+ * shorter than QOS_WINDOW.
+ */
+extern void qos_update(ptask_t *tasks[], int n);
+
+/* ------------- SAFE FUNCTIONS - CAN BE CALLED FROM ANY THREAD ------------- */
+
+/// Returns the current level of the governor
+extern qos_level_t qos_get_level();
+
+#endif
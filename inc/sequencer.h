@@ -0,0 +1,90 @@
+/**
+ * @file sequencer.h
+ * @brief ALSA sequencer MIDI output public functions and data types
+ *
+ * This module sends pre-parsed MIDI sequences (see midi.h) to external
+ * synthesizers through the ALSA sequencer. Each sequence is compiled into an
+ * array of sequencer events when the file is opened; when triggered, the whole
+ * phrase is scheduled on a kernel queue in a single batch, so that the timing
+ * of the events is handled by the kernel instead of a user-space task.
+ *
+ * The module creates a subscribable output port, which can be connected to any
+ * sequencer client (for example the ones provided by snd-seq-dummy or virtual
+ * MIDI ports, using aconnect); if AUDIO_MIDI_SEQ_DEST is not empty, the port is
+ * connected to that address on initialization.
+ *
+ * NOTICE: alsa/asoundlib.h and midi.h shall be included before this header.
+ *
+ * Except the ones that shall be called from a single-thread environment,
+ * functions are safe from a concurrency point of view.
+ *
+ */
+
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+// -----------------------------------------------------------------------------
+//                             PUBLIC DATA TYPES
+// -----------------------------------------------------------------------------
+
+/**
+ * A MIDI sequence compiled into ALSA sequencer events.
+ */
+typedef struct __SEQUENCER_PHRASE_STRUCT
+{
+	snd_seq_event_t*	events;		///< Precompiled events, their timestamps
+									///< are relative to the beginning of the
+									///< phrase
+	int					num_events;	///< Number of events in the array
+} sequencer_phrase_t;
+
+// -----------------------------------------------------------------------------
+//                             PUBLIC FUNCTIONS
+// -----------------------------------------------------------------------------
+
+/* ------- UNSAFE FUNCTIONS - CALL ONLY IN SINGLE THREAD ENVIRONMENT -------- */
+
+/**
+ * Opens the ALSA sequencer, creates the output port and starts the queue used
+ * to schedule phrases.
+ * Returns zero on success, a non zero value otherwise.
+ */
+extern int sequencer_init();
+
+/**
+ * Compiles the given sequence into the given phrase.
+ * Returns zero on success, ENOMEM if the events array cannot be allocated.
+ */
+extern int sequencer_phrase_compile(sequencer_phrase_t *phrase,
+	const midi_sequence_t *sequence);
+
+/**
+ * Releases the memory allocated by sequencer_phrase_compile(). It is safe to
+ * call this function on an empty phrase.
+ */
+extern void sequencer_phrase_free(sequencer_phrase_t *phrase);
+
+/**
+ * Stops the queue and closes the ALSA sequencer.
+ */
+extern void sequencer_close();
+
+/* ------------- SAFE FUNCTIONS - CAN BE CALLED FROM ANY THREAD ------------- */
+
+/**
+ * Schedules the whole phrase on the sequencer queue, starting from now.
+ * Volume uses the same scale of Allegro samples ([0,255]) and scales note
+ * velocities, while the frequency is the playback speed in thousandths (1000
+ * means the original speed). Panning is left to the receiving synthesizer.
+ * Returns zero on success, a negative ALSA error code otherwise.
+ */
+extern int sequencer_play(const sequencer_phrase_t *phrase, int volume,
+	int frequency);
+
+/**
+ * Removes all the scheduled events from the queue and silences all the
+ * channels of the output port.
+ */
+extern void sequencer_stop();
+
+#endif
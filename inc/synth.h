@@ -0,0 +1,76 @@
+/**
+ * @file synth.h
+ * @brief Wavetable synthesizer public functions
+ *
+ * This module renders pre-parsed MIDI sequences (see midi.h) using a simple
+ * in-process wavetable synthesizer. The rendered audio is mixed together with
+ * samples by Allegro digital sound driver through an audio stream, hence no
+ * MIDI driver is needed to play MIDI files.
+ *
+ * Except the ones that shall be called from a single-thread environment,
+ * functions are safe from a concurrency point of view.
+ *
+ */
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+// -----------------------------------------------------------------------------
+//                             PUBLIC FUNCTIONS
+// -----------------------------------------------------------------------------
+
+/* ------- UNSAFE FUNCTIONS - CALL ONLY IN SINGLE THREAD ENVIRONMENT -------- */
+
+/**
+ * Initializes the synthesizer, which will render audio at the given rate.
+ * It shall be called after Allegro sound has been installed.
+ * Returns zero on success, a non zero value otherwise.
+ */
+extern int synth_init(int rate);
+
+/* ------------- SAFE FUNCTIONS - CAN BE CALLED FROM ANY THREAD ------------- */
+
+/**
+ * Starts playing the given sequence. The sequence descriptor is copied, but
+ * its events array must stay valid until it is stopped with synth_stop() or
+ * synth_stop_sequence(), or it ends.
+ * Volume and panning use the same scale of Allegro samples ([0,255]), while
+ * the frequency is the playback speed in thousandths (1000 means the original
+ * speed and pitch).
+ * Returns zero on success, EAGAIN if too many sequences are already playing.
+ *
+ * NOTICE: the sequence starts playing at the beginning of the next block
+ * rendered by the synth task.
+ */
+extern int synth_play(const midi_sequence_t *sequence, int volume, int panning,
+	int frequency);
+
+/**
+ * Stops all the playing sequences and releases all sounding notes.
+ * When this function returns no sequence is referenced by the synthesizer
+ * anymore, hence they can be safely destroyed.
+ */
+extern void synth_stop();
+
+/**
+ * Stops all the plays of the given sequence and releases their sounding notes,
+ * while other sequences keep playing.
+ * When this function returns the events of the sequence are not referenced by
+ * the synthesizer anymore, hence they can be safely destroyed.
+ */
+extern void synth_stop_sequence(const midi_sequence_t *sequence);
+
+/**
+ * Requests the termination of the synth task.
+ */
+extern void synth_terminate();
+
+// -----------------------------------------------------------------------------
+//                                  TASKS
+// -----------------------------------------------------------------------------
+
+/// The body of the synth task, which keeps running until synth_terminate() is
+/// called
+extern void* synth_task(void *arg);
+
+#endif
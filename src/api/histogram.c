@@ -0,0 +1,155 @@
+/**
+ * @file histogram.c
+ * @brief Lock-free log-linear histograms
+ *
+ * For actual documentation, chechout the corresponding header file,
+ * api/histogram.h.
+ *
+ */
+
+#include <math.h>
+
+#include "api/histogram.h"
+
+//-------------------------------------------------------------
+// PRIVATE CONSTANTS
+//-------------------------------------------------------------
+
+#define LINEAR_BUCKETS	(1 << HISTOGRAM_SUB_BITS)
+									///< Values below this have a bucket each
+#define HALF_BUCKETS	(1 << (HISTOGRAM_SUB_BITS - 1))
+									///< Buckets for each power of two above
+									///< the linear ones
+
+//-------------------------------------------------------------
+// PRIVATE FUNCTIONS
+//-------------------------------------------------------------
+
+/**
+ * Returns the index of the bucket that counts the given value.
+ */
+static inline int _histogram_index(uint64_t value)
+{
+int msb;	// Most significant bit of the value
+int shift;	// Width of the buckets, as a power of two
+
+	if (value < LINEAR_BUCKETS)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+
+	if (msb > HISTOGRAM_MAX_BITS)
+		return HISTOGRAM_BUCKETS - 1;
+
+	// The value shifted right has HISTOGRAM_SUB_BITS significant bits, whose
+	// most significant one is always set
+	shift = msb - HISTOGRAM_SUB_BITS + 1;
+
+	return LINEAR_BUCKETS + (shift - 1) * HALF_BUCKETS +
+		(int) (value >> shift) - HALF_BUCKETS;
+}
+
+/**
+ * Returns the greatest value counted by the bucket with the given index.
+ */
+static inline uint64_t _histogram_upper(int index)
+{
+int			shift;
+uint64_t	top;	// The value of the bucket shifted right
+
+	if (index < LINEAR_BUCKETS)
+		return index;
+
+	// The last bucket counts also all the values out of range
+	if (index == HISTOGRAM_BUCKETS - 1)
+		return UINT64_MAX;
+
+	index	-= LINEAR_BUCKETS;
+	shift	= index / HALF_BUCKETS + 1;
+	top		= index % HALF_BUCKETS + HALF_BUCKETS;
+
+	return ((top + 1) << shift) - 1;
+}
+
+//-------------------------------------------------------------
+// PUBLIC FUNCTIONS
+//-------------------------------------------------------------
+
+void histogram_init(histogram_t *h)
+{
+int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		atomic_init(&h->buckets[i], 0);
+
+	atomic_init(&h->count, 0);
+	atomic_init(&h->sum, 0);
+	atomic_init(&h->max, 0);
+}
+
+void histogram_add(histogram_t *h, uint64_t value)
+{
+unsigned long long max;
+
+	atomic_fetch_add_explicit(&h->buckets[_histogram_index(value)], 1,
+		memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+	while (value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max,
+			value, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+uint64_t histogram_count(const histogram_t *h)
+{
+	return atomic_load_explicit(&h->count, memory_order_relaxed);
+}
+
+uint64_t histogram_sum(const histogram_t *h)
+{
+	return atomic_load_explicit(&h->sum, memory_order_relaxed);
+}
+
+uint64_t histogram_max(const histogram_t *h)
+{
+	return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+uint64_t histogram_mean(const histogram_t *h)
+{
+uint64_t count = histogram_count(h);
+
+	if (count == 0)
+		return 0;
+
+	return atomic_load_explicit(&h->sum, memory_order_relaxed) / count;
+}
+
+uint64_t histogram_percentile(const histogram_t *h, double percentile)
+{
+uint64_t	target;		// Rank of the requested sample
+uint64_t	seen = 0;	// Number of samples in the buckets scanned so far
+uint64_t	upper;
+int			i;
+
+	target = (uint64_t) ceil(percentile / 100. * histogram_count(h));
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+
+		if (seen >= target)
+		{
+			upper = _histogram_upper(i);
+			return upper < histogram_max(h) ? upper : histogram_max(h);
+		}
+	}
+
+	// The histogram is empty or samples are being added
+	return histogram_max(h);
+}
@@ -12,14 +12,130 @@
  *
  */
 
+#include <stdio.h>
+#include <alloca.h>
 #include <limits.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <linux/futex.h>
 
 #include "api/time_utils.h"
+#include "api/trace.h"
 #include "api/ptask.h"
 
+//-------------------------------------------------------------
+// PRIVATE CONSTANTS
+//-------------------------------------------------------------
+
+#define PTASK_STACK_RESERVED	(16 * 1024)
+									///< Bytes of the stack of a task that are
+									///< not prefaulted, they hold the thread
+									///< local storage and the first frames
+
+// Older C libraries do not export the name of the target thread of a timer
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id	_sigev_un._tid
+#endif
+
+#ifndef SCHED_IDLE
+#define SCHED_IDLE	(5)
+#endif
+
+#ifdef PTASK_SIMULATION
+#define PTASK_SIM_THREADS	(PTASK_MAX + 16)
+									///< Threads known to the simulation at the
+									///< same time, further ones can only poll
+#endif
+
+//-------------------------------------------------------------
+// PRIVATE DATA TYPES
+//-------------------------------------------------------------
+
+/**
+ * Scheduling attributes used by the sched_setattr system call, which has no
+ * wrapper in older C libraries. All times are in nanoseconds.
+ */
+struct _ptask_sched_attr
+{
+	uint32_t	size;				///< Size of this structure
+	uint32_t	sched_policy;		///< Scheduling policy
+	uint64_t	sched_flags;		///< Scheduling flags
+	int32_t		sched_nice;			///< Nice value, for SCHED_OTHER
+	uint32_t	sched_priority;		///< Static priority, for SCHED_FIFO/RR
+	uint64_t	sched_runtime;		///< Runtime, for SCHED_DEADLINE
+	uint64_t	sched_deadline;		///< Relative deadline, for SCHED_DEADLINE
+	uint64_t	sched_period;		///< Period, for SCHED_DEADLINE
+};
+
+/**
+ * Passed by ptask_create to the new thread of a SCHED_DEADLINE task, which
+ * reports the outcome of the admission control back to it.
+ */
+typedef struct __PTASK_START
+{
+	ptask_t*		ptask;			///< The task being started
+	ptask_body_t*	body;			///< The body of the task
+	int				err;			///< Outcome of sched_setattr
+	sem_t			started;		///< Posted once err has been set
+} _ptask_start_t;
+
+#ifdef PTASK_SIMULATION
+
+/**
+ * The states of a thread known to the simulation.
+ */
+typedef enum __PTASK_SIM_STATE_ENUM {
+	_SIM_IDLE = 0,				///< Running without taking part in the
+								///< simulation
+	_SIM_READY,					///< Waiting for its turn to run
+	_SIM_RUNNING,				///< Running, one participant at a time
+	_SIM_CONSUMING,				///< Consuming CPU time
+	_SIM_WAITING				///< Waiting for a channel or a time
+} _ptask_sim_state_t;
+
+/**
+ * A thread known to the simulation: either a participant (see
+ * ptask_sim_enter) or a thread that waits for the virtual clock or for one of
+ * the primitives of the library.
+ */
+typedef struct __PTASK_SIM_THREAD
+{
+	bool				in_use;		///< Tells if the structure is assigned
+	bool				participant;///< Tells if the thread takes part in the
+									///< simulation
+	_ptask_sim_state_t	state;		///< Current state of the thread
+	pthread_cond_t		cond;		///< Signaled when the thread can go on
+	ptask_t*			ptask;		///< The task of the thread, NULL if none
+	const void*			chan;		///< Channel waited for (the address of a
+									///< primitive), NULL if none
+	int64_t				wake;		///< Time at which the wait expires, -1 if
+									///< never
+	bool				timedout;	///< Set if the last wait expired
+	int64_t				demand;		///< CPU time still to be consumed (ns)
+	int64_t				cpu_time;	///< CPU time consumed so far (ns)
+	int64_t				job_start;	///< CPU time when the current job started
+	uint64_t			order;		///< FIFO order among equal priorities
+	bool				progress;	///< Consumes CPU time while the clock
+									///< advances
+	struct timespec		measured;	///< Actual CPU time of the thread when it
+									///< has been resumed
+} _ptask_sim_thread_t;
+
+#endif
+
 //-------------------------------------------------------------
 // GLOBAL PRIVATE VARIABLES
 //-------------------------------------------------------------
@@ -36,6 +152,56 @@ static int _last_task_id = -1;		///< Used to assign the id to the next
 static int _scheduler = SCHED_OTHER;///< The scheduler that needs to be used
 									///< with the ptasks created
 
+static size_t _stack_size = 0;		///< Stack size of the ptasks created, zero
+									///< for the default one
+
+#ifndef PTASK_SIMULATION
+static pthread_once_t _budget_once = PTHREAD_ONCE_INIT;
+									///< Installs the handler of
+									///< PTASK_BUDGET_SIGNAL
+#endif
+
+static struct timespec _origin;		///< Phase origin of the tasks with an
+									///< offset, see ptask_set_offset
+static pthread_once_t _origin_once = PTHREAD_ONCE_INIT;
+
+#ifdef PTASK_RT_GUARD
+static __thread ptask_t *_guarded;	///< The task whose job is running on the
+									///< calling thread, if any
+static __thread long _guard_faults;	///< Page faults taken by the calling thread
+									///< before the current job
+#endif
+
+#ifdef PTASK_MUTEX_PROFILE
+static __thread ptask_t *_self;		///< The task of the calling thread, NULL
+									///< for threads that are not ptasks
+
+static ptask_mutex_t *_mutexes[PTASK_MUTEX_MAX];
+									///< The mutexes included in the report
+static int _nmutexes = 0;			///< Number of mutexes in the report
+static pthread_mutex_t _mutexes_mutex = PTHREAD_MUTEX_INITIALIZER;
+									///< Protects the list of mutexes
+#endif
+
+#ifdef PTASK_SIMULATION
+static pthread_mutex_t _sim_mux = PTHREAD_MUTEX_INITIALIZER;
+									///< Protects the whole simulation
+static _ptask_sim_thread_t _sim_threads[PTASK_SIM_THREADS];
+									///< The threads known to the simulation
+static _ptask_sim_thread_t *_sim_running;
+									///< The participant that is running, NULL
+									///< if none
+static int64_t _sim_now;			///< Current virtual time (in ns)
+static uint64_t _sim_order = 0;		///< Used to assign the FIFO order
+static bool _sim_measure = false;	///< Tells if measured costs are consumed
+static double _sim_scale = 1.;		///< Scale of the measured costs
+static pthread_once_t _sim_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _sim_key;		///< Releases the structure of a thread that
+									///< is not a ptask when it terminates
+static __thread _ptask_sim_thread_t *_sim_self;
+									///< The structure of the calling thread
+#endif
+
 //-------------------------------------------------------------
 // LIBRARY PRIVATE UTILITY FUNCTIONS
 //-------------------------------------------------------------
@@ -133,364 +299,3239 @@ static inline bool _ptask_iserror(ptask_t *ptask)
 }
 
 /**
- * Initializes the `_attr` field of the given ptask.
- * Returns a zero value on success, a non zero value otherwise.
+ * Touches each page of the given memory area, keeping its content.
  */
-static inline int _ptask_attr_init(ptask_t *ptask)
+static inline void _ptask_touch(volatile char *p, size_t size)
 {
-struct sched_param mypar;		// structure used to set the scheduling priority
-pthread_attr_t *attr_ptr = &ptask->_attr;
-								// pointer to the _attr field of the ptask
-int err;						// used to check for errors and return value
-
-
-	if (_scheduler != SCHED_OTHER && ptask->priority == 0)
-		return EINVAL;
+size_t page = sysconf(_SC_PAGESIZE);
+size_t i;
 
-	if (_scheduler == SCHED_OTHER && ptask->priority != 0)
-		return EINVAL;
+	for (i = 0; i < size; i += page)
+		p[i] = p[i];
 
-	err = pthread_attr_init(attr_ptr);
-	if (err) return err;
+	if (size > 0)
+		p[size - 1] = p[size - 1];
+}
 
-	err = pthread_attr_setinheritsched(attr_ptr, PTHREAD_EXPLICIT_SCHED);
-	if (err) return err;
+/**
+ * Touches the stack of the calling thread, which has been created with the
+ * stack size set by ptask_rt_init, so that the task never takes a page fault
+ * when its stack grows. The area is allocated in a frame of its own, which is
+ * released on return while its pages stay mapped.
+ */
+static void _ptask_prefault_stack()
+{
+size_t size;
 
-	err = pthread_attr_setschedpolicy(attr_ptr, _scheduler);
-	if (err) return err;
+	if (_stack_size == 0)
+		return;
 
-	mypar.sched_priority = ptask->priority;
-	err = pthread_attr_setschedparam(attr_ptr, &mypar);
-	return err;
+	size = _stack_size - PTASK_STACK_RESERVED;
+	_ptask_touch(alloca(size), size);
 }
 
+#ifdef PTASK_RT_GUARD
 
-//-------------------------------------------------------------
-// LIBRARY PUBLIC FUNCTIONS
-//-------------------------------------------------------------
-
-int ptask_set_scheduler(int scheduler)
+/**
+ * Returns the number of page faults taken by the calling thread so far.
+ */
+static inline long _ptask_thread_faults()
 {
-int ret = 0;	// returned value
+struct rusage usage;
 
-	switch (scheduler)
-	{
-	case SCHED_OTHER:
-	case SCHED_RR:
-	case SCHED_FIFO:
-		_scheduler = scheduler;
-		break;
-	//case SCHED_DEADLINE:
-	default:
-		ret = EINVAL;
-		break;
-	}
+	if (getrusage(RUSAGE_THREAD, &usage))
+		return 0;
 
-	return ret;
+	return usage.ru_minflt + usage.ru_majflt;
 }
 
-int ptask_init(ptask_t *ptask)
+/**
+ * Starts counting page faults and allocations on behalf of the given task.
+ */
+static inline void _ptask_guard_start(ptask_t *ptask)
 {
-	if (!_ptask_canallocate())
-		return EAGAIN;
+	_guard_faults	= _ptask_thread_faults();
+	_guarded		= ptask;
+}
 
-	*ptask = _ptask_new_task;
-	ptask->id = _ptask_new_id(); // Cannot fail since I already checked canallocate
-	ptask->_state = PS_NEW;
+/**
+ * Stops counting page faults and allocations on behalf of the given task.
+ */
+static inline void _ptask_guard_end(ptask_t *ptask)
+{
+	if (_guarded != ptask)
+		return;
 
-	return 0;
+	_guarded = NULL;
+	ptask->faults += _ptask_thread_faults() - _guard_faults;
 }
 
-int ptask_set_params(ptask_t *ptask, long wcet, int period, int deadline, int priority)
-{
-	if (!_ptask_isnew(ptask))
-		return EINVAL;
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
 
-	ptask->wcet = wcet;
-	ptask->period = period;
-	ptask->deadline = deadline;
-	ptask->priority = priority;
+// The following functions replace the ones of the C library for the whole
+// process, counting the allocations performed within jobs
 
-	return 0;
+void *malloc(size_t size)
+{
+	if (_guarded)
+		++_guarded->allocs;
+
+	return __libc_malloc(size);
 }
 
-int ptask_create(ptask_t *ptask, ptask_body_t *body)
+void *calloc(size_t n, size_t size)
 {
-int err;
-
-	if (!_ptask_isnew(ptask))
-		return EINVAL;
+	if (_guarded)
+		++_guarded->allocs;
 
-	err = _ptask_attr_init(ptask);
+	return __libc_calloc(n, size);
+}
 
-	if (err != 0)
-	{
-		ptask->_state = PS_ERROR;
-		return err;
-	}
+void *realloc(void *ptr, size_t size)
+{
+	if (_guarded)
+		++_guarded->allocs;
 
-	err = pthread_create(&ptask->_tid, &ptask->_attr, body, ptask);
+	return __libc_realloc(ptr, size);
+}
 
-	ptask->_state = (err) ? PS_ERROR : PS_JOINABLE;
+#else
 
-	return err;
+static inline void _ptask_guard_start(ptask_t *ptask)
+{
+	(void) ptask;
 }
 
-int ptask_destroy(ptask_t *ptask)
+static inline void _ptask_guard_end(ptask_t *ptask)
 {
-	if (!_ptask_iserror(ptask))
-		return EINVAL;
+	(void) ptask;
+}
 
-	_ptask_free_id(ptask);
+#endif
 
-	*ptask = _ptask_new_task;
+/**
+ * Tells if the given task is scheduled by the kernel with SCHED_DEADLINE,
+ * which never happens in simulations.
+ */
+static inline bool _ptask_kernel_deadline(ptask_t *ptask)
+{
+#ifdef PTASK_SIMULATION
+	(void) ptask;
+	return false;
+#else
+	return ptask->_policy == SCHED_DEADLINE;
+#endif
+}
 
-	return 0;
+#ifdef PTASK_SIMULATION
 
-}
+// The following functions implement the virtual clock, see PTASK_SIMULATION.
+// Participants run only in the _SIM_RUNNING state, which is given to one
+// ready participant at a time; when no participant is ready, the clock jumps
+// to the next event, either the end of a wait or of a consumption of CPU time.
+// Unless otherwise stated, they shall be called with _sim_mux locked.
 
-int ptask_set_args(ptask_t *ptask, void* args, size_t args_size)
+/**
+ * Releases the structure of a thread that is not a ptask when it terminates.
+ */
+static void _ptask_sim_thread_exit(void *thread);
+
+/**
+ * Starts the virtual clock from the current time.
+ */
+static void _ptask_sim_init()
 {
-	if (!_ptask_isnew(ptask))
-		return EINVAL;
+struct timespec now;
+int				i;
 
-	if (args_size > PTASK_ARGS_SIZE)
-		return EINVAL;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	_sim_now = time_to_ns(now);
 
-	if (args == NULL || args_size < 1)
-		return 0;
+	for (i = 0; i < PTASK_SIM_THREADS; ++i)
+		pthread_cond_init(&_sim_threads[i].cond, NULL);
 
-	memcpy(ptask->args, args, args_size);
+	pthread_key_create(&_sim_key, _ptask_sim_thread_exit);
 
-	return 0;
+	// Events are traced in virtual time too
+	trace_set_clock(ptask_clock_gettime);
 }
 
-int ptask_short(ptask_t *ptask,
-	long wcet, int period, int deadline, int priority, ptask_body_t *body,
-	void* args, size_t args_size)
+/**
+ * Assigns a structure to a thread, returning NULL if there are none left.
+ */
+static inline _ptask_sim_thread_t *_ptask_sim_alloc(ptask_t *ptask,
+	bool participant)
 {
-int err;
-
-	err = ptask_init(ptask);
-	if (err) return err;
-
-	// I'm not checking the returned value because the following function cannot
-	// fail in this point
-	ptask_set_params(ptask, wcet, period, deadline, priority);
-
-	err = ptask_set_args(ptask, args, args_size);
+_ptask_sim_thread_t*	t;
+int						i;
 
-	if (err)
+	for (i = 0; i < PTASK_SIM_THREADS; ++i)
 	{
-		ptask->_state = PS_ERROR;
-		ptask_destroy(ptask);
-		return err;
+		t = &_sim_threads[i];
+
+		if (t->in_use)
+			continue;
+
+		t->in_use		= true;
+		t->participant	= participant;
+		t->state		= _SIM_IDLE;
+		t->ptask		= ptask;
+		t->chan			= NULL;
+		t->wake			= -1;
+		t->demand		= 0;
+		t->cpu_time		= 0;
+		t->job_start	= 0;
+
+		return t;
 	}
 
-	err = ptask_create(ptask, body);
+	return NULL;
+}
 
-	if (err)
-		ptask_destroy(ptask);
+/**
+ * Returns the structure of the calling thread, assigning one to threads that
+ * are not known to the simulation yet, or NULL if there are none left.
+ */
+static inline _ptask_sim_thread_t *_ptask_sim_self()
+{
+	if (_sim_self == NULL)
+	{
+		_sim_self = _ptask_sim_alloc(NULL, false);
 
-	return err;
+		if (_sim_self != NULL)
+			pthread_setspecific(_sim_key, _sim_self);
+	}
+
+	return _sim_self;
 }
 
-int ptask_cancel(ptask_t *ptask)
+/**
+ * Returns the key used to choose among threads: the lower the key, the sooner
+ * the thread runs. Threads that are not ptasks run after the tasks, while
+ * demoted tasks (see PTASK_BUDGET_DEMOTE) run after anything else.
+ */
+static inline int64_t _ptask_sim_key(const _ptask_sim_thread_t *t)
 {
-	if (!_ptask_isjoinable(ptask))
-		return EINVAL;
+	if (t->ptask == NULL)
+		return INT64_MAX - 1;
 
-	return pthread_cancel(ptask->_tid);
+	if (t->ptask->_demoted)
+		return INT64_MAX;
+
+	if (t->ptask->_policy == SCHED_DEADLINE)
+		return time_to_ns(t->ptask->dl);
+
+	return -t->ptask->priority;
 }
 
-int ptask_join(ptask_t *ptask)
+/**
+ * Returns true if thread a shall run before thread b.
+ */
+static inline bool _ptask_sim_before(const _ptask_sim_thread_t *a,
+	const _ptask_sim_thread_t *b)
 {
-int err;
+int64_t ka = _ptask_sim_key(a);
+int64_t kb = _ptask_sim_key(b);
 
-	if (!_ptask_isjoinable(ptask))
-		return EINVAL;
+	return ka < kb || (ka == kb && a->order < b->order);
+}
 
-	err = pthread_join(ptask->_tid, NULL);
+/**
+ * Returns the CPU on which the given thread consumes CPU time, -1 if it has a
+ * CPU of its own.
+ */
+static inline int _ptask_sim_cpu(const _ptask_sim_thread_t *t)
+{
+int cpu;
 
-	_ptask_free_id(ptask);
+	if (t->ptask == NULL)
+		return -1;
 
-	ptask->_state = PS_FREE;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if (CPU_ISSET(cpu, &t->ptask->affinity))
+			return cpu;
+	}
 
-	return err;
+	return -1;
 }
 
-// The following functions should be called by the task itself
-
-void ptask_start_period(ptask_t *ptask)
+/**
+ * Returns true if the given consuming thread is the one that runs on its CPU.
+ */
+static inline bool _ptask_sim_on_cpu(const _ptask_sim_thread_t *t)
 {
-struct timespec t;
+const _ptask_sim_thread_t*	u;
+int							cpu = _ptask_sim_cpu(t);
+int							i;
 
-	clock_gettime(CLOCK_MONOTONIC, &t);
+	if (cpu < 0)
+		return true;
 
-	time_copy(&(ptask->at), t);
-	time_copy(&(ptask->dl), t);
+	for (i = 0; i < PTASK_SIM_THREADS; ++i)
+	{
+		u = &_sim_threads[i];
+
+		if (u != t && u->in_use && u->state == _SIM_CONSUMING &&
+			_ptask_sim_cpu(u) == cpu && _ptask_sim_before(u, t))
+			return false;
+	}
 
-	time_add_ms(&(ptask->at), ptask->period);
-	time_add_ms(&(ptask->dl), ptask->deadline);
+	return true;
 }
 
-void ptask_wait_for_period(ptask_t *ptask)
+/**
+ * Ends the wait or the consumption of the given thread, which becomes ready
+ * if it is a participant.
+ */
+static inline void _ptask_sim_wakeup(_ptask_sim_thread_t *t, bool timedout)
 {
-	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &(ptask->at), NULL) != 0)
+	t->timedout	= timedout;
+	t->chan		= NULL;
+	t->wake		= -1;
+
+	if (t->participant)
 	{
+		t->state = _SIM_READY;
+		t->order = _sim_order++;
+	}
+	else
+	{
+		t->state = _SIM_IDLE;
+		pthread_cond_signal(&t->cond);
 	}
-
-	time_add_ms(&(ptask->at), ptask->period);
-	time_add_ms(&(ptask->dl), ptask->period);
 }
 
-int ptask_deadline_miss(ptask_t *ptask)
+/**
+ * Advances the clock to the next event, waking up the threads whose wait or
+ * consumption ends there. Returns false if there are no events.
+ */
+static inline bool _ptask_sim_advance()
 {
-struct timespec now;
+_ptask_sim_thread_t*	t;
+int64_t					next = INT64_MAX;
+int64_t					elapsed;
+int						i;
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < PTASK_SIM_THREADS; ++i)
+	{
+		t = &_sim_threads[i];
+
+		t->progress = t->in_use && t->state == _SIM_CONSUMING &&
+			_ptask_sim_on_cpu(t);
+
+		if (t->progress && _sim_now + t->demand < next)
+			next = _sim_now + t->demand;
+
+		if (t->in_use && t->state == _SIM_WAITING && t->wake >= 0 &&
+			t->wake < next)
+			next = t->wake;
+	}
+
+	if (next == INT64_MAX)
+		return false;
 
-	if (time_cmp(now, ptask->dl) > 0)
+	elapsed		= next - _sim_now;
+	_sim_now	= next;
+
+	for (i = 0; i < PTASK_SIM_THREADS; ++i)
 	{
-		ptask->dmiss++;
-		return 1;
+		t = &_sim_threads[i];
+
+		if (t->progress)
+		{
+			t->demand	-= elapsed;
+			t->cpu_time	+= elapsed;
+
+			if (t->demand == 0)
+				_ptask_sim_wakeup(t, false);
+		}
+		else if (t->in_use && t->state == _SIM_WAITING && t->wake >= 0 &&
+			t->wake <= next)
+			_ptask_sim_wakeup(t, true);
 	}
 
-	return 0;
+	return true;
 }
 
-//-------------------------------------------------------------
-// GETTERS FOR PTASK ATTRIBUTES
-//-------------------------------------------------------------
-
-int ptask_get_id(ptask_t *ptask)
+/**
+ * If no participant is running, gives the running state to the first ready
+ * one, advancing the clock until one is ready, if possible.
+ */
+static inline void _ptask_sim_dispatch()
 {
-	return ptask->id;
+_ptask_sim_thread_t*	next;
+int						i;
+
+	while (_sim_running == NULL)
+	{
+		next = NULL;
+
+		for (i = 0; i < PTASK_SIM_THREADS; ++i)
+		{
+			if (_sim_threads[i].in_use && _sim_threads[i].state == _SIM_READY &&
+				(next == NULL || _ptask_sim_before(&_sim_threads[i], next)))
+				next = &_sim_threads[i];
+		}
+
+		if (next != NULL)
+		{
+			next->state		= _SIM_RUNNING;
+			_sim_running	= next;
+			pthread_cond_signal(&next->cond);
+		}
+		else if (!_ptask_sim_advance())
+			return;
+	}
 }
 
-long ptask_get_wcet(ptask_t *ptask)
+/**
+ * Suspends the calling thread, whose state has just been set to a waiting
+ * one, until it can go on.
+ */
+static inline void _ptask_sim_suspend(_ptask_sim_thread_t *self)
 {
-	return ptask->wcet;
+	if (_sim_running == self)
+		_sim_running = NULL;
+
+	_ptask_sim_dispatch();
+
+	while (self->state != (self->participant ? _SIM_RUNNING : _SIM_IDLE))
+		pthread_cond_wait(&self->cond, &_sim_mux);
+
+	if (self->participant && _sim_measure)
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &self->measured);
 }
 
-int ptask_get_period(ptask_t *ptask)
+/**
+ * Flags the job of the task of the given thread as over budget if it consumed
+ * more CPU time than the budget of the task, see ptask_set_budget.
+ */
+static inline void _ptask_sim_check_budget(_ptask_sim_thread_t *self)
 {
-	return ptask->period;
+ptask_t *ptask = self->ptask;
+
+	if (ptask == NULL || ptask->budget <= 0 || ptask->_over_budget ||
+		self->cpu_time - self->job_start <= ptask->budget * 1000LL)
+		return;
+
+	ptask->_over_budget = 1;
+	atomic_fetch_add(&ptask->overbudget, 1);
+
+	if (ptask->budget_action == PTASK_BUDGET_DEMOTE &&
+		ptask->_policy != SCHED_DEADLINE)
+		ptask->_demoted = 1;
+	else if (ptask->budget_action == PTASK_BUDGET_HANDLER)
+		ptask->budget_handler(ptask);
 }
 
-int ptask_get_dealine(ptask_t *ptask)
+/**
+ * Makes the calling participant consume the given CPU time.
+ */
+static inline void _ptask_sim_run_for(_ptask_sim_thread_t *self, int64_t ns)
 {
-	return ptask->deadline;
+	self->demand	= ns;
+	self->order		= _sim_order++;
+	self->state		= _SIM_CONSUMING;
+
+	_ptask_sim_suspend(self);
+	_ptask_sim_check_budget(self);
+}
+
+/**
+ * Makes the calling thread consume the CPU time it actually consumed since it
+ * has been resumed, if required, see ptask_sim_measure.
+ */
+static inline void _ptask_sim_charge(_ptask_sim_thread_t *self)
+{
+struct timespec	now;
+int64_t			ns;
+
+	if (!_sim_measure || !self->participant)
+		return;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	ns = (int64_t) (time_diff_ns(now, self->measured) * _sim_scale);
+
+	if (ns > 0)
+		_ptask_sim_run_for(self, ns);
+}
+
+/**
+ * Suspends the calling thread until it is woken up through the given channel
+ * (if not NULL) or until the given virtual time (if not negative). Returns
+ * ETIMEDOUT in the latter case, zero otherwise; like condition variables, it
+ * may return zero without having been woken up.
+ */
+static inline int _ptask_sim_wait(const void *chan, int64_t until)
+{
+_ptask_sim_thread_t *self = _ptask_sim_self();
+
+	// Threads without a structure can only poll
+	if (self == NULL)
+		return until >= 0 && until <= _sim_now ? ETIMEDOUT : 0;
+
+	_ptask_sim_charge(self);
+
+	if (until >= 0 && until <= _sim_now)
+		return ETIMEDOUT;
+
+	self->chan	= chan;
+	self->wake	= until;
+	self->state	= _SIM_WAITING;
+
+	_ptask_sim_suspend(self);
+
+	return self->timedout ? ETIMEDOUT : 0;
+}
+
+/**
+ * Wakes up the first thread waiting for the given channel, or all of them.
+ */
+static inline void _ptask_sim_wake(const void *chan, bool all)
+{
+_ptask_sim_thread_t*	first = NULL;
+_ptask_sim_thread_t*	t;
+int						i;
+
+	for (i = 0; i < PTASK_SIM_THREADS; ++i)
+	{
+		t = &_sim_threads[i];
+
+		if (!t->in_use || t->state != _SIM_WAITING || t->chan != chan)
+			continue;
+
+		if (all)
+			_ptask_sim_wakeup(t, false);
+		else if (first == NULL || t->order < first->order)
+			first = t;
+	}
+
+	if (first != NULL)
+		_ptask_sim_wakeup(first, false);
+
+	// Threads woken up by a thread that is not a participant
+	_ptask_sim_dispatch();
+}
+
+/**
+ * Removes the given thread from the simulation.
+ */
+static inline void _ptask_sim_remove(_ptask_sim_thread_t *t)
+{
+	t->in_use		= false;
+	t->participant	= false;
+	t->state		= _SIM_IDLE;
+
+	if (_sim_running == t)
+		_sim_running = NULL;
+
+	_ptask_sim_dispatch();
+}
+
+static void _ptask_sim_thread_exit(void *thread)
+{
+	pthread_mutex_lock(&_sim_mux);
+	_ptask_sim_remove((_ptask_sim_thread_t *) thread);
+	pthread_mutex_unlock(&_sim_mux);
+}
+
+/**
+ * Locks _sim_mux, starting the virtual clock on the first call.
+ */
+static inline void _ptask_sim_lock()
+{
+	pthread_once(&_sim_once, _ptask_sim_init);
+	pthread_mutex_lock(&_sim_mux);
+}
+
+/// Unlocks _sim_mux
+static inline void _ptask_sim_unlock()
+{
+	pthread_mutex_unlock(&_sim_mux);
+}
+
+/**
+ * Adds the thread of the given task to the simulation as a ready participant,
+ * before the thread is created, so that the clock cannot advance before it
+ * starts. Returns zero on success, EAGAIN if there are no structures left.
+ * It locks _sim_mux by itself.
+ */
+static inline int _ptask_sim_spawn(ptask_t *ptask)
+{
+int err = 0;
+
+	_ptask_sim_lock();
+
+	ptask->_sim = _ptask_sim_alloc(ptask, true);
+
+	if (ptask->_sim == NULL)
+		err = EAGAIN;
+	else
+	{
+		ptask->_sim->state = _SIM_READY;
+		ptask->_sim->order = _sim_order++;
+	}
+
+	_ptask_sim_unlock();
+
+	return err;
+}
+
+/**
+ * Called by the thread of the given task when it starts, it waits until the
+ * thread is given the running state. It locks _sim_mux by itself.
+ */
+static inline void _ptask_sim_start(ptask_t *ptask)
+{
+	_ptask_sim_lock();
+
+	_sim_self = ptask->_sim;
+
+	// The creator may not be a participant
+	_ptask_sim_dispatch();
+
+	while (_sim_self->state != _SIM_RUNNING)
+		pthread_cond_wait(&_sim_self->cond, &_sim_mux);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &_sim_self->measured);
+
+	_ptask_sim_unlock();
+}
+
+/**
+ * Called by the thread of the given task when it terminates, or by its creator
+ * if the thread cannot be created. It locks _sim_mux by itself.
+ */
+static inline void _ptask_sim_exit(ptask_t *ptask)
+{
+	_ptask_sim_lock();
+
+	if (_sim_self == ptask->_sim)
+	{
+		_ptask_sim_charge(_sim_self);
+		_sim_self = NULL;
+	}
+
+	_ptask_sim_remove(ptask->_sim);
+	ptask->_sim = NULL;
+
+	_ptask_sim_unlock();
+}
+
+#endif
+
+/**
+ * Stores the CPU time consumed by the calling thread in the given structure,
+ * in virtual time for the participants of a simulation.
+ */
+static inline void _ptask_cpu_now(struct timespec *t)
+{
+#ifdef PTASK_SIMULATION
+	if (_sim_self != NULL && _sim_self->participant)
+	{
+		_ptask_sim_lock();
+		_ptask_sim_charge(_sim_self);
+		*t = time_from_ns(_sim_self->cpu_time);
+		_ptask_sim_unlock();
+		return;
+	}
+#endif
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, t);
+}
+
+#ifndef PTASK_SIMULATION
+
+/**
+ * Handles the expiration of the budget timer of a task, on the thread of the
+ * task itself.
+ */
+static void _ptask_budget_signal(int sig, siginfo_t *info, void *context)
+{
+ptask_t*			ptask = (ptask_t *) info->si_value.sival_ptr;
+struct sched_param	param = { .sched_priority = 0 };
+int					saved_errno = errno;
+
+	(void) sig;
+	(void) context;
+
+	ptask->_over_budget = 1;
+	atomic_fetch_add(&ptask->overbudget, 1);
+
+	switch (ptask->budget_action)
+	{
+	case PTASK_BUDGET_DEMOTE:
+		// Zero is the calling thread, not the whole process
+		if (ptask->_policy != SCHED_DEADLINE &&
+			sched_setscheduler(0, SCHED_IDLE, &param) == 0)
+			ptask->_demoted = 1;
+		break;
+	case PTASK_BUDGET_HANDLER:
+		ptask->budget_handler(ptask);
+		break;
+	default:
+		break;
+	}
+
+	errno = saved_errno;
+}
+
+/**
+ * Installs the handler of PTASK_BUDGET_SIGNAL for the whole process.
+ */
+static void _ptask_budget_init()
+{
+struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction	= _ptask_budget_signal;
+	sa.sa_flags		= SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(PTASK_BUDGET_SIGNAL, &sa, NULL);
+}
+
+/**
+ * Creates the budget timer of the given ptask, which shall be called by the
+ * task itself since the timer measures the CPU time of the calling thread.
+ * Returns zero on success, the errno value of timer_create otherwise.
+ */
+static inline int _ptask_budget_timer_init(ptask_t *ptask)
+{
+struct sigevent sev;
+
+	pthread_once(&_budget_once, _ptask_budget_init);
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify			= SIGEV_THREAD_ID;
+	sev.sigev_signo				= PTASK_BUDGET_SIGNAL;
+	sev.sigev_value.sival_ptr	= ptask;
+	sev.sigev_notify_thread_id	= syscall(SYS_gettid);
+
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &ptask->_budget_timer))
+		return errno;
+
+	ptask->_has_budget_timer = true;
+
+	return 0;
+}
+
+/**
+ * Restores the scheduling of the calling task if it has been demoted.
+ */
+static inline void _ptask_budget_restore(ptask_t *ptask)
+{
+struct sched_param param = { .sched_priority = ptask->priority };
+
+	if (ptask->_demoted)
+	{
+		sched_setscheduler(0, ptask->_policy, &param);
+		ptask->_demoted = 0;
+	}
+}
+
+/**
+ * Restores the scheduling of the calling task if a signal pending at the end
+ * of its previous job demoted it, then arms its budget timer for the job that
+ * is starting.
+ */
+static inline void _ptask_budget_start(ptask_t *ptask)
+{
+struct itimerspec spec;
+
+	ptask->_over_budget = 0;
+
+	_ptask_budget_restore(ptask);
+
+	if (ptask->budget <= 0 ||
+		(!ptask->_has_budget_timer && _ptask_budget_timer_init(ptask)))
+		return;
+
+	spec.it_value		= time_from_ns(ptask->budget * 1000LL);
+	spec.it_interval	= time_from_ns(0);
+
+	timer_settime(ptask->_budget_timer, 0, &spec, NULL);
+}
+
+/**
+ * Disarms the budget timer of the calling task, if any, then restores its
+ * scheduling if the job has been demoted, so that it waits for the next
+ * activation with its own priority.
+ */
+static inline void _ptask_budget_end(ptask_t *ptask)
+{
+struct itimerspec spec;
+
+	if (ptask->_has_budget_timer)
+	{
+		memset(&spec, 0, sizeof(spec));
+		timer_settime(ptask->_budget_timer, 0, &spec, NULL);
+	}
+
+	_ptask_budget_restore(ptask);
+}
+
+#else
+
+/**
+ * Resets the budget flags of the calling task, then starts measuring the
+ * budget of the job that is starting in virtual time, see
+ * _ptask_sim_check_budget.
+ */
+static inline void _ptask_budget_start(ptask_t *ptask)
+{
+	ptask->_over_budget	= 0;
+	ptask->_demoted		= 0;
+
+	if (ptask->_sim == NULL)
+		return;
+
+	_ptask_sim_lock();
+	ptask->_sim->job_start = ptask->_sim->cpu_time;
+	_ptask_sim_unlock();
+}
+
+/**
+ * Restores the priority of the calling task, if the job has been demoted.
+ */
+static inline void _ptask_budget_end(ptask_t *ptask)
+{
+	if (ptask->_sim == NULL)
+		return;
+
+	_ptask_sim_lock();
+	ptask->_demoted = 0;
+	_ptask_sim_unlock();
+}
+
+#endif
+
+/**
+ * Closes the timerfd and the epoll set of the given ptask, if any, and deletes
+ * its budget timer.
+ */
+static inline void _ptask_close_fds(ptask_t *ptask)
+{
+	if (ptask->_timer >= 0)
+		close(ptask->_timer);
+
+	if (ptask->_epoll >= 0)
+		close(ptask->_epoll);
+
+	if (ptask->_has_budget_timer)
+		timer_delete(ptask->_budget_timer);
+
+	ptask->_timer = -1;
+	ptask->_epoll = -1;
+	ptask->_has_budget_timer = false;
+}
+
+/**
+ * Initializes the `_attr` field of the given ptask.
+ * Returns a zero value on success, a non zero value otherwise.
+ */
+static inline int _ptask_attr_init(ptask_t *ptask)
+{
+struct sched_param mypar;		// structure used to set the scheduling priority
+pthread_attr_t *attr_ptr = &ptask->_attr;
+								// pointer to the _attr field of the ptask
+int err;						// used to check for errors and return value
+int policy = _scheduler;		// policy set on the thread at creation
+
+
+	if (_scheduler == SCHED_DEADLINE)
+	{
+		// The runtime shall fit within the deadline, which shall fit within
+		// the period
+		if (ptask->priority != 0 || ptask->wcet <= 0 || ptask->period <= 0 ||
+			ptask->deadline > ptask->period ||
+			ptask->wcet * 1000 > ptask->deadline)
+			return EINVAL;
+
+		if (CPU_COUNT(&ptask->affinity) > 0)
+			return EINVAL;
+
+		// The policy cannot be set through the thread attributes, the thread
+		// starts with the default policy and then it sets its own
+		policy = SCHED_OTHER;
+	}
+	else if (_scheduler != SCHED_OTHER && ptask->priority == 0)
+		return EINVAL;
+	else if (_scheduler == SCHED_OTHER && ptask->priority != 0)
+		return EINVAL;
+
+	err = pthread_attr_init(attr_ptr);
+	if (err) return err;
+
+	err = pthread_attr_setinheritsched(attr_ptr, PTHREAD_EXPLICIT_SCHED);
+	if (err) return err;
+
+#ifdef PTASK_SIMULATION
+	// The simulation schedules the threads by itself
+	policy = SCHED_OTHER;
+	mypar.sched_priority = 0;
+#else
+	mypar.sched_priority = ptask->priority;
+#endif
+
+	err = pthread_attr_setschedpolicy(attr_ptr, policy);
+	if (err) return err;
+
+	err = pthread_attr_setschedparam(attr_ptr, &mypar);
+	if (err) return err;
+
+	if (_stack_size > 0)
+	{
+		err = pthread_attr_setstacksize(attr_ptr, _stack_size);
+		if (err) return err;
+	}
+
+	if (CPU_COUNT(&ptask->affinity) > 0)
+		err = pthread_attr_setaffinity_np(attr_ptr, sizeof(cpu_set_t),
+			&ptask->affinity);
+
+	return err;
+}
+
+/**
+ * Sets the SCHED_DEADLINE policy on the calling thread, using the parameters of
+ * the given ptask. Returns zero on success, EBUSY if the reservation has been
+ * refused by the admission control, another errno value otherwise.
+ */
+static inline int _ptask_set_deadline(ptask_t *ptask)
+{
+struct _ptask_sched_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.size			= sizeof(attr);
+	attr.sched_policy	= SCHED_DEADLINE;
+	attr.sched_runtime	= (uint64_t) ptask->wcet * 1000;
+	attr.sched_deadline	= (uint64_t) ptask->deadline;
+	attr.sched_period	= (uint64_t) ptask->period;
+
+	if (syscall(SYS_sched_setattr, 0, &attr, 0))
+		return errno;
+
+	return 0;
+}
+
+/**
+ * Sets the phase origin to the current time.
+ */
+static void _ptask_init_origin()
+{
+	ptask_clock_gettime(&_origin);
+}
+
+/**
+ * Returns the first release of the given phased task not earlier than the
+ * given time.
+ */
+static inline struct timespec _ptask_first_release(ptask_t *ptask,
+	struct timespec now)
+{
+struct timespec	release = _origin;
+int64_t			late;		// Time elapsed since the first possible release
+
+	time_add_ns(&release, ptask->offset);
+
+	late = time_diff_ns(now, release);
+
+	// Aperiodic tasks have a single release
+	if (late > 0 && ptask->period > 0)
+		time_add_ns(&release,
+			(late + ptask->period - 1) / ptask->period * ptask->period);
+
+	return time_cmp(release, now) > 0 ? release : now;
+}
+
+/**
+ * Runs the given body on the thread of the given task, after prefaulting its
+ * stack.
+ */
+static inline void *_ptask_run(ptask_t *ptask, ptask_body_t *body)
+{
+void *ret;
+
+#ifdef PTASK_MUTEX_PROFILE
+	_self = ptask;
+#endif
+
+	_ptask_prefault_stack();
+
+#ifdef PTASK_SIMULATION
+	_ptask_sim_start(ptask);
+	ret = body(ptask);
+	_ptask_sim_exit(ptask);
+#else
+	ret = body(ptask);
+#endif
+
+	return ret;
+}
+
+/**
+ * The first function executed by the thread of a task.
+ */
+static void *_ptask_trampoline(void *arg)
+{
+ptask_t *ptask = (ptask_t *) arg;
+
+	return _ptask_run(ptask, ptask->_body);
+}
+
+/**
+ * The first function executed by the thread of a SCHED_DEADLINE task, which
+ * sets its own scheduling policy before running the body of the task.
+ */
+static void *_ptask_deadline_trampoline(void *arg)
+{
+_ptask_start_t*	start = (_ptask_start_t *) arg;
+ptask_t*		ptask = start->ptask;
+ptask_body_t*	body = start->body;
+int				err;
+
+	err = _ptask_set_deadline(ptask);
+
+	// The start structure belongs to the creator and it is not valid anymore
+	// after this call
+	start->err = err;
+	sem_post(&start->started);
+
+	if (err)
+		return NULL;
+
+	return _ptask_run(ptask, body);
+}
+
+/**
+ * Creates the thread of a SCHED_DEADLINE task, waiting until its reservation
+ * has been either accepted or refused by the kernel. If it has been refused the
+ * thread is joined and the error is returned.
+ */
+static inline int _ptask_create_deadline(ptask_t *ptask, ptask_body_t *body)
+{
+_ptask_start_t	start;
+int				err;
+
+	start.ptask	= ptask;
+	start.body	= body;
+	start.err	= 0;
+
+	if (sem_init(&start.started, 0, 0))
+		return errno;
+
+	err = pthread_create(&ptask->_tid, &ptask->_attr,
+		_ptask_deadline_trampoline, &start);
+
+	if (!err)
+	{
+		while (sem_wait(&start.started) && errno == EINTR)
+			;
+
+		err = start.err;
+
+		if (err)
+			pthread_join(ptask->_tid, NULL);
+	}
+
+	sem_destroy(&start.started);
+
+	return err;
+}
+
+
+//-------------------------------------------------------------
+// LIBRARY PUBLIC FUNCTIONS
+//-------------------------------------------------------------
+
+int ptask_set_scheduler(int scheduler)
+{
+int ret = 0;	// returned value
+
+	switch (scheduler)
+	{
+	case SCHED_OTHER:
+	case SCHED_RR:
+	case SCHED_FIFO:
+	case SCHED_DEADLINE:
+		_scheduler = scheduler;
+		break;
+	default:
+		ret = EINVAL;
+		break;
+	}
+
+	return ret;
+}
+
+int ptask_init(ptask_t *ptask)
+{
+	if (!_ptask_canallocate())
+		return EAGAIN;
+
+	*ptask = _ptask_new_task;
+	ptask->id = _ptask_new_id(); // Cannot fail since I already checked canallocate
+	ptask->_state = PS_NEW;
+	ptask->offset = PTASK_NO_OFFSET;
+	ptask->_timer = -1;
+	ptask->_epoll = -1;
+
+#ifdef PTASK_PROFILE
+	histogram_init(&ptask->profile.exec);
+	histogram_init(&ptask->profile.response);
+	histogram_init(&ptask->profile.jitter);
+#endif
+
+	return 0;
+}
+
+int ptask_set_params(ptask_t *ptask, long wcet, int period, int deadline, int priority)
+{
+	if (!_ptask_isnew(ptask))
+		return EINVAL;
+
+	ptask->wcet = wcet;
+	ptask->period = period * TIME_NS_PER_MS;
+	ptask->deadline = deadline * TIME_NS_PER_MS;
+	ptask->priority = priority;
+
+	return 0;
+}
+
+int ptask_set_period_ns(ptask_t *ptask, int64_t period, int64_t deadline)
+{
+int64_t old_period = ptask->period;
+int64_t old_deadline = ptask->deadline;
+#ifdef PTASK_TIMERFD
+struct itimerspec spec;
+#endif
+int err;
+
+	if (!_ptask_isvalid(ptask) || period <= 0 || deadline <= 0)
+		return EINVAL;
+
+	ptask->period = period;
+	ptask->deadline = deadline;
+
+	// A running deadline task changes its own reservation
+	if (!_ptask_isnew(ptask) && _ptask_kernel_deadline(ptask))
+	{
+		err = EINVAL;
+
+		if (deadline <= period && ptask->wcet * 1000 <= deadline)
+			err = _ptask_set_deadline(ptask);
+
+		if (err)
+		{
+			ptask->period = old_period;
+			ptask->deadline = old_deadline;
+			return err;
+		}
+	}
+
+#ifdef PTASK_TIMERFD
+	// A running timer still expires at the next activation, then it follows
+	// the new period
+	if (ptask->_timer >= 0)
+	{
+		spec.it_value		= ptask->at;
+		spec.it_interval	= time_from_ns(period);
+
+		if (timerfd_settime(ptask->_timer, TFD_TIMER_ABSTIME, &spec, NULL))
+		{
+			ptask->period = old_period;
+			ptask->deadline = old_deadline;
+			return errno;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+int ptask_create(ptask_t *ptask, ptask_body_t *body)
+{
+int err;
+
+	if (!_ptask_isnew(ptask))
+		return EINVAL;
+
+	err = _ptask_attr_init(ptask);
+
+	if (err != 0)
+	{
+		ptask->_state = PS_ERROR;
+		return err;
+	}
+
+	ptask->_policy = _scheduler;
+	ptask->_body = body;
+
+#ifdef PTASK_SIMULATION
+	err = _ptask_sim_spawn(ptask);
+	if (err)
+	{
+		ptask->_state = PS_ERROR;
+		return err;
+	}
+#endif
+
+	if (_ptask_kernel_deadline(ptask))
+		err = _ptask_create_deadline(ptask, body);
+	else
+		err = pthread_create(&ptask->_tid, &ptask->_attr, _ptask_trampoline,
+			ptask);
+
+#ifdef PTASK_SIMULATION
+	if (err)
+		_ptask_sim_exit(ptask);
+#endif
+
+	ptask->_state = (err) ? PS_ERROR : PS_JOINABLE;
+
+	return err;
+}
+
+int ptask_destroy(ptask_t *ptask)
+{
+	if (!_ptask_iserror(ptask) && !_ptask_isnew(ptask))
+		return EINVAL;
+
+	_ptask_free_id(ptask);
+	_ptask_close_fds(ptask);
+
+	*ptask = _ptask_new_task;
+
+	return 0;
+
+}
+
+int ptask_set_affinity(ptask_t *ptask, const cpu_set_t *affinity)
+{
+	if (!_ptask_isnew(ptask))
+		return EINVAL;
+
+	if (affinity == NULL)
+		CPU_ZERO(&ptask->affinity);
+	else
+		ptask->affinity = *affinity;
+
+	return 0;
+}
+
+int ptask_set_overrun(ptask_t *ptask, ptask_overrun_t overrun,
+	ptask_overrun_handler_t *handler)
+{
+	if (!_ptask_isvalid(ptask))
+		return EINVAL;
+
+	if (overrun < PTASK_OVERRUN_CATCHUP || overrun > PTASK_OVERRUN_HANDLER)
+		return EINVAL;
+
+	if (overrun == PTASK_OVERRUN_HANDLER && handler == NULL)
+		return EINVAL;
+
+	ptask->overrun			= overrun;
+	ptask->overrun_handler	= handler;
+
+	return 0;
+}
+
+int ptask_set_budget(ptask_t *ptask, long budget,
+	ptask_budget_action_t action, ptask_budget_handler_t *handler)
+{
+	if (!_ptask_isvalid(ptask) || budget < 0)
+		return EINVAL;
+
+	if (action < PTASK_BUDGET_FLAG || action > PTASK_BUDGET_HANDLER)
+		return EINVAL;
+
+	if (action == PTASK_BUDGET_HANDLER && handler == NULL)
+		return EINVAL;
+
+	ptask->budget			= budget;
+	ptask->budget_action	= action;
+	ptask->budget_handler	= handler;
+
+	return 0;
+}
+
+int ptask_set_offset(ptask_t *ptask, int64_t offset)
+{
+	if (!_ptask_isvalid(ptask) || (offset < 0 && offset != PTASK_NO_OFFSET))
+		return EINVAL;
+
+	pthread_once(&_origin_once, _ptask_init_origin);
+
+	ptask->offset = offset;
+
+	return 0;
+}
+
+int ptask_stagger(ptask_t *tasks[], int n, int64_t span)
+{
+int i;
+
+	if (n < 1)
+		return 0;
+
+	if (span < 0 || span > tasks[0]->period)
+		return EINVAL;
+
+	for (i = 0; i < n; ++i)
+	{
+		if (!_ptask_isnew(tasks[i]) || tasks[i]->period != tasks[0]->period)
+			return EINVAL;
+	}
+
+	if (span == 0)
+		span = tasks[0]->period;
+
+	for (i = 0; i < n; ++i)
+		ptask_set_offset(tasks[i], span * i / n);
+
+	return 0;
+}
+
+int ptask_set_args(ptask_t *ptask, void* args, size_t args_size)
+{
+	if (!_ptask_isnew(ptask))
+		return EINVAL;
+
+	if (args_size > PTASK_ARGS_SIZE)
+		return EINVAL;
+
+	if (args == NULL || args_size < 1)
+		return 0;
+
+	memcpy(ptask->args, args, args_size);
+
+	return 0;
+}
+
+int ptask_short(ptask_t *ptask,
+	long wcet, int period, int deadline, int priority, ptask_body_t *body,
+	void* args, size_t args_size)
+{
+	return ptask_short_affinity(ptask, wcet, period, deadline, priority, NULL,
+		body, args, args_size);
+}
+
+int ptask_short_affinity(ptask_t *ptask,
+	long wcet, int period, int deadline, int priority,
+	const cpu_set_t *affinity, ptask_body_t *body,
+	void* args, size_t args_size)
+{
+int err;
+
+	err = ptask_init(ptask);
+	if (err) return err;
+
+	// I'm not checking the returned values because the following functions
+	// cannot fail in this point
+	ptask_set_params(ptask, wcet, period, deadline, priority);
+	ptask_set_affinity(ptask, affinity);
+
+	err = ptask_set_args(ptask, args, args_size);
+
+	if (err)
+	{
+		ptask->_state = PS_ERROR;
+		ptask_destroy(ptask);
+		return err;
+	}
+
+	err = ptask_create(ptask, body);
+
+	if (err)
+		ptask_destroy(ptask);
+
+	return err;
+}
+
+int ptask_cancel(ptask_t *ptask)
+{
+	if (!_ptask_isjoinable(ptask))
+		return EINVAL;
+
+	return pthread_cancel(ptask->_tid);
+}
+
+int ptask_join(ptask_t *ptask)
+{
+int err;
+
+	if (!_ptask_isjoinable(ptask))
+		return EINVAL;
+
+	err = pthread_join(ptask->_tid, NULL);
+
+	_ptask_free_id(ptask);
+	_ptask_close_fds(ptask);
+
+	ptask->_state = PS_FREE;
+
+	return err;
+}
+
+// The following functions should be called by the task itself
+
+#ifdef PTASK_TIMERFD
+
+/**
+ * Creates the timerfd of the given task, which expires at its next activation
+ * time and then every period, adding it to the epoll set of the task if any.
+ * The task is activated by sleeping if the timer cannot be created.
+ */
+static inline void _ptask_timer_init(ptask_t *ptask)
+{
+struct itimerspec	spec;
+struct epoll_event	ev;
+
+	ptask->_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ptask->_timer < 0)
+		return;
+
+	spec.it_value		= ptask->at;
+	spec.it_interval	= time_from_ns(ptask->period);
+
+	ev.events	= EPOLLIN;
+	ev.data.fd	= ptask->_timer;
+
+	if (timerfd_settime(ptask->_timer, TFD_TIMER_ABSTIME, &spec, NULL) ||
+		(ptask->_epoll >= 0 &&
+			epoll_ctl(ptask->_epoll, EPOLL_CTL_ADD, ptask->_timer, &ev)))
+	{
+		close(ptask->_timer);
+		ptask->_timer = -1;
+	}
+}
+
+#endif
+
+void ptask_start_period(ptask_t *ptask)
+{
+struct timespec t;
+
+	ptask_clock_gettime(&t);
+
+	if (ptask->offset != PTASK_NO_OFFSET)
+	{
+		// A deadline task gets a new period when it wakes up after it
+		t = _ptask_first_release(ptask, t);
+		ptask_sleep_until(&t);
+	}
+	else if (_ptask_kernel_deadline(ptask))
+	{
+		// The kernel resumes the task at the beginning of its next period
+		sched_yield();
+		ptask_clock_gettime(&t);
+	}
+
+	time_copy(&(ptask->at), t);
+	time_copy(&(ptask->dl), t);
+
+	time_add_ns(&(ptask->at), ptask->period);
+	time_add_ns(&(ptask->dl), ptask->deadline);
+
+	ptask->_pending = 0;
+
+#ifdef PTASK_TIMERFD
+	if (ptask->_policy != SCHED_DEADLINE && ptask->period > 0 &&
+		ptask->_timer < 0)
+		_ptask_timer_init(ptask);
+#endif
+
+	ptask_job_start(ptask, &t);
+}
+
+/**
+ * Applies the overrun policy of the given task, given the number of its
+ * activations that already elapsed. If the activations are skipped, the
+ * activation time (and the deadline) is moved forward to the first aligned
+ * activation in the future and true is returned.
+ */
+static inline bool _ptask_apply_overrun(ptask_t *ptask, int elapsed)
+{
+ptask_overrun_t overrun = ptask->overrun;
+
+	if (overrun == PTASK_OVERRUN_HANDLER)
+		overrun = ptask->overrun_handler(ptask, elapsed);
+
+	if (overrun != PTASK_OVERRUN_SKIP)
+		return false;
+
+	ptask->skipped += elapsed;
+
+	time_add_ns(&(ptask->at), elapsed * ptask->period);
+	time_add_ns(&(ptask->dl), elapsed * ptask->period);
+
+	return true;
+}
+
+/**
+ * If the next activation time of the given task already elapsed, applies the
+ * overrun policy of the task, see _ptask_apply_overrun.
+ */
+static inline void _ptask_handle_overrun(ptask_t *ptask)
+{
+struct timespec	now;
+int64_t			late;		// How late the task is w.r.t. its activation (ns)
+
+	if (ptask->overrun == PTASK_OVERRUN_CATCHUP || ptask->period <= 0)
+		return;
+
+	ptask_clock_gettime(&now);
+
+	if (time_cmp(now, ptask->at) <= 0)
+		return;
+
+	late = time_diff_ns(now, ptask->at);
+
+	_ptask_apply_overrun(ptask, (int) (late / ptask->period) + 1);
+}
+
+/**
+ * Suspends the calling task until its next activation time, without a timer.
+ */
+static inline void _ptask_wait_clock(ptask_t *ptask)
+{
+	_ptask_handle_overrun(ptask);
+
+	// A SCHED_DEADLINE task that yields gives back its remaining runtime and is
+	// suspended until its budget is replenished, at the beginning of its next
+	// period
+	if (_ptask_kernel_deadline(ptask))
+		sched_yield();
+	else
+		ptask_sleep_until(&(ptask->at));
+}
+
+#ifdef PTASK_TIMERFD
+
+/**
+ * Returns the number of expirations of the timer of the given task since the
+ * last read, zero if none.
+ */
+static inline int _ptask_timer_read(ptask_t *ptask)
+{
+uint64_t expirations;
+
+	if (read(ptask->_timer, &expirations, sizeof(expirations)) !=
+		sizeof(expirations))
+		return 0;
+
+	return (int) expirations;
+}
+
+/**
+ * Blocks the calling task until its timer expires or, if fd is not NULL, until
+ * one of the file descriptors in its epoll set is readable. Returns the number
+ * of expirations of the timer, or zero if the task has been woken up by the
+ * file descriptor stored in fd.
+ */
+static inline int _ptask_timer_block(ptask_t *ptask, int *fd)
+{
+struct pollfd		pfd;
+struct epoll_event	ev;
+int					n = 0;
+
+	pfd.fd		= ptask->_timer;
+	pfd.events	= POLLIN;
+
+	// Waits interrupted by a signal are restarted
+	do
+	{
+		if (fd != NULL && ptask->_epoll >= 0)
+		{
+			if (epoll_wait(ptask->_epoll, &ev, 1, -1) < 1)
+				continue;
+
+			if (ev.data.fd != ptask->_timer)
+			{
+				*fd = ev.data.fd;
+				return 0;
+			}
+		}
+		else if (poll(&pfd, 1, -1) < 1)
+			continue;
+
+		n = _ptask_timer_read(ptask);
+	} while (n == 0);
+
+	return n;
+}
+
+/**
+ * Suspends the calling task until its next activation using its timer, see
+ * _ptask_timer_block. Returns true if the task has been woken up by the file
+ * descriptor stored in fd instead.
+ */
+static inline bool _ptask_wait_timer(ptask_t *ptask, int *fd)
+{
+int n;	// Number of activations elapsed
+
+	// Activations elapsed during an overrun are released one after the other
+	if (ptask->_pending > 0)
+	{
+		--ptask->_pending;
+		return false;
+	}
+
+	// The timer already expired if the last job overran
+	n = _ptask_timer_read(ptask);
+
+	if (n > 0 && _ptask_apply_overrun(ptask, n))
+		n = 0;
+
+	if (n == 0)
+		n = _ptask_timer_block(ptask, fd);
+
+	if (n == 0)
+		return true;
+
+	ptask->_pending = n - 1;
+
+	return false;
+}
+
+#endif
+
+/**
+ * Ends the current job of the given task and waits for its next activation or,
+ * if fd is not NULL, for one of the file descriptors of the task. Returns -1 if
+ * the task has been activated by its period, the ready file descriptor
+ * otherwise.
+ */
+static inline int _ptask_wait(ptask_t *ptask, int *fd)
+{
+struct timespec release;	// Activation time of the next job
+
+	ptask_job_end(ptask);
+
+#ifdef PTASK_TIMERFD
+	if (ptask->_timer >= 0)
+	{
+		if (_ptask_wait_timer(ptask, fd))
+		{
+			ptask_clock_gettime(&release);
+			ptask_job_start(ptask, &release);
+			return *fd;
+		}
+	}
+	else
+		_ptask_wait_clock(ptask);
+#else
+	(void) fd;
+	_ptask_wait_clock(ptask);
+#endif
+
+	release = ptask->at;
+
+	ptask_job_start(ptask, &release);
+
+	time_add_ns(&(ptask->at), ptask->period);
+	time_add_ns(&(ptask->dl), ptask->period);
+
+	return -1;
+}
+
+void ptask_wait_for_period(ptask_t *ptask)
+{
+	_ptask_wait(ptask, NULL);
+}
+
+int ptask_wait_for_event(ptask_t *ptask)
+{
+int fd = -1;
+
+	return _ptask_wait(ptask, &fd);
+}
+
+int ptask_add_event_fd(ptask_t *ptask, int fd)
+{
+#ifdef PTASK_TIMERFD
+struct epoll_event ev;
+
+	if (ptask->_epoll < 0)
+	{
+		ptask->_epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (ptask->_epoll < 0)
+			return errno;
+
+		// The timer is added here if the task already started its period
+		ev.events	= EPOLLIN;
+		ev.data.fd	= ptask->_timer;
+
+		if (ptask->_timer >= 0 &&
+			epoll_ctl(ptask->_epoll, EPOLL_CTL_ADD, ptask->_timer, &ev))
+			return errno;
+	}
+
+	ev.events	= EPOLLIN;
+	ev.data.fd	= fd;
+
+	if (epoll_ctl(ptask->_epoll, EPOLL_CTL_ADD, fd, &ev))
+		return errno;
+
+	return 0;
+#else
+	(void) ptask;
+	(void) fd;
+	return ENOTSUP;
+#endif
+}
+
+void ptask_job_start(ptask_t *ptask, const struct timespec *release)
+{
+#ifdef PTASK_PROFILE
+ptask_profile_t*	profile = &ptask->profile;
+struct timespec		now;
+
+	ptask_clock_gettime(&now);
+	_ptask_cpu_now(&profile->_cpu_start);
+
+	// A job started before its release time has no jitter
+	histogram_add(&profile->jitter,
+		time_cmp(now, *release) > 0 ? time_diff_ns(now, *release) : 0);
+
+	profile->_release	= *release;
+	profile->_in_job	= true;
+#endif
+
+	trace_instant_at("release", ptask->id, 0, release);
+	trace_begin("job", ptask->id);
+
+	_ptask_guard_start(ptask);
+	_ptask_budget_start(ptask);
+}
+
+void ptask_job_end(ptask_t *ptask)
+{
+#ifdef PTASK_PROFILE
+ptask_profile_t*	profile = &ptask->profile;
+struct timespec		now;
+struct timespec		cpu_now;
+#endif
+
+	_ptask_budget_end(ptask);
+	_ptask_guard_end(ptask);
+
+	if (ptask->_over_budget)
+		trace_instant("over budget", ptask->id,
+			atomic_load(&ptask->overbudget));
+
+	trace_end("job", ptask->id);
+
+#ifdef PTASK_PROFILE
+	if (!profile->_in_job)
+		return;
+
+	_ptask_cpu_now(&cpu_now);
+	ptask_clock_gettime(&now);
+
+	histogram_add(&profile->exec, time_diff_ns(cpu_now, profile->_cpu_start));
+	histogram_add(&profile->response,
+		time_cmp(now, profile->_release) > 0 ?
+			time_diff_ns(now, profile->_release) : 0);
+
+	profile->_in_job = false;
+#endif
+}
+
+bool ptask_over_budget(ptask_t *ptask)
+{
+	return ptask->_over_budget;
+}
+
+void ptask_wait_for_offset(ptask_t *ptask, struct timespec *release)
+{
+	if (ptask->offset == PTASK_NO_OFFSET || ptask->offset == 0)
+		return;
+
+	time_add_ns(release, ptask->offset);
+	ptask_sleep_until(release);
+}
+
+/**
+ * If the current time is later than the given absolute deadline, it counts a
+ * deadline miss of the given ptask and returns a non zero value, otherwise it
+ * returns zero.
+ */
+static inline int _ptask_deadline_miss(ptask_t *ptask, struct timespec dl)
+{
+struct timespec now;
+
+	ptask_clock_gettime(&now);
+
+	if (time_cmp(now, dl) > 0)
+	{
+		ptask->dmiss++;
+		trace_instant("deadline miss", ptask->id, ptask->dmiss);
+		return 1;
+	}
+
+	return 0;
+}
+
+int ptask_deadline_miss(ptask_t *ptask)
+{
+	return _ptask_deadline_miss(ptask, ptask->dl);
+}
+
+int ptask_job_deadline_miss(ptask_t *ptask, const struct timespec *release)
+{
+struct timespec dl = *release;
+
+	time_add_ns(&dl, ptask->deadline);
+
+	return _ptask_deadline_miss(ptask, dl);
+}
+
+//-------------------------------------------------------------
+// REAL-TIME MEMORY
+//-------------------------------------------------------------
+
+int ptask_rt_init(size_t stack_size)
+{
+	if (stack_size > 0 &&
+		stack_size < (size_t) PTHREAD_STACK_MIN + PTASK_STACK_RESERVED)
+		return EINVAL;
+
+	_stack_size = stack_size;
+
+	// Freed memory is kept by the allocator, even big blocks that would
+	// otherwise be mapped on their own
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		return errno;
+
+	return 0;
+}
+
+void ptask_rt_prefault(void *buffer, size_t size)
+{
+	_ptask_touch((volatile char *) buffer, size);
+}
+
+//-------------------------------------------------------------
+// APERIODIC SERVERS
+//-------------------------------------------------------------
+
+// The server is active from the moment it has both pending jobs and budget
+// (activation) until it has no more jobs or budget; the budget consumed in
+// such an interval is given back one period after its activation. The
+// following functions shall be called with the mutex of the server locked.
+
+/// Gives back the budget of the replenishments that are due at time now
+static inline void _ptask_server_replenish(ptask_server_t *server,
+	struct timespec now)
+{
+int i = 0;
+
+	while (i < server->_nrepl && time_cmp(server->_repl_time[i], now) <= 0)
+		server->capacity += server->_repl_amount[i++];
+
+	if (i == 0)
+		return;
+
+	server->_nrepl -= i;
+	memmove(server->_repl_time, server->_repl_time + i,
+		server->_nrepl * sizeof(struct timespec));
+	memmove(server->_repl_amount, server->_repl_amount + i,
+		server->_nrepl * sizeof(int64_t));
+}
+
+/// Schedules the replenishment of the given amount of budget, consumed in an
+/// active interval started at the given activation time
+static inline void _ptask_server_schedule(ptask_server_t *server,
+	struct timespec activation, int64_t amount)
+{
+int last;
+
+	if (amount <= 0)
+		return;
+
+	time_add_ns(&activation, server->period);
+
+	// When the list is full the amount is merged with the last replenishment,
+	// which is postponed, hence the budget is never given back earlier
+	if (server->_nrepl == PTASK_SERVER_REPL)
+	{
+		last = server->_nrepl - 1;
+		server->_repl_time[last]	= activation;
+		server->_repl_amount[last]	+= amount;
+		return;
+	}
+
+	server->_repl_time[server->_nrepl]		= activation;
+	server->_repl_amount[server->_nrepl]	= amount;
+	server->_nrepl++;
+}
+
+int ptask_server_init(ptask_server_t *server, long budget, int period)
+{
+int err;
+
+	if (budget <= 0 || period <= 0 || budget > period * 1000l)
+		return EINVAL;
+
+	memset(server, 0, sizeof(ptask_server_t));
+
+	server->budget		= budget * 1000ll;
+	server->period		= period * 1000000ll;
+	server->capacity	= server->budget;
+
+	err = ptask_mutex_init(&server->_mux);
+	if (err)
+		return err;
+
+	ptask_mutex_set_name(&server->_mux, "server");
+
+	return ptask_cond_init(&server->_cond);
+}
+
+void *ptask_server_task(void *arg)
+{
+ptask_t*			ptask = (ptask_t *) arg;
+ptask_server_t*		server;
+ptask_server_job_t	job;
+struct timespec		now;
+struct timespec		activation;	// Activation time of the current interval
+struct timespec		cpu_start;
+struct timespec		cpu_end;
+int64_t				used = 0;	// Budget consumed in the current interval
+bool				active = false;
+
+	memcpy(&server, ptask->args, sizeof(ptask_server_t *));
+
+	ptask_mutex_lock(&server->_mux);
+
+	while (!server->_terminate)
+	{
+		ptask_clock_gettime(&now);
+		_ptask_server_replenish(server, now);
+
+		if (active && (server->_count == 0 || server->capacity <= 0))
+		{
+			_ptask_server_schedule(server, activation, used);
+			active	= false;
+			used	= 0;
+		}
+
+		if (server->_count == 0)
+		{
+			ptask_cond_wait(&server->_cond, &server->_mux);
+			continue;
+		}
+
+		if (server->capacity <= 0)
+		{
+			// There is always a pending replenishment when the budget is over
+			activation = server->_repl_time[0];
+
+			ptask_mutex_unlock(&server->_mux);
+			ptask_sleep_until(&activation);
+			ptask_mutex_lock(&server->_mux);
+			continue;
+		}
+
+		if (!active)
+		{
+			activation	= now;
+			active		= true;
+		}
+
+		job = server->_queue[server->_head];
+		server->_head = (server->_head + 1) % PTASK_SERVER_QUEUE;
+		server->_count--;
+
+		// The job is demoted as soon as it exhausts the remaining capacity, so
+		// that it overdraws the budget only when the CPU would be idle
+		ptask_set_budget(ptask, (server->capacity + 999) / 1000,
+			PTASK_BUDGET_DEMOTE, NULL);
+
+		ptask_mutex_unlock(&server->_mux);
+
+		_ptask_cpu_now(&cpu_start);
+		ptask_job_start(ptask, &job.submitted);
+
+		job.job(job.arg);
+
+		ptask_job_end(ptask);
+		_ptask_cpu_now(&cpu_end);
+
+		ptask_mutex_lock(&server->_mux);
+
+		used				+= time_diff_ns(cpu_end, cpu_start);
+		server->capacity	-= time_diff_ns(cpu_end, cpu_start);
+		server->served++;
+	}
+
+	if (active)
+		_ptask_server_schedule(server, activation, used);
+
+	server->discarded	+= server->_count;
+	server->_count		= 0;
+
+	ptask_mutex_unlock(&server->_mux);
+
+	return NULL;
+}
+
+int ptask_server_submit(ptask_server_t *server, ptask_job_t *job, void *arg)
+{
+ptask_server_job_t*	slot;
+int					err = 0;
+
+	ptask_mutex_lock(&server->_mux);
+
+	if (server->_terminate || server->_count == PTASK_SERVER_QUEUE)
+	{
+		server->rejected++;
+		err = EAGAIN;
+	}
+	else
+	{
+		slot = &server->_queue[
+			(server->_head + server->_count) % PTASK_SERVER_QUEUE];
+
+		slot->job	= job;
+		slot->arg	= arg;
+		ptask_clock_gettime(&slot->submitted);
+
+		server->_count++;
+		ptask_cond_signal(&server->_cond);
+	}
+
+	ptask_mutex_unlock(&server->_mux);
+
+	return err;
+}
+
+void ptask_server_stop(ptask_server_t *server)
+{
+	ptask_mutex_lock(&server->_mux);
+	server->_terminate = true;
+	ptask_cond_signal(&server->_cond);
+	ptask_mutex_unlock(&server->_mux);
+}
+
+//-------------------------------------------------------------
+// VIRTUAL CLOCK
+//-------------------------------------------------------------
+
+void ptask_clock_gettime(struct timespec *t)
+{
+#ifdef PTASK_SIMULATION
+	_ptask_sim_lock();
+	*t = time_from_ns(_sim_now);
+	_ptask_sim_unlock();
+#else
+	clock_gettime(CLOCK_MONOTONIC, t);
+#endif
+}
+
+void ptask_sleep_until(const struct timespec *t)
+{
+#ifdef PTASK_SIMULATION
+	_ptask_sim_lock();
+
+	while (_ptask_sim_wait(NULL, time_to_ns(*t)) != ETIMEDOUT)
+		;
+
+	_ptask_sim_unlock();
+#else
+	// Sleeps interrupted by a signal are resumed
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL) == EINTR)
+		;
+#endif
+}
+
+void ptask_sim_consume(int64_t ns)
+{
+#ifdef PTASK_SIMULATION
+	// Threads that do not take part in the simulation have no costs
+	if (_sim_self == NULL || !_sim_self->participant || ns <= 0)
+		return;
+
+	_ptask_sim_lock();
+	_ptask_sim_charge(_sim_self);
+	_ptask_sim_run_for(_sim_self, ns);
+	_ptask_sim_unlock();
+#else
+	(void) ns;
+#endif
+}
+
+void ptask_sim_measure(bool measure, double scale)
+{
+#ifdef PTASK_SIMULATION
+	_ptask_sim_lock();
+	_sim_measure	= measure;
+	_sim_scale		= scale;
+	_ptask_sim_unlock();
+#else
+	(void) measure;
+	(void) scale;
+#endif
+}
+
+void ptask_sim_enter()
+{
+#ifdef PTASK_SIMULATION
+_ptask_sim_thread_t *self;
+
+	_ptask_sim_lock();
+
+	self = _ptask_sim_self();
+
+	if (self != NULL && !self->participant)
+	{
+		self->participant	= true;
+		self->state			= _SIM_READY;
+		self->order			= _sim_order++;
+
+		_ptask_sim_suspend(self);
+	}
+
+	_ptask_sim_unlock();
+#endif
+}
+
+void ptask_sim_leave()
+{
+#ifdef PTASK_SIMULATION
+_ptask_sim_thread_t *self = _sim_self;
+
+	// The threads of the tasks always take part in the simulation
+	if (self == NULL || !self->participant || self->ptask != NULL)
+		return;
+
+	_ptask_sim_lock();
+
+	_ptask_sim_charge(self);
+
+	self->participant	= false;
+	self->state			= _SIM_IDLE;
+
+	if (_sim_running == self)
+		_sim_running = NULL;
+
+	_ptask_sim_dispatch();
+
+	_ptask_sim_unlock();
+#endif
+}
+
+//-------------------------------------------------------------
+// SCHEDULABILITY ANALYSIS
+//-------------------------------------------------------------
+
+/**
+ * Returns the value that orders the given task when assigning priorities.
+ */
+static inline int64_t _ptask_prio_key(ptask_t *ptask, ptask_prio_order_t order)
+{
+	return order == PTASK_PRIO_DM ? ptask->deadline : ptask->period;
+}
+
+/**
+ * Returns true if the two given tasks can run on the same CPU.
+ */
+static inline bool _ptask_share_cpu(ptask_t *t1, ptask_t *t2)
+{
+cpu_set_t common;
+
+	if (CPU_COUNT(&t1->affinity) == 0 || CPU_COUNT(&t2->affinity) == 0)
+		return true;
+
+	CPU_AND(&common, &t1->affinity, &t2->affinity);
+
+	return CPU_COUNT(&common) > 0;
+}
+
+/**
+ * Returns the WCET (in ns) of the i-th task used by the response-time analysis.
+ */
+static inline int64_t _ptask_rta_wcet(ptask_t *tasks[], const int64_t wcet[],
+	int i)
+{
+	return wcet ? wcet[i] : (int64_t) tasks[i]->wcet * 1000;
+}
+
+int ptask_assign_priorities(ptask_t *tasks[], int n, ptask_prio_order_t order,
+	int min_prio, int max_prio)
+{
+int64_t	key;
+int		levels = 0;	// Number of distinct keys
+int		rank;		// Number of distinct keys smaller than the current one
+int		i, j, k;
+
+	for (i = 0; i < n; ++i)
+	{
+		if (!_ptask_isnew(tasks[i]))
+			return EINVAL;
+
+		// A key is counted only on its first occurrence
+		for (j = 0; j < i; ++j)
+		{
+			if (_ptask_prio_key(tasks[j], order) ==
+				_ptask_prio_key(tasks[i], order))
+				break;
+		}
+
+		if (j == i)
+			++levels;
+	}
+
+	if (levels > max_prio - min_prio + 1)
+		return EINVAL;
+
+	for (i = 0; i < n; ++i)
+	{
+		key		= _ptask_prio_key(tasks[i], order);
+		rank	= 0;
+
+		for (j = 0; j < n; ++j)
+		{
+			if (_ptask_prio_key(tasks[j], order) >= key)
+				continue;
+
+			for (k = 0; k < j; ++k)
+			{
+				if (_ptask_prio_key(tasks[k], order) ==
+					_ptask_prio_key(tasks[j], order))
+					break;
+			}
+
+			if (k == j)
+				++rank;
+		}
+
+		tasks[i]->priority = max_prio - rank;
+	}
+
+	return 0;
+}
+
+int ptask_response_time_analysis(ptask_t *tasks[], const int64_t wcet[],
+	int n, int64_t response[])
+{
+int64_t	c;				// WCET of the analyzed task
+int64_t	r;				// Current response time of the analyzed task
+int64_t	next;			// Next iteration of r
+int		unschedulable = 0;
+int		i, j;
+
+	for (i = 0; i < n; ++i)
+	{
+		c		= _ptask_rta_wcet(tasks, wcet, i);
+		next	= c;
+
+		// The iteration converges if the interfering utilization is below one,
+		// otherwise it stops as soon as the deadline is exceeded
+		do
+		{
+			r		= next;
+			next	= c;
+
+			for (j = 0; j < n; ++j)
+			{
+				if (j == i || tasks[j]->priority < tasks[i]->priority ||
+					tasks[j]->period <= 0 ||
+					!_ptask_share_cpu(tasks[i], tasks[j]))
+					continue;
+
+				next += ((r + tasks[j]->period - 1) / tasks[j]->period) *
+					_ptask_rta_wcet(tasks, wcet, j);
+			}
+		} while (next != r && next <= tasks[i]->deadline);
+
+		response[i] = next;
+
+		if (next > tasks[i]->deadline)
+			++unschedulable;
+	}
+
+	return unschedulable;
+}
+
+//-------------------------------------------------------------
+// GETTERS FOR PTASK ATTRIBUTES
+//-------------------------------------------------------------
+
+int ptask_get_id(ptask_t *ptask)
+{
+	return ptask->id;
+}
+
+long ptask_get_wcet(ptask_t *ptask)
+{
+	return ptask->wcet;
+}
+
+int ptask_get_period(ptask_t *ptask)
+{
+	return (int) (ptask->period / TIME_NS_PER_MS);
+}
+
+int ptask_get_dealine(ptask_t *ptask)
+{
+	return (int) (ptask->deadline / TIME_NS_PER_MS);
+}
+
+int64_t ptask_get_period_ns(ptask_t *ptask)
+{
+	return ptask->period;
+}
+
+int64_t ptask_get_deadline_ns(ptask_t *ptask)
+{
+	return ptask->deadline;
+}
+
+int ptask_get_overbudget(ptask_t *ptask)
+{
+	return atomic_load(&ptask->overbudget);
+}
+
+int64_t ptask_get_offset(ptask_t *ptask)
+{
+	return ptask->offset;
 }
 
 int ptask_get_priority(ptask_t *ptask)
 {
-	return ptask->priority;
+	return ptask->priority;
+}
+
+int ptask_get_dmiss(ptask_t *ptask)
+{
+	return ptask->dmiss;
+}
+
+int ptask_get_skipped(ptask_t *ptask)
+{
+	return ptask->skipped;
+}
+
+void ptask_get_affinity(ptask_t *ptask, cpu_set_t *affinity)
+{
+	*affinity = ptask->affinity;
+}
+
+#ifdef PTASK_RT_GUARD
+
+long ptask_get_faults(ptask_t *ptask)
+{
+	return ptask->faults;
+}
+
+long ptask_get_allocs(ptask_t *ptask)
+{
+	return ptask->allocs;
+}
+
+#endif
+
+#ifdef PTASK_PROFILE
+
+const ptask_profile_t *ptask_get_profile(ptask_t *ptask)
+{
+	return &ptask->profile;
+}
+
+#endif
+
+#if defined PTASK_PROFILE || defined PTASK_MUTEX_PROFILE
+
+/// Prints the given statistics of a histogram of durations in microseconds
+static inline void _ptask_print_histogram(const char *label,
+	const histogram_t *h)
+{
+	printf(" | %s %7.1f %7.1f %7.1f", label,
+		histogram_percentile(h, 50) / 1000.,
+		histogram_percentile(h, 99) / 1000.,
+		histogram_max(h) / 1000.);
+}
+
+#endif
+
+void ptask_print_profile(ptask_t *ptask, const char *name)
+{
+#ifdef PTASK_PROFILE
+const ptask_profile_t *profile = &ptask->profile;
+
+	if (histogram_count(&profile->exec) == 0)
+		return;
+
+	printf("%-8s jobs %7llu", name,
+		(unsigned long long) histogram_count(&profile->exec));
+
+	_ptask_print_histogram("exec", &profile->exec);
+	_ptask_print_histogram("resp", &profile->response);
+	_ptask_print_histogram("jitter", &profile->jitter);
+
+	printf("\r\n");
+#else
+	(void) ptask;
+	(void) name;
+#endif
+}
+
+//-------------------------------------------------------------
+// MUTEXES AND CONDITION VARIABLES
+//-------------------------------------------------------------
+
+static pthread_mutexattr_t _matt;	///< Attributes used to initialize any
+									///< mutex allocated in the system
+static pthread_once_t _once_mutex_attr;
+									///< Handles whether the _matt variable is
+									///< already initialized or not
+
+/**
+ * Executed once per program on the first mutex init, it initializes the mutex
+ * attributes static global variable.
+ */
+static void _ptask_init_mutex_attr()
+{
+	pthread_mutexattr_init(&_matt);
+
+	// NOTICE: Change to priority ceiling if needed
+	pthread_mutexattr_setprotocol(&_matt, PTHREAD_PRIO_INHERIT);
+}
+
+#ifdef PTASK_SIMULATION
+
+// In simulations, threads wait for mutexes and condition variables through the
+// virtual clock, using the address of each one as channel, so that the clock
+// is not stopped by a participant blocked on them.
+
+/// Locks the given mutex, waiting through the virtual clock if it is held
+static inline int _ptask_lock(pthread_mutex_t *mux)
+{
+int err;
+
+	err = pthread_mutex_trylock(mux);
+	if (err != EBUSY)
+		return err;
+
+	_ptask_sim_lock();
+
+	while ((err = pthread_mutex_trylock(mux)) == EBUSY)
+		_ptask_sim_wait(mux, -1);
+
+	_ptask_sim_unlock();
+
+	return err;
+}
+
+/// Unlocks the given mutex, waking up the threads waiting for it
+static inline int _ptask_unlock(pthread_mutex_t *mux)
+{
+int err;
+
+	err = pthread_mutex_unlock(mux);
+
+	_ptask_sim_lock();
+	_ptask_sim_wake(mux, true);
+	_ptask_sim_unlock();
+
+	return err;
+}
+
+/// Waits for the given condition variable, releasing the given mutex meanwhile
+static inline int _ptask_cond_block(pthread_cond_t *cond,
+	pthread_mutex_t *mux)
+{
+	_ptask_sim_lock();
+
+	pthread_mutex_unlock(mux);
+	_ptask_sim_wake(mux, true);
+
+	_ptask_sim_wait(cond, -1);
+
+	_ptask_sim_unlock();
+
+	return _ptask_lock(mux);
+}
+
+/// Wakes up the first thread waiting for the given condition variable, or all
+static inline int _ptask_cond_wake(pthread_cond_t *cond, bool all)
+{
+	_ptask_sim_lock();
+	_ptask_sim_wake(cond, all);
+	_ptask_sim_unlock();
+
+	return 0;
+}
+
+#else
+
+static inline int _ptask_lock(pthread_mutex_t *mux)
+{
+	return pthread_mutex_lock(mux);
+}
+
+static inline int _ptask_unlock(pthread_mutex_t *mux)
+{
+	return pthread_mutex_unlock(mux);
+}
+
+static inline int _ptask_cond_block(pthread_cond_t *cond,
+	pthread_mutex_t *mux)
+{
+	return pthread_cond_wait(cond, mux);
+}
+
+static inline int _ptask_cond_wake(pthread_cond_t *cond, bool all)
+{
+	return all ? pthread_cond_broadcast(cond) : pthread_cond_signal(cond);
+}
+
+#endif
+
+#ifdef PTASK_MUTEX_PROFILE
+
+/**
+ * Adds the given mutex to the report, unless it is already there or the report
+ * is full.
+ */
+static inline void _ptask_mutex_register(ptask_mutex_t *mux_p)
+{
+int i;
+
+	pthread_mutex_lock(&_mutexes_mutex);
+
+	for (i = 0; i < _nmutexes && _mutexes[i] != mux_p; ++i)
+		;
+
+	if (i == _nmutexes && _nmutexes < PTASK_MUTEX_MAX)
+		_mutexes[_nmutexes++] = mux_p;
+
+	pthread_mutex_unlock(&_mutexes_mutex);
+}
+
+/**
+ * Records that the calling thread acquired the given mutex at the given time.
+ * When counted is false, the acquisition is not counted, because the mutex was
+ * reacquired at the end of a wait on a condition variable.
+ */
+static inline void _ptask_mutex_acquired(ptask_mutex_t *mux_p,
+	struct timespec acquired, bool counted, bool contended)
+{
+ptask_mutex_holder_t*	holder;
+int						task = _self != NULL ? _self->id : -1;
+int						i;
+
+	for (i = 0; i < mux_p->nholders && mux_p->holders[i].task != task; ++i)
+		;
+
+	if (i == PTASK_MUTEX_HOLDERS)
+		i = PTASK_MUTEX_HOLDERS - 1;
+	else if (i == mux_p->nholders)
+	{
+		mux_p->holders[i].task = task;
+		++mux_p->nholders;
+	}
+
+	holder = &mux_p->holders[i];
+
+	if (counted)
+	{
+		++mux_p->acquisitions;
+		++holder->acquisitions;
+
+		if (contended)
+		{
+			++mux_p->contended;
+			++holder->contended;
+		}
+	}
+
+	mux_p->holder		= i;
+	mux_p->_acquired	= acquired;
+}
+
+/**
+ * Records that the current holder of the given mutex is releasing it.
+ */
+static inline void _ptask_mutex_released(ptask_mutex_t *mux_p)
+{
+struct timespec	now;
+int64_t			hold;
+
+	ptask_clock_gettime(&now);
+
+	hold = time_to_ns(now) - time_to_ns(mux_p->_acquired);
+
+	histogram_add(&mux_p->hold, hold);
+	mux_p->holders[mux_p->holder].hold += hold;
+}
+
+int ptask_mutex_init(ptask_mutex_t *mux_p)
+{
+int err;
+
+	pthread_once(&_once_mutex_attr, _ptask_init_mutex_attr);
+
+	memset(mux_p, 0, sizeof(ptask_mutex_t));
+
+	err = pthread_mutex_init(&mux_p->_mux, &_matt);
+	if (err)
+		return err;
+
+	histogram_init(&mux_p->wait);
+	histogram_init(&mux_p->hold);
+
+	_ptask_mutex_register(mux_p);
+
+	return 0;
+}
+
+int ptask_mutex_lock(ptask_mutex_t *mux_p)
+{
+struct timespec	start;
+struct timespec	acquired;
+bool			contended;
+int				err;
+
+	err = pthread_mutex_trylock(&mux_p->_mux);
+	contended = err == EBUSY;
+
+	if (contended)
+	{
+		ptask_clock_gettime(&start);
+		err = _ptask_lock(&mux_p->_mux);
+	}
+
+	if (err)
+		return err;
+
+	ptask_clock_gettime(&acquired);
+
+	histogram_add(&mux_p->wait,
+		contended ? time_to_ns(acquired) - time_to_ns(start) : 0);
+
+	_ptask_mutex_acquired(mux_p, acquired, true, contended);
+
+	return 0;
+}
+
+int ptask_mutex_unlock(ptask_mutex_t *mux_p)
+{
+	_ptask_mutex_released(mux_p);
+
+	return _ptask_unlock(&mux_p->_mux);
+}
+
+int ptask_cond_init(ptask_cond_t *cond_p)
+{
+	return pthread_cond_init(cond_p, NULL);
+}
+
+int ptask_cond_wait(ptask_cond_t *cond_p, ptask_mutex_t *mux_p)
+{
+struct timespec	acquired;
+int				err;
+
+	// The time spent waiting for the condition is not part of the hold time
+	_ptask_mutex_released(mux_p);
+
+	err = _ptask_cond_block(cond_p, &mux_p->_mux);
+
+	ptask_clock_gettime(&acquired);
+	_ptask_mutex_acquired(mux_p, acquired, false, false);
+
+	return err;
+}
+
+void ptask_mutex_set_name(ptask_mutex_t *mux_p, const char *name)
+{
+	mux_p->name = name;
+}
+
+void ptask_mutex_report()
+{
+ptask_mutex_t*	mux;
+int				nmutexes;
+int				i;
+int				j;
+
+	pthread_mutex_lock(&_mutexes_mutex);
+	nmutexes = _nmutexes;
+	pthread_mutex_unlock(&_mutexes_mutex);
+
+	for (i = 0; i < nmutexes; ++i)
+	{
+		mux = _mutexes[i];
+
+		if (mux->acquisitions == 0)
+			continue;
+
+		if (mux->name != NULL)
+			printf("%-12s", mux->name);
+		else
+			printf("mutex #%-5d", i);
+
+		printf(" acq %8llu contended %5.1f%%",
+			(unsigned long long) mux->acquisitions,
+			100. * mux->contended / mux->acquisitions);
+
+		_ptask_print_histogram("wait", &mux->wait);
+		_ptask_print_histogram("hold", &mux->hold);
+
+		printf("\r\n");
+
+		for (j = 0; j < mux->nholders; ++j)
+		{
+			if (mux->holders[j].task < 0)
+				printf("%14s", "other threads");
+			else
+				printf("%9s %4d", "task", mux->holders[j].task);
+
+			printf(" acq %8llu contended %8llu hold %10.1f ms\r\n",
+				(unsigned long long) mux->holders[j].acquisitions,
+				(unsigned long long) mux->holders[j].contended,
+				mux->holders[j].hold / 1e6);
+		}
+	}
+}
+
+#else
+
+int ptask_mutex_init(ptask_mutex_t *mux_p)
+{
+	pthread_once(&_once_mutex_attr, _ptask_init_mutex_attr);
+
+	return pthread_mutex_init(mux_p, &_matt);
+}
+
+int ptask_mutex_lock(ptask_mutex_t *mux_p)
+{
+	return _ptask_lock(mux_p);
+}
+
+int ptask_mutex_unlock(ptask_mutex_t *mux_p)
+{
+	return _ptask_unlock(mux_p);
+}
+
+int ptask_cond_init(ptask_cond_t *cond_p)
+{
+	return pthread_cond_init(cond_p, NULL);
+}
+
+int ptask_cond_wait(ptask_cond_t *cond_p, ptask_mutex_t *mux_p)
+{
+	return _ptask_cond_block(cond_p, mux_p);
+}
+
+void ptask_mutex_set_name(ptask_mutex_t *mux_p, const char *name)
+{
+	(void) mux_p;
+	(void) name;
+}
+
+void ptask_mutex_report()
+{
+}
+
+#endif
+
+int ptask_cond_signal(ptask_cond_t *cond_p)
+{
+	return _ptask_cond_wake(cond_p, false);
+}
+
+int ptask_cond_broadcast(ptask_cond_t *cond_p)
+{
+	return _ptask_cond_wake(cond_p, true);
+}
+
+
+//-------------------------------------------------------------
+// CYCLIC ASYNCHRONOUS BUFFERS
+//-------------------------------------------------------------
+
+static int _next_cab_id = 1;		///< Used to assign the id to the next new
+									///< cab, a zero or negative value is
+									///< invalid
+
+// NOTICE: no need to keep trace of used ids since a cab cannot be destroyed.
+// Instead, cabs should be reused and reinitialized (using the reset function).
+// This implementation choice is due to reliability and integrty reasons united
+// with the will to write the simplest library possibile.
+// In order to destroy safely a cab, a trace of all tasks that are currently
+// using the cab should be kept, forbidding further acquisitions of buffers
+// until all the currently used buffers have been freed. Only when no buffers
+// inside the cab are used anymore the cab could be destroyed.
+
+/// Returns true if a new cab structure can be allocated
+static inline int _ptask_cab_canallocate()
+{
+	return _next_cab_id <= PTASK_CAB_MAX;
+}
+
+/// Allocates a new cab id
+static inline int _ptask_cab_next_id()
+{
+	return _next_cab_id++;
+}
+
+// Both implementations assign a sequence number to each message when it is
+// put and publish the most recent one in the sequence field, which is also used
+// as a futex word by readers blocked in ptask_cab_getmes_next. Writers issue
+// the wake up system call only if some reader is actually blocked.
+
+/// Returns true if sequence number a is more recent than b, even on wraparound
+static inline bool _ptask_cab_seq_after(unsigned int a, unsigned int b)
+{
+	return (int) (a - b) > 0;
+}
+
+/// Initializes the sequence numbers and the history of a new cab
+static inline void _ptask_cab_seq_init(ptask_cab_t *ptask_cab, int depth)
+{
+int i;
+
+	atomic_init(&ptask_cab->sequence, 0);
+	atomic_init(&ptask_cab->_next_sequence, 0);
+	atomic_init(&ptask_cab->_waiters, 0);
+	atomic_init(&ptask_cab->_base_sequence, 0);
+
+	ptask_cab->depth = depth;
+	ptask_cab->_eventfd = -1;
+
+	for (i = 0; i < PTASK_CAB_MAX_SIZE; ++i)
+	{
+		ptask_cab->sequences[i] = 0;
+		atomic_init(&ptask_cab->history[i], -1);
+	}
+}
+
+/// Assigns a new sequence number to the message in the given buffer and
+/// records the buffer in the history
+static inline void _ptask_cab_seq_assign(ptask_cab_t *ptask_cab, int b_id)
+{
+unsigned int seq = atomic_fetch_add(&ptask_cab->_next_sequence, 1) + 1;
+
+	ptask_cab->sequences[b_id] = seq;
+	atomic_store(&ptask_cab->history[seq % PTASK_CAB_MAX_SIZE], b_id);
+}
+
+// The history contains the depth most recent published messages put after the
+// last reset. Messages that have been assigned a sequence number but not
+// published yet are considered part of the history too, so that a writer can
+// never reserve a buffer that may become part of a window acquired by readers.
+
+/// Returns true if the message in the given buffer is part of the history
+static inline bool _ptask_cab_in_history(ptask_cab_t *ptask_cab, int i)
+{
+unsigned int seq = ptask_cab->sequences[i];
+unsigned int cur = atomic_load(&ptask_cab->sequence);
+
+	return _ptask_cab_seq_after(seq, atomic_load(&ptask_cab->_base_sequence))
+		&& (int) (cur - seq) < ptask_cab->depth;
 }
 
-int ptask_get_dmiss(ptask_t *ptask)
+/**
+ * Blocks the calling thread until the sequence number of the given cab is
+ * woken up, unless it is not the given one anymore, or until the given
+ * deadline (if not NULL). Returns ETIMEDOUT if the deadline expired, zero or
+ * another errno value otherwise.
+ */
+static inline int _ptask_cab_seq_wait(ptask_cab_t *ptask_cab, unsigned int cur,
+	const struct timespec *deadline)
 {
-	return ptask->dmiss;
+#ifdef PTASK_SIMULATION
+int err = 0;
+
+	_ptask_sim_lock();
+
+	if (atomic_load(&ptask_cab->sequence) == cur)
+		err = _ptask_sim_wait(&ptask_cab->sequence,
+			deadline != NULL ? time_to_ns(*deadline) : -1);
+
+	_ptask_sim_unlock();
+
+	return err;
+#else
+	// The kernel checks that the sequence has not changed before sleeping,
+	// so no wake up can be lost
+	if (syscall(SYS_futex, &ptask_cab->sequence, FUTEX_WAIT_BITSET_PRIVATE,
+			cur, deadline, NULL, FUTEX_BITSET_MATCH_ANY))
+		return errno;
+
+	return 0;
+#endif
 }
 
-//-------------------------------------------------------------
-// MUTEXES AND CONDITION VARIABLES
-//-------------------------------------------------------------
+/// Wakes up all the readers blocked on the sequence number of the given cab
+static inline void _ptask_cab_seq_wake(ptask_cab_t *ptask_cab)
+{
+#ifdef PTASK_SIMULATION
+	_ptask_sim_lock();
+	_ptask_sim_wake(&ptask_cab->sequence, true);
+	_ptask_sim_unlock();
+#else
+	syscall(SYS_futex, &ptask_cab->sequence, FUTEX_WAKE_PRIVATE, INT_MAX,
+		NULL, NULL, 0);
+#endif
+}
 
-static pthread_mutexattr_t _matt;	///< Attributes used to initialize any
-									///< mutex allocated in the system
-static pthread_once_t _once_mutex_attr;
-									///< Handles whether the _matt variable is
-									///< already initialized or not
+/// Publishes the sequence number of a new message, waking up blocked readers
+static inline void _ptask_cab_seq_publish(ptask_cab_t *ptask_cab, int b_id)
+{
+unsigned int seq = ptask_cab->sequences[b_id];
+unsigned int cur = atomic_load(&ptask_cab->sequence);
+
+	// With several writers, messages may be published out of order
+	while (_ptask_cab_seq_after(seq, cur) &&
+		!atomic_compare_exchange_weak(&ptask_cab->sequence, &cur, seq))
+		;
+
+	if (atomic_load(&ptask_cab->_waiters) > 0)
+		_ptask_cab_seq_wake(ptask_cab);
+
+	if (ptask_cab->_eventfd >= 0)
+		eventfd_write(ptask_cab->_eventfd, 1);
+
+	trace_instant("putmes", ptask_cab->id, seq);
+}
+
+#ifdef PTASK_CAB_LOCKFREE
+
+// In the lock-free implementation each buffer has an atomic reference count,
+// which holds either the number of readers using the buffer or the
+// PTASK_CAB_WRITER flag if a writer reserved it. Writers reserve buffers by
+// swapping a zero count with the flag, which can never succeed while a reader
+// holds the buffer; readers increment the count of the last buffer only if the
+// flag is not set and then verify that it is still the last one. The free_hint
+// bitmap is only a hint: any reservation is confirmed by the swap on the count.
+
+/// Marks the given buffer as possibly free in the hint bitmap
+static inline void _ptask_cab_hint_free(ptask_cab_t *ptask_cab, int i)
+{
+	atomic_fetch_or_explicit(&ptask_cab->free_hint, 1u << i,
+		memory_order_relaxed);
+}
 
 /**
- * Executed once per program on the first mutex init, it initializes the mutex
- * attributes static global variable.
+ * Tries to reserve the given buffer for writing, returns true on success.
  */
-static void _ptask_init_mutex_attr()
+static inline bool _ptask_cab_try_reserve(ptask_cab_t *ptask_cab, int i)
 {
-	pthread_mutexattr_init(&_matt);
+int expected = 0;
+
+	if (!atomic_compare_exchange_strong_explicit(&ptask_cab->busy[i],
+			&expected, PTASK_CAB_WRITER,
+			memory_order_acquire, memory_order_relaxed))
+		return false;
+
+	// The last buffer and the ones in the history can have no readers, but
+	// they cannot be overwritten. Since only the owner of a buffer can publish
+	// it, once it is reserved it cannot enter the history in the meantime.
+	if (atomic_load_explicit(&ptask_cab->last_index, memory_order_acquire) == i
+		|| _ptask_cab_in_history(ptask_cab, i))
+	{
+		atomic_store_explicit(&ptask_cab->busy[i], 0, memory_order_release);
+		return false;
+	}
 
-	// NOTICE: Change to priority ceiling if needed
-	pthread_mutexattr_setprotocol(&_matt, PTHREAD_PRIO_INHERIT);
+	atomic_fetch_and_explicit(&ptask_cab->free_hint, ~(1u << i),
+		memory_order_relaxed);
+
+	return true;
 }
 
-int ptask_mutex_init(ptask_mutex_t *mux_p)
+/**
+ * Releases a reference held by a reader on the given buffer.
+ */
+static inline void _ptask_cab_release(ptask_cab_t *ptask_cab, int i)
 {
-	pthread_once(&_once_mutex_attr, _ptask_init_mutex_attr);
-
-	return pthread_mutex_init(mux_p, &_matt);
+	if (atomic_fetch_sub_explicit(&ptask_cab->busy[i], 1,
+			memory_order_release) == 1)
+		_ptask_cab_hint_free(ptask_cab, i);
 }
 
-int ptask_mutex_lock(ptask_mutex_t *mux_p)
+/**
+ * Acquires a reference on the buffer that holds the message with the given
+ * sequence number, returns true on success.
+ */
+static inline bool _ptask_cab_acquire_seq(ptask_cab_t *ptask_cab,
+	unsigned int seq, int *b_id)
 {
-	return pthread_mutex_lock(mux_p);
+int i;
+int count;
+
+	i = atomic_load_explicit(&ptask_cab->history[seq % PTASK_CAB_MAX_SIZE],
+		memory_order_acquire);
+
+	if (i < 0)
+		return false;
+
+	count = atomic_load_explicit(&ptask_cab->busy[i], memory_order_relaxed);
+
+	do
+	{
+		if (count & PTASK_CAB_WRITER)
+			return false;
+	} while (!atomic_compare_exchange_weak_explicit(&ptask_cab->busy[i],
+			&count, count + 1, memory_order_acquire, memory_order_relaxed));
+
+	// Once the reference is taken the buffer cannot be overwritten, but it may
+	// have been reused before
+	if (ptask_cab->sequences[i] != seq)
+	{
+		_ptask_cab_release(ptask_cab, i);
+		return false;
+	}
+
+	*b_id = i;
+
+	return true;
 }
 
-int ptask_mutex_unlock(ptask_mutex_t *mux_p)
+int ptask_cab_init_history(ptask_cab_t *ptask_cab, int n, int size,
+	void *buffers[], int depth)
 {
-	return pthread_mutex_unlock(mux_p);
+int i;
+
+	if (n > PTASK_CAB_MAX_SIZE || depth < 1 || depth >= n)
+		return EINVAL;
+
+	if (!_ptask_cab_canallocate())
+		return EINVAL;
+
+	ptask_cab->id = _ptask_cab_next_id();
+	ptask_cab->num_buffers = n;
+	ptask_cab->size_buffers = size;
+	// timestamps remain uninitialized
+
+	for (i = 0; i < n; ++i)
+	{
+		ptask_cab->buffers[i] = buffers[i];
+		atomic_init(&ptask_cab->busy[i], 0);
+	}
+
+	atomic_init(&ptask_cab->last_index, -1);
+	atomic_init(&ptask_cab->free_hint,
+		n == PTASK_CAB_MAX_SIZE ? ~0u : (1u << n) - 1);
+	_ptask_cab_seq_init(ptask_cab, depth);
+
+	return 0;
 }
 
-int ptask_cond_init(ptask_cond_t *cond_p)
+int ptask_cab_reset(ptask_cab_t *ptask_cab)
 {
-	return pthread_cond_init(cond_p, NULL);
+int n = ptask_cab->num_buffers;
+
+	atomic_store(&ptask_cab->_base_sequence, atomic_load(&ptask_cab->sequence));
+	atomic_store_explicit(&ptask_cab->last_index, -1, memory_order_release);
+
+	// Every buffer that is not used by any task is free again
+	atomic_fetch_or_explicit(&ptask_cab->free_hint,
+		n == PTASK_CAB_MAX_SIZE ? ~0u : (1u << n) - 1, memory_order_relaxed);
+
+	return 0;
 }
 
-int ptask_cond_wait(ptask_cond_t *cond_p, ptask_mutex_t *mux_p)
+// NOTICE: the following functions assume that the cab is used correctly, hence
+// only n-1 tasks can use the cab.
+
+int ptask_cab_reserve(ptask_cab_t *ptask_cab, void* buffer[], ptask_cab_id_t *b_id)
 {
-	return pthread_cond_wait(cond_p, mux_p);
+unsigned int	candidates;	// Buffers that are likely to be free
+int				i;
+
+	candidates = atomic_load_explicit(&ptask_cab->free_hint,
+		memory_order_relaxed);
+
+	while (candidates)
+	{
+		i = __builtin_ctz(candidates);
+		candidates &= candidates - 1;
+
+		if (i < ptask_cab->num_buffers && _ptask_cab_try_reserve(ptask_cab, i))
+			goto reserved;
+	}
+
+	// The hint may be stale, fall back to a full scan
+	for (i = 0; i < ptask_cab->num_buffers; ++i)
+	{
+		if (_ptask_cab_try_reserve(ptask_cab, i))
+			goto reserved;
+	}
+
+	return EAGAIN;
+
+reserved:
+	*buffer = ptask_cab->buffers[i];
+	*b_id = i;
+
+	return 0;
 }
 
-int ptask_cond_signal(ptask_cond_t *cond_p)
+int ptask_cab_putmes(ptask_cab_t *ptask_cab, ptask_cab_id_t b_id)
 {
-	return pthread_cond_signal(cond_p);
+int				old;	// The buffer whose message leaves the history
+int				last;	// The buffer replaced as the last one
+unsigned int	seq;
+
+	if (atomic_load_explicit(&ptask_cab->busy[b_id], memory_order_relaxed)
+		!= PTASK_CAB_WRITER)
+		return EINVAL;
+
+	ptask_clock_gettime(&ptask_cab->timestamps[b_id]);
+	_ptask_cab_seq_assign(ptask_cab, b_id);
+	seq = ptask_cab->sequences[b_id];
+
+	// The writer keeps a reference while publishing, so that no other writer
+	// can reserve the buffer before it becomes the last one
+	atomic_store_explicit(&ptask_cab->busy[b_id], 1, memory_order_release);
+
+	// With several writers, the buffer becomes the last one only if its
+	// message is newer than the current one, like the sequence field; if a
+	// newer sequence number has been assigned, its writer is publishing it
+	last = atomic_load_explicit(&ptask_cab->last_index, memory_order_acquire);
+
+	do
+	{
+		if (last >= 0 && !_ptask_cab_seq_after(seq, ptask_cab->sequences[last]))
+			break;
+	} while (!atomic_compare_exchange_weak_explicit(&ptask_cab->last_index,
+			&last, b_id, memory_order_acq_rel, memory_order_acquire));
+
+	atomic_fetch_sub_explicit(&ptask_cab->busy[b_id], 1, memory_order_release);
+
+	old = atomic_load_explicit(&ptask_cab->history[
+		(seq - ptask_cab->depth) % PTASK_CAB_MAX_SIZE],
+		memory_order_relaxed);
+
+	if (old >= 0 &&
+		atomic_load_explicit(&ptask_cab->busy[old], memory_order_relaxed) == 0)
+		_ptask_cab_hint_free(ptask_cab, old);
+
+	_ptask_cab_seq_publish(ptask_cab, b_id);
+
+	return 0;
 }
 
-int ptask_cond_broadcast(ptask_cond_t *cond_p)
+int ptask_cab_getmes(ptask_cab_t *ptask_cab, const void* buffer[],
+	ptask_cab_id_t *b_id, struct timespec *timestamp)
 {
-	return pthread_cond_broadcast(cond_p);
+int last;
+int count;
+
+	for (;;)
+	{
+		last = atomic_load_explicit(&ptask_cab->last_index,
+			memory_order_acquire);
+
+		if (last < 0)
+			return EAGAIN;
+
+		// A reference is taken only if no writer owns the buffer, which means
+		// that it has been replaced and it is being overwritten
+		count = atomic_load_explicit(&ptask_cab->busy[last],
+			memory_order_relaxed);
+
+		if (count & PTASK_CAB_WRITER)
+			continue;
+
+		if (!atomic_compare_exchange_weak_explicit(&ptask_cab->busy[last],
+				&count, count + 1, memory_order_acquire, memory_order_relaxed))
+			continue;
+
+		if (atomic_load_explicit(&ptask_cab->last_index, memory_order_acquire)
+			== last)
+			break;
+
+		// A newer message has been published in the meantime
+		_ptask_cab_release(ptask_cab, last);
+	}
+
+	*b_id = last;
+	*buffer = ptask_cab->buffers[last];
+
+	if (timestamp != NULL)
+		*timestamp = ptask_cab->timestamps[last];
+
+	trace_instant("getmes", ptask_cab->id, ptask_cab->sequences[last]);
+
+	return 0;
 }
 
+int ptask_cab_unget(ptask_cab_t *ptask_cab, ptask_cab_id_t b_id)
+{
+int count = PTASK_CAB_WRITER;
 
-//-------------------------------------------------------------
-// CYCLIC ASYNCHRONOUS BUFFERS
-//-------------------------------------------------------------
+	// Cancellation of a reservation, readers never hold a reserved buffer
+	if (atomic_compare_exchange_strong_explicit(&ptask_cab->busy[b_id],
+			&count, 0, memory_order_release, memory_order_relaxed))
+	{
+		_ptask_cab_hint_free(ptask_cab, b_id);
+		return 0;
+	}
+
+	if (count < 1)
+		return EINVAL;
+
+	_ptask_cab_release(ptask_cab, b_id);
+
+	return 0;
+}
+
+#else
 
 static const struct __PTASK_CAB _ptask_new_cab;
 									///< Used to initialize each struct
 									///< __PTASK_CAB to default values
 
-static int _next_cab_id = 1;		///< Used to assign the id to the next new
-									///< cab, a zero or negative value is
-									///< invalid
+/**
+ * Acquires a reference on the buffer that holds the message with the given
+ * sequence number, returns true on success.
+ */
+static inline bool _ptask_cab_acquire_seq(ptask_cab_t *ptask_cab,
+	unsigned int seq, int *b_id)
+{
+int		i;
+bool	found;
 
-// NOTICE: no need to keep trace of used ids since a cab cannot be destroyed.
-// Instead, cabs should be reused and reinitialized (using the reset function).
-// This implementation choice is due to reliability and integrty reasons united
-// with the will to write the simplest library possibile.
-// In order to destroy safely a cab, a trace of all tasks that are currently
-// using the cab should be kept, forbidding further acquisitions of buffers
-// until all the currently used buffers have been freed. Only when no buffers
-// inside the cab are used anymore the cab could be destroyed.
+	ptask_mutex_lock(&ptask_cab->_mux);
 
-/// Returns true if a new cab structure can be allocated
-static inline int _ptask_cab_canallocate()
-{
-	return _next_cab_id <= PTASK_CAB_MAX;
-}
+	i = atomic_load(&ptask_cab->history[seq % PTASK_CAB_MAX_SIZE]);
 
-/// Allocates a new cab id
-static inline int _ptask_cab_next_id()
-{
-	return _next_cab_id++;
+	// Buffers outside the history may be reserved by a writer
+	found = i >= 0 && ptask_cab->sequences[i] == seq &&
+		_ptask_cab_in_history(ptask_cab, i);
+
+	if (found)
+	{
+		++ptask_cab->busy[i];
+		*b_id = i;
+	}
+
+	ptask_mutex_unlock(&ptask_cab->_mux);
+
+	return found;
 }
 
-int ptask_cab_init(ptask_cab_t *ptask_cab, int n, int size, void *buffers[])
+int ptask_cab_init_history(ptask_cab_t *ptask_cab, int n, int size,
+	void *buffers[], int depth)
 {
 int i;
 
-	if (n > PTASK_CAB_MAX_SIZE)
+	if (n > PTASK_CAB_MAX_SIZE || depth < 1 || depth >= n)
 		return EINVAL;
 
 	if (!_ptask_cab_canallocate())
@@ -502,12 +3543,14 @@ int i;
 	ptask_cab->num_buffers = n;
 	ptask_cab->size_buffers = size;
 	ptask_cab->last_index = -1;
-	// timestamp remains uninitialized
+	// timestamps remain uninitialized
 
 	for (i = 0; i < n; ++i)
 		ptask_cab->buffers[i] = buffers[i];
 
 	ptask_mutex_init(&ptask_cab->_mux);
+	ptask_mutex_set_name(&ptask_cab->_mux, "cab");
+	_ptask_cab_seq_init(ptask_cab, depth);
 
 	return 0;
 }
@@ -517,6 +3560,7 @@ int ptask_cab_reset(ptask_cab_t *ptask_cab)
 	ptask_mutex_lock(&ptask_cab->_mux);
 
 	ptask_cab->last_index = -1;
+	atomic_store(&ptask_cab->_base_sequence, atomic_load(&ptask_cab->sequence));
 
 	ptask_mutex_unlock(&ptask_cab->_mux);
 
@@ -532,7 +3576,8 @@ int i = 0;
 
 	ptask_mutex_lock(&ptask_cab->_mux);
 
-	while (ptask_cab->busy[i] || i == ptask_cab->last_index)
+	while (ptask_cab->busy[i] || i == ptask_cab->last_index ||
+		_ptask_cab_in_history(ptask_cab, i))
 		++i;
 
 	++ptask_cab->busy[i];
@@ -557,11 +3602,15 @@ int err = 0;
 	{
 		ptask_cab->busy[b_id] = 0;
 		ptask_cab->last_index = b_id;
-		clock_gettime(CLOCK_MONOTONIC, &ptask_cab->timestamp);
+		ptask_clock_gettime(&ptask_cab->timestamps[b_id]);
+		_ptask_cab_seq_assign(ptask_cab, b_id);
 	}
 
 	ptask_mutex_unlock(&ptask_cab->_mux);
 
+	if (!err)
+		_ptask_cab_seq_publish(ptask_cab, b_id);
+
 	return err;
 }
 
@@ -578,14 +3627,17 @@ int err = 0;
 	{
 		*b_id = ptask_cab->last_index;
 		if (timestamp != NULL)
-			*timestamp	= ptask_cab->timestamp;
+			*timestamp	= ptask_cab->timestamps[*b_id];
 		++ptask_cab->busy[*b_id];
 	}
 
 	ptask_mutex_unlock(&ptask_cab->_mux);
 
 	if (!err)
+	{
 		*buffer = ptask_cab->buffers[*b_id];
+		trace_instant("getmes", ptask_cab->id, ptask_cab->sequences[*b_id]);
+	}
 
 	return err;
 }
@@ -605,3 +3657,135 @@ int err = 0;
 
 	return err;
 }
+
+#endif
+
+int ptask_cab_init(ptask_cab_t *ptask_cab, int n, int size, void *buffers[])
+{
+	return ptask_cab_init_history(ptask_cab, n, size, buffers, 1);
+}
+
+int ptask_cab_getmes_window(ptask_cab_t *ptask_cab, int k,
+	const void* buffer[], ptask_cab_id_t b_id[], struct timespec timestamp[],
+	int *count)
+{
+unsigned int	cur;		// Most recent published sequence number
+unsigned int	base;		// Sequence number at the last reset
+unsigned int	first;		// Sequence number of the oldest acquired message
+int				n;			// Number of messages in the window
+int				j;
+
+	if (k < 1 || k > ptask_cab->depth)
+		return EINVAL;
+
+retry:
+	cur		= atomic_load(&ptask_cab->sequence);
+	base	= atomic_load(&ptask_cab->_base_sequence);
+
+	if (!_ptask_cab_seq_after(cur, base))
+		return EAGAIN;
+
+	n = (int) (cur - base) < k ? (int) (cur - base) : k;
+	first = cur - n + 1;
+
+	for (j = 0; j < n; ++j)
+	{
+		if (!_ptask_cab_acquire_seq(ptask_cab, first + j, &b_id[j]))
+		{
+			// Part of the window has been overwritten or it is still being
+			// published, start again from the most recent message
+			ptask_cab_unget_window(ptask_cab, b_id, j);
+			goto retry;
+		}
+	}
+
+	for (j = 0; j < n; ++j)
+	{
+		buffer[j] = ptask_cab->buffers[b_id[j]];
+
+		if (timestamp != NULL)
+			timestamp[j] = ptask_cab->timestamps[b_id[j]];
+	}
+
+	*count = n;
+
+	return 0;
+}
+
+int ptask_cab_unget_window(ptask_cab_t *ptask_cab,
+	const ptask_cab_id_t b_id[], int count)
+{
+int j;
+int err = 0;
+
+	for (j = 0; j < count; ++j)
+	{
+		if (ptask_cab_unget(ptask_cab, b_id[j]))
+			err = EINVAL;
+	}
+
+	return err;
+}
+
+int ptask_cab_getmes_next(ptask_cab_t *ptask_cab, const void* buffer[],
+	ptask_cab_id_t *b_id, struct timespec *timestamp, unsigned int *seq,
+	int timeout)
+{
+struct timespec	deadline;	// Absolute time at which the wait expires
+unsigned int	cur;		// Most recent published sequence number
+int				err;
+
+	ptask_clock_gettime(&deadline);
+	if (timeout >= 0)
+		time_add_ms(&deadline, timeout);
+
+	for (;;)
+	{
+		cur = atomic_load(&ptask_cab->sequence);
+
+		if (_ptask_cab_seq_after(cur, *seq))
+		{
+			err = ptask_cab_getmes(ptask_cab, buffer, b_id, timestamp);
+			if (!err)
+			{
+				*seq = ptask_cab->sequences[*b_id];
+				return 0;
+			}
+
+			// The cab has been reset after the newer messages: they are gone,
+			// only the ones put after the reset can be acquired
+			*seq = atomic_load(&ptask_cab->_base_sequence);
+			continue;
+		}
+
+		atomic_fetch_add(&ptask_cab->_waiters, 1);
+
+		err = _ptask_cab_seq_wait(ptask_cab, cur,
+			timeout >= 0 ? &deadline : NULL);
+
+		atomic_fetch_sub(&ptask_cab->_waiters, 1);
+
+		if (err == ETIMEDOUT)
+			return ETIMEDOUT;
+	}
+}
+
+int ptask_cab_get_eventfd(ptask_cab_t *ptask_cab)
+{
+	if (ptask_cab->_eventfd < 0)
+		ptask_cab->_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	return ptask_cab->_eventfd;
+}
+
+int ptask_cab_destroy(ptask_cab_t *ptask_cab)
+{
+int err = 0;
+
+	if (ptask_cab->_eventfd >= 0 && close(ptask_cab->_eventfd))
+		err = errno;
+
+	ptask_cab->_eventfd = -1;
+
+	return err;
+}
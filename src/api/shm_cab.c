@@ -0,0 +1,534 @@
+/**
+ * @file shm_cab.c
+ * @brief Cyclic asynchronous buffers shared between processes
+ *
+ * For actual documentation, chechout the corresponding header file,
+ * api/shm_cab.h.
+ *
+ */
+
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "api/time_utils.h"
+#include "api/shm_cab.h"
+
+//-------------------------------------------------------------
+// PRIVATE CONSTANTS AND DATA TYPES
+//-------------------------------------------------------------
+
+#define SHM_CAB_MAGIC	(0x43414253u)	///< Identifies a shared CAB segment
+#define SHM_CAB_VERSION	(2u)			///< Layout version of the segment,
+										///< change it whenever the header
+										///< structure changes
+#define SHM_CAB_ALIGN	(64)			///< Alignment of the buffers, a cache
+										///< line
+
+/// Rounds the given size up to a multiple of SHM_CAB_ALIGN
+#define SHM_CAB_ROUND(size)	\
+	(((size) + SHM_CAB_ALIGN - 1) / SHM_CAB_ALIGN * SHM_CAB_ALIGN)
+
+/**
+ * The control header at the beginning of a shared CAB segment. Fields that are
+ * not atomic are written only once on creation or are protected by the mutex.
+ */
+struct __SHM_CAB_SEGMENT
+{
+	uint32_t	magic;				///< SHM_CAB_MAGIC, written last
+	uint32_t	version;			///< SHM_CAB_VERSION
+	pid_t		owner_pid;			///< Process that created the segment,
+									///< written first
+	int			num_buffers;		///< Number of buffers in the cab
+	int			size_buffers;		///< Size of each buffer in bytes
+	size_t		segment_size;		///< Size of the whole segment
+	size_t		offsets[SHM_CAB_MAX_SIZE];
+									///< Offset of each buffer from the
+									///< beginning of the segment
+
+	pthread_mutex_t	mux;			///< Process-shared robust mutex that
+									///< serializes writers
+	unsigned int	reserved;		///< Bitmap of the buffers reserved by
+									///< writers, protected by mux
+	unsigned int	next_sequence;	///< Sequence number of the next message,
+									///< protected by mux
+
+	atomic_int		last_index;		///< Buffer holding the most recent message
+	atomic_uint		sequences[SHM_CAB_MAX_SIZE];
+									///< Sequence number of the message
+									///< contained in each buffer, zero while it
+									///< is being written
+	struct timespec	timestamps[SHM_CAB_MAX_SIZE];
+									///< Time at which each buffer has been
+									///< published
+	atomic_uint		sequence;		///< Sequence number of the most recent
+									///< message, readers blocked in
+									///< shm_cab_read_next wait on it
+};
+
+//-------------------------------------------------------------
+// PRIVATE FUNCTIONS
+//-------------------------------------------------------------
+
+/// Returns true if sequence number a is more recent than b, even on wraparound
+static inline bool _shm_cab_seq_after(unsigned int a, unsigned int b)
+{
+	return (int) (a - b) > 0;
+}
+
+/// Returns a pointer to the given buffer within the mapped segment
+static inline void *_shm_cab_buffer(const shm_cab_t *cab, int b_id)
+{
+	return (char *) cab->segment + cab->segment->offsets[b_id];
+}
+
+/// Checks and copies the name of the segment into the handle
+static inline int _shm_cab_set_name(shm_cab_t *cab, const char *name)
+{
+	if (name[0] != '/' || strlen(name) >= SHM_CAB_NAME_SIZE)
+		return EINVAL;
+
+	strcpy(cab->name, name);
+
+	return 0;
+}
+
+/**
+ * Returns true if the existing segment with the given name has been left by an
+ * owner that terminated without closing it. Segments that are not shared CABs
+ * of this version, or whose owner is still running, are never considered
+ * stale.
+ */
+static inline bool _shm_cab_stale(const char *name)
+{
+struct __SHM_CAB_SEGMENT *segment;
+struct stat	st;
+bool		stale;
+int			fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) ||
+		(size_t) st.st_size < sizeof(struct __SHM_CAB_SEGMENT))
+	{
+		close(fd);
+		return false;
+	}
+
+	segment = mmap(NULL, sizeof(struct __SHM_CAB_SEGMENT), PROT_READ,
+		MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (segment == MAP_FAILED)
+		return false;
+
+	// A zero magic number means that the owner died while creating it
+	stale = (segment->magic == 0 || (segment->magic == SHM_CAB_MAGIC &&
+			segment->version == SHM_CAB_VERSION)) &&
+		segment->owner_pid > 0 &&
+		kill(segment->owner_pid, 0) && errno == ESRCH;
+
+	munmap(segment, sizeof(struct __SHM_CAB_SEGMENT));
+
+	return stale;
+}
+
+/**
+ * Locks the mutex of the segment. If its previous owner died while holding it,
+ * the mutex is recovered: each critical section leaves the header consistent
+ * after every single store, at most a reserved buffer is lost.
+ */
+static inline int _shm_cab_lock(struct __SHM_CAB_SEGMENT *segment)
+{
+int err;
+
+	err = pthread_mutex_lock(&segment->mux);
+
+	if (err == EOWNERDEAD)
+		err = pthread_mutex_consistent(&segment->mux);
+
+	return err;
+}
+
+/// Initializes the process-shared robust mutex of a new segment
+static inline int _shm_cab_mutex_init(struct __SHM_CAB_SEGMENT *segment)
+{
+pthread_mutexattr_t matt;
+int					err;
+
+	pthread_mutexattr_init(&matt);
+	pthread_mutexattr_setpshared(&matt, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&matt, PTHREAD_MUTEX_ROBUST);
+	pthread_mutexattr_setprotocol(&matt, PTHREAD_PRIO_INHERIT);
+
+	err = pthread_mutex_init(&segment->mux, &matt);
+
+	pthread_mutexattr_destroy(&matt);
+
+	return err;
+}
+
+//-------------------------------------------------------------
+// PUBLIC FUNCTIONS
+//-------------------------------------------------------------
+
+int shm_cab_create(shm_cab_t *cab, const char *name, int n, int size)
+{
+struct __SHM_CAB_SEGMENT *segment;
+size_t	header_size;		// Size of the header, rounded to the alignment
+size_t	stride;				// Distance between two buffers
+size_t	total;				// Size of the whole segment
+int		fd;
+int		i;
+int		err;
+
+	if (n < 2 || n > SHM_CAB_MAX_SIZE || size <= 0)
+		return EINVAL;
+
+	err = _shm_cab_set_name(cab, name);
+	if (err) return err;
+
+	header_size	= SHM_CAB_ROUND(sizeof(struct __SHM_CAB_SEGMENT));
+	stride		= SHM_CAB_ROUND((size_t) size);
+	total		= header_size + stride * n;
+
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+
+	// Only a segment left by a dead owner is replaced by a new one, readers
+	// that still map it will never see new messages on it anyway
+	if (fd < 0 && errno == EEXIST && _shm_cab_stale(name))
+	{
+		shm_unlink(name);
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	}
+
+	if (fd < 0)
+		return errno;
+
+	// The umask could have removed the read permission for other users
+	if (fchmod(fd, 0644) || ftruncate(fd, total))
+	{
+		err = errno;
+		close(fd);
+		shm_unlink(name);
+		return err;
+	}
+
+	segment = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+
+	if (segment == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return err;
+	}
+
+	// The segment is already zero-filled by ftruncate
+	segment->owner_pid		= getpid();
+	segment->version		= SHM_CAB_VERSION;
+	segment->num_buffers	= n;
+	segment->size_buffers	= size;
+	segment->segment_size	= total;
+	segment->reserved		= 0;
+	segment->next_sequence	= 1;
+
+	for (i = 0; i < n; ++i)
+	{
+		segment->offsets[i] = header_size + stride * i;
+		atomic_init(&segment->sequences[i], 0);
+	}
+
+	atomic_init(&segment->last_index, -1);
+	atomic_init(&segment->sequence, 0);
+
+	err = _shm_cab_mutex_init(segment);
+	if (err)
+	{
+		munmap(segment, total);
+		shm_unlink(name);
+		return err;
+	}
+
+	// Readers check the magic number before using the header
+	atomic_thread_fence(memory_order_release);
+	segment->magic = SHM_CAB_MAGIC;
+
+	cab->segment		= segment;
+	cab->segment_size	= total;
+	cab->owner			= true;
+
+	return 0;
+}
+
+int shm_cab_open(shm_cab_t *cab, const char *name)
+{
+struct __SHM_CAB_SEGMENT *segment;
+struct stat	st;
+int			fd;
+int			i;
+int			err;
+
+	err = _shm_cab_set_name(cab, name);
+	if (err) return err;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return errno;
+
+	if (fstat(fd, &st))
+	{
+		err = errno;
+		close(fd);
+		return err;
+	}
+
+	if ((size_t) st.st_size < sizeof(struct __SHM_CAB_SEGMENT))
+	{
+		close(fd);
+		return EINVAL;
+	}
+
+	segment = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+
+	if (segment == MAP_FAILED)
+		return err;
+
+	err = 0;
+
+	if (segment->magic != SHM_CAB_MAGIC ||
+		segment->version != SHM_CAB_VERSION ||
+		segment->segment_size != (size_t) st.st_size ||
+		segment->num_buffers < 2 || segment->num_buffers > SHM_CAB_MAX_SIZE ||
+		segment->size_buffers <= 0)
+		err = EINVAL;
+
+	atomic_thread_fence(memory_order_acquire);
+
+	// Offsets are checked too, a broken header shall not lead readers outside
+	// the mapped segment
+	for (i = 0; !err && i < segment->num_buffers; ++i)
+	{
+		if (segment->offsets[i] < sizeof(struct __SHM_CAB_SEGMENT) ||
+			segment->offsets[i] + segment->size_buffers > segment->segment_size)
+			err = EINVAL;
+	}
+
+	if (err)
+	{
+		munmap(segment, st.st_size);
+		return err;
+	}
+
+	cab->segment		= segment;
+	cab->segment_size	= st.st_size;
+	cab->owner			= false;
+
+	return 0;
+}
+
+void shm_cab_close(shm_cab_t *cab)
+{
+	munmap(cab->segment, cab->segment_size);
+
+	if (cab->owner)
+		shm_unlink(cab->name);
+
+	cab->segment = NULL;
+}
+
+int shm_cab_get_size(const shm_cab_t *cab)
+{
+	return cab->segment->size_buffers;
+}
+
+int shm_cab_reserve(shm_cab_t *cab, void *buffer[], int *b_id)
+{
+struct __SHM_CAB_SEGMENT *segment = cab->segment;
+unsigned int	age;		// Number of messages published after a buffer
+unsigned int	max_age = 0;
+int				last;
+int				i;
+int				err;
+
+	if (!cab->owner)
+		return EPERM;
+
+	err = _shm_cab_lock(segment);
+	if (err) return err;
+
+	last = atomic_load_explicit(&segment->last_index, memory_order_relaxed);
+	*b_id = -1;
+
+	// The buffer with the oldest message is chosen, giving readers as much
+	// time as possible to validate their reads
+	for (i = 0; i < segment->num_buffers; ++i)
+	{
+		if (i == last || (segment->reserved & (1u << i)))
+			continue;
+
+		age = segment->next_sequence - atomic_load_explicit(
+			&segment->sequences[i], memory_order_relaxed);
+
+		if (*b_id < 0 || age > max_age)
+		{
+			*b_id	= i;
+			max_age	= age;
+		}
+	}
+
+	if (*b_id < 0)
+	{
+		pthread_mutex_unlock(&segment->mux);
+		return EAGAIN;
+	}
+
+	segment->reserved |= 1u << *b_id;
+
+	// Readers of the old message detect the change before any new data is
+	// written into the buffer
+	atomic_store_explicit(&segment->sequences[*b_id], 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	pthread_mutex_unlock(&segment->mux);
+
+	*buffer = _shm_cab_buffer(cab, *b_id);
+
+	return 0;
+}
+
+int shm_cab_putmes(shm_cab_t *cab, int b_id)
+{
+struct __SHM_CAB_SEGMENT *segment = cab->segment;
+unsigned int	seq;
+int				err;
+
+	if (!cab->owner || b_id < 0 || b_id >= segment->num_buffers)
+		return EINVAL;
+
+	err = _shm_cab_lock(segment);
+	if (err) return err;
+
+	if (!(segment->reserved & (1u << b_id)))
+	{
+		pthread_mutex_unlock(&segment->mux);
+		return EINVAL;
+	}
+
+	// Zero marks buffers being written, hence it is skipped on wraparound
+	seq = segment->next_sequence++;
+	if (segment->next_sequence == 0)
+		segment->next_sequence = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &segment->timestamps[b_id]);
+
+	atomic_store_explicit(&segment->sequences[b_id], seq, memory_order_release);
+	atomic_store_explicit(&segment->last_index, b_id, memory_order_release);
+	segment->reserved &= ~(1u << b_id);
+	atomic_store_explicit(&segment->sequence, seq, memory_order_release);
+
+	pthread_mutex_unlock(&segment->mux);
+
+	// Readers cannot write on the segment, so they cannot tell writers whether
+	// they are waiting: the wake up is always issued
+	syscall(SYS_futex, &segment->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	return 0;
+}
+
+int shm_cab_getmes(const shm_cab_t *cab, const void *buffer[], int *b_id,
+	struct timespec *timestamp, unsigned int *seq)
+{
+struct __SHM_CAB_SEGMENT *segment = cab->segment;
+int last;
+
+	for (;;)
+	{
+		last = atomic_load_explicit(&segment->last_index, memory_order_acquire);
+
+		if (last < 0)
+			return EAGAIN;
+
+		*seq = atomic_load_explicit(&segment->sequences[last],
+			memory_order_acquire);
+
+		// The buffer has been replaced and it is being overwritten
+		if (*seq != 0)
+			break;
+	}
+
+	if (timestamp != NULL)
+		*timestamp = segment->timestamps[last];
+
+	*b_id	= last;
+	*buffer	= _shm_cab_buffer(cab, last);
+
+	return 0;
+}
+
+bool shm_cab_validate(const shm_cab_t *cab, int b_id, unsigned int seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+
+	return atomic_load_explicit(&cab->segment->sequences[b_id],
+		memory_order_relaxed) == seq;
+}
+
+int shm_cab_read_next(const shm_cab_t *cab, void *buffer,
+	struct timespec *timestamp, unsigned int *seq, int timeout)
+{
+struct __SHM_CAB_SEGMENT *segment = cab->segment;
+struct timespec	deadline;	// Absolute time at which the wait expires
+const void*		message;	// The message in the shared segment
+unsigned int	cur;		// Most recent published sequence number
+unsigned int	msg_seq;	// Sequence number of the read message
+int				b_id;
+int				err;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if (timeout >= 0)
+		time_add_ms(&deadline, timeout);
+
+	for (;;)
+	{
+		cur = atomic_load(&segment->sequence);
+
+		if (_shm_cab_seq_after(cur, *seq) &&
+			!shm_cab_getmes(cab, &message, &b_id, timestamp, &msg_seq))
+		{
+			memcpy(buffer, message, segment->size_buffers);
+
+			if (shm_cab_validate(cab, b_id, msg_seq))
+			{
+				*seq = msg_seq;
+				return 0;
+			}
+
+			// The message has been overwritten while copying it
+			continue;
+		}
+
+		// The futex word is in a read-only mapping, which is allowed for
+		// waiting; the mapping is shared, so the private flag is not used
+		err = syscall(SYS_futex, &segment->sequence, FUTEX_WAIT_BITSET, cur,
+			timeout >= 0 ? &deadline : NULL, NULL, FUTEX_BITSET_MATCH_ANY);
+
+		if (err && errno == ETIMEDOUT)
+			return ETIMEDOUT;
+	}
+}
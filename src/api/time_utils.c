@@ -24,13 +24,42 @@ void time_add_ms(struct timespec *t, int ms)
 {
 	t->tv_sec += ms/1000;
 	t->tv_nsec += (ms%1000)*1000000;
-	if (t->tv_nsec > 1000000000)
+	if (t->tv_nsec >= 1000000000)
 	{
 		t->tv_nsec -= 1000000000;
 		t->tv_sec += 1;
 	}
 }
 
+void time_add_ns(struct timespec *t, int64_t ns)
+{
+	t->tv_sec += ns / TIME_NS_PER_S;
+	t->tv_nsec += ns % TIME_NS_PER_S;
+	if (t->tv_nsec >= TIME_NS_PER_S)
+	{
+		t->tv_nsec -= TIME_NS_PER_S;
+		t->tv_sec += 1;
+	}
+	else if (t->tv_nsec < 0)
+	{
+		t->tv_nsec += TIME_NS_PER_S;
+		t->tv_sec -= 1;
+	}
+}
+
+int64_t time_to_ns(struct timespec t)
+{
+	return t.tv_sec * TIME_NS_PER_S + t.tv_nsec;
+}
+
+struct timespec time_from_ns(int64_t ns)
+{
+struct timespec t = { .tv_sec = 0, .tv_nsec = 0 };
+
+	time_add_ns(&t, ns);
+	return t;
+}
+
 int time_cmp(struct timespec t1, struct timespec t2)
 {
 	if (t1.tv_sec > t2.tv_sec) return 1;
@@ -40,6 +69,11 @@ int time_cmp(struct timespec t1, struct timespec t2)
 	return 0;
 }
 
+int64_t time_diff_ns(struct timespec t2, struct timespec t1)
+{
+	return (t2.tv_sec - t1.tv_sec) * TIME_NS_PER_S + (t2.tv_nsec - t1.tv_nsec);
+}
+
 int time_diff(struct timespec *tdest, struct timespec t2, struct timespec t1)
 {
 	if (time_cmp(t2, t1) < 0)
@@ -50,7 +84,7 @@ int time_diff(struct timespec *tdest, struct timespec t2, struct timespec t1)
 
 	if (tdest->tv_nsec < 0)
 	{
-		tdest->tv_nsec = 1000000000 - tdest->tv_nsec;
+		tdest->tv_nsec += 1000000000;
 		tdest->tv_sec -= 1;
 	}
 
@@ -0,0 +1,324 @@
+/**
+ * @file trace.c
+ * @brief Per-thread event traces exported as Chrome trace events
+ *
+ * For actual documentation, chechout the corresponding header file,
+ * api/trace.h.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "api/time_utils.h"
+#include "api/trace.h"
+
+//-------------------------------------------------------------
+// PRIVATE DATA TYPES
+//-------------------------------------------------------------
+
+/**
+ * A recorded event, phases are the ones of the Chrome trace-event format.
+ */
+typedef struct __TRACE_EVENT
+{
+	int64_t		ts;				///< Time of the event (in ns)
+	const char*	name;			///< Name of the event
+	double		value;			///< Value of counters and instant events
+	int			id;				///< Identifier of the traced object
+	char		phase;			///< 'B', 'E', 'i' or 'C'
+} _trace_event_t;
+
+/**
+ * The ring of a thread.
+ */
+typedef struct __TRACE_RING
+{
+	char			name[TRACE_NAME_SIZE];
+									///< Name of the thread
+	int				tid;			///< Kernel id of the last owner thread
+	bool			in_use;			///< True while its thread is running
+	atomic_uint		head;			///< Number of events recorded so far
+	_trace_event_t	events[TRACE_RING_SIZE];
+									///< The last recorded events
+} _trace_ring_t;
+
+//-------------------------------------------------------------
+// GLOBAL PRIVATE VARIABLES
+//-------------------------------------------------------------
+
+static atomic_bool _enabled;		///< True if recording is enabled
+
+static trace_clock_t *_clock = NULL;///< Clock of the events, NULL to use
+									///< CLOCK_MONOTONIC
+
+static _trace_ring_t *_rings[TRACE_MAX_RINGS];
+									///< All the allocated rings
+static int _nrings = 0;				///< Number of allocated rings
+static pthread_mutex_t _rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+									///< Protects the allocation of rings
+
+static __thread _trace_ring_t *_ring;
+									///< The ring of the calling thread
+
+static pthread_key_t _exit_key;		///< Releases the ring of a thread when it
+									///< terminates
+static pthread_once_t _exit_once = PTHREAD_ONCE_INIT;
+
+//-------------------------------------------------------------
+// PRIVATE FUNCTIONS
+//-------------------------------------------------------------
+
+/**
+ * Releases the ring of the calling thread when it terminates, so that it can
+ * be reused by a new thread with the same name.
+ */
+static void _trace_thread_exit(void *ring)
+{
+	pthread_mutex_lock(&_rings_mutex);
+	((_trace_ring_t *) ring)->in_use = false;
+	pthread_mutex_unlock(&_rings_mutex);
+}
+
+/**
+ * Creates the key used to release rings.
+ */
+static void _trace_init_exit_key()
+{
+	pthread_key_create(&_exit_key, _trace_thread_exit);
+}
+
+/**
+ * Records an event in the ring of the calling thread, if any.
+ */
+static inline void _trace_record(char phase, const char *name, int id,
+	double value, const struct timespec *t)
+{
+_trace_ring_t*	ring = _ring;
+_trace_event_t*	event;
+struct timespec	now;
+unsigned int	head;
+
+	if (ring == NULL || !atomic_load_explicit(&_enabled, memory_order_relaxed))
+		return;
+
+	if (t == NULL && _clock != NULL)
+		_clock(&now);
+	else if (t == NULL)
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (t == NULL)
+		t = &now;
+
+	head	= atomic_load_explicit(&ring->head, memory_order_relaxed);
+	event	= &ring->events[head & (TRACE_RING_SIZE - 1)];
+
+	// The slot is overwritten only after the previous head is visible, so
+	// that trace_write can tell which copied events may be corrupted
+	atomic_thread_fence(memory_order_release);
+
+	event->ts		= time_to_ns(*t);
+	event->name		= name;
+	event->value	= value;
+	event->id		= id;
+	event->phase	= phase;
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Writes the given event of the given ring in the Chrome format.
+ */
+static inline void _trace_write_event(FILE *f, int pid,
+	const _trace_ring_t *ring, const _trace_event_t *event)
+{
+	fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+		"\"pid\":%d,\"tid\":%d,", event->name, event->phase,
+		event->ts / 1000., pid, ring->tid);
+
+	switch (event->phase)
+	{
+	case 'C':
+		fprintf(f, "\"args\":{\"%d\":%g}}", event->id, event->value);
+		break;
+	case 'i':
+		fprintf(f, "\"s\":\"t\",\"args\":{\"id\":%d,\"value\":%g}}",
+			event->id, event->value);
+		break;
+	default:
+		fprintf(f, "\"args\":{\"id\":%d}}", event->id);
+		break;
+	}
+}
+
+//-------------------------------------------------------------
+// PUBLIC FUNCTIONS
+//-------------------------------------------------------------
+
+void trace_enable()
+{
+	atomic_store(&_enabled, true);
+}
+
+bool trace_enabled()
+{
+	return atomic_load(&_enabled);
+}
+
+void trace_set_clock(trace_clock_t *clock)
+{
+	_clock = clock;
+}
+
+int trace_thread_register(const char *name)
+{
+_trace_ring_t*	ring = NULL;
+int				err = 0;
+int				i;
+
+	if (!trace_enabled() || _ring != NULL)
+		return 0;
+
+	pthread_once(&_exit_once, _trace_init_exit_key);
+	pthread_mutex_lock(&_rings_mutex);
+
+	for (i = 0; i < _nrings && ring == NULL; ++i)
+	{
+		if (!_rings[i]->in_use &&
+			strncmp(_rings[i]->name, name, TRACE_NAME_SIZE - 1) == 0)
+			ring = _rings[i];
+	}
+
+	if (ring == NULL && _nrings == TRACE_MAX_RINGS)
+		err = EAGAIN;
+	else if (ring == NULL)
+	{
+		ring = calloc(1, sizeof(_trace_ring_t));
+
+		if (ring == NULL)
+			err = ENOMEM;
+		else
+		{
+			strncpy(ring->name, name, TRACE_NAME_SIZE - 1);
+			atomic_init(&ring->head, 0);
+			_rings[_nrings++] = ring;
+		}
+	}
+
+	if (ring != NULL)
+	{
+		ring->tid		= syscall(SYS_gettid);
+		ring->in_use	= true;
+		_ring			= ring;
+		pthread_setspecific(_exit_key, ring);
+	}
+
+	pthread_mutex_unlock(&_rings_mutex);
+
+	return err;
+}
+
+void trace_begin(const char *name, int id)
+{
+	_trace_record('B', name, id, 0, NULL);
+}
+
+void trace_end(const char *name, int id)
+{
+	_trace_record('E', name, id, 0, NULL);
+}
+
+void trace_instant(const char *name, int id, double value)
+{
+	_trace_record('i', name, id, value, NULL);
+}
+
+void trace_instant_at(const char *name, int id, double value,
+	const struct timespec *t)
+{
+	_trace_record('i', name, id, value, t);
+}
+
+void trace_counter(const char *name, int id, double value)
+{
+	_trace_record('C', name, id, value, NULL);
+}
+
+int trace_write(const char *filename)
+{
+FILE*			f;
+_trace_ring_t*	ring;
+_trace_event_t*	events;		// Copy of the events of a ring
+unsigned int	head;
+unsigned int	last_head;	// Head of the ring after the copy
+unsigned int	first;		// The oldest event still in the ring
+unsigned int	j;
+int				pid = getpid();
+int				nrings;
+int				i;
+
+	events = malloc(TRACE_RING_SIZE * sizeof(_trace_event_t));
+	if (events == NULL)
+		return ENOMEM;
+
+	f = fopen(filename, "w");
+	if (f == NULL)
+	{
+		free(events);
+		return errno;
+	}
+
+	pthread_mutex_lock(&_rings_mutex);
+	nrings = _nrings;
+	pthread_mutex_unlock(&_rings_mutex);
+
+	// The first element is the name of the process, so that each following
+	// element can be preceded by a comma
+	fprintf(f, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\","
+		"\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pid,
+		program_invocation_short_name);
+
+	for (i = 0; i < nrings; ++i)
+	{
+		ring = _rings[i];
+
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, ring->tid,
+			ring->name);
+
+		head	= atomic_load_explicit(&ring->head, memory_order_acquire);
+		first	= head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		for (j = first; j != head; ++j)
+			events[j & (TRACE_RING_SIZE - 1)] =
+				ring->events[j & (TRACE_RING_SIZE - 1)];
+
+		// The thread may still be recording: events whose slot has been
+		// reused, or is being reused, during the copy are dropped
+		atomic_thread_fence(memory_order_acquire);
+		last_head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+		if (last_head - first >= TRACE_RING_SIZE)
+			first = last_head - TRACE_RING_SIZE + 1;
+
+		for (j = first; (int) (head - j) > 0; ++j)
+			_trace_write_event(f, pid, ring,
+				&events[j & (TRACE_RING_SIZE - 1)]);
+	}
+
+	free(events);
+
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f))
+		return errno;
+
+	return 0;
+}
@@ -23,9 +23,11 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <libgen.h>			// Used for basename
 #include <complex.h>		// Used for C99 standard complex numbers in fftw3
+#include <stdatomic.h>		// Used for the lock-free play requests queue
 
 #include <assert.h>			// Used in debug
 
@@ -38,11 +40,17 @@
 #include "api/std_emu.h"
 #include "api/time_utils.h"
 #include "api/ptask.h"
+#include "api/trace.h"
+#include "api/shm_cab.h"
 
 // Other modules
 #include "constants.h"
 #include "audio.h"
 #include "main.h"
+#include "midi.h"
+#include "synth.h"
+#include "sequencer.h"
+#include "qos.h"
 
 // -----------------------------------------------------------------------------
 //                           PRIVATE CONSTANTS
@@ -67,9 +75,9 @@
 								///< The maximum length of the audio file
 								///< base name
 
-#define COUNTDOWN_SECONDS	5
-								///< The number of seconds to wait before
-								///< recording an audio sample
+#define PLAY_QUEUE_SIZE		16
+								///< The maximum number of pending play
+								///< requests, it must be a power of two
 
 // -----------------------------------------------------------------------------
 //                           PRIVATE DATA TYPES
@@ -92,6 +100,11 @@ typedef struct __AUDIO_FILE_DESC_STRUCT
 
 	audio_pointer_t datap;		///< Pointer to the opened file
 	audio_type_t	type;		///< File type
+	midi_sequence_t	sequence;	///< Pre-parsed events, only for MIDI files
+#ifdef AUDIO_MIDI_ALSA_SEQ
+	sequencer_phrase_t phrase;	///< Precompiled sequencer events, only for
+								///< MIDI files
+#endif
 	int				volume;		///< Volume used when playing this file
 	int				panning;	///< Panning used when playing this file
 	int				frequency;	///< Frequency used when playing this file,
@@ -103,6 +116,10 @@ typedef struct __AUDIO_FILE_DESC_STRUCT
 								///< recorded audio that can be recognized to
 								///< start it playing
 
+	bool			armed;		///< Tells if the recorded audio shall be
+								///< analyzed by analysis workers, see
+								///< audio_triggers_t
+
 	char 			filename[MAX_AUDIO_NAME_LENGTH];
 								///< Name of the file displayed on the screen,
 								///< contains only the basename, ellipsed if
@@ -111,6 +128,9 @@ typedef struct __AUDIO_FILE_DESC_STRUCT
 	double 			autocorr;	///< The cross correlation of the signal with
 								///< itself
 
+	int				onset;		///< Index of the first frame of the recorded
+								///< sample that belongs to the actual sound
+
 	short			recorded_sample[AUDIO_DESIRED_BUFFER_SIZE];
 								///< Contains the recorded sample by the user
 								///< to play the audio file whenever a sample
@@ -136,6 +156,15 @@ typedef struct __AUDIO_RECORD_STRUCT
 								///< ALSA Hardware Handle used to playback
 								///< recorded audio
 
+#ifdef AUDIO_CAPTURE_FILE
+	FILE*				capture_file;
+								///< File read in place of the microphone
+	struct timespec		capture_start;
+								///< Time of the last prepare
+	int64_t				capture_read;
+								///< Frames read since the last prepare
+#endif
+
 #ifdef AUDIO_APERIODIC
 	snd_pcm_uframes_t	avail;	///< The number of available frames to be read
 								///< in the capture buffer
@@ -153,6 +182,11 @@ typedef struct __AUDIO_RECORD_STRUCT
 								///< Buffers used within the cab
 
 	ptask_cab_t			cab;	///< CAB used to handle allocated buffers
+
+#ifdef AUDIO_SHM_PUBLISH
+	shm_cab_t			shm;	///< Shared CAB on which captures are
+								///< published for other processes
+#endif
 } audio_record_t;
 
 /**
@@ -161,12 +195,33 @@ typedef struct __AUDIO_RECORD_STRUCT
  */
 typedef struct __FFT_OUTPUT
 {
-	double	autocorr;			///< The autocorrelation of the given sample
+	bool	active;				///< False if the gate was closed, the sample
+								///< cannot match any recorded one then (see
+								///< AUDIO_GATE)
+	double	autocorr;			///< The autocorrelation of the given sample,
+								///< computed only if active
+	struct timespec capture_end;///< Capture time of the last frame of the
+								///< given sample
 	double	fft[AUDIO_DESIRED_PADBUFFER_SIZE];
 								///< The FFT of the given sample, its format is
 								///< Halfcomplex-formatted FFT
 } fft_output_t;
 
+#ifdef AUDIO_GATE
+/// State of the gate applied to published FFTs, used by the microphone task
+/// only
+typedef struct __AUDIO_GATE_STRUCT
+{
+	double	noise_floor;		///< Running RMS of the windows with the gate
+								///< closed, zero before the first window
+	double	mean_flux;			///< Running mean of the spectral flux
+	int64_t	open_until;			///< Capture time (in ns) until which the gate
+								///< stays open after the last onset
+	double	magnitudes[AUDIO_DESIRED_HALFCOMPLEX];
+								///< Magnitudes of the previous FFT
+} audio_gate_t;
+#endif
+
 /// Status of the resources used to perform fft
 typedef struct __AUDIO_FFT_STRUCT
 {
@@ -185,6 +240,14 @@ typedef struct __AUDIO_FFT_STRUCT
 
 	ptask_cab_t			cab;	///< CAB used to handle allocated buffers
 
+#ifdef AUDIO_GATE
+	audio_gate_t		gate;	///< Gate applied to published FFTs
+#endif
+
+#ifdef AUDIO_SHM_PUBLISH
+	shm_cab_t			shm;	///< Shared CAB on which FFTs are published
+								///< for other processes
+#endif
 } audio_fft_t;
 
 /// Structure that contains a cab used by the correlation_non_normalized()
@@ -196,6 +259,96 @@ typedef struct __AUDIO_ANALYSIS_STRUCT
 	ptask_cab_t cab;			///< The CAB is used as a buffer pool
 } audio_analysis_t;
 
+/// A request to play an audio file, issued by any task and served by the
+/// playback task
+typedef struct __AUDIO_PLAY_REQUEST_STRUCT
+{
+	int				filenum;	///< Index of the file to be played
+	double			score;		///< The correlation value that triggered the
+								///< request, 1 for manual requests
+	struct timespec	timestamp;	///< Time at which the request was issued
+	struct timespec	start;		///< Time at which the sound should start, if
+								///< it is served later the beginning of the
+								///< sound is skipped
+} audio_play_request_t;
+
+/// A single slot of the play requests queue
+typedef struct __AUDIO_PLAY_CELL_STRUCT
+{
+	atomic_size_t			sequence;
+								///< The position in the queue that is allowed
+								///< to use this cell next, see
+								///< play_queue_push() and play_queue_pop()
+	audio_play_request_t	request;
+								///< The stored request
+} audio_play_cell_t;
+
+/**
+ * Bounded multi-producer single-consumer lock-free queue of play requests.
+ * Producers never block: if the queue is full the request is dropped.
+ */
+typedef struct __AUDIO_PLAY_QUEUE_STRUCT
+{
+	audio_play_cell_t	cells[PLAY_QUEUE_SIZE];
+								///< The circular array of cells
+
+	atomic_size_t		tail;	///< Next position that will be reserved by a
+								///< producer
+	size_t				head;	///< Next position that will be consumed,
+								///< accessed by the playback task only
+
+	atomic_long			dropped;///< Number of requests dropped because the
+								///< queue was full
+
+	long				served;	///< Number of requests served so far, accessed
+								///< by the playback task only
+	long				max_late_us;
+								///< Maximum time elapsed between the
+								///< requested start time of a sound and the
+								///< moment it has been handed to Allegro,
+								///< which is skipped into samples; the latency
+								///< of the mixer is not included. Accessed by
+								///< the playback task only
+} audio_play_queue_t;
+
+/// An entry of the triggers registry, associated with the opened audio file
+/// with the same index
+typedef struct __AUDIO_TRIGGER_STRUCT
+{
+	_Atomic(const audio_file_desc_t *) file;
+								///< The file whose recorded sample is matched
+								///< against the input, NULL if the trigger is
+								///< not armed
+	atomic_llong		mute_until;
+								///< Time (in ns, CLOCK_MONOTONIC) before which
+								///< the trigger is not analyzed again
+} audio_trigger_t;
+
+/**
+ * Lock-free registry of the armed triggers, scanned by the analysis workers at
+ * the beginning of each FFT without taking any lock; changes are thus picked up
+ * at the next FFT, without restarting any task.
+ *
+ * Each worker has an epoch counter, which is odd while the worker is using
+ * the registry entries. Writers that want to modify the recorded sample of a
+ * file first retract its entry, then wait for a grace period: once each odd
+ * counter has changed, no worker can reference the retracted entry anymore.
+ * Writers are serialized by the mutex of the module, and they sleep during the
+ * grace period, since a worker demoted by its budget may need an idle CPU to
+ * close its epoch; workers wake them only if some writer is waiting.
+ */
+typedef struct __AUDIO_TRIGGERS_STRUCT
+{
+	audio_trigger_t		entries[AUDIO_MAX_FILES];
+								///< One entry for each opened file
+	atomic_uint			epochs[TASK_ALS_NUM];
+								///< Epoch counter of each analysis worker
+	atomic_int			waiting;///< Number of writers in a grace period
+	ptask_mutex_t		mutex;	///< Protects the wait of writers
+	ptask_cond_t		closed;	///< Signaled when an epoch is closed while
+								///< some writer is waiting
+} audio_triggers_t;
+
 /// Global state of the module
 typedef struct __AUDIO_STRUCT
 {
@@ -216,8 +369,19 @@ typedef struct __AUDIO_STRUCT
 	audio_analysis_t	analysis;///< Contains all the data needed to perform
 								///< analysis of FFTs
 
+	audio_play_queue_t	play_queue;
+								///< Requests that shall be served by the
+								///< playback task
+
+	audio_triggers_t	triggers;
+								///< Triggers analyzed by analysis workers
+
 	ptask_mutex_t		mutex;	///< Protrects access to opened files attributes
 								///< in multithreaded environment.
+
+	bool				headless;
+								///< Tells if no sound is played, see
+								///< audio_init_headless()
 } audio_state_t;
 
 
@@ -226,10 +390,15 @@ const audio_file_desc_t audio_file_new =
 {
 	.datap		= { .gen_p = NULL },
 	.type		= AUDIO_TYPE_SAMPLE,
+	.sequence	= { .events = NULL, .num_events = 0, .duration = 0 },
+#ifdef AUDIO_MIDI_ALSA_SEQ
+	.phrase		= { .events = NULL, .num_events = 0 },
+#endif
 	.volume		= MAX_VOL,
 	.panning	= MID_PAN,
 	.frequency	= SAME_FRQ,
 	.has_rec	= false,
+	.armed		= true,
 	// .loop		= false,
 	.filename	= "",
 };
@@ -242,6 +411,7 @@ const audio_file_desc_t audio_file_new =
 static audio_state_t audio_state =
 {
 	.audio_files_opened = 0,
+	.headless			= false,
 };
 
 // -----------------------------------------------------------------------------
@@ -409,19 +579,27 @@ int last_idx;	// The index of the last element (which is a pure real value)
 }
 
 /**
- * Returns the maximum value among the values in v.
+ * Returns the maximum value among the values in v, storing its index in
+ * argmax if not NULL.
  */
-static inline double max(double *v, size_t n)
+static inline double max(double *v, size_t n, int *argmax)
 {
 size_t i;
 double m = v[0];	// The current max
+size_t m_idx = 0;	// The index of the current max
 
 	for (i = 1; i < n; ++i)
 	{
 		if (m < v[i])
-			m = v[i];
+		{
+			m		= v[i];
+			m_idx	= i;
+		}
 	}
 
+	if (argmax != NULL)
+		*argmax = m_idx;
+
 	return m;
 }
 
@@ -429,9 +607,11 @@ double m = v[0];	// The current max
  * Computes the non-normalized correlation value between the two given FFTs.
  * This can be used to calculate the auto-correlatino of a fft with itself,
  * since first_fft and second_fft can be the same vector.
+ * If lag is not NULL, it is set to the lag of the correlation peak: frame n of
+ * the second signal matches frame n + lag of the first one.
  */
 static inline double correlation_non_normalized(
-	const double *first_fft, const double *second_fft)
+	const double *first_fft, const double *second_fft, int *lag)
 {
 double*			buffer;
 ptask_cab_id_t	index;
@@ -445,10 +625,14 @@ ptask_cab_id_t	index;
 
 	cross_correlation(buffer, first_fft, second_fft);
 
-	double correlation_value = max(buffer, audio_state.fft.rframes);
+	double correlation_value = max(buffer, audio_state.fft.rframes, lag);
 
 	ptask_cab_unget(&audio_state.analysis.cab, index);
 
+	// The correlation is circular, so lags in the second half are negative
+	if (lag != NULL && *lag > STATIC_CAST(int, audio_state.fft.rframes / 2))
+		*lag -= audio_state.fft.rframes;
+
 	return correlation_value;
 }
 
@@ -459,24 +643,131 @@ ptask_cab_id_t	index;
  */
 static inline double correlation_normalized(
 	const double *first_fft, const double *second_fft,
-	double first_autocorr, double second_autocorr)
+	double first_autocorr, double second_autocorr, int *lag)
 {
 double unnormalized;	// The non normalized correlation between the two FFTs
 
-	unnormalized = correlation_non_normalized(first_fft, second_fft);
+	unnormalized = correlation_non_normalized(first_fft, second_fft, lag);
 	return (unnormalized * unnormalized) / (first_autocorr * second_autocorr);
 }
 
+#ifdef AUDIO_SHM_PUBLISH
+
+/**
+ * Copies the given message into a new buffer of the given shared CAB. Messages
+ * are dropped if the CAB has no free buffer, which cannot happen if it has a
+ * single writer.
+ */
+static inline void shm_publish(shm_cab_t *cab, const void *message,
+	size_t size)
+{
+void*	buffer;
+int		b_id;
+
+	if (shm_cab_reserve(cab, &buffer, &b_id))
+		return;
+
+	memcpy(buffer, message, size);
+	shm_cab_putmes(cab, b_id);
+}
+
+/**
+ * Creates the shared CABs on which captures and FFTs are published.
+ */
+static inline int install_shm()
+{
+int err;
+
+	err = shm_cab_create(&audio_state.record.shm, AUDIO_SHM_RECORD_NAME,
+		AUDIO_REC_NUM_BUFFERS, sizeof(audio_state.record.buffers[0]));
+	if (err) return err;
+
+	err = shm_cab_create(&audio_state.fft.shm, AUDIO_SHM_FFT_NAME,
+		AUDIO_FFT_NUM_BUFFERS, sizeof(fft_output_t));
+	if (err)
+		shm_cab_close(&audio_state.record.shm);
+
+	return err;
+}
+
+#endif
+
+#ifdef AUDIO_GATE
+/**
+ * Returns true if the gate is open for the given window, whose FFT is given
+ * too, and updates the state of the gate, see AUDIO_GATE. It costs a pass over
+ * the window and one over the FFT, much less than a correlation.
+ */
+static inline bool gate_update(const short *audio_buffer,
+	const double *fft_buffer, struct timespec capture_end)
+{
+audio_gate_t*	gate = &audio_state.fft.gate;
+int				n = audio_state.fft.rframes;	// Length of the FFT
+int				bins = AUDIO_FRAMES_TO_HALFCOMPLEX(n);
+int64_t			end = time_to_ns(capture_end);
+double			rms = 0.;		// RMS of the window
+double			flux = 0.;		// Spectral flux since the previous window
+double			magnitude;
+bool			onset;
+int				i;
+
+	for (i = 0; i < STATIC_CAST(int, audio_state.record.rframes); ++i)
+		rms += STATIC_CAST(double, audio_buffer[i]) * audio_buffer[i];
+
+	rms = sqrt(rms / audio_state.record.rframes);
+
+	// Only the magnitudes that increased count, so that the decay of a sound
+	// is not an onset. See video.c for the halfcomplex notation
+	for (i = 1; i <= bins; ++i)
+	{
+		magnitude = sqrt(fft_buffer[i] * fft_buffer[i] +
+			fft_buffer[n-i] * fft_buffer[n-i]);
+
+		if (magnitude > gate->magnitudes[i-1])
+			flux += magnitude - gate->magnitudes[i-1];
+
+		gate->magnitudes[i-1] = magnitude;
+	}
+
+	// The first window only initializes the gate
+	onset = gate->noise_floor > 0. &&
+		rms > AUDIO_GATE_SNR * gate->noise_floor &&
+		flux > AUDIO_GATE_FLUX * gate->mean_flux;
+
+	gate->mean_flux += (flux - gate->mean_flux) * AUDIO_GATE_FLUX_WEIGHT;
+
+	// An onset is analyzed until its frames leave the window
+	if (onset)
+		gate->open_until = end + FRAMES_TO_NS(audio_state.record.rframes,
+			audio_state.record.rrate);
+
+	if (rms < gate->noise_floor || gate->noise_floor == 0.)
+		gate->noise_floor = rms;
+	else if (end >= gate->open_until)
+		gate->noise_floor += (rms - gate->noise_floor) * AUDIO_GATE_RISE;
+
+	if (gate->noise_floor < AUDIO_GATE_MIN_RMS)
+		gate->noise_floor = AUDIO_GATE_MIN_RMS;
+
+	return end < gate->open_until;
+}
+#endif
+
 /**
  * Computes and publishes the fft of the given audio_buffer, reserving a buffer
- * from the CAB and performing the autocorrelation of the given audio sample.
+ * from the CAB and performing the autocorrelation of the given audio sample if
+ * the gate is open for it (see AUDIO_GATE).
+ * The capture time of the last frame of the buffer is published with the FFT.
  */
-static inline void do_fft(const short *audio_buffer)
+static inline void do_fft(const short *audio_buffer,
+	struct timespec capture_end)
 {
 double*			fft_buffer;			// The buffer used to compute the FFT
 fft_output_t*	fft_pointer;		// The pointer to the structure in the CAB
 int				fft_pointer_index;	// The index of said structure in the CAB
 
+	trace_begin("fft", 0);
+
 	// Get buffer on which operate
 	ptask_cab_reserve(&audio_state.fft.cab,
 		STATIC_CAST(void **, &fft_pointer),
@@ -496,45 +787,62 @@ int				fft_pointer_index;	// The index of said structure in the CAB
 	// FFT, it should be changed to a full array of magniutes to be
 	// printed.
 
-	// Calculate at the same time the autocorrelation of the FFT
-	fft_pointer->autocorr = correlation_non_normalized(
-		fft_buffer,
-		fft_buffer
-	);
+#ifdef AUDIO_GATE
+	fft_pointer->active = gate_update(audio_buffer, fft_buffer, capture_end);
+#else
+	fft_pointer->active = true;
+#endif
+
+	trace_counter("gate", 0, fft_pointer->active);
+
+	// Calculate at the same time the autocorrelation of the FFT, which is
+	// needed only to analyze it
+	if (fft_pointer->active)
+		fft_pointer->autocorr = correlation_non_normalized(
+			fft_buffer,
+			fft_buffer,
+			NULL
+		);
+	else
+		fft_pointer->autocorr = 0.;
+
+	fft_pointer->capture_end = capture_end;
+
+#ifdef AUDIO_SHM_PUBLISH
+	// Other processes get their own copies, so that they never hold buffers
+	// of the local CABs
+	shm_publish(&audio_state.record.shm, audio_buffer,
+		sizeof(short) * audio_state.record.rframes);
+	shm_publish(&audio_state.fft.shm, fft_pointer, sizeof(fft_output_t));
+#endif
+
+	// In simulations the window is published once its cost has been consumed
+	ptask_sim_consume(TASK_MIC_COST * 1000LL);
 
 	// Publish new FFT
 	ptask_cab_putmes(&audio_state.fft.cab, fft_pointer_index);
+
+	trace_end("fft", 0);
 }
 
 
 /**
  * Waits for a specified amount of ms.
- * If interrupted the wait is resumed with the remaining time, thus this
- * function always waits for the specified amount of ms.
+ * If interrupted the wait is resumed until the deadline, thus this function
+ * always waits for the specified amount of ms (of the clock of the tasks, see
+ * ptask_clock_gettime).
  */
 static inline void timed_wait(int ms)
 {
-int s = 0;
+struct timespec t;
 
 	if (ms < 1)
 		return;
 
-	if (ms >= 1000)
-	{
-		s	= ms / 1000;
-		ms	= ms % 1000;
-	}
+	ptask_clock_gettime(&t);
+	time_add_ms(&t, ms);
 
-	const struct timespec req = {
-		.tv_sec		= s,
-		.tv_nsec	= ms * 1000000L,
-	};
-
-	// The nanosleep updates req with the remaining time if interrupted, thus
-	// even if interrupted the call waits always for the given amount of ms
-	// before terminating.
-	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &req, NULL))
-		;
+	ptask_sleep_until(&t);
 }
 
 /**
@@ -553,6 +861,30 @@ static inline void wait_seconds_print(int nseconds)
 	printf("!\r\n");
 }
 
+/**
+ * Returns the index of the first frame of the given recorded sample whose
+ * amplitude reaches AUDIO_ONSET_RATIO times the peak amplitude of the sample.
+ */
+static inline int find_onset(const short *sample)
+{
+unsigned int	i;
+int				peak = 0;	// Peak absolute amplitude
+
+	for (i = 0; i < audio_state.record.rframes; ++i)
+	{
+		if (abs(sample[i]) > peak)
+			peak = abs(sample[i]);
+	}
+
+	for (i = 0; i < audio_state.record.rframes; ++i)
+	{
+		if (abs(sample[i]) >= AUDIO_ONSET_RATIO * peak)
+			break;
+	}
+
+	return i;
+}
+
 /**
  * Copy file descriptor src into dest. Use this instead of simple assignment
  * operator to skip copying unnecessary buffers.
@@ -569,10 +901,15 @@ static inline void audio_file_copy(
 		// I can skip copying the big arrays
 		dest->datap		= src->datap;
 		dest->type		= src->type;
+		dest->sequence	= src->sequence;
+#ifdef AUDIO_MIDI_ALSA_SEQ
+		dest->phrase	= src->phrase;
+#endif
 		dest->volume	= src->volume;
 		dest->panning	= src->panning;
 		dest->frequency	= src->frequency;
 		dest->has_rec	= src->has_rec;
+		dest->armed		= src->armed;
 		strcpy(dest->filename, src->filename);
 	}
 }
@@ -742,6 +1079,27 @@ int install_alsa_playback(snd_pcm_t **playback_handle_ptr,
 		SND_PCM_STREAM_PLAYBACK, 0);
 }
 
+#ifdef AUDIO_CAPTURE_FILE
+/**
+ * Opens the file read in place of the microphone, no ALSA handle is used to
+ * record. Returns zero on success, the errno value of the failing call
+ * otherwise.
+ */
+static inline int install_capture_file(snd_pcm_t **record_handle_ptr)
+{
+	audio_state.record.capture_file = fopen(AUDIO_CAPTURE_FILE, "rb");
+	if (audio_state.record.capture_file == NULL)
+	{
+		print_log(LOG_VERBOSE, "Failed to open %s.\r\n", AUDIO_CAPTURE_FILE);
+		return errno;
+	}
+
+	*record_handle_ptr = NULL;
+
+	return 0;
+}
+#endif
+
 /**
  * Initializes both Allegro sound and ALSA library to record
  */
@@ -755,19 +1113,44 @@ int index;
 void *cab_pointers[AUDIO_REC_NUM_BUFFERS];
 								// Pointers to buffers used in cab library
 
-	// Allegro sound initialization
-	// MIDI files do not work, consider enabling MIDI_AUTODETECT and
-	// implement MIDI files support
-	err = install_sound(DIGI_AUTODETECT, MIDI_NONE, NULL);
-	if (err) return err;
+	// Headless runs play nothing, hence they need no sound output at all
+	if (!audio_state.headless)
+	{
+		// Allegro sound initialization, MIDI files are rendered by the
+		// built-in synthesizer, hence no MIDI driver is needed
+		err = install_sound(DIGI_AUTODETECT, MIDI_NONE, NULL);
+		if (err) return err;
+
+#ifdef AUDIO_MIDI_ALSA_SEQ
+		// MIDI files are sent to external synthesizers
+		err = sequencer_init();
+		if (err) return err;
+#else
+		// Synthesizer initialization, it renders at the digital driver rate
+		err = synth_init(get_mixer_frequency());
+		if (err) return err;
+#endif
+	}
 
+#ifdef AUDIO_CAPTURE_FILE
+	// The file replaces the microphone, at the desired rate and period
+	err = install_capture_file(record_handle_ptr);
+	if (err) return err;
+#else
 	// Initialization of ALSA recorder
 	err = install_alsa_recorder(record_handle_ptr, rrate_ptr, rframes_ptr);
 	if (err) return err;
+#endif
 
 	// Initialization of ALSA playback
-	err = install_alsa_playback(playback_handle_ptr, rrate_ptr, rframes_ptr);
-	if (err) return err;
+	if (audio_state.headless)
+		*playback_handle_ptr = NULL;
+	else
+	{
+		err = install_alsa_playback(playback_handle_ptr, rrate_ptr,
+			rframes_ptr);
+		if (err) return err;
+	}
 
 	// Construction of CAB pointers for audio buffers
 	for (index = 0; index < AUDIO_REC_NUM_BUFFERS; ++index)
@@ -893,6 +1276,78 @@ void*	cab_pointers[AUDIO_FFT_NUM_BUFFERS];
 	return err;
 }
 
+#ifdef AUDIO_CAPTURE_FILE
+
+/**
+ * Returns the number of frames of the capture file that are available to be
+ * read, i.e. the ones captured since the last prepare and not read yet.
+ */
+static inline int64_t mic_avail()
+{
+struct timespec now;
+
+	ptask_clock_gettime(&now);
+
+	return time_diff_ns(now, audio_state.record.capture_start) *
+		audio_state.record.rrate / 1000000000LL - audio_state.record.capture_read;
+}
+
+/**
+ * Prepares the capture file to be read: frames become available from now on.
+ * Returns 0.
+ */
+static inline int mic_prepare()
+{
+	ptask_clock_gettime(&audio_state.record.capture_start);
+	audio_state.record.capture_read = 0;
+
+	return 0;
+}
+
+/**
+ * Reads the available frames of the capture file, up to nframes, rewinding it
+ * at its end. Returns the number of read frames, -EAGAIN if there were no
+ * frame to read and -EIO on error or if the file is empty.
+ */
+static inline int mic_read(short* buffer, const int nframes)
+{
+FILE*	f = audio_state.record.capture_file;
+int64_t	avail = mic_avail();
+int		n;					// Frames to be read
+int		done = 0;			// Frames read so far
+size_t	got;
+bool	rewound = false;	// True if nothing was read since the last rewind
+
+	if (avail <= 0)
+		return -EAGAIN;
+
+	n = avail < nframes ? avail : nframes;
+
+	while (done < n)
+	{
+		got = fread(buffer + done, sizeof(short), n - done, f);
+
+		if (got == 0 && (rewound || ferror(f)))
+			return -EIO;
+
+		if (got == 0)
+		{
+			rewind(f);
+			rewound = true;
+		}
+		else
+			rewound = false;
+
+		done += got;
+	}
+
+	audio_state.record.capture_read += n;
+
+	return n;
+}
+
+#else
+
 /**
  * Prepares the microphone to record. Returns 0 on success, less than zero on
  * error.
@@ -925,6 +1380,8 @@ int err;
 	return err;
 }
 
+#endif
+
 /**
  * Reads microphone data if available, blocking until the number of frames that
  * is requested is not available yet.
@@ -1027,7 +1484,11 @@ int missing = nframes;	// How many frames are still missing
  */
 static inline int mic_stop()
 {
+#ifdef AUDIO_CAPTURE_FILE
+	return 0;
+#else
 	return snd_pcm_drop(audio_state.record.record_handle);
+#endif
 }
 
 #ifdef AUDIO_APERIODIC
@@ -1045,7 +1506,11 @@ static inline void mic_update_avail()
 snd_pcm_sframes_t avail;// The number of available frames to be read in the
 						// capture buffer
 
+#ifdef AUDIO_CAPTURE_FILE
+	avail = mic_avail();
+#else
 	avail = snd_pcm_avail_update(audio_state.record.record_handle);
+#endif
 
 	if (avail < 0)
 		avail = 0;
@@ -1175,101 +1640,652 @@ int err;
 	return 0;
 }
 
+/**
+ * Returns the capture time of the last frame read from the microphone, which
+ * is estimated from the number of frames that have been captured but not read
+ * yet. It shall be called right after a read.
+ */
+static inline struct timespec mic_capture_time()
+{
+struct timespec		t;
+snd_pcm_sframes_t	delay;	// Frames captured and not read yet
 
-//@}
-
-// -----------------------------------------------------------------------------
-//                           PUBLIC FUNCTIONS
-// -----------------------------------------------------------------------------
+	ptask_clock_gettime(&t);
 
-// See the header file for documentation
+#ifdef AUDIO_CAPTURE_FILE
+	delay = mic_avail();
+	if (delay > 0)
+#else
+	if (snd_pcm_delay(audio_state.record.record_handle, &delay) == 0 &&
+		delay > 0)
+#endif
+	{
+		time_add_ns(&t, -STATIC_CAST(int64_t, delay) * TIME_NS_PER_S /
+			audio_state.record.rrate);
+	}
 
-/* ------- UNSAFE FUNCTIONS - CALL ONLY IN SINGLE THREAD ENVIRONMENT -------- */
+	return t;
+}
 
-int audio_init()
+/**
+ * Returns the capture time of a tap detected in the given FFT window, given
+ * the onset of the recorded sample that matched and the lag of the peak of
+ * their correlation.
+ */
+static inline struct timespec tap_capture_time(const fft_output_t *fft_ptr,
+	int onset, int lag)
 {
-int err;
-
-unsigned int		rrate;		// Recording acquisition ratio, as accepted by
-								// the device
-snd_pcm_uframes_t	rframes;	// Period requested to recorder task, expressed
-								// in terms of number of frames
-snd_pcm_t*			record_handle;	// ALSA Hardware Handle used to record audio
-snd_pcm_t*			playback_handle;// ALSA Hardware Handle used to playback
-									// recorded audio
-fftw_plan			fft_plan;	// The FFTW3 plan, which is the algorithm that will
-								// be used to calculate the FFT, optimized for
-								// the size of the recording buffer
-fftw_plan			fft_plan_inverse;
-								// The FFTW3 plan used to compute the inverse FFT
-
-	rrate	= AUDIO_DESIRED_RATE;
-	rframes	= AUDIO_DESIRED_FRAMES;
-
-	// Mutexes and condition variables initialization
-	err = ptask_mutex_init(&audio_state.mutex);
-	if (err) return err;
+struct timespec	t = fft_ptr->capture_end;
+long			frame;	// Position of the tap within the window
+long			last;	// Position of the last frame of the window
 
-#ifdef AUDIO_APERIODIC
-	err = ptask_mutex_init(&audio_state.record.availability_mutex);
-	if (err) return err;
+	last	= audio_state.record.rframes - 1;
+	frame	= onset - lag;
 
-	err = ptask_cond_init(&audio_state.record.availability_cond);
-	if (err) return err;
-#endif
+	if (frame < 0)
+		frame = 0;
+	else if (frame > last)
+		frame = last;
 
-	// Allegro and ALSA initialization
-	err = install_allegro_alsa_sound(&rrate, &rframes, &record_handle, &playback_handle);
-	if (err) return err;
+	time_add_ns(&t, -STATIC_CAST(int64_t, last - frame) * TIME_NS_PER_S /
+		audio_state.record.rrate);
 
-	// FFTW3 initialization
-	err = install_fftw(rframes, &fft_plan, &fft_plan_inverse);
-	if (err) return err;
+	return t;
+}
 
-	// Analysis data structures initialization
-	err = install_analysis();
-	if (err) return err;
+/**
+ * Initializes the play requests queue, so that each cell can be used by the
+ * position with the same index.
+ */
+static inline void play_queue_init()
+{
+size_t i;
 
-	// Copy local vales to global structures
-	audio_state.record.rrate			= rrate;
-	audio_state.record.rframes			= rframes;
-	audio_state.record.record_handle	= record_handle;
-	audio_state.record.playback_handle	= playback_handle;
+	for (i = 0; i < PLAY_QUEUE_SIZE; ++i)
+		atomic_init(&audio_state.play_queue.cells[i].sequence, i);
 
-	audio_state.fft.rrate			= rrate;
-	audio_state.fft.rframes			= AUDIO_ADD_PADDING(rframes);
-	audio_state.fft.plan			= fft_plan;
-	audio_state.fft.plan_inverse	= fft_plan_inverse;
+	atomic_init(&audio_state.play_queue.tail, 0);
+	atomic_init(&audio_state.play_queue.dropped, 0);
 
-	return 0;
+	audio_state.play_queue.head			= 0;
+	audio_state.play_queue.served		= 0;
+	audio_state.play_queue.max_late_us	= 0;
 }
 
-int audio_file_open(const char *filename)
+/**
+ * Inserts a new request in the play requests queue, it can be called by any
+ * number of concurrent tasks.
+ * Returns true on success, false if the queue is full.
+ */
+static inline bool play_queue_push(const audio_play_request_t *request)
 {
-audio_pointer_t	file_pointer;	// Pointer to the opened file
-audio_type_t	file_type;		// Detected file type
-int				index;			// Index of newly used audio file descriptor
-
-	if (audio_state.audio_files_opened >= AUDIO_MAX_FILES)
-		return EAGAIN;
-
-	index = audio_state.audio_files_opened;
+audio_play_queue_t*	queue = &audio_state.play_queue;
+audio_play_cell_t*	cell;
+size_t				pos;	// The position reserved by this producer
+long				diff;	// Tells if the cell is ready for this position
 
-	file_pointer.audio_p = load_sample(filename);
-	file_type = AUDIO_TYPE_SAMPLE;
+	pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
 
-	if (!file_pointer.gen_p)
+	for (;;)
 	{
-		// It was not an audio file, let's try if it was a MIDI istead
-		file_pointer.midi_p = load_midi(filename);
-		file_type = AUDIO_TYPE_MIDI;
-	}
+		cell = &queue->cells[pos & (PLAY_QUEUE_SIZE - 1)];
+		diff = STATIC_CAST(long,
+			atomic_load_explicit(&cell->sequence, memory_order_acquire) - pos);
+
+		if (diff == 0)
+		{
+			// The cell is free for this position, try to reserve it. On
+			// failure pos is updated with the current tail
+			if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos,
+					pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// The cell still contains a request that has not been consumed
+			// yet, hence the queue is full
+			return false;
+		}
+		else
+		{
+			// Another producer reserved this position in the meantime
+			pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+		}
+	}
+
+	cell->request = *request;
+
+	// Publish the request to the consumer
+	atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+	return true;
+}
+
+/**
+ * Extracts the oldest request from the play requests queue. It shall be called
+ * by the playback task only.
+ * Returns true if a request has been extracted, false if the queue is empty.
+ */
+static inline bool play_queue_pop(audio_play_request_t *request)
+{
+audio_play_queue_t*	queue = &audio_state.play_queue;
+audio_play_cell_t*	cell;
+size_t				pos = queue->head;
+
+	cell = &queue->cells[pos & (PLAY_QUEUE_SIZE - 1)];
+
+	if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + 1)
+		return false;
+
+	*request = cell->request;
+	queue->head = pos + 1;
+
+	// Give the cell back to producers, for the next round of the queue
+	atomic_store_explicit(&cell->sequence, pos + PLAY_QUEUE_SIZE,
+		memory_order_release);
+
+	return true;
+}
+
+/**
+ * Issues a request to play the given file at the given time.
+ * Returns zero on success, EAGAIN if the queue is full.
+ */
+static inline int play_request_push(int i, double score,
+	struct timespec start)
+{
+audio_play_request_t request;
+
+	request.filenum	= i;
+	request.score	= score;
+	request.start	= start;
+	ptask_clock_gettime(&request.timestamp);
+
+	if (!play_queue_push(&request))
+	{
+		atomic_fetch_add_explicit(&audio_state.play_queue.dropped, 1,
+			memory_order_relaxed);
+		return EAGAIN;
+	}
+
+	return 0;
+}
+
+/**
+ * Starts playing the given sample, skipping its first skip_us microseconds
+ * (scaled by the playing frequency). Nothing is played if the skipped part is
+ * longer than the sample itself.
+ * Returns zero on success, EINVAL if no voice can be allocated.
+ */
+static inline int sample_play_from(const SAMPLE *sample, int volume,
+	int panning, int frequency, long skip_us)
+{
+int		voice;
+long	position;	// The first played frame of the sample
+
+	position = skip_us * sample->freq / 1000L * frequency / 1000000L;
+
+	if (position >= STATIC_CAST(long, sample->len))
+		return 0;
+
+	voice = allocate_voice(sample);
+	if (voice < 0)
+		return EINVAL;
+
+	voice_set_volume(voice, volume);
+	voice_set_pan(voice, panning);
+	voice_set_frequency(voice, sample->freq * frequency / 1000);
+	voice_set_position(voice, position);
+	voice_start(voice);
+
+	// The voice is freed automatically when the sample ends
+	release_voice(voice);
+
+	return 0;
+}
+
+/**
+ * Plays the given file, skipping its first skip_us microseconds if it is a
+ * sample. MIDI files always start from the beginning.
+ */
+static inline int audio_file_play_from(int i, long skip_us)
+{
+int					err = 0;
+audio_file_desc_t	file;
+
+	// Nobody can modify in multithreaded environment the number of opened audio
+	// files
+	if (i >= 0 && i < audio_state.audio_files_opened)
+	{
+		ptask_mutex_lock(&audio_state.mutex);
+
+		// Copy file attributes in critical section (volume, panning, etc.)
+		file = audio_state.audio_files[i];
+
+		ptask_mutex_unlock(&audio_state.mutex);
+
+		switch (file.type)
+		{
+		case AUDIO_TYPE_SAMPLE:
+			err = sample_play_from(
+				file.datap.audio_p,
+				file.volume,
+				file.panning,
+				file.frequency,
+				skip_us
+				);
+
+			break;
+		case AUDIO_TYPE_MIDI:
+#ifdef AUDIO_MIDI_ALSA_SEQ
+			err = sequencer_play(
+				&file.phrase,
+				file.volume,
+				file.frequency
+				);
+
+			err = err < 0 ? EINVAL : 0;
+#else
+			err = synth_play(
+				&file.sequence,
+				file.volume,
+				file.panning,
+				file.frequency
+				);
+#endif
+
+			break;
+		default:
+			assert(false);
+			err = EINVAL;
+		}
+	}
+	else
+	{
+		err = EINVAL;
+	}
+
+	return err;
+}
+
+/**
+ * Serves a play request extracted from the queue, whose start time has already
+ * been reached, skipping into the sound by the time elapsed since then.
+ *
+ * NOTICE: the sound is actually heard only when Allegro mixes it in the next
+ * buffer of the digital sound driver; that latency is neither compensated nor
+ * measured, hence the measured lateness is only the one of the playback task.
+ */
+static inline void play_request_serve(const audio_play_request_t *request)
+{
+struct timespec	now;
+long			late_us;	// Time elapsed since the requested start
+
+	ptask_clock_gettime(&now);
+	late_us = STATIC_CAST(long, time_diff_ns(now, request->start) / 1000);
+
+	// Headless runs only measure when requests would have been played
+	if (!audio_state.headless)
+		audio_file_play_from(request->filenum, late_us);
+	trace_instant("play", request->filenum+1, late_us);
+
+	++audio_state.play_queue.served;
+	if (late_us > audio_state.play_queue.max_late_us)
+		audio_state.play_queue.max_late_us = late_us;
+
+	print_log(LOG_VERBOSE,
+		"TASK_PLY played file %d (score %f) %ld us after its start time, "
+		"%ld us after the request.\r\n",
+		request->filenum+1, request->score, late_us,
+		STATIC_CAST(long, time_diff_ns(now, request->timestamp) / 1000));
+}
+
+/**
+ * Updates the registry entry of the given file, which is armed only if the
+ * file is open, has a recorded sample and the user did not disarm it.
+ * The module mutex shall be held by the caller.
+ */
+static inline void triggers_publish(int i)
+{
+const audio_file_desc_t *file = NULL;
+
+	if (audio_file_is_open(i) && audio_state.audio_files[i].has_rec &&
+		audio_state.audio_files[i].armed)
+	{
+		file = &audio_state.audio_files[i];
+	}
+
+	atomic_store(&audio_state.triggers.entries[i].file, file);
+}
+
+/**
+ * Disarms the triggers of the files with index in [first, last) and waits until
+ * no analysis worker uses them anymore, so that the descriptors of said files
+ * can be modified.
+ * The module mutex shall be held by the caller.
+ */
+static inline void triggers_retract(int first, int last)
+{
+unsigned int	epochs[TASK_ALS_NUM];	// Epochs observed before waiting
+int				i;
+
+	for (i = first; i < last; ++i)
+		atomic_store(&audio_state.triggers.entries[i].file, NULL);
+
+	for (i = 0; i < TASK_ALS_NUM; ++i)
+		epochs[i] = atomic_load(&audio_state.triggers.epochs[i]);
+
+	// Workers check the counter of waiting writers after closing their epoch,
+	// so either they see it or the epoch is seen closed below
+	atomic_fetch_add(&audio_state.triggers.waiting, 1);
+	ptask_mutex_lock(&audio_state.triggers.mutex);
+
+	// Workers that were not using the registry will see the new entries
+	for (i = 0; i < TASK_ALS_NUM; ++i)
+	{
+		while ((epochs[i] & 1) &&
+			atomic_load(&audio_state.triggers.epochs[i]) == epochs[i])
+		{
+			ptask_cond_wait(&audio_state.triggers.closed,
+				&audio_state.triggers.mutex);
+		}
+	}
+
+	ptask_mutex_unlock(&audio_state.triggers.mutex);
+	atomic_fetch_sub(&audio_state.triggers.waiting, 1);
+}
+
+/**
+ * Closes the epoch of the given worker, waking up the writers waiting for it.
+ */
+static inline void triggers_epoch_close(atomic_uint *epoch)
+{
+	atomic_fetch_add(epoch, 1);
+
+	if (atomic_load(&audio_state.triggers.waiting) == 0)
+		return;
+
+	ptask_mutex_lock(&audio_state.triggers.mutex);
+	ptask_cond_broadcast(&audio_state.triggers.closed);
+	ptask_mutex_unlock(&audio_state.triggers.mutex);
+}
+
+/**
+ * Matches the given FFT against the recorded sample of the given file and, on
+ * success, requests the playback of said file. Each trigger is then muted for
+ * AUDIO_ANALYSIS_DELAY_MS to avoid analyzing too often the input.
+ */
+static inline void trigger_analyze(int file_index,
+	const audio_file_desc_t *file, const fft_output_t *fft_ptr,
+	struct timespec timestamp)
+{
+audio_trigger_t*	trigger = &audio_state.triggers.entries[file_index];
+double				correlation;	// The normalized correlation value
+int					lag;			// The lag of the correlation peak
+struct timespec		start;			// Time at which the triggered sound
+									// should start
+struct timespec		mute_until;
+
+	if (time_to_ns(timestamp) <= atomic_load_explicit(&trigger->mute_until,
+		memory_order_relaxed))
+	{
+		return;
+	}
+
+	correlation = correlation_normalized(
+		file->recorded_fft,
+		fft_ptr->fft,
+		file->autocorr,
+		fft_ptr->autocorr,
+		&lag
+	);
+
+	ptask_sim_consume(TASK_ALS_COST * 1000LL);
+
+	print_log(LOG_VERBOSE,
+		"TASK_ALS correlation with file %d is %f .\r\n",
+		file_index+1, correlation);
+
+	trace_counter("score", file_index+1, correlation);
+
+	if (fabs(correlation) > AUDIO_THRESHOLD)
+	{
+		// We request a new execution, without waiting for it. The sound shall
+		// start at a fixed latency from the tap, wherever it fell within the
+		// analyzed window
+		start = tap_capture_time(fft_ptr, file->onset, lag);
+		time_add_ms(&start, AUDIO_PLAY_LATENCY_MS);
+
+		play_request_push(file_index, correlation, start);
+		trace_instant("trigger", file_index+1, correlation);
+
+		mute_until = timestamp;
+		time_add_ms(&mute_until, AUDIO_ANALYSIS_DELAY_MS);
+
+		atomic_store_explicit(&trigger->mute_until,
+			time_to_ns(mute_until), memory_order_relaxed);
+	}
+}
+
+/**
+ * Marks temporarily the given file as without a recorded sample, waiting until
+ * no worker uses the previous one, so that it can be overwritten.
+ */
+static inline void sample_retract(int i)
+{
+	ptask_mutex_lock(&audio_state.mutex);
+	triggers_retract(i, i+1);
+	audio_state.audio_files[i].has_rec = false;
+	ptask_mutex_unlock(&audio_state.mutex);
+}
+
+/**
+ * Computes the FFT, the autocorrelation and the onset of the new recorded
+ * sample of the given file, retracted by sample_retract(), and arms it.
+ */
+static inline void sample_arm(int i)
+{
+	// Calculate the FFT of the signal once for later use
+	copy_buffer_with_padding(audio_state.audio_files[i].recorded_fft,
+		audio_state.audio_files[i].recorded_sample);
+
+	fft(audio_state.audio_files[i].recorded_fft);
+
+	// Calculate autocorrelation once for later use, defined as the
+	// cross-correlation with itself
+	audio_state.audio_files[i].autocorr = correlation_non_normalized(
+		audio_state.audio_files[i].recorded_fft,
+		audio_state.audio_files[i].recorded_fft,
+		NULL
+	);
+
+	// The onset is used to locate taps within the analyzed windows
+	audio_state.audio_files[i].onset =
+		find_onset(audio_state.audio_files[i].recorded_sample);
+
+	// A new recording is armed, even if the previous one was not
+	ptask_mutex_lock(&audio_state.mutex);
+	audio_state.audio_files[i].has_rec	= true;
+	audio_state.audio_files[i].armed	= true;
+	triggers_publish(i);
+	ptask_mutex_unlock(&audio_state.mutex);
+}
+
+//@}
+
+// -----------------------------------------------------------------------------
+//                           PUBLIC FUNCTIONS
+// -----------------------------------------------------------------------------
+
+// See the header file for documentation
+
+/* ------- UNSAFE FUNCTIONS - CALL ONLY IN SINGLE THREAD ENVIRONMENT -------- */
+
+int audio_init()
+{
+int err;
+
+unsigned int		rrate;		// Recording acquisition ratio, as accepted by
+								// the device
+snd_pcm_uframes_t	rframes;	// Period requested to recorder task, expressed
+								// in terms of number of frames
+snd_pcm_t*			record_handle;	// ALSA Hardware Handle used to record audio
+snd_pcm_t*			playback_handle;// ALSA Hardware Handle used to playback
+									// recorded audio
+fftw_plan			fft_plan;	// The FFTW3 plan, which is the algorithm that will
+								// be used to calculate the FFT, optimized for
+								// the size of the recording buffer
+fftw_plan			fft_plan_inverse;
+								// The FFTW3 plan used to compute the inverse FFT
+
+	rrate	= AUDIO_DESIRED_RATE;
+	rframes	= AUDIO_DESIRED_FRAMES;
+
+	// Mutexes and condition variables initialization
+	err = ptask_mutex_init(&audio_state.mutex);
+	if (err) return err;
+	ptask_mutex_set_name(&audio_state.mutex, "audio");
+
+#ifdef AUDIO_APERIODIC
+	err = ptask_mutex_init(&audio_state.record.availability_mutex);
+	if (err) return err;
+	ptask_mutex_set_name(&audio_state.record.availability_mutex,
+		"availability");
+
+	err = ptask_cond_init(&audio_state.record.availability_cond);
+	if (err) return err;
+#endif
+
+	err = ptask_mutex_init(&audio_state.triggers.mutex);
+	if (err) return err;
+	ptask_mutex_set_name(&audio_state.triggers.mutex, "triggers");
+
+	err = ptask_cond_init(&audio_state.triggers.closed);
+	if (err) return err;
+
+	// Allegro and ALSA initialization
+	err = install_allegro_alsa_sound(&rrate, &rframes, &record_handle, &playback_handle);
+	if (err) return err;
+
+	// FFTW3 initialization
+	err = install_fftw(rframes, &fft_plan, &fft_plan_inverse);
+	if (err) return err;
+
+	// Analysis data structures initialization
+	err = install_analysis();
+	if (err) return err;
+
+	// Play requests queue initialization
+	play_queue_init();
+
+#ifdef AUDIO_SHM_PUBLISH
+	// Shared memory segments initialization
+	err = install_shm();
+	if (err) return err;
+#endif
+
+	// Copy local vales to global structures
+	audio_state.record.rrate			= rrate;
+	audio_state.record.rframes			= rframes;
+	audio_state.record.record_handle	= record_handle;
+	audio_state.record.playback_handle	= playback_handle;
+
+	audio_state.fft.rrate			= rrate;
+	audio_state.fft.rframes			= AUDIO_ADD_PADDING(rframes);
+	audio_state.fft.plan			= fft_plan;
+	audio_state.fft.plan_inverse	= fft_plan_inverse;
+
+	// Buffers are written by real-time tasks only, which shall not be the
+	// first ones to touch them
+	ptask_rt_prefault(&audio_state, sizeof(audio_state));
+
+	return 0;
+}
+
+#ifdef AUDIO_CAPTURE_FILE
+int audio_init_headless()
+{
+	audio_state.headless = true;
+
+	return audio_init();
+}
+#endif
+
+void audio_close()
+{
+	ptask_cab_destroy(&audio_state.record.cab);
+	ptask_cab_destroy(&audio_state.fft.cab);
+	ptask_cab_destroy(&audio_state.analysis.cab);
+
+#ifdef AUDIO_CAPTURE_FILE
+	if (audio_state.record.capture_file != NULL)
+		fclose(audio_state.record.capture_file);
+#endif
+
+#ifdef AUDIO_SHM_PUBLISH
+	shm_cab_close(&audio_state.record.shm);
+	shm_cab_close(&audio_state.fft.shm);
+#endif
+}
+
+int audio_file_open(const char *filename)
+{
+audio_pointer_t	file_pointer;	// Pointer to the opened file
+audio_type_t	file_type;		// Detected file type
+int				index;			// Index of newly used audio file descriptor
+midi_sequence_t	sequence = { .events = NULL, .num_events = 0, .duration = 0 };
+								// Pre-parsed events, only for MIDI files
+#ifdef AUDIO_MIDI_ALSA_SEQ
+sequencer_phrase_t phrase = { .events = NULL, .num_events = 0 };
+								// Precompiled sequencer events
+#endif
+
+	if (audio_state.audio_files_opened >= AUDIO_MAX_FILES)
+		return EAGAIN;
+
+	index = audio_state.audio_files_opened;
+
+	file_pointer.audio_p = load_sample(filename);
+	file_type = AUDIO_TYPE_SAMPLE;
+
+	if (!file_pointer.gen_p)
+	{
+		// It was not an audio file, let's try if it was a MIDI istead
+		file_pointer.midi_p = load_midi(filename);
+		file_type = AUDIO_TYPE_MIDI;
+
+		// MIDI events are parsed now, so that triggering the file later does
+		// not require any parsing
+		if (file_pointer.midi_p &&
+			midi_sequence_parse(&sequence, file_pointer.midi_p))
+		{
+			destroy_midi(file_pointer.midi_p);
+			file_pointer.midi_p = NULL;
+		}
+
+#ifdef AUDIO_MIDI_ALSA_SEQ
+		// Sequencer events are compiled too, the parsed sequence is not needed
+		// anymore after that
+		if (file_pointer.midi_p &&
+			sequencer_phrase_compile(&phrase, &sequence))
+		{
+			destroy_midi(file_pointer.midi_p);
+			file_pointer.midi_p = NULL;
+		}
+
+		midi_sequence_free(&sequence);
+#endif
+	}
 
 	if (file_pointer.gen_p)
 	{
 		// Valid input file
 		audio_file_copy(&audio_state.audio_files[index], &audio_file_new);
 		audio_state.audio_files[index].type = file_type;
+		audio_state.audio_files[index].sequence = sequence;
+#ifdef AUDIO_MIDI_ALSA_SEQ
+		audio_state.audio_files[index].phrase = phrase;
+#endif
 		path_to_basename(audio_state.audio_files[index].filename, filename);
 		audio_state.audio_files[index].datap = file_pointer;
 
@@ -1293,15 +2309,29 @@ int audio_file_num_opened()
 int audio_file_close(int i)
 {
 int err = 0;
+int first = i;	// The first file whose index changes
 
 	if (audio_file_is_open(i))
 	{
+		// Descriptors are going to be shifted back, no worker can use them
+		ptask_mutex_lock(&audio_state.mutex);
+		triggers_retract(first, AUDIO_MAX_FILES);
+		ptask_mutex_unlock(&audio_state.mutex);
+
 		switch (audio_state.audio_files[i].type)
 		{
 		case AUDIO_TYPE_SAMPLE:
 			destroy_sample(audio_state.audio_files[i].datap.audio_p);
 			break;
 		case AUDIO_TYPE_MIDI:
+#ifdef AUDIO_MIDI_ALSA_SEQ
+			// Scheduled events are copies, they can be freed anytime
+			sequencer_phrase_free(&audio_state.audio_files[i].phrase);
+#else
+			// The synthesizer may still reference the events
+			synth_stop_sequence(&audio_state.audio_files[i].sequence);
+#endif
+			midi_sequence_free(&audio_state.audio_files[i].sequence);
 			destroy_midi(audio_state.audio_files[i].datap.midi_p);
 			break;
 		default:
@@ -1318,6 +2348,11 @@ int err = 0;
 				&audio_state.audio_files[i+1]
 			);
 		}
+
+		ptask_mutex_lock(&audio_state.mutex);
+		for (i = first; i < AUDIO_MAX_FILES; ++i)
+			triggers_publish(i);
+		ptask_mutex_unlock(&audio_state.mutex);
 	}
 	else
 		err = EINVAL;
@@ -1330,6 +2365,11 @@ bool audio_file_has_rec(int i)
 	return audio_state.audio_files[i].has_rec;
 }
 
+bool audio_file_is_armed(int i)
+{
+	return atomic_load(&audio_state.triggers.entries[i].file) != NULL;
+}
+
 const char* audio_file_name(int i)
 {
 	return audio_state.audio_files[i].filename;
@@ -1339,52 +2379,48 @@ const char* audio_file_name(int i)
 
 int audio_file_play(int i)
 {
-int					err = 0;
-audio_file_desc_t	file;
+	return audio_file_play_from(i, 0);
+}
 
-	// Nobody can modify in multithreaded environment the number of opened audio
-	// files
-	if (i >= 0 && i < audio_state.audio_files_opened)
-	{
-		ptask_mutex_lock(&audio_state.mutex);
+int audio_file_record_last_capture(int i)
+{
+const short*	buffer;
+int				buffer_index;
+int				rframes;
 
-		// Copy file attributes in critical section (volume, panning, etc.)
-		file = audio_state.audio_files[i];
+	// Files are neither opened nor closed in multithreaded environment
+	if (!audio_file_is_open(i))
+		return EINVAL;
 
-		ptask_mutex_unlock(&audio_state.mutex);
+	rframes = audio_get_last_record(&buffer, &buffer_index);
+	if (rframes < 0)
+		return EAGAIN;
 
-		switch (file.type)
-		{
-		case AUDIO_TYPE_SAMPLE:
-			err = play_sample(
-				file.datap.audio_p,
-				file.volume,
-				file.panning,
-				file.frequency,
-				false /*file.loop*/
-				);
+	sample_retract(i);
 
-			err = err < 0 ? EINVAL : 0;
+	memcpy(audio_state.audio_files[i].recorded_sample, buffer,
+		sizeof(short) * rframes);
 
-			break;
-		case AUDIO_TYPE_MIDI:
-			err = play_midi(
-				file.datap.midi_p,
-				false /*file.loop*/
-				);
+	audio_free_last_record(buffer_index);
 
-			break;
-		default:
-			assert(false);
-			err = EINVAL;
-		}
-	}
-	else
-	{
-		err = EINVAL;
-	}
+	sample_arm(i);
 
-	return err;
+	return 0;
+}
+
+int audio_file_request_play(int i, double score)
+{
+struct timespec now;
+
+	// Nobody can modify in multithreaded environment the number of opened audio
+	// files
+	if (i < 0 || i >= audio_state.audio_files_opened)
+		return EINVAL;
+
+	// Manual requests shall be served as soon as possible
+	ptask_clock_gettime(&now);
+
+	return play_request_push(i, score, now);
 }
 
 void audio_stop()
@@ -1400,7 +2436,11 @@ int i;
 
 	ptask_mutex_unlock(&audio_state.mutex);
 
-	stop_midi();
+#ifdef AUDIO_MIDI_ALSA_SEQ
+	sequencer_stop();
+#else
+	synth_stop();
+#endif
 }
 
 // -------------- GETTERS --------------
@@ -1415,6 +2455,18 @@ int audio_get_record_rframes()
 	return audio_state.record.rframes;
 }
 
+long long audio_get_record_period_ns()
+{
+#ifdef AUDIO_APERIODIC
+	return FRAMES_TO_NS(audio_state.record.rframes, audio_state.record.rrate);
+#else
+	// The device publishes the frames of a sample in AUDIO_LATENCY_REDUCER
+	// periods, see install_alsa_pcm
+	return FRAMES_TO_NS(audio_state.record.rframes / AUDIO_LATENCY_REDUCER,
+		audio_state.record.rrate);
+#endif
+}
+
 int audio_get_fft_rrate()
 {
 	return audio_state.fft.rrate;
@@ -1624,6 +2676,20 @@ void audio_file_frequency_down(int i)
 	ptask_mutex_unlock(&audio_state.mutex);
 }
 
+void audio_file_toggle_armed(int i)
+{
+	if (i >= audio_state.audio_files_opened)
+		return;
+
+	ptask_mutex_lock(&audio_state.mutex);
+
+	audio_state.audio_files[i].armed = !audio_state.audio_files[i].armed;
+
+	triggers_publish(i);
+
+	ptask_mutex_unlock(&audio_state.mutex);
+}
+
 // -------------- BUFFERS FUNCTIONS --------------
 
 int audio_get_last_record(const short* buffer_ptr[], int* buffer_index_ptr)
@@ -1670,6 +2736,11 @@ void audio_free_last_fft(int buffer_index)
 	ptask_cab_unget(&audio_state.fft.cab, buffer_index);
 }
 
+void audio_record_countdown()
+{
+	wait_seconds_print(COUNTDOWN_SECONDS);
+}
+
 int audio_file_record_sample_to_play(int i)
 {
 int err;
@@ -1682,29 +2753,13 @@ int err;
 
 	// Since we overwrite the previous one, we mark temprarily that this file
 	// has no sample associated with it
-	audio_state.audio_files[i].has_rec = false;
-
-	// Wait a few seconds to let the user get the timing right
-	wait_seconds_print(COUNTDOWN_SECONDS);
+	sample_retract(i);
 
 	err = record_sample(audio_state.audio_files[i].recorded_sample);
 	if (err)
 		return err;
 
-	audio_state.audio_files[i].has_rec = true;
-
-	// Calculate the FFT of the signal once for later use
-	copy_buffer_with_padding(audio_state.audio_files[i].recorded_fft,
-		audio_state.audio_files[i].recorded_sample);
-
-	fft(audio_state.audio_files[i].recorded_fft);
-
-	// Calculate autocorrelation once for later use, defined as the
-	// cross-correlation with itself
-	audio_state.audio_files[i].autocorr = correlation_non_normalized(
-		audio_state.audio_files[i].recorded_fft,
-		audio_state.audio_files[i].recorded_fft
-	);
+	sample_arm(i);
 
 	return 0;
 }
@@ -1736,7 +2791,10 @@ int err;
 
 void audio_file_discard_recorded_sample(int i)
 {
+	ptask_mutex_lock(&audio_state.mutex);
 	audio_state.audio_files[i].has_rec = false;
+	triggers_publish(i);
+	ptask_mutex_unlock(&audio_state.mutex);
 }
 
 // -----------------------------------------------------------------------------
@@ -1755,6 +2813,8 @@ void* checkdata_task(void *arg)
 {
 ptask_t* tp = STATIC_CAST(ptask_t *, arg);
 
+	trace_thread_register("CHK");
+
 	ptask_start_period(tp);
 
 	while (!main_get_tasks_terminate())
@@ -1762,6 +2822,8 @@ ptask_t* tp = STATIC_CAST(ptask_t *, arg);
 
 		mic_update_avail();
 
+		ptask_sim_consume(TASK_CHK_COST * 1000LL);
+
 		if (ptask_deadline_miss(tp))
 			printf("TASK_CHK missed %d deadlines!\r\n", ptask_get_dmiss(tp));
 
@@ -1785,6 +2847,8 @@ short*		buffer;		// Pointer to local buffer, changes each time the buffer
 
 	tp = STATIC_CAST(ptask_t *, arg);
 
+	trace_thread_register("MIC");
+
 	err = mic_prepare();
 	if (err)
 		abort_on_error("Could not prepare microphone acquisition.");
@@ -1820,7 +2884,7 @@ short*		buffer;		// Pointer to local buffer, changes each time the buffer
 			// NOTICE: Nobody can overwrite this audio buffer even after the
 			// release with the putmes, because this task is the only one
 			// doing the putmes on this cab.
-			do_fft(buffer);
+			do_fft(buffer, mic_capture_time());
 
 			// Get a local buffer from the CAB
 			// There is no check because it never fails if used correcly
@@ -1872,16 +2936,29 @@ short*		buffer;			// Pointer to local buffer, changes each time
 							// the buffer is full
 int			how_many_read;	// How many frames are already in the buffer
 int			missing;		// How many frames are missing
+int64_t		period;			// Period of the capture device (in ns)
 
 	tp				= STATIC_CAST(ptask_t *, arg);
 	how_many_read	= 0;
 	missing			= audio_state.record.rframes;
 
+	trace_thread_register("MIC");
+
 	// Preparing the microphone interface to be used
 	err = mic_prepare();
 	if (err)
 		abort_on_error("Could not prepare microphone acquisition.");
 
+	ptask_set_overrun(tp, TASK_MIC_OVERRUN, NULL);
+
+	// The period of the task is exactly the one of the capture device, so that
+	// each job finds a full period of frames
+	period = audio_get_record_period_ns();
+
+	err = ptask_set_period_ns(tp, period, period);
+	if (err)
+		abort_on_error("Could not set the period of the microphone task.");
+
 	ptask_start_period(tp);
 
 	// Get a local buffer from the CAB
@@ -1916,7 +2993,7 @@ int			missing;		// How many frames are missing
 				// NOTICE: Nobody can overwrite my audio buffer even after the
 				// release with the putmes, because this task is the only one
 				// doing the putmes on this cab.
-				do_fft(buffer);
+				do_fft(buffer, mic_capture_time());
 
 				// Get a local buffer from the CAB
 				// There is no check because it never fails if used correcly
@@ -1959,76 +3036,182 @@ int			missing;		// How many frames are missing
 void *analysis_task(void *arg)
 {
 ptask_t*			tp; // Task pointer
-struct timespec		last_timestamp;	// Timestamp of last accessed FFT
+unsigned int		seq;			// Sequence number of last accessed FFT
 struct timespec		new_timestamp;	// Timestamp of the new FFT
-int					file_index;		// Index of the file that has been
-									// associated with this task
+struct timespec		start;			// Start time of the job, after the
+									// offset of the worker
+int					worker;			// Index of this worker within the pool
+atomic_uint*		epoch;			// Epoch counter of this worker
 const fft_output_t*	fft_ptr;		// The pointer to the most recent FFT
 									// within the CAB
 ptask_cab_id_t		fft_id;			// The id of the most recent FFT within
 									// the CAB
-double				correlation;	// The normalized correlation value between the
-									// most recent FFT and the audio sample
-									// associated with this task
+const audio_file_desc_t* file;		// The file associated with a trigger
+int					armed;			// Armed triggers found so far in the
+									// registry
+int					i;
+int					degraded = 0;	// Triggers not analyzed because the job
+									// exceeded its budget
+char				name[TRACE_NAME_SIZE];	// Name of the trace of the worker
 int					err;
 
 	tp = STATIC_CAST(ptask_t *, arg);
 
-	last_timestamp.tv_sec	= 0;
-	last_timestamp.tv_nsec	= 0;
+	seq = 0;
 
-	// Get the associated file index as it is the only argument
-	file_index = *STATIC_CAST(int*, &tp->args);
+	// Get the index of the worker as it is the only argument
+	worker	= *STATIC_CAST(int*, &tp->args);
+	epoch	= &audio_state.triggers.epochs[worker];
 
-	ptask_start_period(tp);
+	snprintf(name, sizeof(name), "ALS %d", worker+1);
+	trace_thread_register(name);
 
+	// This task is event-driven: it is woken up as soon as a new FFT is
+	// published, the period is used only as timeout to check for termination
 	while (!main_get_tasks_terminate())
 	{
-		err = ptask_cab_getmes(&audio_state.fft.cab,
+		err = ptask_cab_getmes_next(&audio_state.fft.cab,
 			STATIC_CAST(const void **, &fft_ptr),
 			&fft_id,
-			&new_timestamp
+			&new_timestamp,
+			&seq,
+			ptask_get_period(tp)
 		);
 
-		// If the acquired buffer has not been analyzed yet
-		if (err != EAGAIN && time_cmp(last_timestamp, new_timestamp) < 0)
+		if (err)
+			continue;
+
+		// FFTs published with the gate closed cannot match any trigger
+		if (!fft_ptr->active)
 		{
-			last_timestamp = new_timestamp;
+			ptask_cab_unget(&audio_state.fft.cab, fft_id);
+			continue;
+		}
 
-			correlation = correlation_normalized(
-				audio_state.audio_files[file_index].recorded_fft,
-				fft_ptr->fft,
-				audio_state.audio_files[file_index].autocorr,
-				fft_ptr->autocorr
-			);
+		// Under overload, only one FFT every QOS_ANALYSIS_HOP is analyzed; all
+		// the workers skip the same ones
+		if (qos_get_level() >= QOS_LEVEL_ANALYSIS_HOP &&
+			seq % QOS_ANALYSIS_HOP != 0)
+		{
+			ptask_cab_unget(&audio_state.fft.cab, fft_id);
+			continue;
+		}
 
-			print_log(LOG_VERBOSE,
-				"TASK_ALS correlation with file %d is %f .\r\n",
-				file_index+1, correlation);
+		// Each job is released by the publication of the FFT and starts
+		// after the offset of the worker if staggered, which counts in its
+		// response time
+		start = new_timestamp;
+		ptask_wait_for_offset(tp, &start);
 
-			if (fabs(correlation) > AUDIO_THRESHOLD)
-			{
-				// We start a new execution
-				audio_file_play(file_index);
+		ptask_job_start(tp, &new_timestamp);
+
+		// The registry is read once per FFT: the k-th armed trigger is
+		// analyzed by worker k modulo TASK_ALS_NUM. A trigger armed or
+		// disarmed meanwhile may be analyzed by two workers or by none for
+		// this FFT only
+		atomic_fetch_add(epoch, 1);
+
+		armed = 0;
+
+		for (i = 0; i < AUDIO_MAX_FILES; ++i)
+		{
+			file = atomic_load(&audio_state.triggers.entries[i].file);
+
+			if (file == NULL)
+				continue;
+
+			if (armed++ % TASK_ALS_NUM != worker)
+				continue;
+
+			// A job over budget skips the rest of its triggers
+			if (ptask_over_budget(tp))
+				++degraded;
+			else
+				trigger_analyze(i, file, fft_ptr, new_timestamp);
+		}
+
+		triggers_epoch_close(epoch);
 
-				// We then move the last_timestamp forward in time to avoid
-				// analyzing too often the input
-				time_add_ms(&last_timestamp, AUDIO_ANALYSIS_DELAY_MS);
+		// Realease acquired buffer
+		ptask_cab_unget(&audio_state.fft.cab, fft_id);
+
+		ptask_job_end(tp);
+
+		// The deadline is relative to the publication of the FFT, misses are
+		// counted by the task for the QoS governor
+		ptask_job_deadline_miss(tp, &new_timestamp);
+	}
+
+	// Cleanup
+
+	if (ptask_get_dmiss(tp) > 0)
+		printf("TASK_ALS worker %d missed %d deadlines!\r\n", worker+1,
+			ptask_get_dmiss(tp));
+
+	if (degraded > 0)
+		print_log(LOG_VERBOSE, "TASK_ALS worker %d skipped %d analyses after "
+			"exceeding its budget.\r\n", worker+1, degraded);
+
+	return NULL;
+}
+
+/// The body of the playback task
+void *playback_task(void *arg)
+{
+ptask_t*				tp;			// Task pointer
+audio_play_request_t	request;	// The request extracted from the queue
+audio_play_request_t	pending[PLAY_QUEUE_SIZE];
+									// Requests waiting for their start time
+int						num_pending = 0;
+struct timespec			now;
+int						i;
+
+	tp = STATIC_CAST(ptask_t *, arg);
+
+	trace_thread_register("PLY");
+
+	ptask_start_period(tp);
+
+	while (!main_get_tasks_terminate())
+	{
+		// When the pending list is full, new requests wait in the queue
+		while (num_pending < PLAY_QUEUE_SIZE && play_queue_pop(&request))
+			pending[num_pending++] = request;
+
+		// A request is never served before its start time, hence in the
+		// first period after it; the lateness is compensated by skipping into
+		// the sound
+		ptask_clock_gettime(&now);
+
+		for (i = 0; i < num_pending; )
+		{
+			if (time_cmp(pending[i].start, now) <= 0)
+			{
+				play_request_serve(&pending[i]);
+				pending[i] = pending[--num_pending];
 			}
+			else
+				++i;
 		}
 
-		// Realease acquired buffer (if acquired)
-		if (err == 0)
-			ptask_cab_unget(&audio_state.fft.cab, fft_id);
+		ptask_sim_consume(TASK_PLY_COST * 1000LL);
 
 		if (ptask_deadline_miss(tp))
-			printf("TASK_ALS for file %d missed %d deadlines!\r\n",
-				file_index+1, ptask_get_dmiss(tp));
+			printf("TASK_PLY missed %d deadlines!\r\n", ptask_get_dmiss(tp));
 
 		ptask_wait_for_period(tp);
 	}
 
-	// Cleanup
+	// Cleanup, requests still pending or in the queue are discarded
+	while (play_queue_pop(&request))
+		;
+
+	print_log(LOG_VERBOSE,
+		"TASK_PLY served %ld requests, dropped %ld, max start lateness %ld us "
+		"(mixer latency excluded).\r\n",
+		audio_state.play_queue.served,
+		atomic_load(&audio_state.play_queue.dropped),
+		audio_state.play_queue.max_late_us);
 
 	return NULL;
 }
@@ -24,22 +24,53 @@
 
 // Linux-related types
 #include <sys/types.h>
+#include <sched.h>			// Used for CPU affinity
+#include <pthread.h>
 
 // POSIX directory management functions
 #include <dirent.h>
 
 // Linked libraries
 #include <allegro.h>
+#include <alsa/asoundlib.h>
 
 // Custom libraries
 #include "api/std_emu.h"
 #include "api/ptask.h"
+#include "api/trace.h"
 
 // Other modules
 #include "constants.h"
 #include "main.h"
 #include "audio.h"
 #include "video.h"
+#include "midi.h"
+#include "synth.h"
+#include "sequencer.h"
+#include "qos.h"
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE CONSTANTS
+// -----------------------------------------------------------------------------
+
+#if defined TASK_CPU_PLACEMENT && !(defined NDEBUG && defined TASK_SCHED_DEADLINE)
+#define CPU_PLACEMENT		///< Tasks are bound to CPUs, see TASK_CPU_PLACEMENT
+#endif
+
+#if defined NDEBUG && !defined TASK_SCHED_DEADLINE
+#define FIXED_PRIORITY		///< Tasks are scheduled with SCHED_FIFO
+#endif
+
+#if defined PTASK_SIMULATION && defined AUDIO_CAPTURE_FILE
+#define HEADLESS_SIMULATION	///< The -s flag runs an offline simulation, see
+							///< headless_simulation()
+#endif
+
+#define CPU_ONLINE_PATH		"/sys/devices/system/cpu/online"
+									///< List of the CPUs that are online
+#define CPU_ISOLATED_PATH	"/sys/devices/system/cpu/isolated"
+									///< List of the CPUs isolated from the
+									///< general scheduler
 
 // -----------------------------------------------------------------------------
 //                           PRIVATE DATA TYPES
@@ -54,6 +85,8 @@ typedef struct __MAIN_STRUCT
 	bool			tasks_terminate;///< Tells if concurrent tasks should stop
 									///< their execution
 	bool			quit;			///< Tells if the program is shutting down
+	bool			headless;		///< Tells if the program runs an offline
+									///< simulation, see headless_simulation()
 	bool			log_level;		///< The system log level
 	char			directory[MAX_DIRECTORY_LENGTH];
 									///< The specified directory where to search
@@ -61,12 +94,36 @@ typedef struct __MAIN_STRUCT
 									///< current working directory)
 
 	ptask_t			tasks[TASK_NUM];///< All the tasks data
+	ptask_server_t	server;			///< The jobs executed by TASK_SRV
+
+	bool			placement;		///< Tells if tasks are bound to CPUs
+	cpu_set_t		affinity[TASK_NUM];
+									///< The CPUs each task is bound to, if
+									///< placement is enabled
+
+	int				priority[TASK_NUM];
+									///< The priority of each task, see
+									///< plan_tasks()
+	int64_t			wcet[TASK_NUM];	///< The greatest execution time measured
+									///< for each task so far (in ns), zero if
+									///< unknown
 
 	ptask_mutex_t	mutex;			///< Protects access to this data structure
 	ptask_cond_t	cond;			///< used to wake up the main thread when in
 									///< graphical mode
 } main_state_t;
 
+/// A command executed by the aperiodic server on behalf of the main thread,
+/// see run_job()
+typedef struct __MAIN_JOB_STRUCT
+{
+	const char*		path;			///< The file to be opened, if any
+	int				index;			///< The file whose sample shall be
+									///< recorded, if any
+	int				err;			///< The result of the command
+	bool			done;			///< Tells if the command has been executed
+} main_job_t;
+
 // -----------------------------------------------------------------------------
 //                           GLOBAL VARIABLES
 // -----------------------------------------------------------------------------
@@ -76,6 +133,7 @@ static main_state_t main_state =
 {
 	.tasks_terminate	= false,
 	.quit				= false,
+	.headless			= false,
 	.directory			= "",
 #ifdef NDEBUG
 	.log_level			= 0,
@@ -144,6 +202,30 @@ bool res;
 	return res;
 }
 
+int main_submit_job(ptask_job_t *job, void *arg)
+{
+	return ptask_server_submit(&main_state.server, job, arg);
+}
+
+void main_update_qos()
+{
+ptask_t*	tasks[TASK_NUM];
+int			n = 0;
+int			i;
+
+	tasks[n++] = &main_state.tasks[TASK_MIC];	// Same index of TASK_CHK
+	tasks[n++] = &main_state.tasks[TASK_PLY];
+
+#ifndef AUDIO_MIDI_ALSA_SEQ
+	tasks[n++] = &main_state.tasks[TASK_SYN];
+#endif
+
+	for (i = 0; i < TASK_ALS_NUM; ++i)
+		tasks[n++] = &main_state.tasks[TASK_ALS_FIRST + i];
+
+	qos_update(tasks, n);
+}
+
 
 // -----------------------------------------------------------------------------
 //                           PRIVATE FUNCTIONS
@@ -177,6 +259,15 @@ int err = 0;
 			// repeated flags are not checked
 			main_state.log_level |= LOG_VERBOSE;
 		break;
+	case 't':
+		// Tasks record their events from the first time they are started
+		trace_enable();
+		break;
+#ifdef HEADLESS_SIMULATION
+	case 's':
+		main_state.headless = true;
+		break;
+#endif
 	default:
 		// Unknown argument
 		err = EINVAL;
@@ -306,6 +397,62 @@ int			begin = 0;					// The index from which we will copy the
  */
 //@{
 
+/**
+ * Submits the given job to the aperiodic server and waits until it has been
+ * executed, so that loading files and recording samples, which may take long,
+ * never run in the main thread. Returns the result of the command or, if it
+ * could not be submitted, the error of main_submit_job().
+ */
+static inline int run_job(ptask_job_t *job, main_job_t *cmd)
+{
+int err;
+
+	cmd->done = false;
+
+	err = main_submit_job(job, STATIC_CAST(void *, cmd));
+	if (err) return err;
+
+	ptask_mutex_lock(&main_state.mutex);
+
+	while (!cmd->done)
+		ptask_cond_wait(&main_state.cond, &main_state.mutex);
+
+	ptask_mutex_unlock(&main_state.mutex);
+
+	return cmd->err;
+}
+
+/**
+ * Stores the result of the given command and wakes up the main thread.
+ */
+static inline void job_done(main_job_t *cmd, int err)
+{
+	ptask_mutex_lock(&main_state.mutex);
+
+	cmd->err	= err;
+	cmd->done	= true;
+	ptask_cond_broadcast(&main_state.cond);
+
+	ptask_mutex_unlock(&main_state.mutex);
+}
+
+/// The aperiodic job that opens the file of the given command
+static void open_job(void *arg)
+{
+main_job_t *cmd = STATIC_CAST(main_job_t *, arg);
+
+	job_done(cmd, audio_file_open(cmd->path));
+}
+
+/// The aperiodic job that records the sample of the given command, the
+/// countdown is displayed by the main thread before submitting it
+static void record_job(void *arg)
+{
+main_job_t *cmd = STATIC_CAST(main_job_t *, arg);
+
+	job_done(cmd, audio_file_record_sample_to_play(cmd->index));
+}
+
 /**
  * Displays all available commands in terminal mode.
  */
@@ -326,6 +473,9 @@ static inline void cmd_help()
 	printf(" quit\t\tTo quit this program.\r\n");
 	printf(" record\t<fnum>\tTo record an audio input that will trigger the "
 		"file specified by the num.\r\n");
+	printf(" trace\t\tTo write the events recorded so far by the tasks in "
+		"%s,\r\n\t\tif the program has been started with -t.\r\n",
+		TRACE_FILE_NAME);
 
 	printf("\r\n");
 
@@ -334,6 +484,13 @@ static inline void cmd_help()
 
 	printf("\r\n");
 
+	printf(" \t\tIn windowed mode, keys 1-0 play files, F1-F8 arm or disarm "
+		"the recorded\r\n\t\tsample of a file, Shift+F1-F8 record a new "
+		"one after a countdown\r\n\t\tand Q goes back to this mode. Files "
+		"can be opened and closed in this\r\n\t\tmode only.\r\n");
+
+	printf("\r\n");
+
 	printf(" \t\tThe specified <fname> shall be an absolute path "
 		"or a relative path to the\r\n\t\tcurrent working directory.\r\n");
 
@@ -348,13 +505,39 @@ static inline void cmd_pwd()
 	printf("Current working dir: %s\r\n", main_state.directory);
 }
 
+/**
+ * Writes the trace of the tasks in the working directory.
+ */
+static inline void cmd_trace()
+{
+char	path[MAX_DIRECTORY_LENGTH + MAX_CHAR_BUFFER_SIZE];
+int		err;
+
+	if (!trace_enabled())
+	{
+		printf("Tracing is disabled, start the program with -t.\r\n");
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s%s", main_state.directory,
+		TRACE_FILE_NAME);
+
+	err = trace_write(path);
+	if (err)
+		printf("Could not write the trace in %s: %s.\r\n", path,
+			strerror(err));
+	else
+		printf("Trace written in %s.\r\n", path);
+}
+
 /**
  * Opens an audio input file, being it a sample or a midi it doesn't matter.
  */
 static inline void cmd_open(char* filename)
 {
-char	buffer[MAX_CHAR_BUFFER_SIZE];
-int		err = 0;
+char		buffer[MAX_CHAR_BUFFER_SIZE];
+main_job_t	cmd = { .path = buffer };
+int			err = 0;
 
 	if (filename[0] != '/')
 	{
@@ -367,7 +550,7 @@ int		err = 0;
 		strncpy(buffer, filename, sizeof(buffer));
 	}
 
-	err = audio_file_open(buffer);
+	err = run_job(open_job, &cmd);
 
 	if (err)
 	{
@@ -509,6 +692,7 @@ bool accepted	= false;
 bool again		= true;
 int err;
 int index = fnum-1;
+main_job_t cmd = { .index = index };
 
 	if (!audio_file_is_open(index))
 	{
@@ -536,7 +720,9 @@ int index = fnum-1;
 		wait_enter();
 		printf("\r\n");
 
-		err = audio_file_record_sample_to_play(index);
+		audio_record_countdown();
+
+		err = run_job(record_job, &cmd);
 
 		if (err)
 		{
@@ -682,6 +868,10 @@ int err;
 			// the loop.
 			start_graphic_mode = true;
 		}
+		else if (strcmp(command, "trace") == 0)
+		{
+			cmd_trace();
+		}
 		else if (strcmp(command, "record") == 0)
 		{
 			// Convert second argument to a number
@@ -708,17 +898,175 @@ int err;
  */
 //@{
 
+#ifdef CPU_PLACEMENT
+
+/**
+ * Reads a list of CPUs in the format used by sysfs (e.g. "0,2-3") from the
+ * given file into set. On error or if the file does not exist, the set is
+ * empty.
+ */
+static inline void read_cpu_list(const char *path, cpu_set_t *set)
+{
+FILE*	f;
+char	line[MAX_CHAR_BUFFER_SIZE];
+char*	p;				// Current position in the line
+char*	end;			// End of the last parsed number
+long	first, last;	// Range of CPUs being parsed
+
+	CPU_ZERO(set);
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return;
+
+	p = fgets(line, sizeof(line), f);
+	fclose(f);
+
+	while (p != NULL && *p != '\0' && *p != '\n')
+	{
+		first = last = strtol(p, &end, 10);
+		if (end == p)
+			break;
+
+		if (*end == '-')
+		{
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				break;
+		}
+
+		for (; first <= last && first < CPU_SETSIZE; ++first)
+			CPU_SET(first, set);
+
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	// A malformed list is ignored altogether
+	if (p == NULL || (*p != '\0' && *p != '\n'))
+		CPU_ZERO(set);
+}
+
+/**
+ * Returns the n-th CPU of the given non-empty set, wrapping around.
+ */
+static inline int nth_cpu(const cpu_set_t *set, int n)
+{
+int cpu;
+
+	n %= CPU_COUNT(set);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if (CPU_ISSET(cpu, set) && n-- == 0)
+			break;
+	}
+
+	return cpu;
+}
+
+/**
+ * Chooses the CPUs each task is bound to, see TASK_CPU_PLACEMENT. The main
+ * thread is bound to the CPUs of the GUI, so that threads created by Allegro
+ * will inherit its affinity.
+ */
+static inline void init_cpu_placement()
+{
+cpu_set_t	online;		// CPUs that are online
+cpu_set_t	isolated;	// Online CPUs isolated from the general scheduler
+cpu_set_t	capture;	// The CPU reserved to the microphone task
+cpu_set_t	realtime;	// CPUs used by other real-time tasks
+cpu_set_t	gui;		// CPUs used by the GUI and by the rest of the system
+cpu_set_t	single;		// A single CPU, used for analysis tasks
+int			cpu;		// The CPU reserved to the microphone task
+int			i;
+
+	main_state.placement = false;
+
+	read_cpu_list(CPU_ONLINE_PATH, &online);
+	read_cpu_list(CPU_ISOLATED_PATH, &isolated);
+	CPU_AND(&isolated, &isolated, &online);
+
+	// With a single CPU there is nothing to place
+	if (CPU_COUNT(&online) < 2)
+		return;
+
+	// Without isolated CPUs the last one is used, since the kernel prefers the
+	// first ones for interrupts and housekeeping
+	if (CPU_COUNT(&isolated) > 0)
+		cpu = nth_cpu(&isolated, 0);
+	else
+		cpu = nth_cpu(&online, CPU_COUNT(&online) - 1);
+
+	CPU_ZERO(&capture);
+	CPU_SET(cpu, &capture);
+
+	// Since both isolated and capture are subsets of online, the xor computes
+	// the difference between sets
+	if (CPU_COUNT(&isolated) > 1)
+		CPU_XOR(&realtime, &isolated, &capture);
+	else
+		CPU_XOR(&realtime, &online, &capture);
+
+	CPU_XOR(&gui, &online, &isolated);
+	CPU_CLR(cpu, &gui);
+
+	if (CPU_COUNT(&gui) == 0)
+		CPU_XOR(&gui, &online, &capture);
+
+	main_state.affinity[TASK_GUI]	= gui;
+	main_state.affinity[TASK_UI]	= gui;
+	main_state.affinity[TASK_MIC]	= capture;	// Same index of TASK_CHK
+	main_state.affinity[TASK_PLY]	= realtime;
+	main_state.affinity[TASK_SYN]	= realtime;
+	main_state.affinity[TASK_SRV]	= gui;
+
+	for (i = TASK_ALS_FIRST; i < TASK_NUM; ++i)
+	{
+		CPU_ZERO(&single);
+		CPU_SET(nth_cpu(&realtime, i - TASK_ALS_FIRST), &single);
+		main_state.affinity[i] = single;
+	}
+
+	pthread_setaffinity_np(pthread_self(), sizeof(gui), &gui);
+
+	main_state.placement = true;
+
+	print_log(LOG_VERBOSE, "Microphone task bound to CPU %d, %d CPUs for "
+		"other real-time tasks, %d for the GUI.\r\n", cpu,
+		CPU_COUNT(&realtime), CPU_COUNT(&gui));
+}
+
+#endif
+
+/**
+ * Returns the CPUs the given task shall be bound to, NULL if any CPU is fine.
+ */
+static inline const cpu_set_t *task_affinity(int task_id)
+{
+	return main_state.placement ? &main_state.affinity[task_id] : NULL;
+}
+
+/**
+ * Returns the priority of the given task, see plan_tasks().
+ */
+static inline int task_priority(int task_id)
+{
+	return main_state.priority[task_id];
+}
+
 /**
  * Initializes and starts the GUI task, returning zero on success.
  */
 static inline int start_gui_task()
 {
-	return ptask_short(
+	return ptask_short_affinity(
 		&main_state.tasks[TASK_GUI],
-		TASK_GUI_WCET,
+		GET_WCET(TASK_GUI_WCET, TASK_GUI_BUDGET),
 		TASK_GUI_PERIOD,
 		TASK_GUI_DEADLINE,
-		GET_PRIO(TASK_GUI_PRIORITY),
+		task_priority(TASK_GUI),
+		task_affinity(TASK_GUI),
 		gui_task,
 		NULL,
 		0);
@@ -729,12 +1077,13 @@ static inline int start_gui_task()
  */
 static inline int start_ui_task()
 {
-	return	ptask_short(
+	return	ptask_short_affinity(
 		&main_state.tasks[TASK_UI],
-		TASK_UI_WCET,
+		GET_WCET(TASK_UI_WCET, TASK_UI_BUDGET),
 		TASK_UI_PERIOD,
 		TASK_UI_DEADLINE,
-		GET_PRIO(TASK_UI_PRIORITY),
+		task_priority(TASK_UI),
+		task_affinity(TASK_UI),
 		user_interaction_task,
 		NULL,
 		0);
@@ -748,12 +1097,13 @@ static inline int start_ui_task()
  */
 static inline int start_checkdata_task()
 {
-	return	ptask_short(
+	return	ptask_short_affinity(
 		&main_state.tasks[TASK_CHK],
-		TASK_CHK_WCET,
+		GET_WCET(TASK_CHK_WCET, TASK_CHK_BUDGET),
 		TASK_CHK_PERIOD,
 		TASK_CHK_DEADLINE,
-		GET_PRIO(TASK_CHK_PRIORITY),
+		task_priority(TASK_CHK),
+		task_affinity(TASK_CHK),
 		checkdata_task,
 		NULL,
 		0);
@@ -765,47 +1115,407 @@ static inline int start_checkdata_task()
  */
 static inline int start_microphone_task()
 {
-	return	ptask_short(
+#ifdef AUDIO_APERIODIC
+// The task is activated by the checkdata task, which shares the same index
+int priority = GET_PRIO(TASK_MIC_PRIORITY);
+#else
+int priority = task_priority(TASK_MIC);
+#endif
+
+	return	ptask_short_affinity(
 		&main_state.tasks[TASK_MIC],
-		TASK_MIC_WCET,
+		GET_WCET(TASK_MIC_WCET, TASK_MIC_BUDGET),
 		TASK_MIC_PERIOD,
 		TASK_MIC_DEADLINE,
-		GET_PRIO(TASK_MIC_PRIORITY),
+		priority,
+		task_affinity(TASK_MIC),
 		microphone_task,
 		NULL,
 		0);
 }
 
 /**
- * Initializes and starts the analyzer task, returning zero on success.
+ * Initializes and starts the playback task, returning zero on success.
+ */
+static inline int start_playback_task()
+{
+	return	ptask_short_affinity(
+		&main_state.tasks[TASK_PLY],
+		GET_WCET(TASK_PLY_WCET, TASK_PLY_BUDGET),
+		TASK_PLY_PERIOD,
+		TASK_PLY_DEADLINE,
+		task_priority(TASK_PLY),
+		task_affinity(TASK_PLY),
+		playback_task,
+		NULL,
+		0);
+}
+
+/**
+ * Initializes and starts the task of the aperiodic server, returning zero on
+ * success. Like the synthesizer task, it is started only once and it keeps
+ * running in terminal mode too, where it executes the commands that load files
+ * and record samples, see run_job().
+ */
+static inline int start_server_task()
+{
+ptask_server_t *server = &main_state.server;
+int err;
+
+	err = ptask_server_init(server, TASK_SRV_BUDGET, TASK_SRV_PERIOD);
+	if (err) return err;
+
+	return	ptask_short_affinity(
+		&main_state.tasks[TASK_SRV],
+		GET_WCET(TASK_SRV_WCET, TASK_SRV_BUDGET),
+		TASK_SRV_PERIOD,
+		TASK_SRV_DEADLINE,
+		task_priority(TASK_SRV),
+		task_affinity(TASK_SRV),
+		ptask_server_task,
+		STATIC_CAST(void *, &server),
+		sizeof(server));
+}
+
+#ifndef AUDIO_MIDI_ALSA_SEQ
+/**
+ * Initializes and starts the synthesizer task, returning zero on success.
+ * Unlike other tasks, it is started only once and it keeps running in terminal
+ * mode too, so that MIDI files can be played from the command line.
+ */
+static inline int start_synth_task()
+{
+	return	ptask_short_affinity(
+		&main_state.tasks[TASK_SYN],
+		GET_WCET(TASK_SYN_WCET, TASK_SYN_BUDGET),
+		TASK_SYN_PERIOD,
+		TASK_SYN_DEADLINE,
+		task_priority(TASK_SYN),
+		task_affinity(TASK_SYN),
+		synth_task,
+		NULL,
+		0);
+}
+#endif
+
+/**
+ * Initializes and starts the pool of analysis workers, returning zero on
+ * success. Workers are started regardless of the recorded samples, since
+ * triggers can be armed and disarmed at any time. With TASK_ALS_STAGGER, the
+ * jobs of the workers are staggered after each FFT, so that the last one can
+ * still complete its budget before the deadline.
  */
 static inline int start_analyzer_tasks()
 {
-int i;
-int num_recording_files = 0;
+ptask_t*	tasks[TASK_ALS_NUM];
+ptask_t*	tp;
+int			i;
+int			err;
 
-	for (i = 0; i < audio_file_num_opened(); ++i)
+	for (i = 0; i < TASK_ALS_NUM; ++i)
+	{
+		tp = tasks[i] = &main_state.tasks[TASK_ALS_FIRST + i];
+
+		err = ptask_init(tp);
+
+		if (err)
+		{
+			while (i-- > 0)
+				ptask_destroy(tasks[i]);
+
+			return err;
+		}
+
+		ptask_set_params(tp, GET_WCET(TASK_ALS_WCET, TASK_ALS_BUDGET),
+			TASK_ALS_PERIOD, TASK_ALS_DEADLINE,
+			task_priority(TASK_ALS_FIRST + i));
+		ptask_set_affinity(tp, task_affinity(TASK_ALS_FIRST + i));
+		ptask_set_args(tp, STATIC_CAST(void *, &i), sizeof(i));
+
+#ifdef TASK_ALS_ENFORCE_BUDGET
+		ptask_set_budget(tp, TASK_ALS_BUDGET, PTASK_BUDGET_DEMOTE, NULL);
+#endif
+	}
+
+#ifdef TASK_ALS_STAGGER
+	err = ptask_stagger(tasks, TASK_ALS_NUM,
+		TASK_ALS_DEADLINE * 1000000LL - TASK_ALS_BUDGET * 1000LL);
+
+	if (err)
 	{
-		if (audio_file_has_rec(i))
+		for (i = 0; i < TASK_ALS_NUM; ++i)
+			ptask_destroy(tasks[i]);
+
+		return err;
+	}
+#endif
+
+	for (i = 0; i < TASK_ALS_NUM; ++i)
+	{
+		err = ptask_create(tasks[i], analysis_task);
+
+		if (err)
 		{
-			ptask_short(
-				&main_state.tasks[TASK_ALS_FIRST + num_recording_files],
-				TASK_ALS_WCET,
-				TASK_ALS_PERIOD,
-				TASK_ALS_DEADLINE,
-				GET_PRIO(TASK_ALS_PRIORITY),
-				analysis_task,
-				STATIC_CAST(void *, &i),
-				sizeof(i)
-			);
-
-			++num_recording_files;
+			// Workers that have not been started are released
+			for (; i < TASK_ALS_NUM; ++i)
+				ptask_destroy(tasks[i]);
+
+			return err;
 		}
 	}
 
 	return 0;
 }
 
+/**
+ * Stores in ids the indexes of the tasks that are started in graphic mode,
+ * together with the server task and the synthesizer task if present, returning
+ * their number.
+ */
+static inline int task_ids(int ids[])
+{
+int n = 0;
+int i;
+
+	ids[n++] = TASK_GUI;
+	ids[n++] = TASK_UI;
+	ids[n++] = TASK_MIC;	// Same index of TASK_CHK
+	ids[n++] = TASK_PLY;
+	ids[n++] = TASK_SRV;
+
+#ifndef AUDIO_MIDI_ALSA_SEQ
+	ids[n++] = TASK_SYN;
+#endif
+
+	for (i = 0; i < TASK_ALS_NUM; ++i)
+		ids[n++] = TASK_ALS_FIRST + i;
+
+	return n;
+}
+
+/**
+ * Initializes the given task with the given parameters without starting it,
+ * so that it can be used for the analysis of the task set.
+ */
+static inline void plan_task(int task_id, long budget, int period,
+	int deadline, int priority)
+{
+ptask_t *tp = &main_state.tasks[task_id];
+
+	ptask_init(tp);
+	ptask_set_params(tp, budget, period, deadline, priority);
+	ptask_set_affinity(tp, task_affinity(task_id));
+}
+
+/**
+ * Performs the response-time analysis of the given tasks, using the measured
+ * WCET of each task if known, its budget otherwise. The tasks need not be
+ * running. It prints the result for each task in verbose mode and a warning
+ * for each task that may miss its deadline, whose number is returned.
+ */
+static inline int check_schedulability(ptask_t *tasks[], const int ids[],
+	int n)
+{
+int64_t	wcet[TASK_NUM];		// WCETs used for the analysis (in ns)
+int64_t	response[TASK_NUM];	// Worst-case response times (in ns)
+int		unschedulable;
+int		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		wcet[i] = main_state.wcet[ids[i]] > 0 ?
+			main_state.wcet[ids[i]] : ptask_get_wcet(tasks[i]) * 1000LL;
+	}
+
+	unschedulable = ptask_response_time_analysis(tasks, wcet, n, response);
+
+	for (i = 0; i < n; ++i)
+	{
+		print_log(LOG_VERBOSE, "Task %d: priority %d, WCET %lld us, "
+			"response time %lld us, deadline %lld us.\r\n", ids[i],
+			ptask_get_priority(tasks[i]), (long long) wcet[i] / 1000,
+			(long long) response[i] / 1000,
+			(long long) ptask_get_deadline_ns(tasks[i]) / 1000);
+
+		if (response[i] > ptask_get_deadline_ns(tasks[i]))
+		{
+			printf("WARNING: task %d may miss its deadline, its response time "
+				"may exceed %lld us.\r\n", ids[i],
+				(long long) response[i] / 1000);
+		}
+	}
+
+	return unschedulable;
+}
+
+#ifdef FIXED_PRIORITY
+
+/**
+ * Returns true if the task with the given id belongs to the audio chain, whose
+ * tasks get higher priorities than the interactive ones with
+ * TASK_AUTO_PRIORITY.
+ */
+static inline bool task_is_audio(int task_id)
+{
+	return task_id != TASK_GUI && task_id != TASK_UI && task_id != TASK_SRV;
+}
+
+/**
+ * Assigns priorities to the tasks initialized by plan_tasks(), if
+ * TASK_AUTO_PRIORITY is defined, and performs their response-time analysis.
+ * Returns zero on success, EINVAL if priorities cannot be assigned and, with
+ * TASK_RTA_STRICT, EDEADLK if some task may miss its deadline.
+ */
+static inline int analyze_tasks()
+{
+ptask_t*	tasks[TASK_NUM];
+int			ids[TASK_NUM];
+int			n;
+int			i;
+int			err = 0;
+#ifdef TASK_AUTO_PRIORITY
+ptask_t*	audio[TASK_NUM];	// The tasks of the audio chain
+ptask_t*	others[TASK_NUM];	// The interactive tasks
+int			naudio = 0;
+int			nothers = 0;
+#endif
+
+	n = task_ids(ids);
+
+	for (i = 0; i < n; ++i)
+		tasks[i] = &main_state.tasks[ids[i]];
+
+#ifdef TASK_AUTO_PRIORITY
+	for (i = 0; i < n; ++i)
+	{
+		if (task_is_audio(ids[i]))
+			audio[naudio++] = tasks[i];
+		else
+			others[nothers++] = tasks[i];
+	}
+
+	// The audio chain is always above the interactive tasks, whatever their
+	// deadlines are
+	err = ptask_assign_priorities(others, nothers, PTASK_PRIO_DM, 1, nothers);
+	if (err) return err;
+
+	err = ptask_assign_priorities(audio, naudio, PTASK_PRIO_DM, nothers + 1,
+		TASK_NUM);
+	if (err) return err;
+#endif
+
+	if (check_schedulability(tasks, ids, n) > 0)
+	{
+#ifdef TASK_RTA_STRICT
+		err = EDEADLK;
+#else
+		printf("WARNING: the tasks may not be schedulable, see above.\r\n");
+#endif
+	}
+
+	return err;
+}
+
+#endif
+
+/**
+ * Chooses the priority of each task and checks whether the task set is
+ * schedulable on the CPUs it is bound to, before any task is started. With
+ * TASK_AUTO_PRIORITY and SCHED_FIFO, priorities are assigned in
+ * deadline-monotonic order within two bands, the audio chain above the
+ * interactive tasks, otherwise the configured ones are used.
+ * Returns zero on success, EINVAL if priorities cannot be assigned and, with
+ * TASK_RTA_STRICT, EDEADLK if some task may miss its deadline.
+ */
+static inline int plan_tasks()
+{
+int			i;
+#ifndef AUDIO_APERIODIC
+int64_t		period;	// The exact period of the microphone task (in ns)
+#endif
+int			err = 0;
+
+	plan_task(TASK_GUI, TASK_GUI_BUDGET, TASK_GUI_PERIOD, TASK_GUI_DEADLINE,
+		GET_PRIO(TASK_GUI_PRIORITY));
+	plan_task(TASK_UI, TASK_UI_BUDGET, TASK_UI_PERIOD, TASK_UI_DEADLINE,
+		GET_PRIO(TASK_UI_PRIORITY));
+
+#ifdef AUDIO_APERIODIC
+	plan_task(TASK_CHK, TASK_CHK_BUDGET, TASK_CHK_PERIOD, TASK_CHK_DEADLINE,
+		GET_PRIO(TASK_CHK_PRIORITY));
+#else
+	plan_task(TASK_MIC, TASK_MIC_BUDGET, TASK_MIC_PERIOD, TASK_MIC_DEADLINE,
+		GET_PRIO(TASK_MIC_PRIORITY));
+
+	// The microphone task follows the period of the capture device
+	period = audio_get_record_period_ns();
+	ptask_set_period_ns(&main_state.tasks[TASK_MIC], period, period);
+#endif
+
+	plan_task(TASK_PLY, TASK_PLY_BUDGET, TASK_PLY_PERIOD, TASK_PLY_DEADLINE,
+		GET_PRIO(TASK_PLY_PRIORITY));
+	plan_task(TASK_SYN, TASK_SYN_BUDGET, TASK_SYN_PERIOD, TASK_SYN_DEADLINE,
+		GET_PRIO(TASK_SYN_PRIORITY));
+	plan_task(TASK_SRV, TASK_SRV_BUDGET, TASK_SRV_PERIOD, TASK_SRV_DEADLINE,
+		GET_PRIO(TASK_SRV_PRIORITY));
+
+	for (i = 0; i < TASK_ALS_NUM; ++i)
+	{
+		plan_task(TASK_ALS_FIRST + i, TASK_ALS_BUDGET, TASK_ALS_PERIOD,
+			TASK_ALS_DEADLINE, GET_PRIO(TASK_ALS_PRIORITY));
+	}
+
+	// Without fixed priorities there is nothing to analyze, the kernel
+	// performs its own admission control of SCHED_DEADLINE tasks
+#ifdef FIXED_PRIORITY
+	err = analyze_tasks();
+#endif
+
+	for (i = 0; i < TASK_NUM; ++i)
+	{
+		main_state.priority[i] = ptask_get_priority(&main_state.tasks[i]);
+		ptask_destroy(&main_state.tasks[i]);
+	}
+
+	return err;
+}
+
+#ifdef FIXED_PRIORITY
+
+/**
+ * Updates the measured WCET of the tasks started in graphic mode, which shall
+ * have been joined already, and checks again whether the task set is
+ * schedulable using the measured values, so that the user is warned before the
+ * next session.
+ */
+static inline void recheck_schedulability()
+{
+ptask_t*	tasks[TASK_NUM];
+int			ids[TASK_NUM];
+int			n;
+int			i;
+
+	n = task_ids(ids);
+
+	for (i = 0; i < n; ++i)
+	{
+		tasks[i] = &main_state.tasks[ids[i]];
+
+#ifdef PTASK_PROFILE
+		if ((int64_t) histogram_max(&ptask_get_profile(tasks[i])->exec) >
+			main_state.wcet[ids[i]])
+		{
+			main_state.wcet[ids[i]] =
+				histogram_max(&ptask_get_profile(tasks[i])->exec);
+		}
+#endif
+	}
+
+	check_schedulability(tasks, ids, n);
+}
+
+#endif
+
 /**
  * Aborts the task specified by the id. It is unsafe, since the task will leave
  * all data structures in a dirty condition, so it shall be called only when
@@ -829,11 +1539,17 @@ int err;
 
 	main_state.tasks_terminate = false;
 
-	err = start_gui_task();
-	if (err) return err;
+	qos_reset();
 
-	err = start_ui_task();
-	if (err) return err;
+	// Offline simulations have no user interface
+	if (!main_state.headless)
+	{
+		err = start_gui_task();
+		if (err) return err;
+
+		err = start_ui_task();
+		if (err) return err;
+	}
 
 #ifdef AUDIO_APERIODIC
 	err = start_checkdata_task();
@@ -843,34 +1559,95 @@ int err;
 	err = start_microphone_task();
 	if (err) return err;
 
+	err = start_playback_task();
+	if (err) return err;
+
 	err = start_analyzer_tasks();
 	return err;
 }
 
+/**
+ * Prints the timing profile of the given task, if it has run.
+ */
+static inline void print_task_profile(int task_id, const char *name)
+{
+int skipped = ptask_get_skipped(&main_state.tasks[task_id]);
+
+	ptask_print_profile(&main_state.tasks[task_id], name);
+
+	if (skipped > 0)
+		printf("%-8s skipped %d activations after overruns\r\n", name,
+			skipped);
+
+	if (ptask_get_overbudget(&main_state.tasks[task_id]) > 0)
+		printf("%-8s exceeded its budget in %d jobs\r\n", name,
+			ptask_get_overbudget(&main_state.tasks[task_id]));
+
+#ifdef PTASK_RT_GUARD
+	if (ptask_get_faults(&main_state.tasks[task_id]) > 0 ||
+		ptask_get_allocs(&main_state.tasks[task_id]) > 0)
+		printf("%-8s took %ld page faults and %ld allocations within jobs\r\n",
+			name, ptask_get_faults(&main_state.tasks[task_id]),
+			ptask_get_allocs(&main_state.tasks[task_id]));
+#endif
+
+#ifdef PTASK_MUTEX_PROFILE
+	// Maps the holders in the report of ptask_mutex_report to task names
+	printf("%-8s is task %d\r\n", name,
+		ptask_get_id(&main_state.tasks[task_id]));
+#endif
+}
+
+/**
+ * Prints the timing profile of the tasks started by initialize_tasks(), which
+ * shall have been joined already. Durations are in microseconds.
+ */
+static inline void print_tasks_profile()
+{
+char	name[16];
+int		i;
+
+	printf("Tasks timing (us): p50, p99 and max of execution time, response "
+		"time and jitter.\r\n");
+
+	if (!main_state.headless)
+	{
+		print_task_profile(TASK_GUI, "GUI");
+		print_task_profile(TASK_UI, "UI");
+	}
+
+	print_task_profile(TASK_MIC, "MIC");
+	print_task_profile(TASK_PLY, "PLY");
+
+	for (i = 0; i < TASK_ALS_NUM; ++i)
+	{
+		snprintf(name, sizeof(name), "ALS %d", i + 1);
+		print_task_profile(TASK_ALS_FIRST + i, name);
+	}
+}
+
 /**
  * Blocks the thread execution to join all the active tasks.
  */
 static inline void join_tasks()
 {
-	ptask_join(&main_state.tasks[TASK_UI]);
-	ptask_join(&main_state.tasks[TASK_GUI]);
+	if (!main_state.headless)
+	{
+		ptask_join(&main_state.tasks[TASK_UI]);
+		ptask_join(&main_state.tasks[TASK_GUI]);
+	}
+
 	ptask_join(&main_state.tasks[TASK_MIC]);
+	ptask_join(&main_state.tasks[TASK_PLY]);
 
 #ifdef AUDIO_APERIODIC
 	ptask_join(&main_state.tasks[TASK_CHK]);
 #endif
 
-	int num_recording_files = 0;
 	int i;
 
-	for (i = 0; i < audio_file_num_opened(); ++i)
-	{
-		if (audio_file_has_rec(i))
-		{
-			ptask_join(&main_state.tasks[TASK_ALS_FIRST + num_recording_files]);
-			++num_recording_files;
-		}
-	}
+	for (i = 0; i < TASK_ALS_NUM; ++i)
+		ptask_join(&main_state.tasks[TASK_ALS_FIRST + i]);
 }
 
 //@}
@@ -897,8 +1674,89 @@ static inline void main_wait()
 
 	// Wait for termination of all the tasks
 	join_tasks();
+
+	print_tasks_profile();
+
+#ifdef FIXED_PRIORITY
+	recheck_schedulability();
+#endif
 }
 
+#ifdef HEADLESS_SIMULATION
+/**
+ * Opens the audio files of the working directory (in alphabetical order, up to
+ * AUDIO_MAX_FILES), records the sample of each one from consecutive windows of
+ * the capture file and then runs all the tasks but the GUI and the user
+ * interaction ones for TASK_SIM_DURATION seconds of virtual time, on the rest
+ * of the capture file. Prints the timing profile of the tasks at the end.
+ * Returns zero on success, a non zero value otherwise.
+ */
+static inline int headless_simulation()
+{
+struct dirent**	entries;	// Entries of the working directory
+struct timespec	end;		// Virtual time at which the simulation ends
+char			path[MAX_DIRECTORY_LENGTH + MAX_CHAR_BUFFER_SIZE];
+main_job_t		cmd = { .path = path };
+int				n;
+int				i;
+int				err;
+
+	n = scandir(main_state.directory, &entries, NULL, alphasort);
+	if (n < 0) return errno;
+
+	for (i = 0; i < n; ++i)
+	{
+		snprintf(path, sizeof(path), "%s%s", main_state.directory,
+			entries[i]->d_name);
+
+		// Anything that is not an audio or MIDI file is skipped
+		if (entries[i]->d_type == DT_REG &&
+			audio_file_num_opened() < AUDIO_MAX_FILES &&
+			run_job(open_job, &cmd) == 0)
+			printf("%d. %s\r\n", audio_file_num_opened(), entries[i]->d_name);
+
+		free(entries[i]);
+	}
+
+	free(entries);
+
+	if (audio_file_num_opened() == 0)
+	{
+		printf("No audio files found in the working directory.\r\n");
+		return ENOENT;
+	}
+
+	for (i = 0; i < audio_file_num_opened(); ++i)
+	{
+		cmd.index = i;
+
+		err = run_job(record_job, &cmd);
+		if (err) return err;
+	}
+
+	printf("Simulating %d s...\r\n", TASK_SIM_DURATION);
+
+	// Tasks start together in the virtual time of simulations
+	ptask_sim_enter();
+	err = initialize_tasks();
+	ptask_sim_leave();
+
+	if (err) return err;
+
+	ptask_clock_gettime(&end);
+	end.tv_sec += TASK_SIM_DURATION;
+	ptask_sleep_until(&end);
+
+	main_terminate_tasks();
+
+	join_tasks();
+
+	print_tasks_profile();
+
+	return 0;
+}
+#endif
+
 /**
  * Initializes the program and the Allegro resources needed through all the
  * program life.
@@ -908,7 +1766,11 @@ static inline int program_init()
 {
 int err;
 
-#ifdef NDEBUG
+#if defined NDEBUG && defined TASK_SCHED_DEADLINE
+	// Each task gets its own CPU reservation
+	err = ptask_set_scheduler(SCHED_DEADLINE);
+	if (err) return err;
+#elif defined NDEBUG
 	// Program has not been compiled for debug, so I can use real-time
 	// scheduling
 	err = ptask_set_scheduler(SCHED_FIFO);
@@ -920,6 +1782,19 @@ int err;
 	if (err) return err;
 #endif
 
+	// Memory is locked before the other modules allocate their own, without
+	// the needed privileges tasks still get their stacks prefaulted
+	err = ptask_rt_init(TASK_STACK_SIZE);
+	if (err == EPERM || err == ENOMEM)
+		printf("WARNING: could not lock memory, real-time tasks may take "
+			"page faults.\r\n");
+	else if (err) return err;
+
+#ifdef CPU_PLACEMENT
+	// Must be done before Allegro creates its own threads
+	init_cpu_placement();
+#endif
+
 	// Allegro initialization
 	err = allegro_init();
 	if (err) return err;
@@ -929,7 +1804,12 @@ int err;
 	if (err) return err;
 
 	// Audio module initialization
-	err = audio_init();
+#ifdef HEADLESS_SIMULATION
+	if (main_state.headless)
+		err = audio_init_headless();
+	else
+#endif
+		err = audio_init();
 	if (err) return err;
 
 	// Video module initialization
@@ -939,6 +1819,7 @@ int err;
 	// Initializing semaphores
 	err = ptask_mutex_init(&main_state.mutex);
 	if (err) return err;
+	ptask_mutex_set_name(&main_state.mutex, "main");
 	err = ptask_cond_init(&main_state.cond);
 	if (err) return err;
 
@@ -969,11 +1850,32 @@ int err;
 	if (err)
 		abort_on_error("Could not properly initialize the program.");
 
+	err = plan_tasks();
+	if (err == EDEADLK)
+		abort_on_error("The tasks are not schedulable, try reducing their "
+			"budgets or the number of analysis tasks.");
+	if (err)
+		abort_on_error("Could not assign priorities to the tasks.");
+
+	err = start_server_task();
+	if (err)
+		abort_on_error("Could not start the server task.");
+
+#ifndef AUDIO_MIDI_ALSA_SEQ
+	// Offline simulations do not play anything
+	if (!main_state.headless)
+	{
+		err = start_synth_task();
+		if (err)
+			abort_on_error("Could not start the synthesizer task.");
+	}
+#endif
+
 	printf("Program initialized!\r\n");
 
 	print_log(LOG_VERBOSE,
-		"The desired period for audio tasks is %ld ms.\r\n",
-		AUDIO_DESIRED_PERIOD);
+		"The period for audio tasks is %lld us.\r\n",
+		audio_get_record_period_ns() / 1000);
 
 #ifdef AUDIO_APERIODIC
 	print_log(LOG_VERBOSE, "This is the APERIDIC version of the program.\r\n");
@@ -981,6 +1883,17 @@ int err;
 	print_log(LOG_VERBOSE, "This is the timer-based version of the program.\r\n");
 #endif
 
+#ifdef HEADLESS_SIMULATION
+	if (main_state.headless)
+	{
+		err = headless_simulation();
+		if (err)
+			abort_on_error("Could not run the simulation.");
+
+		main_state.quit = true;
+	}
+#endif
+
 	while (!main_state.quit)
 	{
 		terminal_mode();
@@ -991,7 +1904,14 @@ int err;
 
 			printf("Starting concurrent tasks...\r\n");
 
+			// Tasks start together in the virtual time of simulations
+			ptask_sim_enter();
 			err = initialize_tasks();
+			ptask_sim_leave();
+
+			if (err == EBUSY)
+				abort_on_error("The kernel refused the CPU reservations of the "
+					"tasks, try reducing their budgets.");
 			if (err)
 				abort_on_error("Could not initialize concurrent tasks.");
 
@@ -1003,6 +1923,34 @@ int err;
 		}
 	}
 
+#ifdef AUDIO_MIDI_ALSA_SEQ
+	// Silences external synthesizers before closing the sequencer
+	sequencer_close();
+#else
+	if (!main_state.headless)
+	{
+		synth_terminate();
+		ptask_join(&main_state.tasks[TASK_SYN]);
+		print_task_profile(TASK_SYN, "SYN");
+	}
+#endif
+
+	ptask_server_stop(&main_state.server);
+	ptask_join(&main_state.tasks[TASK_SRV]);
+	print_task_profile(TASK_SRV, "SRV");
+
+	printf("%-8s served %d jobs, rejected %d, discarded %d\r\n", "SRV",
+		main_state.server.served, main_state.server.rejected,
+		main_state.server.discarded);
+
+	if (trace_enabled())
+		cmd_trace();
+
+	// Does nothing unless PTASK_MUTEX_PROFILE is defined
+	ptask_mutex_report();
+
+	audio_close();
+
 	allegro_exit();
 
 	return EXIT_SUCCESS;
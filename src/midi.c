@@ -0,0 +1,354 @@
+/**
+ * @file midi.c
+ * @brief MIDI files pre-parsing functions
+ *
+ * This module converts MIDI files loaded by Allegro into flat arrays of channel
+ * events sorted by time.
+ *
+ * For public functions, documentation can be found in corresponding header
+ * file: midi.h.
+ *
+ */
+
+// Standard libraries
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+
+// Linked libraries
+#include <allegro.h>
+
+// Custom libraries
+#include "api/std_emu.h"
+
+// Other modules
+#include "midi.h"
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE CONSTANTS
+// -----------------------------------------------------------------------------
+
+#define META_EVENT		(0xFF)	///< Meta event status byte
+#define SYSEX_EVENT		(0xF0)	///< System exclusive event status byte
+#define SYSEX_ESCAPE	(0xF7)	///< System exclusive continuation status byte
+
+#define META_TEMPO		(0x51)	///< Set tempo meta event type
+#define META_END		(0x2F)	///< End of track meta event type
+
+#define DEFAULT_TEMPO	(500000)///< Microseconds per quarter note (120 bpm)
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE DATA TYPES
+// -----------------------------------------------------------------------------
+
+/// An event as read from a track, before converting its time in nanoseconds
+typedef struct __MIDI_RAW_EVENT_STRUCT
+{
+	uint32_t		tick;		///< Time of the event in MIDI ticks
+	uint32_t		order;		///< Reading order, used to keep the sorting
+								///< stable
+	uint32_t		tempo;		///< New tempo, only for tempo events
+	unsigned char	status;		///< Status byte, META_EVENT for tempo events
+	unsigned char	data1;		///< First data byte
+	unsigned char	data2;		///< Second data byte
+} midi_raw_event_t;
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE FUNCTIONS
+// -----------------------------------------------------------------------------
+
+/**
+ * @name Private functions
+ */
+//@{
+
+/**
+ * Reads a variable-length quantity starting from position pos, updating it.
+ * Returns false if the quantity exceeds the track length.
+ */
+static inline bool read_varlen(const unsigned char *data, int len, int *pos,
+	uint32_t *value)
+{
+unsigned char	byte;
+int				count = 0;	// Number of bytes read, at most 4 are allowed
+
+	*value = 0;
+
+	do
+	{
+		if (*pos >= len || count >= 4)
+			return false;
+
+		byte	= data[(*pos)++];
+		*value	= (*value << 7) | (byte & 0x7F);
+		++count;
+	} while (byte & 0x80);
+
+	return true;
+}
+
+/**
+ * Returns the number of data bytes of a channel event, given its status.
+ */
+static inline int channel_event_length(unsigned char status)
+{
+	switch (MIDI_STATUS_TYPE(status))
+	{
+	case MIDI_PROGRAM_CHANGE:
+	case MIDI_CHANNEL_PRESSURE:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+/**
+ * Parses a single track, appending its channel and tempo events to the out
+ * array (if not NULL) starting at position *count, which is updated.
+ * Returns zero on success, EINVAL if the track is malformed.
+ */
+static int parse_track(const unsigned char *data, int len,
+	midi_raw_event_t *out, int *count)
+{
+int				pos		= 0;	// Current reading position
+uint32_t		tick	= 0;	// Absolute time of current event in ticks
+uint32_t		delta;			// Delta time of current event
+uint32_t		length;			// Length of sysex and meta events
+unsigned char	status;			// Status of the current event
+unsigned char	running	= 0;	// Running status, zero if not available
+unsigned char	type;			// Meta event type
+midi_raw_event_t event;
+
+	while (pos < len)
+	{
+		if (!read_varlen(data, len, &pos, &delta))
+			return EINVAL;
+
+		tick += delta;
+
+		if (pos >= len)
+			return EINVAL;
+
+		status = data[pos];
+
+		if (status & 0x80)
+			++pos;
+		else if (running)
+			status = running;	// Running status, data byte is not consumed
+		else
+			return EINVAL;
+
+		if (status == META_EVENT)
+		{
+			if (pos >= len)
+				return EINVAL;
+
+			type = data[pos++];
+
+			if (!read_varlen(data, len, &pos, &length) ||
+				length > STATIC_CAST(uint32_t, len - pos))
+				return EINVAL;
+
+			if (type == META_TEMPO && length == 3)
+			{
+				event.tick		= tick;
+				event.order		= *count;
+				event.status	= META_EVENT;
+				event.tempo		= (data[pos] << 16) | (data[pos+1] << 8) |
+								data[pos+2];
+				event.data1		= event.data2 = 0;
+
+				if (out)
+					out[*count] = event;
+				++*count;
+			}
+
+			pos += length;
+			running = 0;
+
+			if (type == META_END)
+				break;
+		}
+		else if (status == SYSEX_EVENT || status == SYSEX_ESCAPE)
+		{
+			if (!read_varlen(data, len, &pos, &length) ||
+				length > STATIC_CAST(uint32_t, len - pos))
+				return EINVAL;
+
+			pos += length;
+			running = 0;
+		}
+		else if (status < 0xF0)
+		{
+			if (pos + channel_event_length(status) > len)
+				return EINVAL;
+
+			event.tick		= tick;
+			event.order		= *count;
+			event.status	= status;
+			event.tempo		= 0;
+			event.data1		= data[pos++] & 0x7F;
+			event.data2		= 0;
+
+			if (channel_event_length(status) == 2)
+				event.data2 = data[pos++] & 0x7F;
+
+			if (out)
+				out[*count] = event;
+			++*count;
+
+			running = status;
+		}
+		else
+		{
+			// System common and real-time messages are not allowed in files
+			return EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Comparison function used to sort events by time, keeping reading order for
+ * events happening at the same tick.
+ */
+static int raw_event_compare(const void *a, const void *b)
+{
+const midi_raw_event_t *ea = STATIC_CAST(const midi_raw_event_t *, a);
+const midi_raw_event_t *eb = STATIC_CAST(const midi_raw_event_t *, b);
+
+	if (ea->tick != eb->tick)
+		return ea->tick < eb->tick ? -1 : 1;
+
+	if (ea->order != eb->order)
+		return ea->order < eb->order ? -1 : 1;
+
+	return 0;
+}
+
+/**
+ * Parses all the tracks of the given MIDI into the out array, if not NULL.
+ * Returns zero on success and the number of events in count.
+ */
+static inline int parse_all_tracks(const MIDI *midi, midi_raw_event_t *out,
+	int *count)
+{
+int i;
+int err;
+
+	*count = 0;
+
+	for (i = 0; i < MIDI_TRACKS; ++i)
+	{
+		if (midi->track[i].data == NULL || midi->track[i].len <= 0)
+			continue;
+
+		err = parse_track(midi->track[i].data, midi->track[i].len, out, count);
+		if (err) return err;
+	}
+
+	return 0;
+}
+
+//@}
+
+// -----------------------------------------------------------------------------
+//                           PUBLIC FUNCTIONS
+// -----------------------------------------------------------------------------
+
+int midi_sequence_parse(midi_sequence_t *sequence, const MIDI *midi)
+{
+midi_raw_event_t*	raw;		// Events read from the tracks
+int					num_raw;	// Number of read events (including tempo)
+int					num_events;	// Number of channel events
+int					i, j;
+int					err;
+uint32_t			last_tick;	// Tick of the last tempo change
+int64_t				last_time;	// Time of the last tempo change (ns)
+uint32_t			tempo;		// Current tempo (us per quarter note)
+
+	sequence->events		= NULL;
+	sequence->num_events	= 0;
+	sequence->duration		= 0;
+
+	// SMPTE-based timing is not supported
+	if (midi->divisions <= 0)
+		return EINVAL;
+
+	// The first pass only counts the events, so that a single allocation is
+	// needed
+	err = parse_all_tracks(midi, NULL, &num_raw);
+	if (err) return err;
+
+	if (num_raw == 0)
+		return 0;
+
+	raw = STATIC_CAST(midi_raw_event_t *, malloc(sizeof(*raw) * num_raw));
+	if (raw == NULL)
+		return ENOMEM;
+
+	parse_all_tracks(midi, raw, &num_raw);
+
+	// Tracks are merged by sorting their events on time
+	qsort(raw, num_raw, sizeof(*raw), raw_event_compare);
+
+	num_events = 0;
+	for (i = 0; i < num_raw; ++i)
+	{
+		if (raw[i].status != META_EVENT)
+			++num_events;
+	}
+
+	sequence->events = STATIC_CAST(midi_event_t *,
+		malloc(sizeof(midi_event_t) * (num_events > 0 ? num_events : 1)));
+
+	if (sequence->events == NULL)
+	{
+		free(raw);
+		return ENOMEM;
+	}
+
+	// Ticks are converted to nanoseconds, following the tempo map
+	tempo		= DEFAULT_TEMPO;
+	last_tick	= 0;
+	last_time	= 0;
+
+	for (i = 0, j = 0; i < num_raw; ++i)
+	{
+		int64_t time = last_time + STATIC_CAST(int64_t, raw[i].tick - last_tick)
+			* tempo * 1000 / midi->divisions;
+
+		if (raw[i].status == META_EVENT)
+		{
+			last_tick	= raw[i].tick;
+			last_time	= time;
+			tempo		= raw[i].tempo;
+			continue;
+		}
+
+		sequence->events[j].time	= time;
+		sequence->events[j].status	= raw[i].status;
+		sequence->events[j].data1	= raw[i].data1;
+		sequence->events[j].data2	= raw[i].data2;
+		++j;
+	}
+
+	sequence->num_events	= num_events;
+	sequence->duration		=
+		num_events > 0 ? sequence->events[num_events-1].time : 0;
+
+	free(raw);
+
+	return 0;
+}
+
+void midi_sequence_free(midi_sequence_t *sequence)
+{
+	free(sequence->events);
+
+	sequence->events		= NULL;
+	sequence->num_events	= 0;
+	sequence->duration		= 0;
+}
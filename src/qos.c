@@ -0,0 +1,202 @@
+/**
+ * @file qos.c
+ * @brief Quality of service governor functions and data types
+ *
+ * For public functions, documentation can be found in corresponding header
+ * file: qos.h.
+ *
+ */
+
+// Standard libraries
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Custom libraries
+#include "api/std_emu.h"
+#include "api/time_utils.h"
+#include "api/ptask.h"
+#include "api/trace.h"
+
+// Other modules
+#include "constants.h"
+#include "qos.h"
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE DATA TYPES
+// -----------------------------------------------------------------------------
+
+/// The counters of a task at the beginning of the current window
+typedef struct __QOS_TASK_STRUCT
+{
+	int			dmiss;			///< Deadline misses
+	int			overbudget;		///< Jobs that exceeded their budget
+	uint64_t	jobs;			///< Jobs whose response time was measured
+	uint64_t	response;		///< Sum of their response times (in ns)
+} qos_task_t;
+
+/// Global state of the module
+typedef struct __QOS_STRUCT
+{
+	atomic_int		level;			///< The current level, see qos_level_t
+	bool			started;		///< False until the first window starts
+	struct timespec	window_end;		///< End of the current window
+	int				calm_windows;	///< Consecutive windows with headroom
+	qos_task_t		tasks[TASK_NUM];///< Counters of the observed tasks
+} qos_state_t;
+
+// -----------------------------------------------------------------------------
+//                           GLOBAL VARIABLES
+// -----------------------------------------------------------------------------
+
+/// The variable keeping the whole state of the governor
+static qos_state_t qos_state;
+
+/// What each level sheds, used for logging
+static const char *const qos_level_names[QOS_LEVEL_NUM] =
+{
+	"full quality",
+	"slower GUI",
+	"no FFT plot",
+	"no amplitude plot",
+	"reduced analysis rate",
+};
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE FUNCTIONS
+// -----------------------------------------------------------------------------
+
+/**
+ * @name Private functions
+ */
+//@{
+
+/**
+ * Stores the current counters of the given task in the given structure.
+ */
+static inline void read_counters(ptask_t *tp, qos_task_t *counters)
+{
+	counters->dmiss			= ptask_get_dmiss(tp);
+	counters->overbudget	= ptask_get_overbudget(tp);
+
+#ifdef PTASK_PROFILE
+	counters->jobs		= histogram_count(&ptask_get_profile(tp)->response);
+	counters->response	= histogram_sum(&ptask_get_profile(tp)->response);
+#else
+	counters->jobs		= 0;
+	counters->response	= 0;
+#endif
+}
+
+/**
+ * Returns the mean response time of the jobs of the given task within the
+ * window, relative to its deadline, and adds its deadline misses and budget
+ * overruns to misses. The counters are updated for the next window.
+ */
+static inline double observe_task(ptask_t *tp, qos_task_t *last, int *misses)
+{
+qos_task_t	now;
+double		load = 0.;
+
+	read_counters(tp, &now);
+
+	*misses += (now.dmiss - last->dmiss) + (now.overbudget - last->overbudget);
+
+	if (now.jobs > last->jobs)
+	{
+		load = STATIC_CAST(double, now.response - last->response) /
+			(now.jobs - last->jobs) / ptask_get_deadline_ns(tp);
+	}
+
+	*last = now;
+
+	return load;
+}
+
+/**
+ * Changes the level by the given step, logging the reason.
+ */
+static inline void change_level(int step, int misses, double load)
+{
+int level = atomic_load(&qos_state.level) + step;
+
+	atomic_store(&qos_state.level, level);
+
+	printf("QoS level %d (%s): %d misses, load %.0f%% of the deadline.\r\n",
+		level, qos_level_names[level], misses, load * 100.);
+
+	trace_counter("qos level", 0, level);
+}
+
+//@}
+
+// -----------------------------------------------------------------------------
+//                           PUBLIC FUNCTIONS
+// -----------------------------------------------------------------------------
+
+void qos_reset()
+{
+	atomic_store(&qos_state.level, QOS_LEVEL_FULL);
+
+	qos_state.started		= false;
+	qos_state.calm_windows	= 0;
+}
+
+void qos_update(ptask_t *tasks[], int n)
+{
+struct timespec	now;
+int				misses = 0;		// Misses and overruns within the window
+double			load = 0.;		// Greatest relative response time
+double			task_load;
+int				level;
+int				i;
+
+	ptask_clock_gettime(&now);
+
+	if (qos_state.started && time_cmp(now, qos_state.window_end) < 0)
+		return;
+
+	for (i = 0; i < n; ++i)
+	{
+		task_load = observe_task(tasks[i], &qos_state.tasks[i], &misses);
+
+		if (task_load > load)
+			load = task_load;
+	}
+
+	qos_state.window_end = now;
+	time_add_ms(&qos_state.window_end, QOS_WINDOW);
+
+	// The first window only reads the counters
+	if (!qos_state.started)
+	{
+		qos_state.started = true;
+		return;
+	}
+
+	level = atomic_load(&qos_state.level);
+
+	if (misses > 0 || load > QOS_HIGH_LOAD)
+	{
+		qos_state.calm_windows = 0;
+
+		if (level < QOS_LEVEL_NUM - 1)
+			change_level(+1, misses, load);
+	}
+	else if (load >= QOS_LOW_LOAD)
+		qos_state.calm_windows = 0;
+	else if (++qos_state.calm_windows >= QOS_UP_WINDOWS)
+	{
+		qos_state.calm_windows = 0;
+
+		if (level > QOS_LEVEL_FULL)
+			change_level(-1, misses, load);
+	}
+}
+
+qos_level_t qos_get_level()
+{
+	return atomic_load_explicit(&qos_state.level, memory_order_relaxed);
+}
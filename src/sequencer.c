@@ -0,0 +1,380 @@
+/**
+ * @file sequencer.c
+ * @brief ALSA sequencer MIDI output functions and data types
+ *
+ * This module sends pre-parsed MIDI sequences to external synthesizers through
+ * the ALSA sequencer, scheduling whole phrases on a kernel queue.
+ *
+ * For public functions, documentation can be found in corresponding header
+ * file: sequencer.h.
+ *
+ */
+
+// Standard libraries
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+// Linked libraries
+#include <allegro.h>
+#include <alsa/asoundlib.h>
+
+// Custom libraries
+#include "api/std_emu.h"
+#include "api/ptask.h"
+
+// Other modules
+#include "constants.h"
+#include "main.h"
+#include "midi.h"
+#include "sequencer.h"
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE CONSTANTS
+// -----------------------------------------------------------------------------
+
+#define SEQUENCER_POOL_SIZE		(2000)	///< Number of events that can wait in
+										///< the kernel queue, bigger phrases
+										///< block the caller until earlier
+										///< events are delivered
+#define SEQUENCER_BUFFER_SIZE	(SEQUENCER_POOL_SIZE * sizeof(snd_seq_event_t))
+										///< Size of the user-space output
+										///< buffer, so that a whole phrase is
+										///< usually written with one syscall
+
+#define CC_ALL_NOTES_OFF		(123)	///< All notes off controller
+
+#define SEQUENCER_MAX_VOL		(255)	///< Maximum volume, same scale of
+										///< Allegro samples
+
+#define NSEC_PER_SEC			(1000000000LL)
+										///< Nanoseconds in a second
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE DATA TYPES
+// -----------------------------------------------------------------------------
+
+/// Global state of the module
+typedef struct __SEQUENCER_STRUCT
+{
+	snd_seq_t*		handle;		///< ALSA sequencer handle
+	int				port;		///< Output port
+	int				queue;		///< Queue used to schedule phrases
+	ptask_mutex_t	mutex;		///< Serializes the accesses to the handle
+} sequencer_state_t;
+
+// -----------------------------------------------------------------------------
+//                           GLOBAL VARIABLES
+// -----------------------------------------------------------------------------
+
+/// The variable keeping the whole state of the sequencer module
+static sequencer_state_t sequencer_state =
+{
+	.handle	= NULL,
+	.port	= -1,
+	.queue	= -1,
+};
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE FUNCTIONS
+// -----------------------------------------------------------------------------
+
+/**
+ * @name Private functions
+ */
+//@{
+
+/**
+ * Converts a time in nanoseconds into an ALSA real time.
+ */
+static inline snd_seq_real_time_t ns_to_real_time(int64_t ns)
+{
+snd_seq_real_time_t res;
+
+	res.tv_sec	= ns / NSEC_PER_SEC;
+	res.tv_nsec	= ns % NSEC_PER_SEC;
+
+	return res;
+}
+
+/**
+ * Converts an ALSA real time into nanoseconds.
+ */
+static inline int64_t real_time_to_ns(const snd_seq_real_time_t *t)
+{
+	return STATIC_CAST(int64_t, t->tv_sec) * NSEC_PER_SEC + t->tv_nsec;
+}
+
+/**
+ * Fills the sequencer event corresponding to the given MIDI event, except for
+ * its timestamp. Returns false if the event has no sequencer counterpart.
+ */
+static inline bool compile_event(snd_seq_event_t *ev, const midi_event_t *e)
+{
+int channel = MIDI_STATUS_CHANNEL(e->status);
+
+	snd_seq_ev_clear(ev);
+	snd_seq_ev_set_source(ev, sequencer_state.port);
+	snd_seq_ev_set_subs(ev);
+
+	switch (MIDI_STATUS_TYPE(e->status))
+	{
+	case MIDI_NOTE_OFF:
+		snd_seq_ev_set_noteoff(ev, channel, e->data1, e->data2);
+		break;
+	case MIDI_NOTE_ON:
+		snd_seq_ev_set_noteon(ev, channel, e->data1, e->data2);
+		break;
+	case MIDI_KEY_PRESSURE:
+		snd_seq_ev_set_keypress(ev, channel, e->data1, e->data2);
+		break;
+	case MIDI_CONTROL_CHANGE:
+		snd_seq_ev_set_controller(ev, channel, e->data1, e->data2);
+		break;
+	case MIDI_PROGRAM_CHANGE:
+		snd_seq_ev_set_pgmchange(ev, channel, e->data1);
+		break;
+	case MIDI_CHANNEL_PRESSURE:
+		snd_seq_ev_set_chanpress(ev, channel, e->data1);
+		break;
+	case MIDI_PITCH_BEND:
+		snd_seq_ev_set_pitchbend(ev, channel,
+			(e->data1 | (e->data2 << 7)) - 8192);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+//@}
+
+// -----------------------------------------------------------------------------
+//                           PUBLIC FUNCTIONS
+// -----------------------------------------------------------------------------
+
+/* ------- UNSAFE FUNCTIONS - CALL ONLY IN SINGLE THREAD ENVIRONMENT -------- */
+
+int sequencer_init()
+{
+int				err;
+snd_seq_t*		handle;
+snd_seq_addr_t	dest;		// Address the port is connected to, if any
+
+	err = ptask_mutex_init(&sequencer_state.mutex);
+	if (err) return err;
+	ptask_mutex_set_name(&sequencer_state.mutex, "sequencer");
+
+	// Output only, blocking mode: if the kernel pool is full the caller waits
+	err = snd_seq_open(&handle, "default", SND_SEQ_OPEN_OUTPUT, 0);
+	if (err < 0)
+	{
+		print_log(LOG_VERBOSE, "Failed to open ALSA sequencer.\r\n");
+		return err;
+	}
+
+	sequencer_state.handle = handle;
+
+	err = snd_seq_set_client_name(handle, AUDIO_MIDI_SEQ_CLIENT_NAME);
+	if (err < 0) return err;
+
+	err = snd_seq_create_simple_port(handle, "MIDI out",
+		SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+		SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+	if (err < 0)
+	{
+		print_log(LOG_VERBOSE, "Failed to create ALSA sequencer port.\r\n");
+		return err;
+	}
+
+	sequencer_state.port = err;
+
+	err = snd_seq_set_client_pool_output(handle, SEQUENCER_POOL_SIZE);
+	if (err < 0) return err;
+
+	err = snd_seq_set_output_buffer_size(handle, SEQUENCER_BUFFER_SIZE);
+	if (err < 0) return err;
+
+	err = snd_seq_alloc_named_queue(handle, AUDIO_MIDI_SEQ_CLIENT_NAME);
+	if (err < 0)
+	{
+		print_log(LOG_VERBOSE, "Failed to allocate ALSA sequencer queue.\r\n");
+		return err;
+	}
+
+	sequencer_state.queue = err;
+
+	err = snd_seq_start_queue(handle, sequencer_state.queue, NULL);
+	if (err < 0) return err;
+
+	err = snd_seq_drain_output(handle);
+	if (err < 0) return err;
+
+	// A missing destination is not an error, the port can still be connected
+	// from outside
+	if (strlen(AUDIO_MIDI_SEQ_DEST) > 0)
+	{
+		err = snd_seq_parse_address(handle, &dest, AUDIO_MIDI_SEQ_DEST);
+		if (err >= 0)
+			err = snd_seq_connect_to(handle, sequencer_state.port,
+				dest.client, dest.port);
+
+		if (err < 0)
+			print_log(LOG_VERBOSE, "Could not connect MIDI output to %s: %s\r\n",
+				AUDIO_MIDI_SEQ_DEST, snd_strerror(err));
+	}
+
+	print_log(LOG_VERBOSE, "MIDI output available on ALSA port %d:%d.\r\n",
+		snd_seq_client_id(handle), sequencer_state.port);
+
+	return 0;
+}
+
+int sequencer_phrase_compile(sequencer_phrase_t *phrase,
+	const midi_sequence_t *sequence)
+{
+snd_seq_event_t*	ev;
+snd_seq_real_time_t	time;
+int					i;
+
+	phrase->events		= NULL;
+	phrase->num_events	= 0;
+
+	if (sequence->num_events == 0)
+		return 0;
+
+	phrase->events = STATIC_CAST(snd_seq_event_t *,
+		malloc(sizeof(snd_seq_event_t) * sequence->num_events));
+
+	if (phrase->events == NULL)
+		return ENOMEM;
+
+	for (i = 0; i < sequence->num_events; ++i)
+	{
+		ev = &phrase->events[phrase->num_events];
+
+		if (!compile_event(ev, &sequence->events[i]))
+			continue;
+
+		time = ns_to_real_time(sequence->events[i].time);
+		snd_seq_ev_schedule_real(ev, sequencer_state.queue, 0, &time);
+
+		++phrase->num_events;
+	}
+
+	return 0;
+}
+
+void sequencer_phrase_free(sequencer_phrase_t *phrase)
+{
+	free(phrase->events);
+
+	phrase->events		= NULL;
+	phrase->num_events	= 0;
+}
+
+void sequencer_close()
+{
+	if (sequencer_state.handle == NULL)
+		return;
+
+	sequencer_stop();
+
+	snd_seq_stop_queue(sequencer_state.handle, sequencer_state.queue, NULL);
+	snd_seq_drain_output(sequencer_state.handle);
+	snd_seq_free_queue(sequencer_state.handle, sequencer_state.queue);
+	snd_seq_close(sequencer_state.handle);
+
+	sequencer_state.handle = NULL;
+}
+
+/* ------------- SAFE FUNCTIONS - CAN BE CALLED FROM ANY THREAD ------------- */
+
+int sequencer_play(const sequencer_phrase_t *phrase, int volume, int frequency)
+{
+snd_seq_queue_status_t*	status;
+snd_seq_event_t			ev;		// Copy of the event being scheduled
+int64_t					now;	// Current queue time (ns)
+int64_t					offset;	// Event time relative to now (ns)
+int						velocity;
+int						err = 0;
+int						i;
+
+	if (frequency <= 0)
+		return -EINVAL;
+
+	snd_seq_queue_status_alloca(&status);
+
+	ptask_mutex_lock(&sequencer_state.mutex);
+
+	// All the events are timestamped with respect to the same queue time, so
+	// the phrase is not stretched by the time needed to enqueue it
+	err = snd_seq_get_queue_status(sequencer_state.handle,
+		sequencer_state.queue, status);
+
+	if (err >= 0)
+	{
+		now = real_time_to_ns(snd_seq_queue_status_get_real_time(status));
+
+		for (i = 0; i < phrase->num_events && err >= 0; ++i)
+		{
+			ev		= phrase->events[i];
+			offset	= real_time_to_ns(&ev.time.time) * 1000 / frequency;
+
+			ev.time.time = ns_to_real_time(now + offset);
+
+			if (ev.type == SND_SEQ_EVENT_NOTEON && ev.data.note.velocity > 0)
+			{
+				velocity = ev.data.note.velocity * volume / SEQUENCER_MAX_VOL;
+				ev.data.note.velocity = velocity > 0 ? velocity : 1;
+			}
+
+			err = snd_seq_event_output(sequencer_state.handle, &ev);
+		}
+
+		if (err >= 0)
+			err = snd_seq_drain_output(sequencer_state.handle);
+	}
+
+	ptask_mutex_unlock(&sequencer_state.mutex);
+
+	return err < 0 ? err : 0;
+}
+
+void sequencer_stop()
+{
+snd_seq_remove_events_t*	remove;
+snd_seq_event_t				ev;
+int							channel;
+
+	snd_seq_remove_events_alloca(&remove);
+	snd_seq_remove_events_set_condition(remove,
+		SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_IGNORE_OFF);
+	snd_seq_remove_events_set_queue(remove, sequencer_state.queue);
+
+	ptask_mutex_lock(&sequencer_state.mutex);
+
+	// Events still in the user-space buffer and in the kernel queue are dropped,
+	// except note offs that are kept for synthesizers ignoring all notes off
+	snd_seq_drop_output(sequencer_state.handle);
+	snd_seq_remove_events(sequencer_state.handle, remove);
+
+	// Notes that already started are silenced with direct events
+	for (channel = 0; channel < MIDI_CHANNELS; ++channel)
+	{
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_source(&ev, sequencer_state.port);
+		snd_seq_ev_set_subs(&ev);
+		snd_seq_ev_set_direct(&ev);
+		snd_seq_ev_set_controller(&ev, channel, CC_ALL_NOTES_OFF, 0);
+
+		snd_seq_event_output(sequencer_state.handle, &ev);
+	}
+
+	snd_seq_drain_output(sequencer_state.handle);
+
+	ptask_mutex_unlock(&sequencer_state.mutex);
+}
@@ -0,0 +1,884 @@
+/**
+ * @file synth.c
+ * @brief Wavetable synthesizer functions and data types
+ *
+ * This module renders pre-parsed MIDI sequences using a simple in-process
+ * wavetable synthesizer, whose output is played through an Allegro audio
+ * stream.
+ *
+ * Each program family of the General MIDI set is associated with a single
+ * cycle wavetable, built at initialization time from a family-specific
+ * harmonic spectrum; percussions use a noise table instead. Voices are
+ * rendered four frames at a time using GCC vector extensions, both for the
+ * oscillators and for the linear ADSR envelopes.
+ *
+ * For public functions, documentation can be found in corresponding header
+ * file: synth.h.
+ *
+ */
+
+// Standard libraries
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+
+// Linked libraries
+#include <allegro.h>
+
+// Custom libraries
+#include "api/std_emu.h"
+#include "api/ptask.h"
+#include "api/trace.h"
+
+// Other modules
+#include "constants.h"
+#include "midi.h"
+#include "synth.h"
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE CONSTANTS
+// -----------------------------------------------------------------------------
+
+#define SYNTH_MAX_VOICES		(32)	///< Maximum number of sounding notes
+#define SYNTH_MAX_PLAYERS		(8)		///< Maximum number of sequences that
+										///< can be played at the same time
+
+#define SYNTH_STREAM_FRAMES		(256)
+										///< Number of frames of each half of
+										///< the Allegro stream buffer, the
+										///< period of the synth task shall be
+										///< shorter than its duration
+#define SYNTH_BLOCK_FRAMES		(32)
+										///< Events are applied at the
+										///< beginning of blocks of this many
+										///< frames, it must be a multiple of 4
+
+#define SYNTH_TABLE_BITS		(11)	///< Log2 of the wavetables length
+#define SYNTH_TABLE_SIZE		(1 << SYNTH_TABLE_BITS)
+										///< Number of samples in a wavetable
+#define SYNTH_TABLE_MASK		(SYNTH_TABLE_SIZE - 1)
+										///< Mask used to wrap table indexes
+#define SYNTH_HARMONICS			(16)	///< Harmonics summed in each table
+
+#define SYNTH_FAMILIES			(16)	///< Number of General MIDI families
+#define SYNTH_NOISE_TABLE		(SYNTH_FAMILIES)
+										///< Index of the percussion table
+#define SYNTH_NUM_TABLES		(SYNTH_FAMILIES + 1)
+										///< Number of wavetables
+
+#define SYNTH_MASTER_GAIN		(0.25f)	///< Gain applied to the whole mix
+
+#define SYNTH_BEND_RANGE		(2.f)	///< Pitch bend range in semitones
+
+#define CC_VOLUME				(7)		///< Channel volume controller
+#define CC_PAN					(10)	///< Channel panning controller
+#define CC_EXPRESSION			(11)	///< Channel expression controller
+#define CC_ALL_SOUND_OFF		(120)	///< All sound off controller
+#define CC_ALL_NOTES_OFF		(123)	///< All notes off controller
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE DATA TYPES
+// -----------------------------------------------------------------------------
+
+/// Four packed floats, processed in parallel
+typedef float synth_v4sf_t __attribute__ ((vector_size (16)));
+/// Four packed integers, used as masks for synth_v4sf_t comparisons
+typedef int synth_v4si_t __attribute__ ((vector_size (16)));
+
+/// The possible states of a voice envelope
+typedef enum __SYNTH_ENV_ENUM
+{
+	ENV_OFF = 0,				///< The voice is free
+	ENV_ATTACK,					///< Level is rising to the maximum
+	ENV_DECAY,					///< Level is falling to the sustain level
+	ENV_SUSTAIN,				///< Level is constant until note off
+	ENV_RELEASE,				///< Level is falling to zero
+} synth_env_t;
+
+/// A single sounding note
+typedef struct __SYNTH_VOICE_STRUCT
+{
+	synth_env_t		state;		///< Envelope state, ENV_OFF if free
+	long			owner;		///< Identifier of the play that started it
+	unsigned char	channel;	///< MIDI channel of the note
+	unsigned char	note;		///< MIDI key of the note
+
+	const float*	table;		///< Wavetable used by the oscillator
+	float			phase;		///< Current position in the wavetable
+	float			base_incr;	///< Phase increment per frame, without bend
+	float			incr;		///< Actual phase increment per frame
+
+	float			level;		///< Current envelope level
+	float			attack;		///< Level increment per frame in attack
+	float			decay;		///< Level decrement per frame in decay
+	float			sustain;	///< Sustain level, zero for percussive sounds
+	float			release;	///< Level decrement per frame in release
+
+	float			gain_l;		///< Left channel gain
+	float			gain_r;		///< Right channel gain
+
+	int64_t			age;		///< Frame at which the note started, used to
+								///< choose which voice should be stolen
+} synth_voice_t;
+
+/// The state of a sequence that is being played
+typedef struct __SYNTH_PLAYER_STRUCT
+{
+	bool			playing;	///< False if the slot is free
+	midi_sequence_t	sequence;	///< The played sequence, events are shared
+								///< with the caller
+	long			id;			///< Identifier of this play
+	int				next;		///< Index of the next event to be applied
+	bool			started;	///< False until a start frame is assigned
+	int64_t			start_frame;///< Frame corresponding to time zero
+	double			frames_per_ns;
+								///< Frames per nanosecond of sequence time,
+								///< speed adjustment included
+	float			pitch;		///< Frequency ratio applied to all notes
+	float			volume;		///< Volume of the play, in [0,1]
+	float			panning;	///< Panning of the play, in [0,1]
+
+	unsigned char	program[MIDI_CHANNELS];
+								///< Current program of each channel
+	unsigned char	cc_volume[MIDI_CHANNELS];
+								///< Current volume of each channel
+	unsigned char	cc_expression[MIDI_CHANNELS];
+								///< Current expression of each channel
+	unsigned char	cc_pan[MIDI_CHANNELS];
+								///< Current panning of each channel
+	float			bend[MIDI_CHANNELS];
+								///< Current pitch bend ratio of each channel
+} synth_player_t;
+
+/// Global state of the module
+typedef struct __SYNTH_STRUCT
+{
+	int				rate;		///< Rendering rate
+	AUDIOSTREAM*	stream;		///< Stream mixed by Allegro with samples
+
+	float			tables[SYNTH_NUM_TABLES][SYNTH_TABLE_SIZE + 1];
+								///< Single cycle wavetables, the last sample
+								///< repeats the first one to simplify the
+								///< interpolation
+
+	synth_voice_t	voices[SYNTH_MAX_VOICES];
+								///< All the voices
+	synth_player_t	players[SYNTH_MAX_PLAYERS];
+								///< All the sequence players
+
+	synth_v4sf_t	mix_l[SYNTH_STREAM_FRAMES / 4];
+								///< Left channel mix of the current chunk
+	synth_v4sf_t	mix_r[SYNTH_STREAM_FRAMES / 4];
+								///< Right channel mix of the current chunk
+
+	int64_t			frame;		///< Number of frames rendered so far
+	long			next_id;	///< Identifier of the next play
+
+	bool			stop_requested;
+								///< Tells the synth task to release all voices
+	bool			terminate;	///< Tells the synth task to terminate
+
+	ptask_mutex_t	mutex;		///< Protects players and flags, it is held
+								///< by the synth task while rendering a chunk
+} synth_state_t;
+
+// -----------------------------------------------------------------------------
+//                           GLOBAL VARIABLES
+// -----------------------------------------------------------------------------
+
+/// The variable keeping the whole state of the synth module
+static synth_state_t synth_state =
+{
+	.stream		= NULL,
+	.frame		= 0,
+	.next_id	= 1,
+};
+
+// -----------------------------------------------------------------------------
+//                           PRIVATE FUNCTIONS
+// -----------------------------------------------------------------------------
+
+/**
+ * @name Private functions
+ */
+//@{
+
+/// Returns a vector with all four elements equal to the given value
+static inline synth_v4sf_t v4_splat(float x)
+{
+	return (synth_v4sf_t) { x, x, x, x };
+}
+
+/// Element-wise minimum between two vectors
+static inline synth_v4sf_t v4_min(synth_v4sf_t a, synth_v4sf_t b)
+{
+synth_v4si_t mask = a < b;
+
+	return STATIC_CAST(synth_v4sf_t,
+		(mask & STATIC_CAST(synth_v4si_t, a)) |
+		(~mask & STATIC_CAST(synth_v4si_t, b)));
+}
+
+/// Element-wise maximum between two vectors
+static inline synth_v4sf_t v4_max(synth_v4sf_t a, synth_v4sf_t b)
+{
+synth_v4si_t mask = a > b;
+
+	return STATIC_CAST(synth_v4sf_t,
+		(mask & STATIC_CAST(synth_v4si_t, a)) |
+		(~mask & STATIC_CAST(synth_v4si_t, b)));
+}
+
+/**
+ * Fills the wavetable of the given program family. Families differ in the
+ * slope of their harmonic spectrum and in the presence of even harmonics.
+ */
+static inline void build_family_table(float *table, int family)
+{
+double	slope;		// Spectrum slope, the higher the mellower
+bool	odd_only;	// True for hollow, clarinet-like sounds
+double	peak = 0.;	// Peak value, used for normalization
+double	value;
+int		i, h;
+
+	slope		= 1. + 0.5 * (family % 4);
+	odd_only	= (family / 4) % 2;
+
+	for (i = 0; i < SYNTH_TABLE_SIZE; ++i)
+	{
+		value = 0.;
+
+		for (h = 1; h <= SYNTH_HARMONICS; ++h)
+		{
+			if (odd_only && h % 2 == 0)
+				continue;
+
+			value += sin(2. * M_PI * h * i / SYNTH_TABLE_SIZE) / pow(h, slope);
+		}
+
+		table[i] = value;
+
+		if (fabs(value) > peak)
+			peak = fabs(value);
+	}
+
+	for (i = 0; i < SYNTH_TABLE_SIZE; ++i)
+		table[i] /= peak;
+
+	table[SYNTH_TABLE_SIZE] = table[0];
+}
+
+/**
+ * Fills the percussion table with deterministic white noise.
+ */
+static inline void build_noise_table(float *table)
+{
+uint32_t	seed = 0x12345678;	// Linear congruential generator state
+int			i;
+
+	for (i = 0; i < SYNTH_TABLE_SIZE; ++i)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		table[i] = STATIC_CAST(float, seed >> 8) / STATIC_CAST(float, 1 << 23)
+			- 1.f;
+	}
+
+	table[SYNTH_TABLE_SIZE] = table[0];
+}
+
+/**
+ * Returns true if the given program family has a percussive envelope, i.e.\ its
+ * notes fade out even if the key is held.
+ */
+static inline bool family_is_percussive(int family)
+{
+	switch (family)
+	{
+	case 0:		// Piano
+	case 1:		// Chromatic percussion
+	case 3:		// Guitar
+	case 4:		// Bass
+	case 14:	// Percussive
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Sets the envelope of a voice, given the program family or the percussion
+ * channel.
+ */
+static inline void voice_set_envelope(synth_voice_t *v, int family, bool drum)
+{
+float attack_time	= 0.005f;	// Attack duration (s)
+float decay_time	= 0.3f;		// Decay duration (s)
+float release_time	= 0.15f;	// Release duration (s)
+float rate			= synth_state.rate;
+
+	v->sustain = 0.7f;
+
+	if (drum)
+	{
+		attack_time		= 0.001f;
+		decay_time		= 0.15f;
+		release_time	= 0.05f;
+		v->sustain		= 0.f;
+	}
+	else if (family_is_percussive(family))
+	{
+		decay_time		= 1.5f;
+		v->sustain		= 0.f;
+	}
+	else if (family == 6 || family == 11)
+	{
+		// Slow attack for ensembles and pads
+		attack_time		= 0.08f;
+	}
+
+	v->attack	= 1.f / (attack_time * rate);
+	v->decay	= (1.f - v->sustain) / (decay_time * rate);
+	v->release	= 1.f / (release_time * rate);
+	v->level	= 0.f;
+	v->state	= ENV_ATTACK;
+}
+
+/**
+ * Returns the index of the voice that shall be used for a new note: a free one
+ * if available, otherwise the quietest released one, otherwise the oldest one.
+ */
+static inline int voice_allocate()
+{
+int		i;
+int		best		= 0;
+bool	releasing	= false;	// True if best is a voice in release
+
+	for (i = 0; i < SYNTH_MAX_VOICES; ++i)
+	{
+		const synth_voice_t *v = &synth_state.voices[i];
+
+		if (v->state == ENV_OFF)
+			return i;
+
+		if (v->state == ENV_RELEASE)
+		{
+			if (!releasing || v->level < synth_state.voices[best].level)
+			{
+				best		= i;
+				releasing	= true;
+			}
+		}
+		else if (!releasing && v->age < synth_state.voices[best].age)
+		{
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Starts a new note on the given player.
+ */
+static inline void player_note_on(synth_player_t *p, int channel, int note,
+	int velocity)
+{
+synth_voice_t*	v;
+int				family;
+bool			drum;
+float			amplitude;
+float			pan;
+float			frequency;
+
+	drum	= channel == MIDI_DRUM_CHANNEL;
+	family	= p->program[channel] / 8;
+
+	v = &synth_state.voices[voice_allocate()];
+
+	v->owner	= p->id;
+	v->channel	= channel;
+	v->note		= note;
+	v->table	= synth_state.tables[drum ? SYNTH_NOISE_TABLE : family];
+	v->phase	= 0.f;
+	v->age		= synth_state.frame;
+
+	frequency = 440.f * powf(2.f, (note - 69) / 12.f) * p->pitch;
+
+	v->base_incr	= frequency * SYNTH_TABLE_SIZE / synth_state.rate;
+	v->incr			= v->base_incr * p->bend[channel];
+
+	amplitude	= (velocity / 127.f) * (p->cc_volume[channel] / 127.f) *
+		(p->cc_expression[channel] / 127.f) * p->volume;
+
+	pan = p->panning + (p->cc_pan[channel] - 64) / 127.f;
+	pan = pan < 0.f ? 0.f : pan > 1.f ? 1.f : pan;
+
+	v->gain_l	= amplitude * sqrtf(1.f - pan);
+	v->gain_r	= amplitude * sqrtf(pan);
+
+	voice_set_envelope(v, family, drum);
+}
+
+/**
+ * Releases the notes of the given player that match the given channel and, if
+ * note is not negative, the given key.
+ */
+static inline void player_note_off(synth_player_t *p, int channel, int note)
+{
+int i;
+
+	for (i = 0; i < SYNTH_MAX_VOICES; ++i)
+	{
+		synth_voice_t *v = &synth_state.voices[i];
+
+		if (v->owner == p->id && v->channel == channel &&
+			(note < 0 || v->note == note) &&
+			v->state != ENV_OFF && v->state != ENV_RELEASE)
+		{
+			v->state = ENV_RELEASE;
+		}
+	}
+}
+
+/**
+ * Applies a pitch bend to a channel, updating sounding notes too.
+ */
+static inline void player_pitch_bend(synth_player_t *p, int channel, int value)
+{
+int i;
+
+	p->bend[channel] = powf(2.f,
+		(value - 8192) / 8192.f * SYNTH_BEND_RANGE / 12.f);
+
+	for (i = 0; i < SYNTH_MAX_VOICES; ++i)
+	{
+		synth_voice_t *v = &synth_state.voices[i];
+
+		if (v->owner == p->id && v->channel == channel && v->state != ENV_OFF)
+			v->incr = v->base_incr * p->bend[channel];
+	}
+}
+
+/**
+ * Applies a single MIDI event to the given player.
+ */
+static inline void player_apply(synth_player_t *p, const midi_event_t *e)
+{
+int channel = MIDI_STATUS_CHANNEL(e->status);
+
+	switch (MIDI_STATUS_TYPE(e->status))
+	{
+	case MIDI_NOTE_ON:
+		if (e->data2 > 0)
+		{
+			player_note_on(p, channel, e->data1, e->data2);
+			break;
+		}
+		// A note on with zero velocity is a note off
+		// fall through
+	case MIDI_NOTE_OFF:
+		player_note_off(p, channel, e->data1);
+		break;
+	case MIDI_CONTROL_CHANGE:
+		switch (e->data1)
+		{
+		case CC_VOLUME:
+			p->cc_volume[channel] = e->data2;
+			break;
+		case CC_PAN:
+			p->cc_pan[channel] = e->data2;
+			break;
+		case CC_EXPRESSION:
+			p->cc_expression[channel] = e->data2;
+			break;
+		case CC_ALL_SOUND_OFF:
+		case CC_ALL_NOTES_OFF:
+			player_note_off(p, channel, -1);
+			break;
+		default:
+			// Other controllers are ignored
+			break;
+		}
+		break;
+	case MIDI_PROGRAM_CHANGE:
+		p->program[channel] = e->data1;
+		break;
+	case MIDI_PITCH_BEND:
+		player_pitch_bend(p, channel, e->data1 | (e->data2 << 7));
+		break;
+	default:
+		// Pressure events are ignored
+		break;
+	}
+}
+
+/**
+ * Applies to each player all the events that fall before the end of the block
+ * starting at the current frame.
+ */
+static inline void players_process_block()
+{
+int64_t	block_end = synth_state.frame + SYNTH_BLOCK_FRAMES;
+int		i;
+
+	for (i = 0; i < SYNTH_MAX_PLAYERS; ++i)
+	{
+		synth_player_t *p = &synth_state.players[i];
+
+		if (!p->playing)
+			continue;
+
+		if (!p->started)
+		{
+			p->started		= true;
+			p->start_frame	= synth_state.frame;
+		}
+
+		while (p->next < p->sequence.num_events)
+		{
+			const midi_event_t *e = &p->sequence.events[p->next];
+
+			if (p->start_frame + STATIC_CAST(int64_t,
+					e->time * p->frames_per_ns) >= block_end)
+				break;
+
+			player_apply(p, e);
+			++p->next;
+		}
+
+		// The slot is freed as soon as all events have been applied, released
+		// notes will fade out anyway
+		if (p->next >= p->sequence.num_events)
+			p->playing = false;
+	}
+}
+
+/**
+ * Renders nframes frames (a multiple of 4) of the given voice, adding them to
+ * the given mix buffers.
+ */
+static inline void voice_render(synth_voice_t *v, synth_v4sf_t *out_l,
+	synth_v4sf_t *out_r, int nframes)
+{
+const synth_v4sf_t offsets	= { 0.f, 1.f, 2.f, 3.f };
+const synth_v4sf_t ramp		= { 1.f, 2.f, 3.f, 4.f };
+
+synth_v4sf_t	phase;		// Phases of four consecutive frames
+synth_v4sf_t	a, b, frac;	// Interpolation points and weights
+synth_v4sf_t	sample;		// Oscillator output
+synth_v4sf_t	env;		// Envelope levels of four consecutive frames
+int				f, k;
+int				index;
+
+	for (f = 0; f < nframes && v->state != ENV_OFF; f += 4)
+	{
+		// Oscillator, the table lookup is the only scalar part
+		phase = v4_splat(v->phase) + v4_splat(v->incr) * offsets;
+
+		for (k = 0; k < 4; ++k)
+		{
+			index	= STATIC_CAST(int, phase[k]);
+			frac[k]	= phase[k] - index;
+			index	&= SYNTH_TABLE_MASK;
+			a[k]	= v->table[index];
+			b[k]	= v->table[index + 1];
+		}
+
+		sample = a + (b - a) * frac;
+
+		v->phase += 4.f * v->incr;
+		v->phase -= SYNTH_TABLE_SIZE * floorf(v->phase / SYNTH_TABLE_SIZE);
+
+		// Envelope
+		switch (v->state)
+		{
+		case ENV_ATTACK:
+			env = v4_min(v4_splat(v->level) + v4_splat(v->attack) * ramp,
+				v4_splat(1.f));
+			if (env[3] >= 1.f)
+				v->state = ENV_DECAY;
+			break;
+		case ENV_DECAY:
+			env = v4_max(v4_splat(v->level) - v4_splat(v->decay) * ramp,
+				v4_splat(v->sustain));
+			if (env[3] <= v->sustain)
+				v->state = v->sustain > 0.f ? ENV_SUSTAIN : ENV_OFF;
+			break;
+		case ENV_SUSTAIN:
+			env = v4_splat(v->level);
+			break;
+		case ENV_RELEASE:
+		default:
+			env = v4_max(v4_splat(v->level) - v4_splat(v->release) * ramp,
+				v4_splat(0.f));
+			if (env[3] <= 0.f)
+				v->state = ENV_OFF;
+			break;
+		}
+
+		v->level = env[3];
+
+		sample *= env;
+
+		out_l[f / 4] += sample * v4_splat(v->gain_l);
+		out_r[f / 4] += sample * v4_splat(v->gain_r);
+	}
+}
+
+/**
+ * Renders a whole chunk of SYNTH_STREAM_FRAMES frames in the mix buffers,
+ * applying events at the beginning of each block.
+ */
+static inline void render_chunk()
+{
+int offset;		// Offset of the current block within the chunk
+int i;
+
+	for (i = 0; i < SYNTH_STREAM_FRAMES / 4; ++i)
+	{
+		synth_state.mix_l[i] = v4_splat(0.f);
+		synth_state.mix_r[i] = v4_splat(0.f);
+	}
+
+	if (synth_state.stop_requested)
+	{
+		for (i = 0; i < SYNTH_MAX_VOICES; ++i)
+		{
+			if (synth_state.voices[i].state != ENV_OFF)
+				synth_state.voices[i].state = ENV_RELEASE;
+		}
+
+		synth_state.stop_requested = false;
+	}
+
+	for (offset = 0; offset < SYNTH_STREAM_FRAMES;
+		offset += SYNTH_BLOCK_FRAMES)
+	{
+		players_process_block();
+
+		for (i = 0; i < SYNTH_MAX_VOICES; ++i)
+		{
+			if (synth_state.voices[i].state == ENV_OFF)
+				continue;
+
+			voice_render(&synth_state.voices[i],
+				synth_state.mix_l + offset / 4,
+				synth_state.mix_r + offset / 4,
+				SYNTH_BLOCK_FRAMES);
+		}
+
+		synth_state.frame += SYNTH_BLOCK_FRAMES;
+	}
+}
+
+/**
+ * Converts the mix buffers into the format used by Allegro streams, which is
+ * interleaved unsigned 16-bit stereo.
+ */
+static inline void mix_to_stream(unsigned short *out)
+{
+float	value;
+int		i;
+
+	for (i = 0; i < SYNTH_STREAM_FRAMES; ++i)
+	{
+		value = synth_state.mix_l[i / 4][i % 4] * SYNTH_MASTER_GAIN;
+		value = value < -1.f ? -1.f : value > 1.f ? 1.f : value;
+		out[2*i] = STATIC_CAST(unsigned short, value * 32767.f + 32768.f);
+
+		value = synth_state.mix_r[i / 4][i % 4] * SYNTH_MASTER_GAIN;
+		value = value < -1.f ? -1.f : value > 1.f ? 1.f : value;
+		out[2*i+1] = STATIC_CAST(unsigned short, value * 32767.f + 32768.f);
+	}
+}
+
+/**
+ * Fills the Allegro stream buffer, if it is waiting for new data.
+ */
+static inline void synth_fill_stream()
+{
+unsigned short* buffer;
+
+	buffer = STATIC_CAST(unsigned short *,
+		get_audio_stream_buffer(synth_state.stream));
+
+	if (buffer == NULL)
+		return;
+
+	ptask_mutex_lock(&synth_state.mutex);
+	render_chunk();
+	ptask_mutex_unlock(&synth_state.mutex);
+
+	mix_to_stream(buffer);
+
+	free_audio_stream_buffer(synth_state.stream);
+}
+
+/**
+ * Returns true if the synth task should terminate.
+ */
+static inline bool synth_get_terminate()
+{
+bool res;
+
+	ptask_mutex_lock(&synth_state.mutex);
+	res = synth_state.terminate;
+	ptask_mutex_unlock(&synth_state.mutex);
+
+	return res;
+}
+
+//@}
+
+// -----------------------------------------------------------------------------
+//                           PUBLIC FUNCTIONS
+// -----------------------------------------------------------------------------
+
+int synth_init(int rate)
+{
+int err;
+int i;
+
+	err = ptask_mutex_init(&synth_state.mutex);
+	if (err) return err;
+	ptask_mutex_set_name(&synth_state.mutex, "synth");
+
+	synth_state.rate = rate;
+
+	for (i = 0; i < SYNTH_FAMILIES; ++i)
+		build_family_table(synth_state.tables[i], i);
+
+	build_noise_table(synth_state.tables[SYNTH_NOISE_TABLE]);
+
+	synth_state.stream = play_audio_stream(SYNTH_STREAM_FRAMES, 16, true, rate,
+		255, 128);
+
+	return synth_state.stream == NULL ? EINVAL : 0;
+}
+
+int synth_play(const midi_sequence_t *sequence, int volume, int panning,
+	int frequency)
+{
+synth_player_t*	p = NULL;
+int				i;
+
+	ptask_mutex_lock(&synth_state.mutex);
+
+	for (i = 0; i < SYNTH_MAX_PLAYERS && p == NULL; ++i)
+	{
+		if (!synth_state.players[i].playing)
+			p = &synth_state.players[i];
+	}
+
+	if (p != NULL)
+	{
+		p->playing		= true;
+		p->sequence		= *sequence;
+		p->id			= synth_state.next_id++;
+		p->next			= 0;
+		p->started		= false;
+		p->frames_per_ns= synth_state.rate / 1e9 * frequency / 1000.;
+		p->pitch		= frequency / 1000.f;
+		p->volume		= volume / 255.f;
+		p->panning		= panning / 255.f;
+
+		for (i = 0; i < MIDI_CHANNELS; ++i)
+		{
+			p->program[i]		= 0;
+			p->cc_volume[i]		= 100;
+			p->cc_expression[i]	= 127;
+			p->cc_pan[i]		= 64;
+			p->bend[i]			= 1.f;
+		}
+	}
+
+	ptask_mutex_unlock(&synth_state.mutex);
+
+	return p == NULL ? EAGAIN : 0;
+}
+
+void synth_stop()
+{
+int i;
+
+	ptask_mutex_lock(&synth_state.mutex);
+
+	for (i = 0; i < SYNTH_MAX_PLAYERS; ++i)
+		synth_state.players[i].playing = false;
+
+	synth_state.stop_requested = true;
+
+	ptask_mutex_unlock(&synth_state.mutex);
+}
+
+void synth_stop_sequence(const midi_sequence_t *sequence)
+{
+int i;
+int j;
+
+	ptask_mutex_lock(&synth_state.mutex);
+
+	for (i = 0; i < SYNTH_MAX_PLAYERS; ++i)
+	{
+		synth_player_t *p = &synth_state.players[i];
+
+		if (!p->playing || p->sequence.events != sequence->events)
+			continue;
+
+		p->playing = false;
+
+		// Voices are rendered while holding the mutex, they can be released
+		// directly; other plays keep sounding
+		for (j = 0; j < SYNTH_MAX_VOICES; ++j)
+		{
+			synth_voice_t *v = &synth_state.voices[j];
+
+			if (v->owner == p->id && v->state != ENV_OFF)
+				v->state = ENV_RELEASE;
+		}
+	}
+
+	ptask_mutex_unlock(&synth_state.mutex);
+}
+
+void synth_terminate()
+{
+	ptask_mutex_lock(&synth_state.mutex);
+	synth_state.terminate = true;
+	ptask_mutex_unlock(&synth_state.mutex);
+}
+
+// -----------------------------------------------------------------------------
+//                                  TASKS
+// -----------------------------------------------------------------------------
+
+void* synth_task(void *arg)
+{
+ptask_t* tp;
+
+	tp = STATIC_CAST(ptask_t *, arg);
+
+	trace_thread_register("SYN");
+
+	ptask_start_period(tp);
+
+	while (!synth_get_terminate())
+	{
+		synth_fill_stream();
+
+		ptask_sim_consume(TASK_SYN_COST * 1000LL);
+
+		if (ptask_deadline_miss(tp))
+			printf("TASK_SYN missed %d deadlines!\r\n", ptask_get_dmiss(tp));
+
+		ptask_wait_for_period(tp);
+	}
+
+	// Cleanup
+	stop_audio_stream(synth_state.stream);
+
+	return NULL;
+}
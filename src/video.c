@@ -24,12 +24,14 @@
 #include "api/std_emu.h"
 #include "api/time_utils.h"
 #include "api/ptask.h"
+#include "api/trace.h"
 
 // Other modules
 #include "constants.h"
 #include "main.h"
 #include "audio.h"
 #include "video.h"
+#include "qos.h"
 
 // -----------------------------------------------------------------------------
 //                           PRIVATE CONSTANTS
@@ -142,8 +144,13 @@ typedef struct __GUI_STRUCT
 	bool		mouse_shown;	///< Tells if the show_mouse function has been
 								///< called on the current screen
 
+	int			record_index;	///< The file whose sample is recorded at the
+								///< end of the countdown, -1 if none
+	struct timespec record_time;///< The time at which said countdown ends
+
 	ptask_mutex_t mutex;		///< This mutex is used to protect the access
-								///< to mouse flags
+								///< to mouse flags and to the pending
+								///< recording
 } gui_state_t;
 
 /**
@@ -176,6 +183,7 @@ static gui_state_t gui_state =
 	.initialized		= false,
 	.mouse_initialized	= false,
 	.mouse_shown		= false,
+	.record_index		= -1,
 };
 
 // -----------------------------------------------------------------------------
@@ -462,6 +470,67 @@ static inline void draw_background()
 		0, 0, 0, 0, WIN_MX, WIN_MY);
 }
 
+/**
+ * Returns the color of the name of the given element, which is highlighted if
+ * the recorded sample of the element can trigger it.
+ */
+static inline int side_element_name_color(int index)
+{
+	return audio_file_is_armed(index) ? COLOR_PRIM_DARK : COLOR_TEXT_PRIM;
+}
+
+/**
+ * Returns the seconds left before the sample of the given element is recorded,
+ * zero once the countdown is over, -1 if no recording is pending for it.
+ */
+static inline int record_seconds_left(int index)
+{
+struct timespec	now;
+int				left = -1;
+
+	ptask_mutex_lock(&gui_state.mutex);
+
+	if (gui_state.record_index == index)
+	{
+		ptask_clock_gettime(&now);
+
+		left = time_cmp(now, gui_state.record_time) >= 0 ? 0 :
+			(time_diff_ns(gui_state.record_time, now) + 999999999LL) /
+				1000000000LL;
+	}
+
+	ptask_mutex_unlock(&gui_state.mutex);
+
+	return left;
+}
+
+/**
+ * Draws the name of the given element at the given height, followed by the
+ * countdown of the recording of its sample, if pending.
+ */
+static inline void draw_side_element_name(int index, int posy)
+{
+char	buffer[MAX_CHAR_BUFFER_SIZE];
+int		left;
+
+	left = record_seconds_left(index);
+
+	if (left > 0)
+		snprintf(buffer, sizeof(buffer), "%s  REC %d", audio_file_name(index),
+			left);
+	else if (left == 0)
+		snprintf(buffer, sizeof(buffer), "%s  REC !", audio_file_name(index));
+	else
+		snprintf(buffer, sizeof(buffer), "%s", audio_file_name(index));
+
+	textout_ex(
+		gui_state.virtual_screen,
+		font,
+		buffer,
+		SIDE_ELEM_NAME_X, posy+SIDE_ELEM_NAME_Y,
+		side_element_name_color(index), COLOR_BKG);
+}
+
 /**
  * Draws the given index element, assuming that it is an audio sample element.
  */
@@ -481,12 +550,7 @@ int		value;		// Value where to store
 		posx, posy,
 		SIDE_ELEM_WIDTH, SIDE_ELEM_HEIGHT);
 
-	textout_ex(
-		gui_state.virtual_screen,
-		font,
-		audio_file_name(index),
-		SIDE_ELEM_NAME_X, posy+SIDE_ELEM_NAME_Y,
-		COLOR_TEXT_PRIM, COLOR_BKG);
+	draw_side_element_name(index, posy);
 
 	value = audio_file_get_volume(index);
 
@@ -533,12 +597,7 @@ int posx, posy;		// Starting point where to draw the given element
 		posx, posy,
 		SIDE_ELEM_MX, SIDE_ELEM_MY);
 
-	textout_ex(
-		gui_state.virtual_screen,
-		font,
-		audio_file_name(index),
-		SIDE_ELEM_NAME_X, posy+SIDE_ELEM_NAME_Y,
-		COLOR_TEXT_PRIM, COLOR_BKG);
+	draw_side_element_name(index, posy);
 }
 
 /**
@@ -901,9 +960,12 @@ static inline void screen_refresh()
 
 	draw_sidebar();
 
-	draw_fft();
+	// Plots are the first work shed by the governor
+	if (qos_get_level() < QOS_LEVEL_NO_FFT)
+		draw_fft();
 
-	draw_amplitude();
+	if (qos_get_level() < QOS_LEVEL_NO_WAVEFORM)
+		draw_amplitude();
 
 	// Previous operations all work on the virtual screen, at the very end we
 	// copy the virtual screen on the actual screen variable
@@ -934,10 +996,108 @@ static inline void handle_num_key(int num)
 
 	if (num < audio_file_num_opened())
 	{
-		audio_file_play(num);
+		// Manual requests are always served, hence the score is the maximum
+		audio_file_request_play(num, 1.);
 	}
 }
 
+/**
+ * The aperiodic job that arms or disarms the recorded sample of the audio file
+ * whose index is given as argument.
+ */
+static void toggle_armed_job(void *arg)
+{
+	audio_file_toggle_armed(STATIC_CAST(int, STATIC_CAST(intptr_t, arg)));
+}
+
+/**
+ * Handles actions that are triggered by function keys.
+ * Each key from F1 to F8 arms or disarms the recorded sample of the
+ * corresponding audio file, without restarting any task. Since the triggers of
+ * all the analysis workers are rebuilt, this is done by the aperiodic server.
+ */
+static inline void handle_fun_key(int num)
+{
+	if (num < audio_file_num_opened() && audio_file_has_rec(num) &&
+		main_submit_job(toggle_armed_job, STATIC_CAST(void *,
+			STATIC_CAST(intptr_t, num))))
+		print_log(LOG_VERBOSE, "Too many pending actions, F%d ignored.\r\n",
+			num + 1);
+}
+
+/**
+ * Handles actions that are triggered by function keys together with shift.
+ * Each key from F1 to F8 starts the countdown after which a new sample is
+ * recorded for the corresponding audio file, see record_update(). Only one
+ * recording can be pending at a time.
+ */
+static inline void handle_shift_fun_key(int num)
+{
+	if (num >= audio_file_num_opened())
+		return;
+
+	ptask_mutex_lock(&gui_state.mutex);
+
+	if (gui_state.record_index < 0)
+	{
+		gui_state.record_index = num;
+		ptask_clock_gettime(&gui_state.record_time);
+		gui_state.record_time.tv_sec += COUNTDOWN_SECONDS;
+	}
+
+	ptask_mutex_unlock(&gui_state.mutex);
+}
+
+/**
+ * The aperiodic job that records the sample of the audio file whose index is
+ * given as argument, from the captures of the microphone task.
+ */
+static void record_job(void *arg)
+{
+int num = STATIC_CAST(int, STATIC_CAST(intptr_t, arg));
+
+	if (audio_file_record_last_capture(num))
+		print_log(LOG_VERBOSE, "Could not record a sample for file %d.\r\n",
+			num + 1);
+}
+
+/**
+ * Submits the recording of the pending sample, if any, to the aperiodic server
+ * once its countdown is over. Captures are published one window at a time, so
+ * the job is submitted after two windows, when the most recent one has been
+ * captured after the end of the countdown.
+ */
+static inline void record_update()
+{
+struct timespec	now;
+struct timespec	due;
+int				num = -1;
+
+	ptask_mutex_lock(&gui_state.mutex);
+
+	if (gui_state.record_index >= 0)
+	{
+		due = gui_state.record_time;
+		time_add_ms(&due, 2 * FRAMES_TO_MS(audio_get_record_rframes(),
+			audio_get_record_rrate()));
+
+		ptask_clock_gettime(&now);
+
+		if (time_cmp(now, due) >= 0)
+		{
+			num = gui_state.record_index;
+			gui_state.record_index = -1;
+		}
+	}
+
+	ptask_mutex_unlock(&gui_state.mutex);
+
+	if (num >= 0 && main_submit_job(record_job, STATIC_CAST(void *,
+			STATIC_CAST(intptr_t, num))))
+		print_log(LOG_VERBOSE, "Too many pending actions, recording of file "
+			"%d ignored.\r\n", num + 1);
+}
+
 /**
  * Checks whether the user has given commands to the program while in graphic
  * mode.
@@ -957,6 +1117,14 @@ int scancode;
 
 		if (scancode >= KEY_0 && scancode <= KEY_9)
 			handle_num_key(scancode - KEY_0);
+		else if (scancode >= KEY_F1 &&
+			scancode < KEY_F1 + AUDIO_MAX_FILES)
+		{
+			if (key_shifts & KB_SHIFT_FLAG)
+				handle_shift_fun_key(scancode - KEY_F1);
+			else
+				handle_fun_key(scancode - KEY_F1);
+		}
 		else
 		{
 			switch (key >> 8)
@@ -1053,17 +1221,22 @@ button_id_t id;				// The type of the selected button
 	return id;
 }
 
+/// Packs the ids of a button and of its element into the argument of a job
+#define CLICK_JOB_ARG(button_id, element_id) \
+	STATIC_CAST(void *, STATIC_CAST(intptr_t, \
+		(button_id) * AUDIO_MAX_FILES + (element_id)))
+
 /**
- * Handles a click operation on the button identified by button_id within the
- * element element_id. If parameters are invalid, this function does nothing.
+ * The aperiodic job that performs the action of a click on a button other than
+ * play, whose ids are packed in the argument by CLICK_JOB_ARG.
  */
-static inline void handle_click(int button_id, int element_id)
+static void click_job(void *arg)
 {
+int button_id	= STATIC_CAST(intptr_t, arg) / AUDIO_MAX_FILES;
+int element_id	= STATIC_CAST(intptr_t, arg) % AUDIO_MAX_FILES;
+
 	switch (button_id)
 	{
-	case BUTTON_PLAY:
-		audio_file_play(element_id);
-		break;
 	case BUTTON_VOL_UP:
 		audio_file_volume_up(element_id);
 		break;
@@ -1088,6 +1261,21 @@ static inline void handle_click(int button_id, int element_id)
 	}
 }
 
+/**
+ * Handles a click operation on the button identified by button_id within the
+ * element element_id. If parameters are invalid, this function does nothing.
+ * Play requests are queued immediately, while the other actions, which contend
+ * with the audio tasks for the audio module, are executed by the aperiodic
+ * server.
+ */
+static inline void handle_click(int button_id, int element_id)
+{
+	if (button_id == BUTTON_PLAY)
+		audio_file_request_play(element_id, 1.);
+	else if (main_submit_job(click_job, CLICK_JOB_ARG(button_id, element_id)))
+		print_log(LOG_VERBOSE, "Too many pending actions, click ignored.\r\n");
+}
+
 /**
  * Checks if the user has pressed the mouse on any button on the screen and if
  * so performs the requested action.
@@ -1149,7 +1337,7 @@ static struct timespec current_time;// The current time at this iteration
 		if (pressed && !pressed_past)
 		{
 			handle_click(button_hover, elem_id);
-			clock_gettime(CLOCK_MONOTONIC, &next_click_time);
+			ptask_clock_gettime(&next_click_time);
 			time_add_ms(&next_click_time, MOUSE_DELAY_LONG);
 		}
 	} else
@@ -1165,12 +1353,12 @@ static struct timespec current_time;// The current time at this iteration
 			// First click is handled, we also reset the timer for further click
 			// events
 			handle_click(button_hover, elem_id);
-			clock_gettime(CLOCK_MONOTONIC, &next_click_time);
+			ptask_clock_gettime(&next_click_time);
 			time_add_ms(&next_click_time, MOUSE_DELAY_LONG);
 		} else if (pressed && pressed_past)
 		{
 			// On the same potion, if long press then timers come into game
-			clock_gettime(CLOCK_MONOTONIC, &current_time);
+			ptask_clock_gettime(&current_time);
 
 			if (time_cmp(current_time, next_click_time) >= 0)
 			{
@@ -1232,6 +1420,7 @@ int video_init()
 int err;
 	err = ptask_mutex_init(&gui_state.mutex);
 	if (err) return err;
+	ptask_mutex_set_name(&gui_state.mutex, "gui");
 
 	set_color_depth(COLOR_MODE);
 
@@ -1245,20 +1434,30 @@ int err;
 
 void* gui_task(void* arg)
 {
-ptask_t*	tp;
-int			err;
+ptask_t*		tp;
+unsigned int	frame = 0;	// Periods elapsed since the task started
+int				err;
 
 	tp	= STATIC_CAST(ptask_t*, arg);
 
+	trace_thread_register("GUI");
+
 	err	= gui_graphic_mode_init();
 	if (err)
 		abort_on_error("Could not initialize graphic mode.");
 
+	ptask_set_overrun(tp, TASK_GUI_OVERRUN, NULL);
+
 	ptask_start_period(tp);
 
 	while (!main_get_tasks_terminate())
 	{
-		screen_refresh();
+		if (qos_get_level() < QOS_LEVEL_GUI_SLOW ||
+			frame++ % QOS_GUI_DIVIDER == 0)
+		{
+			screen_refresh();
+			ptask_sim_consume(TASK_GUI_COST * 1000LL);
+		}
 
 		if (ptask_deadline_miss(tp))
 			printf("TASK_GUI missed %d deadlines!\r\n", ptask_get_dmiss(tp));
@@ -1279,6 +1478,8 @@ int			err;
 
 	tp = STATIC_CAST(ptask_t*, arg);
 
+	trace_thread_register("UI");
+
 	err = install_keyboard();
 	if (err)
 		abort_on_error("Could not initialize the keyboard.");
@@ -1301,6 +1502,14 @@ int			err;
 
 		handle_mouse_input();
 
+		record_update();
+
+		ptask_sim_consume(TASK_UI_COST * 1000LL);
+
+#ifdef QOS_GOVERNOR
+		main_update_qos();
+#endif
+
 		if (ptask_deadline_miss(tp))
 			printf("TASK_UI missed %d deadlines!\r\n", ptask_get_dmiss(tp));
 
@@ -1318,6 +1527,9 @@ int			err;
 	gui_state.mouse_initialized	= false;
 	gui_state.mouse_shown		= false;
 
+	// A recording still pending is dropped together with the session
+	gui_state.record_index		= -1;
+
 	ptask_mutex_unlock(&gui_state.mutex);
 
 	return NULL;